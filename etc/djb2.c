@@ -1,15 +1,19 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <ctype.h>
 
 static void showhelp( FILE* out )
 {
-  fprintf( out, "USAGE: djb2 [ --case ] [ --enum ] [ --prefix ] [ --cpp ] identifiers...\n\n" );
+  fprintf( out, "USAGE: djb2 [ --case ] [ --enum ] [ --prefix ] [ --cpp ] identifiers...\n" );
+  fprintf( out, "       djb2 --scan [ --case ] [ --enum ] [ --prefix ] [ --cpp ] files...\n\n" );
   fprintf( out, "--case     Lists the hashes with case statements for use with a switch\n" );
   fprintf( out, "--enum     Lists identifiers and the hashes in a format to be used in an enum\n" );
   fprintf( out, "--prefix   Adds a 'k' prefix to the identifiers (when they're used)\n" );
-  fprintf( out, "--cpp      Outputs C++-style comments instead of C ones where applicable\n\n" );
+  fprintf( out, "--cpp      Outputs C++-style comments instead of C ones where applicable\n" );
+  fprintf( out, "--scan     Outputs a C++ header with the hashes of all sub names and signal\n" );
+  fprintf( out, "           strings in the script files, and reports hash collisions\n\n" );
 }
 
 static uint32_t djb2( const char* str )
@@ -24,9 +28,376 @@ static uint32_t djb2( const char* str )
   return hash;
 }
 
+static uint32_t djb2lower( const char* str, size_t length )
+{
+  uint32_t hash = 5381;
+  
+  while ( length-- )
+  {
+    hash = hash * 33 + (uint8_t)tolower( (unsigned char)*str++ );
+  }
+  
+  return hash;
+}
+
+static uint32_t djb2length( const char* str, size_t length )
+{
+  uint32_t hash = 5381;
+  
+  while ( length-- )
+  {
+    hash = hash * 33 + (uint8_t)*str++;
+  }
+  
+  return hash;
+}
+
+enum
+{
+  KIND_SUB,
+  KIND_SIGNAL
+};
+
+typedef struct
+{
+  int kind;
+  char* text;       /* As written in the script */
+  char* identifier; /* Valid C++ identifier */
+  uint32_t hash;
+  const char* file;
+  int line;
+}
+symbol_t;
+
+static symbol_t* symbols;
+static int numsymbols, maxsymbols;
+
+static int iskeyword( const char* str, size_t length, const char* keyword )
+{
+  size_t i;
+  
+  if ( strlen( keyword ) != length )
+  {
+    return 0;
+  }
+  
+  for ( i = 0; i < length; i++ )
+  {
+    if ( tolower( (unsigned char)str[ i ] ) != keyword[ i ] )
+    {
+      return 0;
+    }
+  }
+  
+  return 1;
+}
+
+static int addsymbol( int kind, const char* str, size_t length, const char* file, int line )
+{
+  symbol_t* symbol;
+  char* identifier;
+  size_t i;
+  
+  if ( numsymbols == maxsymbols )
+  {
+    maxsymbols = maxsymbols ? maxsymbols * 2 : 64;
+    symbol = (symbol_t*)realloc( symbols, maxsymbols * sizeof( symbol_t ) );
+    
+    if ( !symbol )
+    {
+      return 0;
+    }
+    
+    symbols = symbol;
+  }
+  
+  symbol = symbols + numsymbols;
+  symbol->kind = kind;
+  symbol->text = (char*)malloc( length + 1 );
+  symbol->identifier = (char*)malloc( length + 2 );
+  
+  if ( !symbol->text || !symbol->identifier )
+  {
+    return 0;
+  }
+  
+  memcpy( symbol->text, str, length );
+  symbol->text[ length ] = 0;
+  
+  /* Sub names are case insensitive, signal strings are not */
+  symbol->hash = kind == KIND_SUB ? djb2lower( str, length ) : djb2length( str, length );
+  symbol->file = file;
+  symbol->line = line;
+  
+  /* Signal strings can have any character */
+  identifier = symbol->identifier;
+  
+  if ( length == 0 || isdigit( (unsigned char)*str ) )
+  {
+    *identifier++ = '_';
+  }
+  
+  for ( i = 0; i < length; i++ )
+  {
+    *identifier++ = isalnum( (unsigned char)str[ i ] ) ? str[ i ] : '_';
+  }
+  
+  *identifier = 0;
+  numsymbols++;
+  return 1;
+}
+
+/* Finds the sub names and the strings used in signal statements */
+static int scan( const char* file )
+{
+  FILE* in = fopen( file, "rb" );
+  char* source;
+  const char* current;
+  long size;
+  int line = 1, aftersub = 0, aftersignal = 0, ok = 1;
+  
+  if ( !in )
+  {
+    fprintf( stderr, "Error opening %s\n", file );
+    return 0;
+  }
+  
+  fseek( in, 0, SEEK_END );
+  size = ftell( in );
+  fseek( in, 0, SEEK_SET );
+  
+  source = (char*)malloc( size + 1 );
+  
+  if ( !source || fread( source, 1, size, in ) != (size_t)size )
+  {
+    fprintf( stderr, "Error reading %s\n", file );
+    fclose( in );
+    free( source );
+    return 0;
+  }
+  
+  fclose( in );
+  source[ size ] = 0;
+  current = source;
+  
+  while ( *current && ok )
+  {
+    const char* lexeme = current;
+    
+    if ( *current == '\n' )
+    {
+      line++;
+      current++;
+    }
+    else if ( isspace( (unsigned char)*current ) )
+    {
+      current++;
+    }
+    else if ( *current == '\'' )
+    {
+      while ( *current && *current != '\n' )
+      {
+        current++;
+      }
+    }
+    else if ( *current == '"' )
+    {
+      lexeme = ++current;
+      
+      while ( *current && *current != '\n' && ( *current != '"' || current[ 1 ] == '"' ) )
+      {
+        current += *current == '"' ? 2 : 1;
+      }
+      
+      if ( aftersignal && *current == '"' )
+      {
+        ok = addsymbol( KIND_SIGNAL, lexeme, current - lexeme, file, line );
+      }
+      
+      if ( *current == '"' )
+      {
+        current++;
+      }
+      
+      aftersub = aftersignal = 0;
+    }
+    else if ( isalpha( (unsigned char)*current ) || *current == '_' )
+    {
+      while ( isalnum( (unsigned char)*current ) || *current == '_' )
+      {
+        current++;
+      }
+      
+      if ( aftersub )
+      {
+        ok = addsymbol( KIND_SUB, lexeme, current - lexeme, file, line );
+      }
+      
+      aftersub = iskeyword( lexeme, current - lexeme, "sub" );
+      aftersignal = iskeyword( lexeme, current - lexeme, "signal" );
+    }
+    else
+    {
+      current++;
+      aftersub = aftersignal = 0;
+    }
+  }
+  
+  free( source );
+  
+  if ( !ok )
+  {
+    fprintf( stderr, "Out of memory\n" );
+  }
+  
+  return ok;
+}
+
+/* Removes repeated symbols and returns the number of hash collisions */
+static int collisions( void )
+{
+  int i, j, same, count = 0;
+  
+  for ( i = 0; i < numsymbols; i++ )
+  {
+    for ( j = 0; j < i; j++ )
+    {
+      if ( symbols[ j ].kind != symbols[ i ].kind || !symbols[ j ].text )
+      {
+        continue;
+      }
+      
+      same = symbols[ i ].kind == KIND_SUB ? iskeyword( symbols[ i ].text, strlen( symbols[ i ].text ), symbols[ j ].text ) : !strcmp( symbols[ i ].text, symbols[ j ].text );
+      
+      if ( same )
+      {
+        /* Same sub in another file, or the same signal again */
+        symbols[ i ].text = NULL;
+        break;
+      }
+      
+      if ( symbols[ j ].hash == symbols[ i ].hash )
+      {
+        fprintf( stderr, "%s:%d: \"%s\" has the same hash as \"%s\" (%s:%d): 0x%08xU\n", symbols[ i ].file, symbols[ i ].line, symbols[ i ].text, symbols[ j ].text, symbols[ j ].file, symbols[ j ].line, symbols[ i ].hash );
+        count++;
+      }
+      else if ( !strcmp( symbols[ j ].identifier, symbols[ i ].identifier ) )
+      {
+        fprintf( stderr, "%s:%d: \"%s\" has the same identifier as \"%s\" (%s:%d): %s\n", symbols[ i ].file, symbols[ i ].line, symbols[ i ].text, symbols[ j ].text, symbols[ j ].file, symbols[ j ].line, symbols[ i ].identifier );
+        count++;
+      }
+    }
+  }
+  
+  return count;
+}
+
+static void printsymbol( const symbol_t* symbol, const char* format, int prefix )
+{
+  if ( prefix )
+  {
+    printf( format, toupper( symbol->identifier[ 0 ] ), symbol->identifier + 1, symbol->hash );
+  }
+  else
+  {
+    printf( format, symbol->identifier, symbol->hash );
+  }
+}
+
+static int header( int casestmt, int enumstmt, int prefix, int cpp )
+{
+  static const char* namespaces[] = { "Subs", "Signals" };
+  int kind, i;
+  char format[ 64 ];
+  
+  if ( cpp )
+  {
+    printf( "// Generated by djb2 --scan, do not edit.\n\n" );
+  }
+  else
+  {
+    printf( "/* Generated by djb2 --scan, do not edit. */\n\n" );
+  }
+  
+  if ( casestmt && !enumstmt )
+  {
+    for ( kind = KIND_SUB; kind <= KIND_SIGNAL; kind++ )
+    {
+      for ( i = 0; i < numsymbols; i++ )
+      {
+        if ( symbols[ i ].kind == kind && symbols[ i ].text )
+        {
+          if ( cpp )
+          {
+            printf( "case 0x%08xU: // %s %s\n", symbols[ i ].hash, kind == KIND_SUB ? "sub" : "signal", symbols[ i ].text );
+          }
+          else
+          {
+            printf( "case 0x%08xU: /* %s %s */\n", symbols[ i ].hash, kind == KIND_SUB ? "sub" : "signal", symbols[ i ].text );
+          }
+        }
+      }
+    }
+    
+    return 0;
+  }
+  
+  if ( casestmt )
+  {
+    for ( kind = KIND_SUB; kind <= KIND_SIGNAL; kind++ )
+    {
+      snprintf( format, sizeof( format ), prefix ? "case %s::k%%c%%s:\n" : "case %s::%%s:\n", namespaces[ kind ] );
+      
+      for ( i = 0; i < numsymbols; i++ )
+      {
+        if ( symbols[ i ].kind == kind && symbols[ i ].text )
+        {
+          printsymbol( symbols + i, format, prefix );
+        }
+      }
+    }
+    
+    return 0;
+  }
+  
+  printf( "#pragma once\n\n#include \"rio2d.h\"\n" );
+  
+  for ( kind = KIND_SUB; kind <= KIND_SIGNAL; kind++ )
+  {
+    printf( "\nnamespace %s\n{\n", namespaces[ kind ] );
+    
+    if ( enumstmt )
+    {
+      printf( "  enum : rio2d::Hash\n  {\n" );
+      strncpy( format, prefix ? "    k%c%s = 0x%08xU,\n" : "    %s = 0x%08xU,\n", sizeof( format ) );
+    }
+    else
+    {
+      strncpy( format, prefix ? "  constexpr rio2d::Hash k%c%s = 0x%08xU;\n" : "  constexpr rio2d::Hash %s = 0x%08xU;\n", sizeof( format ) );
+    }
+    
+    for ( i = 0; i < numsymbols; i++ )
+    {
+      if ( symbols[ i ].kind == kind && symbols[ i ].text )
+      {
+        printsymbol( symbols + i, format, prefix );
+      }
+    }
+    
+    if ( enumstmt )
+    {
+      printf( "  };\n" );
+    }
+    
+    printf( "}\n" );
+  }
+  
+  return 0;
+}
+
 int main( int argc, const char* argv[] )
 {
-  int start, casestmt = 0, enumstmt = 0, prefix = 0, cpp = 0;
+  int start, casestmt = 0, enumstmt = 0, prefix = 0, cpp = 0, scanfiles = 0;
   char format[ 32 ];
   
   for ( start = 1; start < argc && argv[ start ][ 0 ] == '-' && argv[ start ][ 1 ] == '-'; start++ )
@@ -47,6 +418,10 @@ int main( int argc, const char* argv[] )
     {
       cpp = 1;
     }
+    else if ( !strcmp( argv[ start ], "--scan" ) )
+    {
+      scanfiles = 1;
+    }
     else if ( !strcmp( argv[ start ], "--help" ) )
     {
       showhelp( stdout );
@@ -60,6 +435,24 @@ int main( int argc, const char* argv[] )
     }
   }
   
+  if ( scanfiles )
+  {
+    for ( ; start < argc; start++ )
+    {
+      if ( !scan( argv[ start ] ) )
+      {
+        return 1;
+      }
+    }
+    
+    if ( collisions() )
+    {
+      return 1;
+    }
+    
+    return header( casestmt, enumstmt, prefix, cpp );
+  }
+  
   if ( enumstmt )
   {
     if ( casestmt )
@@ -0,0 +1,663 @@
+/******************************************************************************
+* Copyright (c) 2016 Andre Leiradella
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+// Offline compiler for rio2d scripts, writes precompiled images and bundles.
+// Compile with g++ -O2 -std=c++11 -o rio2dc rio2dc.cpp -lpthread or a similar command.
+
+#define RIO2D_HEADLESS
+
+// The disassembler is only compiled in debug builds.
+#undef NDEBUG
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include <string>
+#include <vector>
+#include <map>
+
+// The compiler uses the Cocos2d-x logging and assertion macros, the log is only shown when listing the code.
+static bool s_listing = false;
+
+#define CCASSERT(cond, msg) assert(cond)
+#define CCLOG(...) do { if (s_listing) { printf(__VA_ARGS__); putchar('\n'); } } while (0)
+
+#include "../src/rio2d.h"
+#include "../src/compiler.inl"
+#include "../src/bundle.inl"
+
+namespace
+{
+  // Peephole optimizer, folds constant expressions and conditions and removes jumps to the next instruction.
+  class Optimizer
+  {
+  protected:
+    struct Insn
+    {
+      rio2d::Script::Bytecode m_bc[4];
+      rio2d::Script::Address m_address;
+      size_t m_size;
+      bool m_target;
+      bool m_removed;
+    };
+
+    std::vector<Insn> m_insns;
+    std::map<rio2d::Script::Address, size_t> m_indices;
+
+    static inline bool isUnary(rio2d::Script::Insn insn)
+    {
+      switch (insn)
+      {
+      case Insns::kCeil:
+      case Insns::kFloor:
+      case Insns::kLogicalNot:
+      case Insns::kNeg:
+      case Insns::kTrunc:
+        return true;
+      }
+
+      return false;
+    }
+
+    // kModulus isn't folded, the runtime computes it with fmod(a, b != 0.0f).
+    static inline bool isBinary(rio2d::Script::Insn insn)
+    {
+      switch (insn)
+      {
+      case Insns::kAdd:
+      case Insns::kCmpEqual:
+      case Insns::kCmpGreater:
+      case Insns::kCmpGreaterEqual:
+      case Insns::kCmpLess:
+      case Insns::kCmpLessEqual:
+      case Insns::kCmpNotEqual:
+      case Insns::kDiv:
+      case Insns::kLogicalAnd:
+      case Insns::kLogicalOr:
+      case Insns::kMul:
+      case Insns::kSub:
+        return true;
+      }
+
+      return false;
+    }
+
+    // Same results as the Runner.
+    static rio2d::Script::Number evaluate(rio2d::Script::Insn insn, rio2d::Script::Number a)
+    {
+      switch (insn)
+      {
+      case Insns::kCeil:       return ceilf(a);
+      case Insns::kFloor:      return floorf(a);
+      case Insns::kLogicalNot: return a != 0.0f ? 0.0f : 1.0f;
+      case Insns::kNeg:        return -a;
+      case Insns::kTrunc:      return truncf(a);
+      }
+
+      return a;
+    }
+
+    static rio2d::Script::Number evaluate(rio2d::Script::Insn insn, rio2d::Script::Number a, rio2d::Script::Number b)
+    {
+      switch (insn)
+      {
+      case Insns::kAdd:             return a + b;
+      case Insns::kCmpEqual:        return a == b;
+      case Insns::kCmpGreater:      return a > b;
+      case Insns::kCmpGreaterEqual: return a >= b;
+      case Insns::kCmpLess:         return a < b;
+      case Insns::kCmpLessEqual:    return a <= b;
+      case Insns::kCmpNotEqual:     return a != b;
+      case Insns::kDiv:             return a / b;
+      case Insns::kLogicalAnd:      return a != 0.0f && b != 0.0f;
+      case Insns::kLogicalOr:       return a != 0.0f || b != 0.0f;
+      case Insns::kMul:             return a * b;
+      case Insns::kSub:             return a - b;
+      }
+
+      return a;
+    }
+
+    static inline rio2d::Script::Bytecode* target(Insn* insn)
+    {
+      switch (insn->m_bc[0].m_insn)
+      {
+      case Insns::kJump:
+      case Insns::kJz:
+      case Insns::kSpawn:
+        return insn->m_bc + 1;
+
+      case Insns::kNext:
+        return insn->m_bc + 2;
+      }
+
+      return nullptr;
+    }
+
+    // Returns the first instruction not removed starting at index, or the number of instructions.
+    size_t live(size_t index) const
+    {
+      while (index < m_insns.size() && m_insns[index].m_removed)
+      {
+        index++;
+      }
+
+      return index;
+    }
+
+    // Jumps to a removed instruction go to the next one.
+    void remove(size_t index)
+    {
+      m_insns[index].m_removed = true;
+
+      if (m_insns[index].m_target)
+      {
+        size_t next = live(index + 1);
+
+        if (next < m_insns.size())
+        {
+          m_insns[next].m_target = true;
+        }
+      }
+    }
+
+    bool isPush(size_t index) const
+    {
+      return index < m_insns.size() && m_insns[index].m_bc[0].m_insn == Insns::kPush;
+    }
+
+    bool step(size_t i)
+    {
+      Insn* insn = &m_insns[i];
+      size_t j = live(i + 1);
+
+      if (j == m_insns.size())
+      {
+        return false;
+      }
+
+      if (insn->m_bc[0].m_insn == Insns::kJump)
+      {
+        auto found = m_indices.find(insn->m_bc[1].m_address);
+
+        if (found != m_indices.end() && live(found->second) == j)
+        {
+          remove(i);
+          return true;
+        }
+
+        return false;
+      }
+
+      if (m_insns[j].m_target)
+      {
+        return false;
+      }
+
+      rio2d::Script::Insn next = m_insns[j].m_bc[0].m_insn;
+
+      if (insn->m_bc[0].m_insn == Insns::kPush)
+      {
+        if (isUnary(next))
+        {
+          insn->m_bc[1].m_number = evaluate(next, insn->m_bc[1].m_number);
+          remove(j);
+          return true;
+        }
+
+        if (next == Insns::kJz)
+        {
+          if (insn->m_bc[1].m_number != 0.0f)
+          {
+            remove(j);
+            remove(i);
+          }
+          else
+          {
+            insn->m_bc[0].m_insn = Insns::kJump;
+            insn->m_bc[1] = m_insns[j].m_bc[1];
+            remove(j);
+          }
+
+          return true;
+        }
+
+        size_t k = live(j + 1);
+
+        if (isPush(j) && k < m_insns.size() && !m_insns[k].m_target && isBinary(m_insns[k].m_bc[0].m_insn))
+        {
+          insn->m_bc[1].m_number = evaluate(m_insns[k].m_bc[0].m_insn, insn->m_bc[1].m_number, m_insns[j].m_bc[1].m_number);
+          remove(k);
+          remove(j);
+          return true;
+        }
+      }
+
+      return false;
+    }
+
+  public:
+    void optimize(std::vector<rio2d::Script::Bytecode>* bytecode, rio2d::Script::Subroutine* globals, size_t numGlobals)
+    {
+      const rio2d::Script::Bytecode* bc = bytecode->data();
+      const rio2d::Script::Bytecode* end = bc + bytecode->size();
+
+      m_insns.clear();
+      m_indices.clear();
+
+      while (bc < end)
+      {
+        Insn insn;
+        insn.m_address = (rio2d::Script::Address)(bc - bytecode->data());
+        insn.m_size = Insns::size(bc->m_insn);
+        insn.m_target = false;
+        insn.m_removed = false;
+        memcpy(insn.m_bc, bc, insn.m_size * sizeof(rio2d::Script::Bytecode));
+
+        m_indices[insn.m_address] = m_insns.size();
+        m_insns.push_back(insn);
+        bc += insn.m_size;
+      }
+
+      // Nothing can be folded into an instruction that is jumped to.
+      for (size_t i = 0; i < m_insns.size(); i++)
+      {
+        rio2d::Script::Bytecode* address = target(&m_insns[i]);
+
+        if (address != nullptr)
+        {
+          m_insns[m_indices[address->m_address]].m_target = true;
+        }
+      }
+
+      for (size_t i = 0; i < numGlobals; i++)
+      {
+        m_insns[m_indices[globals[i].m_pc]].m_target = true;
+      }
+
+      bool changed;
+
+      do
+      {
+        changed = false;
+
+        for (size_t i = live(0); i < m_insns.size(); i = live(i + 1))
+        {
+          changed = step(i) || changed;
+        }
+      }
+      while (changed);
+
+      // Lay out the remaining instructions and relocate the addresses.
+      std::vector<rio2d::Script::Address> addresses(m_insns.size() + 1);
+      rio2d::Script::Address pc = 0;
+
+      for (size_t i = 0; i < m_insns.size(); i++)
+      {
+        addresses[i] = pc;
+
+        if (!m_insns[i].m_removed)
+        {
+          pc += (rio2d::Script::Address)m_insns[i].m_size;
+        }
+      }
+
+      addresses[m_insns.size()] = pc;
+      bytecode->clear();
+
+      for (size_t i = 0; i < m_insns.size(); i++)
+      {
+        Insn* insn = &m_insns[i];
+
+        if (!insn->m_removed)
+        {
+          rio2d::Script::Bytecode* address = target(insn);
+
+          if (address != nullptr)
+          {
+            address->m_address = addresses[m_indices[address->m_address]];
+          }
+
+          bytecode->insert(bytecode->end(), insn->m_bc, insn->m_bc + insn->m_size);
+        }
+      }
+
+      for (size_t i = 0; i < numGlobals; i++)
+      {
+        globals[i].m_pc = addresses[m_indices[globals[i].m_pc]];
+      }
+    }
+  };
+
+  struct Options
+  {
+    bool m_optimize;
+    bool m_listing;
+    const char* m_output;
+    const char* m_bundle;
+  };
+
+  bool readFile(const char* filename, std::string* contents)
+  {
+    FILE* file = fopen(filename, "rb");
+
+    if (file == nullptr)
+    {
+      return false;
+    }
+
+    char buffer[4096];
+    size_t numread;
+
+    while ((numread = fread(buffer, 1, sizeof(buffer), file)) != 0)
+    {
+      contents->append(buffer, numread);
+    }
+
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+  }
+
+  bool writeFile(const char* filename, const void* data, size_t size)
+  {
+    FILE* file = fopen(filename, "wb");
+
+    if (file == nullptr)
+    {
+      return false;
+    }
+
+    bool ok = fwrite(data, 1, size, file) == size;
+    return fclose(file) == 0 && ok;
+  }
+
+  void error(const char* filename, unsigned line, const char* msg, const char* lexeme, size_t length)
+  {
+    fprintf(stderr, "%s:%u: %s (%.*s)\n", filename, line, msg, (int)std::min<size_t>(length, 63), lexeme);
+  }
+
+  // Checks each subroutine on its own so all the errors are reported, not only the first one.
+  bool check(const char* filename, const std::string& source)
+  {
+    size_t count = Parser::split(source.c_str(), nullptr, 0);
+
+    // Any comments before the first subroutine go with it.
+    if (count == 0)
+    {
+      count = 1;
+    }
+
+    std::vector<Parser::Split> splits(count);
+    Parser::split(source.c_str(), splits.data(), count);
+
+    splits[0].m_source = 0;
+    splits[0].m_line = 1;
+
+    std::map<rio2d::Hash, unsigned> names;
+    bool ok = true;
+
+    for (size_t i = 0; i < count; i++)
+    {
+      size_t begin = splits[i].m_source;
+      size_t end = i + 1 < count ? splits[i + 1].m_source : source.length();
+      std::string chunk = source.substr(begin, end - begin);
+
+      Parser parser;
+      Errors::Enum res = parser.validate(chunk.c_str());
+
+      if (res != Errors::kOk)
+      {
+        size_t length;
+        const char* lexeme = parser.getLexeme(&length);
+        error(filename, splits[i].m_line + parser.getLine() - 1, Errors::describe(res), lexeme, length);
+        ok = false;
+      }
+
+      // Get the name of the subroutine from its header to check for duplicates.
+      Parser::Split split = {0, 0};
+
+      if (Parser::split(chunk.c_str(), &split, 1) == 0)
+      {
+        continue;
+      }
+
+      const char* name = chunk.c_str() + split.m_source + 3;
+
+      while (isspace((unsigned char)*name))
+      {
+        name++;
+      }
+
+      size_t length = 0;
+
+      while (isalnum((unsigned char)name[length]) || name[length] == '_')
+      {
+        length++;
+      }
+
+      unsigned line = splits[i].m_line + split.m_line - 1;
+      rio2d::Hash hash = rio2d::hashLower(name, length);
+
+      if (names.find(hash) != names.end())
+      {
+        error(filename, line, Errors::describe(Errors::kDuplicateIdentifier), name, length);
+        ok = false;
+      }
+      else
+      {
+        names[hash] = line;
+      }
+
+      if (names.size() == rio2d::Script::kMaxGlobals + 1)
+      {
+        error(filename, line, Errors::describe(Errors::kOutOfMemory), name, length);
+        ok = false;
+      }
+    }
+
+    return ok;
+  }
+
+  bool compile(const char* filename, const Options& options, std::vector<uint32_t>* image)
+  {
+    std::string source;
+
+    if (!readFile(filename, &source))
+    {
+      fprintf(stderr, "%s: error reading file\n", filename);
+      return false;
+    }
+
+    if (!check(filename, source))
+    {
+      return false;
+    }
+
+    Parser parser;
+    Arena arena;
+    size_t bcSize;
+    size_t numGlobals;
+
+    Errors::Enum res = parser.initWithSourceAndPointers(source.c_str(), &arena, &bcSize, &numGlobals, false);
+
+    if (res != Errors::kOk)
+    {
+      size_t length;
+      const char* lexeme = parser.getLexeme(&length);
+      error(filename, parser.getLine(), Errors::describe(res), lexeme, length);
+      return false;
+    }
+
+    rio2d::Script::Subroutine* globals = arena.m_globals;
+    std::vector<rio2d::Script::Bytecode> bytecode(arena.m_bytecode, arena.m_bytecode + bcSize);
+
+    if (options.m_optimize)
+    {
+      Optimizer optimizer;
+      optimizer.optimize(&bytecode, globals, numGlobals);
+    }
+
+    if (options.m_listing)
+    {
+      s_listing = true;
+      printf("; %s\n", filename);
+
+      for (size_t i = 0; i < numGlobals; i++)
+      {
+        const rio2d::Script::Subroutine* global = globals + i;
+        size_t end = i + 1 < numGlobals ? globals[i + 1].m_pc : bytecode.size();
+
+        printf("\n; sub #%08x, %u parameter(s), %u local(s)\n", global->m_hash, (unsigned)global->m_numParams, (unsigned)global->m_numLocals);
+        Insns::disasm(bytecode.data(), bytecode.data() + global->m_pc, bytecode.data() + end);
+      }
+
+      s_listing = false;
+    }
+
+    image->resize(Image::size(globals, numGlobals, bytecode.size()) / sizeof(uint32_t));
+    Image::write(image->data(), bytecode.data(), bytecode.size(), globals, numGlobals);
+    arena.release();
+    return true;
+  }
+
+  void showhelp(FILE* out)
+  {
+    fprintf(out, "USAGE: rio2dc [ -O ] [ -S ] [ -o image ] [ -b bundle ] files...\n\n");
+    fprintf(out, "-O         Optimizes the generated code\n");
+    fprintf(out, "-S         Lists the generated code\n");
+    fprintf(out, "-o image   Writes the precompiled image of the only file to image\n");
+    fprintf(out, "-b bundle  Writes the precompiled images of all files to bundle, using the file names as given\n\n");
+    fprintf(out, "All files are checked for errors even if no output is written.\n");
+  }
+}
+
+int main(int argc, const char* argv[])
+{
+  Options options;
+  options.m_optimize = false;
+  options.m_listing = false;
+  options.m_output = nullptr;
+  options.m_bundle = nullptr;
+
+  int start;
+
+  for (start = 1; start < argc && argv[start][0] == '-'; start++)
+  {
+    if (!strcmp(argv[start], "-O"))
+    {
+      options.m_optimize = true;
+    }
+    else if (!strcmp(argv[start], "-S"))
+    {
+      options.m_listing = true;
+    }
+    else if (!strcmp(argv[start], "-o") && start + 1 < argc)
+    {
+      options.m_output = argv[++start];
+    }
+    else if (!strcmp(argv[start], "-b") && start + 1 < argc)
+    {
+      options.m_bundle = argv[++start];
+    }
+    else if (!strcmp(argv[start], "--help"))
+    {
+      showhelp(stdout);
+      return 0;
+    }
+    else
+    {
+      fprintf(stderr, "Unknown option: %s\n\n", argv[start]);
+      showhelp(stderr);
+      return 1;
+    }
+  }
+
+  size_t count = (size_t)(argc - start);
+
+  if (count == 0 || (options.m_output != nullptr && count != 1))
+  {
+    showhelp(stderr);
+    return 1;
+  }
+
+  std::vector<std::vector<uint32_t>> images(count);
+  bool ok = true;
+
+  for (size_t i = 0; i < count; i++)
+  {
+    ok = compile(argv[start + i], options, &images[i]) && ok;
+  }
+
+  if (!ok)
+  {
+    return 1;
+  }
+
+  if (options.m_output != nullptr && !writeFile(options.m_output, images[0].data(), images[0].size() * sizeof(uint32_t)))
+  {
+    fprintf(stderr, "%s: error writing file\n", options.m_output);
+    return 1;
+  }
+
+  if (options.m_bundle != nullptr)
+  {
+    std::vector<rio2d::Hash> hashes(count);
+    std::vector<const void*> data(count);
+    std::vector<size_t> sizes(count);
+
+    for (size_t i = 0; i < count; i++)
+    {
+      hashes[i] = rio2d::hash(argv[start + i]);
+      data[i] = images[i].data();
+      sizes[i] = images[i].size() * sizeof(uint32_t);
+    }
+
+    size_t size = Bundle::size(sizes.data(), count);
+
+    if (size > UINT32_MAX)
+    {
+      fprintf(stderr, "%s: bundle too big\n", options.m_bundle);
+      return 1;
+    }
+
+    std::vector<uint8_t> bundle(size);
+
+    if (!Bundle::write(bundle.data(), hashes.data(), data.data(), sizes.data(), count))
+    {
+      fprintf(stderr, "%s: two file names have the same hash\n", options.m_bundle);
+      return 1;
+    }
+
+    if (!writeFile(options.m_bundle, bundle.data(), size))
+    {
+      fprintf(stderr, "%s: error writing file\n", options.m_bundle);
+      return 1;
+    }
+  }
+
+  return 0;
+}
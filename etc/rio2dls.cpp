@@ -0,0 +1,778 @@
+/******************************************************************************
+* Copyright (c) 2016 Andre Leiradella
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+// Language Server Protocol server for rio2d scripts, talks JSON-RPC via stdin and stdout.
+// Compile with g++ -O2 -std=c++11 -o rio2dls rio2dls.cpp -lpthread or a similar command.
+
+#define RIO2D_HEADLESS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+// The compiler uses the Cocos2d-x logging and assertion macros; stdout is reserved for the protocol.
+#define CCASSERT(cond, msg) assert(cond)
+#define CCLOG(...) do { fprintf(stderr, __VA_ARGS__); fputc('\n', stderr); } while (0)
+
+#include "../src/rio2d.h"
+#include "../src/compiler.inl"
+
+namespace
+{
+  // Just enough JSON to read the requests.
+  struct Json
+  {
+    enum Type
+    {
+      kNull,
+      kBool,
+      kNumber,
+      kString,
+      kArray,
+      kObject,
+    };
+
+    Type m_type;
+    bool m_bool;
+    double m_number;
+    std::string m_string;
+    std::vector<Json> m_array;
+    std::vector<std::pair<std::string, Json>> m_object;
+
+    Json() : m_type(kNull), m_bool(false), m_number(0.0) {}
+
+    const Json& operator[](const char* key) const
+    {
+      static const Json null;
+
+      for (auto it = m_object.begin(); it != m_object.end(); ++it)
+      {
+        if (it->first == key)
+        {
+          return it->second;
+        }
+      }
+
+      return null;
+    }
+
+    const Json& operator[](size_t index) const
+    {
+      static const Json null;
+      return index < m_array.size() ? m_array[index] : null;
+    }
+
+    static bool parse(const char*& json, Json* value)
+    {
+      skip(json);
+
+      switch (*json)
+      {
+      case '{':
+        value->m_type = kObject;
+        json++;
+        skip(json);
+
+        if (*json == '}')
+        {
+          json++;
+          return true;
+        }
+
+        for (;;)
+        {
+          Json key;
+          skip(json);
+
+          if (*json != '"' || !parseString(json, &key.m_string))
+          {
+            return false;
+          }
+
+          skip(json);
+
+          if (*json++ != ':')
+          {
+            return false;
+          }
+
+          value->m_object.push_back(std::pair<std::string, Json>(key.m_string, Json()));
+
+          if (!parse(json, &value->m_object.back().second))
+          {
+            return false;
+          }
+
+          skip(json);
+
+          if (*json == ',')
+          {
+            json++;
+          }
+          else if (*json == '}')
+          {
+            json++;
+            return true;
+          }
+          else
+          {
+            return false;
+          }
+        }
+
+      case '[':
+        value->m_type = kArray;
+        json++;
+        skip(json);
+
+        if (*json == ']')
+        {
+          json++;
+          return true;
+        }
+
+        for (;;)
+        {
+          value->m_array.push_back(Json());
+
+          if (!parse(json, &value->m_array.back()))
+          {
+            return false;
+          }
+
+          skip(json);
+
+          if (*json == ',')
+          {
+            json++;
+          }
+          else if (*json == ']')
+          {
+            json++;
+            return true;
+          }
+          else
+          {
+            return false;
+          }
+        }
+
+      case '"':
+        value->m_type = kString;
+        return parseString(json, &value->m_string);
+
+      case 't':
+        value->m_type = kBool;
+        value->m_bool = true;
+        return literal(json, "true");
+
+      case 'f':
+        value->m_type = kBool;
+        value->m_bool = false;
+        return literal(json, "false");
+
+      case 'n':
+        value->m_type = kNull;
+        return literal(json, "null");
+
+      default:
+      {
+        char* end;
+        value->m_type = kNumber;
+        value->m_number = strtod(json, &end);
+
+        if (end == json)
+        {
+          return false;
+        }
+
+        json = end;
+        return true;
+      }
+      }
+    }
+
+  protected:
+    static void skip(const char*& json)
+    {
+      while (isspace((unsigned char)*json))
+      {
+        json++;
+      }
+    }
+
+    static bool literal(const char*& json, const char* word)
+    {
+      size_t length = strlen(word);
+
+      if (strncmp(json, word, length) != 0)
+      {
+        return false;
+      }
+
+      json += length;
+      return true;
+    }
+
+    static void utf8(std::string* str, unsigned cp)
+    {
+      if (cp < 0x80)
+      {
+        *str += (char)cp;
+      }
+      else if (cp < 0x800)
+      {
+        *str += (char)(0xc0 | (cp >> 6));
+        *str += (char)(0x80 | (cp & 0x3f));
+      }
+      else if (cp < 0x10000)
+      {
+        *str += (char)(0xe0 | (cp >> 12));
+        *str += (char)(0x80 | ((cp >> 6) & 0x3f));
+        *str += (char)(0x80 | (cp & 0x3f));
+      }
+      else
+      {
+        *str += (char)(0xf0 | (cp >> 18));
+        *str += (char)(0x80 | ((cp >> 12) & 0x3f));
+        *str += (char)(0x80 | ((cp >> 6) & 0x3f));
+        *str += (char)(0x80 | (cp & 0x3f));
+      }
+    }
+
+    static bool parseString(const char*& json, std::string* str)
+    {
+      json++; // Skip the opening quote.
+
+      while (*json != '"')
+      {
+        if (*json == 0)
+        {
+          return false;
+        }
+
+        if (*json != '\\')
+        {
+          *str += *json++;
+          continue;
+        }
+
+        json++;
+
+        switch (*json++)
+        {
+        case '"':  *str += '"'; break;
+        case '\\': *str += '\\'; break;
+        case '/':  *str += '/'; break;
+        case 'b':  *str += '\b'; break;
+        case 'f':  *str += '\f'; break;
+        case 'n':  *str += '\n'; break;
+        case 'r':  *str += '\r'; break;
+        case 't':  *str += '\t'; break;
+
+        case 'u':
+        {
+          char hex[5];
+          memcpy(hex, json, 4);
+          hex[4] = 0;
+
+          if (strlen(hex) != 4)
+          {
+            return false;
+          }
+
+          unsigned cp = (unsigned)strtoul(hex, nullptr, 16);
+          json += 4;
+
+          if (cp >= 0xd800 && cp < 0xdc00 && json[0] == '\\' && json[1] == 'u')
+          {
+            // Surrogate pair.
+            memcpy(hex, json + 2, 4);
+            unsigned low = (unsigned)strtoul(hex, nullptr, 16);
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            json += 6;
+          }
+
+          utf8(str, cp);
+          break;
+        }
+
+        default:
+          return false;
+        }
+      }
+
+      json++; // Skip the closing quote.
+      return true;
+    }
+  };
+
+  std::string quote(const std::string& str)
+  {
+    std::string res = "\"";
+
+    for (auto it = str.begin(); it != str.end(); ++it)
+    {
+      switch (*it)
+      {
+      case '"':  res += "\\\""; break;
+      case '\\': res += "\\\\"; break;
+      case '\n': res += "\\n"; break;
+      case '\r': res += "\\r"; break;
+      case '\t': res += "\\t"; break;
+
+      default:
+        if ((uint8_t)*it < 0x20)
+        {
+          char hex[8];
+          snprintf(hex, sizeof(hex), "\\u%04x", (uint8_t)*it);
+          res += hex;
+        }
+        else
+        {
+          res += *it;
+        }
+
+        break;
+      }
+    }
+
+    return res + "\"";
+  }
+
+  std::string position(unsigned line, unsigned character)
+  {
+    char json[64];
+    snprintf(json, sizeof(json), "{\"line\":%u,\"character\":%u}", line, character);
+    return json;
+  }
+
+  std::string range(unsigned line1, unsigned character1, unsigned line2, unsigned character2)
+  {
+    return "{\"start\":" + position(line1, character1) + ",\"end\":" + position(line2, character2) + "}";
+  }
+
+  // A subroutine, along with any comments before it, and what we found out about it.
+  // Positions are zero-based and relative to the beginning of the text.
+  struct Sub
+  {
+    std::string m_text;
+    unsigned m_numLines;
+
+    Errors::Enum m_error;
+    unsigned m_errorLine;
+    unsigned m_errorCharacter;
+    unsigned m_errorLength;
+
+    bool m_hasSub;
+    std::string m_name;
+    std::string m_detail;
+    rio2d::Hash m_hash;
+    unsigned m_nameLine;
+    unsigned m_nameCharacter;
+
+    void analyze()
+    {
+      const char* text = m_text.c_str();
+      m_numLines = (unsigned)std::count(m_text.begin(), m_text.end(), '\n');
+
+      // Only the subroutine in this text is parsed.
+      Parser parser;
+      m_error = parser.validate(text);
+
+      if (m_error != Errors::kOk)
+      {
+        size_t length;
+        const char* lexeme = parser.getLexeme(&length);
+
+        m_errorLine = parser.getLine() - 1;
+        m_errorCharacter = 0;
+        m_errorLength = 0;
+
+        if (lexeme >= text && lexeme <= text + m_text.length())
+        {
+          const char* begin = lexeme;
+
+          while (begin > text && begin[-1] != '\n')
+          {
+            begin--;
+          }
+
+          m_errorCharacter = (unsigned)(lexeme - begin);
+          m_errorLength = (unsigned)length;
+        }
+      }
+
+      // Get the name and the parameter list with a quick look at the header.
+      Parser::Split split;
+      m_hasSub = Parser::split(text, &split, 1) != 0;
+
+      if (m_hasSub)
+      {
+        const char* name = text + split.m_source + 3;
+
+        while (isspace((unsigned char)*name) && *name != '\n')
+        {
+          name++;
+        }
+
+        const char* end = name;
+
+        while (isalnum((unsigned char)*end) || *end == '_')
+        {
+          end++;
+        }
+
+        m_name.assign(name, end - name);
+        m_hash = rio2d::hashLower(name, end - name);
+        m_nameLine = split.m_line - 1;
+
+        const char* begin = name;
+
+        while (begin > text && begin[-1] != '\n')
+        {
+          begin--;
+        }
+
+        m_nameCharacter = (unsigned)(name - begin);
+        m_detail.clear();
+
+        if (*end == '(')
+        {
+          bool space = false;
+
+          for (; *end != 0 && *end != '\n'; end++)
+          {
+            if (isspace((unsigned char)*end))
+            {
+              space = true;
+              continue;
+            }
+
+            if (space && m_detail.back() != '(' && *end != ')' && *end != ',')
+            {
+              m_detail += ' ';
+            }
+
+            space = false;
+            m_detail += *end;
+
+            if (*end == ')')
+            {
+              break;
+            }
+          }
+        }
+      }
+    }
+  };
+
+  struct Document
+  {
+    std::vector<Sub> m_subs;
+    std::vector<unsigned> m_lines; // Where each sub starts.
+
+    void update(const std::string& text)
+    {
+      const char* source = text.c_str();
+      size_t count = Parser::split(source, nullptr, 0);
+
+      // Any comments before the first subroutine go with it.
+      if (count == 0)
+      {
+        count = 1;
+      }
+
+      std::vector<Parser::Split> splits(count);
+      Parser::split(source, splits.data(), count);
+
+      splits[0].m_source = 0;
+      splits[0].m_line = 1;
+
+      // Index the subroutines we already have by their text to reuse them.
+      std::unordered_map<std::string, size_t> old;
+
+      for (size_t i = 0; i < m_subs.size(); i++)
+      {
+        old.insert(std::pair<std::string, size_t>(m_subs[i].m_text, i));
+      }
+
+      std::vector<Sub> subs(count);
+      m_lines.resize(count);
+
+      for (size_t i = 0; i < count; i++)
+      {
+        size_t begin = splits[i].m_source;
+        size_t end = i + 1 < count ? splits[i + 1].m_source : text.length();
+        std::string chunk = text.substr(begin, end - begin);
+        auto found = old.find(chunk);
+
+        if (found != old.end())
+        {
+          subs[i] = m_subs[found->second];
+        }
+        else
+        {
+          subs[i].m_text.swap(chunk);
+          subs[i].analyze();
+        }
+
+        m_lines[i] = splits[i].m_line - 1;
+      }
+
+      m_subs.swap(subs);
+    }
+
+    std::string diagnostics() const
+    {
+      std::string json = "[";
+      std::map<rio2d::Hash, size_t> names;
+      size_t numSubs = 0;
+
+      for (size_t i = 0; i < m_subs.size(); i++)
+      {
+        const Sub& sub = m_subs[i];
+        unsigned base = m_lines[i];
+
+        if (sub.m_error != Errors::kOk)
+        {
+          add(&json, base + sub.m_errorLine, sub.m_errorCharacter, sub.m_errorLength, Errors::describe(sub.m_error));
+        }
+
+        if (sub.m_hasSub)
+        {
+          if (names.find(sub.m_hash) != names.end())
+          {
+            add(&json, base + sub.m_nameLine, sub.m_nameCharacter, sub.m_name.length(), Errors::describe(Errors::kDuplicateIdentifier));
+          }
+          else
+          {
+            names[sub.m_hash] = i;
+          }
+
+          if (++numSubs == rio2d::Script::kMaxGlobals + 1)
+          {
+            add(&json, base + sub.m_nameLine, sub.m_nameCharacter, sub.m_name.length(), Errors::describe(Errors::kOutOfMemory));
+          }
+        }
+      }
+
+      return json + "]";
+    }
+
+    std::string symbols() const
+    {
+      std::string json = "[";
+
+      for (size_t i = 0; i < m_subs.size(); i++)
+      {
+        const Sub& sub = m_subs[i];
+
+        if (sub.m_hasSub)
+        {
+          unsigned base = m_lines[i];
+
+          if (json.length() > 1)
+          {
+            json += ",";
+          }
+
+          json += "{\"name\":" + quote(sub.m_name);
+          json += ",\"detail\":" + quote(sub.m_detail);
+          json += ",\"kind\":12";
+          json += ",\"range\":" + range(base + sub.m_nameLine, 0, base + sub.m_numLines, 0);
+          json += ",\"selectionRange\":" + range(base + sub.m_nameLine, sub.m_nameCharacter, base + sub.m_nameLine, sub.m_nameCharacter + sub.m_name.length());
+          json += "}";
+        }
+      }
+
+      return json + "]";
+    }
+
+  protected:
+    static void add(std::string* json, unsigned line, unsigned character, size_t length, const char* message)
+    {
+      if (json->length() > 1)
+      {
+        *json += ",";
+      }
+
+      *json += "{\"range\":" + range(line, character, line, character + (unsigned)length);
+      *json += ",\"severity\":1,\"source\":\"rio2d\",\"message\":" + quote(message) + "}";
+    }
+  };
+
+  std::map<std::string, Document> s_documents;
+
+  void send(const std::string& json)
+  {
+    fprintf(stdout, "Content-Length: %u\r\n\r\n%s", (unsigned)json.length(), json.c_str());
+    fflush(stdout);
+  }
+
+  std::string id(const Json& value)
+  {
+    if (value.m_type == Json::kString)
+    {
+      return quote(value.m_string);
+    }
+
+    char num[32];
+    snprintf(num, sizeof(num), "%.0f", value.m_number);
+    return num;
+  }
+
+  void respond(const Json& request, const std::string& result)
+  {
+    send("{\"jsonrpc\":\"2.0\",\"id\":" + id(request["id"]) + ",\"result\":" + result + "}");
+  }
+
+  void publish(const std::string& uri, const std::string& diagnostics)
+  {
+    send("{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\",\"params\":{\"uri\":" + quote(uri) + ",\"diagnostics\":" + diagnostics + "}}");
+  }
+
+  // Returns false when the client asks us to exit.
+  bool handle(const Json& request)
+  {
+    const std::string& method = request["method"].m_string;
+    const Json& params = request["params"];
+
+    if (method == "initialize")
+    {
+      respond(request, "{\"capabilities\":{\"textDocumentSync\":1,\"documentSymbolProvider\":true},\"serverInfo\":{\"name\":\"rio2dls\"}}");
+    }
+    else if (method == "textDocument/didOpen")
+    {
+      const std::string& uri = params["textDocument"]["uri"].m_string;
+      Document& document = s_documents[uri];
+      document.update(params["textDocument"]["text"].m_string);
+      publish(uri, document.diagnostics());
+    }
+    else if (method == "textDocument/didChange")
+    {
+      // We use full document sync, the last change has the entire text.
+      const Json& changes = params["contentChanges"];
+
+      if (!changes.m_array.empty())
+      {
+        const std::string& uri = params["textDocument"]["uri"].m_string;
+        Document& document = s_documents[uri];
+        document.update(changes.m_array.back()["text"].m_string);
+        publish(uri, document.diagnostics());
+      }
+    }
+    else if (method == "textDocument/didClose")
+    {
+      const std::string& uri = params["textDocument"]["uri"].m_string;
+      s_documents.erase(uri);
+      publish(uri, "[]");
+    }
+    else if (method == "textDocument/documentSymbol")
+    {
+      auto found = s_documents.find(params["textDocument"]["uri"].m_string);
+      respond(request, found != s_documents.end() ? found->second.symbols() : "[]");
+    }
+    else if (method == "shutdown")
+    {
+      respond(request, "null");
+    }
+    else if (method == "exit")
+    {
+      return false;
+    }
+    else if (request["id"].m_type != Json::kNull)
+    {
+      send("{\"jsonrpc\":\"2.0\",\"id\":" + id(request["id"]) + ",\"error\":{\"code\":-32601,\"message\":\"Method not found\"}}");
+    }
+
+    return true;
+  }
+}
+
+int main(int argc, const char* argv[])
+{
+  (void)argc;
+  (void)argv;
+
+#ifdef _WIN32
+  _setmode(_fileno(stdin), _O_BINARY);
+  _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+  for (;;)
+  {
+    // Read the headers, we only care about Content-Length.
+    char header[256];
+    size_t length = 0;
+
+    for (;;)
+    {
+      if (fgets(header, sizeof(header), stdin) == nullptr)
+      {
+        return 0;
+      }
+
+      if (header[0] == '\r' || header[0] == '\n')
+      {
+        break;
+      }
+
+      if (strncmp(header, "Content-Length:", 15) == 0)
+      {
+        length = (size_t)strtoul(header + 15, nullptr, 10);
+      }
+    }
+
+    std::string body(length, 0);
+
+    if (fread(&body[0], 1, length, stdin) != length)
+    {
+      return 1;
+    }
+
+    Json request;
+    const char* json = body.c_str();
+
+    if (!Json::parse(json, &request))
+    {
+      fprintf(stderr, "rio2dls: invalid JSON message\n");
+      continue;
+    }
+
+    if (!handle(request))
+    {
+      return 0;
+    }
+  }
+}
@@ -0,0 +1,180 @@
+/******************************************************************************
+* Copyright (c) 2016 Andre Leiradella
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#include <string.h>
+
+namespace // Anonymous namespace to hyde the implementation details
+{
+  // Bundles of precompiled scripts. All fields are 32-bit little endian words:
+  //
+  //   Header  magic, version, number of slots in the index
+  //   Index   open addressed hash table keyed by the hash of the file name, with the offset and size of each image;
+  //           the slot of a hash is rio2d::detail::slot, so the index can be used in place
+  //   Images  aligned to kAlignment bytes, so each one is only paged in when used if the bundle is memory mapped
+  struct Bundle
+  {
+    enum
+    {
+      kMagic = 0x646e6272U, // "rbnd"
+      kVersion = 2,
+      kAlignment = 4096,
+    };
+
+    struct Header
+    {
+      uint32_t m_magic;
+      uint32_t m_version;
+      uint32_t m_numSlots;
+    };
+
+    // Empty slots have a size of zero.
+    struct Slot
+    {
+      uint32_t m_hash;
+      uint32_t m_offset;
+      uint32_t m_size;
+    };
+
+    // Keeps the index at most half full so probe sequences are short.
+    static size_t numSlots(size_t count)
+    {
+      size_t slots = 1;
+
+      while (slots < count * 2)
+      {
+        slots *= 2;
+      }
+
+      return slots;
+    }
+
+    // The index is searched like the subroutines of a script, see rio2d::detail::slot.
+    static unsigned slotBits(size_t slots)
+    {
+      unsigned bits = 0;
+
+      while (((size_t)1 << bits) < slots)
+      {
+        bits++;
+      }
+
+      return bits;
+    }
+
+    static size_t size(const size_t* sizes, size_t count)
+    {
+      size_t size = sizeof(Header) + numSlots(count) * sizeof(Slot);
+
+      for (size_t i = 0; i < count; i++)
+      {
+        size = (size + kAlignment - 1) & ~(size_t)(kAlignment - 1);
+        size += sizes[i];
+      }
+
+      return size;
+    }
+
+    // Writes the bundle, which must have room for size() bytes. Returns false if two file names have the same hash.
+    static bool write(void* bundle, const rio2d::Hash* hashes, const void* const* images, const size_t* sizes, size_t count)
+    {
+      size_t slots = numSlots(count);
+      unsigned bits = slotBits(slots);
+      size_t total = size(sizes, count);
+      memset(bundle, 0, total);
+
+      Header* header = (Header*)bundle;
+      header->m_magic = kMagic;
+      header->m_version = kVersion;
+      header->m_numSlots = (uint32_t)slots;
+
+      Slot* index = (Slot*)(header + 1);
+      size_t offset = sizeof(Header) + slots * sizeof(Slot);
+
+      for (size_t i = 0; i < count; i++)
+      {
+        size_t j = rio2d::detail::slot(hashes[i], bits);
+
+        while (index[j].m_size != 0)
+        {
+          if (index[j].m_hash == hashes[i])
+          {
+            return false;
+          }
+
+          j = (j + 1) & (slots - 1);
+        }
+
+        offset = (offset + kAlignment - 1) & ~(size_t)(kAlignment - 1);
+
+        index[j].m_hash = hashes[i];
+        index[j].m_offset = (uint32_t)offset;
+        index[j].m_size = (uint32_t)sizes[i];
+
+        memcpy((char*)bundle + offset, images[i], sizes[i]);
+        offset += sizes[i];
+      }
+
+      return true;
+    }
+
+    static bool validate(const void* bundle, size_t size)
+    {
+      const Header* header = (const Header*)bundle;
+
+      if (size < sizeof(Header) || header->m_magic != kMagic || header->m_version != kVersion)
+      {
+        return false;
+      }
+
+      size_t slots = header->m_numSlots;
+      return slots != 0 && (slots & (slots - 1)) == 0 && slots <= (size - sizeof(Header)) / sizeof(Slot);
+    }
+
+    // Returns the image of the file with the given hash, or nullptr if it's not in the bundle. The bundle must be valid.
+    static const void* find(const void* bundle, size_t size, rio2d::Hash hash, size_t* imageSize)
+    {
+      const Header* header = (const Header*)bundle;
+      size_t slots = header->m_numSlots;
+      const Slot* index = (const Slot*)(header + 1);
+      size_t j = rio2d::detail::slot(hash, slotBits(slots));
+
+      for (size_t probes = 0; probes < slots && index[j].m_size != 0; probes++)
+      {
+        if (index[j].m_hash == hash)
+        {
+          if (index[j].m_offset > size || index[j].m_size > size - index[j].m_offset)
+          {
+            return nullptr;
+          }
+
+          *imageSize = index[j].m_size;
+          return (const char*)bundle + index[j].m_offset;
+        }
+
+        j = (j + 1) & (slots - 1);
+      }
+
+      return nullptr;
+    }
+  };
+}
@@ -0,0 +1,3610 @@
+/******************************************************************************
+* Copyright (c) 2016 Andre Leiradella
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+// HACK this file is directly included in script.cpp and in the tools under etc, it needs CCASSERT
+// and CCLOG to be defined.
+
+#include <setjmp.h>
+#include <string.h>
+#include <ctype.h>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+// Include easing functions taken from https://github.com/warrenm/AHEasing/blob/master/AHEasing/easing.c
+#include "easing.inl"
+
+
+namespace // Anonymous namespace to hyde the implementation details
+{
+  // Error codes.
+  struct Errors
+  {
+    enum Enum
+    {
+      kOk,                      // No error
+      kDuplicateIdentifier,     // Attempting to redefine an identifier
+      kFirstParamNotANode,      // The first parameter of a subroutine must be a node
+      kInvalidCharacterInInput, // Extraneous character in input
+      kMalformedNumber,         // A number constant is malformed
+      kOutOfMemory,             // Error allocating memory, or a fixed-size buffer was full
+      kTypeMismatch,            // Wrong type in expression
+      kUnexpectedEOF,           // The end of the file was reached
+      kUnexpectedToken,         // This token wasn't expected here
+      kUnknownEaseFunc,         // Unknown ease function
+      kUnknownField,            // Invalid field for the object
+      kUnknownIdentifier,       // Identifier not declared
+      kUnknownType,             // Unknown data type
+      kUnterminatedString,      // A string constant is unterminated
+      kInvalidBytecode,         // Precompiled bytecode is corrupted or from another version
+    };
+
+    static const char* describe(Enum error)
+    {
+      switch (error)
+      {
+      case kMalformedNumber:         return "Malformed number";
+      case kUnterminatedString:      return "Unterminated string";
+      case kUnexpectedEOF:           return "Unexpected end of file";
+      case kInvalidCharacterInInput: return "Invalid character in input";
+      case kUnexpectedToken:         return "Unexpected token";
+      case kOutOfMemory:             return "Out of memory";
+      case kUnknownType:             return "Unknown type";
+      case kDuplicateIdentifier:     return "Duplicated identifier";
+      case kUnknownIdentifier:       return "Unknown identifier";
+      case kUnknownField:            return "Unknown field";
+      case kTypeMismatch:            return "Type mismatch";
+      case kFirstParamNotANode:      return "First parameter must be of type \"node\"";
+      case kUnknownEaseFunc:         return "Unknown easing function";
+      case kInvalidBytecode:         return "Invalid bytecode";
+      default:                       return "Unknown error";
+      }
+    }
+  };
+
+  // Tokens; the values of the symbols with only one character are their ASCII integer value.
+  struct Tokens
+  {
+    enum
+    {
+      kAnd = 0x0b885e18U,
+      kAs = 0x00597739U,
+      kCeil = 0x7c9514a2U,
+      kElse = 0x7c964c6eU,
+      kEnd = 0x0b886f1cU,
+      kEof = 0,
+      kFalse = 0x0f6bcef0U,
+      kFloor = 0x0f71e367U,
+      kFor = 0x0b88738cU,
+      kForever = 0xbaa8bf3eU,
+      kFrames = 0xfe132c43U,
+      kGreaterEqual = 1,
+      kIdentifier = 2,
+      kIf = 0x00597834U,
+      kIn = 0x0059783cU,
+      kLessEqual = 3,
+      kMod = 0x0b889145U,
+      kMove = 0x7c9abc9cU,
+      kNext = 0x7c9b1ec4U,
+      kNode = 0x7c9b46abU,
+      kNot = 0x0b889596U,
+      kNotEqual = 4,
+      kNumber = 0x10f9208eU,
+      kNumberConst = 5,
+      kOr = 0x00597906U,
+      kParallel = 0x1455e3f2U,
+      kPause = 0x1020ea43U,
+      kRand = 0x7c9d3deaU,
+      kRepeat = 0x192dec66U,
+      kSecs = 0x7c9dd9f3U,
+      kSequence = 0x0c15489eU,
+      kSignal = 0x1bc6ade3U,
+      kSize = 0x7c9dede0U,
+      kStep = 0x7c9e1a01U,
+      kStringConst = 6,
+      kSub = 0x0b88ab8fU,
+      kThen = 0x7c9e7354U,
+      kTo = 0x005979a8U,
+      kTrue = 0x7c9e9fe5U,
+      kTrunc = 0x10729e11U,
+      kUntil = 0x10828031U,
+      kVec2 = 0x7c9f7ed5U,
+      kWhile = 0x10a3387eU,
+      kWith = 0x7ca01ea1U,
+      kXor = 0x0b88c01eU,
+    };
+
+    static bool isKeyword(rio2d::Hash hash)
+    {
+      switch (hash)
+      {
+      case Tokens::kAnd:
+      case Tokens::kAs:
+      case Tokens::kCeil:
+      case Tokens::kElse:
+      case Tokens::kEnd:
+      case Tokens::kFalse:
+      case Tokens::kFloor:
+      case Tokens::kFor:
+      case Tokens::kForever:
+      case Tokens::kFrames:
+      case Tokens::kIf:
+      case Tokens::kIn:
+      case Tokens::kMod:
+      case Tokens::kMove:
+      case Tokens::kNext:
+      case Tokens::kNode:
+      case Tokens::kNot:
+      case Tokens::kNumber:
+      case Tokens::kOr:
+      case Tokens::kParallel:
+      case Tokens::kPause:
+      case Tokens::kRand:
+      case Tokens::kRepeat:
+      case Tokens::kSecs:
+      case Tokens::kSequence:
+      case Tokens::kSignal:
+      case Tokens::kSize:
+      case Tokens::kStep:
+      case Tokens::kSub:
+      case Tokens::kThen:
+      case Tokens::kTo:
+      case Tokens::kTrue:
+      case Tokens::kTrunc:
+      case Tokens::kUntil:
+      case Tokens::kVec2:
+      case Tokens::kWhile:
+      case Tokens::kWith:
+      case Tokens::kXor:
+        return true;
+      }
+
+      return false;
+    }
+  };
+
+  // Fields that can be addressed with objects.
+  struct Fields
+  {
+    enum
+    {
+      // Hashes
+      kBboxheight = 0xd92bfc69U,
+      kBboxwidth = 0x7c035ed0U,
+      kBlue = 0x7c94a78dU,
+      kFadein = 0xfce10f4cU,
+      kFadeout = 0x990313adU,
+      kFadeto = 0xfce110b8U,
+      kFlipx = 0x0f71ca08U,
+      kFlipy = 0x0f71ca09U,
+      kGreen = 0x0f871a56U,
+      kHeight = 0x01d688deU,
+      kLength = 0x0b2deac7U,
+      kMoveby = 0x0e3c60b7U,
+      kMoveto = 0x0e3c62ffU,
+      kOpacity = 0x70951bfeU,
+      kPlace = 0x10269b4aU,
+      kPosition = 0x4cef7abaU,
+      kRed = 0x0b88a540U,
+      kRotateby = 0x2737766fU,
+      kRotateto = 0x273778b7U,
+      kRotation = 0x27378915U,
+      kScale = 0x1057f68dU,
+      kScaleby = 0x862fdae8U,
+      kScaleto = 0x862fdd30U,
+      kSetframe = 0x120c3ddcU,
+      kSkew = 0x7c9df3bfU,
+      kSkewby = 0x1be9ec9aU,
+      kSkewto = 0x1be9eee2U,
+      kSkewx = 0x105c6c17U,
+      kSkewy = 0x105c6c18U,
+      kTint = 0x7c9e78c4U,
+      kTintby = 0x1e1fc6dfU,
+      kTintto = 0x1e1fc927U,
+      kVisible = 0x7c618d53U,
+      kWidth = 0x10a3b0a5U,
+      kX = 0x0002b61dU,
+      kY = 0x0002b61eU,
+      // Indices
+      kBboxheightIndex = 0,
+      kBboxwidthIndex,
+      kBlueIndex,
+      kFadeinIndex,
+      kFadeoutIndex,
+      kFadetoIndex,
+      kFlipxIndex,
+      kFlipyIndex,
+      kGreenIndex,
+      kHeightIndex,
+      kLengthIndex,
+      kMovebyIndex,
+      kMovetoIndex,
+      kOpacityIndex,
+      kPlaceIndex,
+      kPositionIndex,
+      kRedIndex,
+      kRotatebyIndex,
+      kRotatetoIndex,
+      kRotationIndex,
+      kScaleIndex,
+      kScalebyIndex,
+      kScaletoIndex,
+      kSetframeIndex,
+      kSkewIndex,
+      kSkewbyIndex,
+      kSkewtoIndex,
+      kSkewxIndex,
+      kSkewyIndex,
+      kTintIndex,
+      kTintbyIndex,
+      kTinttoIndex,
+      kVisibleIndex,
+      kWidthIndex,
+      kXIndex,
+      kYIndex,
+    };
+
+    static inline rio2d::Script::Index index(rio2d::Hash hash)
+    {
+      switch (hash)
+      {
+      case kBboxheight:  return kBboxheightIndex;
+      case kBboxwidth:   return kBboxwidthIndex;
+      case kBlue:        return kBlueIndex;
+      case kFadein:      return kFadeinIndex;
+      case kFadeout:     return kFadeoutIndex;
+      case kFadeto:      return kFadetoIndex;
+      case kFlipx:       return kFlipxIndex;
+      case kFlipy:       return kFlipyIndex;
+      case kGreen:       return kGreenIndex;
+      case kHeight:      return kHeightIndex;
+      case kLength:      return kLengthIndex;
+      case kMoveby:      return kMovebyIndex;
+      case kMoveto:      return kMovetoIndex;
+      case kOpacity:     return kOpacityIndex;
+      case kPlace:       return kPlaceIndex;
+      case kPosition:    return kPositionIndex;
+      case kRed:         return kRedIndex;
+      case kRotateby:    return kRotatebyIndex;
+      case kRotateto:    return kRotatetoIndex;
+      case kRotation:    return kRotationIndex;
+      case kScale:       return kScaleIndex;
+      case kScaleby:     return kScalebyIndex;
+      case kScaleto:     return kScaletoIndex;
+      case kSetframe:    return kSetframeIndex;
+      case kSkew:        return kSkewIndex;
+      case kSkewby:      return kSkewbyIndex;
+      case kSkewto:      return kSkewtoIndex;
+      case kSkewx:       return kSkewxIndex;
+      case kSkewy:       return kSkewyIndex;
+      case kTint:        return kTintIndex;
+      case kTintby:      return kTintbyIndex;
+      case kTintto:      return kTinttoIndex;
+      case kVisible:     return kVisibleIndex;
+      case kWidth:       return kWidthIndex;
+      case kX:           return kXIndex;
+      case kY:           return kYIndex;
+      default:           return -1;
+      }
+    }
+  };
+
+  // Available easing functions.
+  struct Easing
+  {
+    enum
+    {
+      // Hashes
+      kBackin = 0xf38bf9edU,
+      kBackinout = 0xd4b93685U,
+      kBackout = 0x650b526eU,
+      kBouncein = 0x66513df8U,
+      kBounceinout = 0x32ae02b0U,
+      kBounceout = 0x307917d9U,
+      kCircin = 0xf679fe3dU,
+      kCircinout = 0x1b4498d5U,
+      kCircout = 0xc5b9e0beU,
+      kCubicin = 0xe09955e2U,
+      kCubicinout = 0xf5130a5aU,
+      kCubicout = 0xf3c42d03U,
+      kElasticin = 0xd27b95c1U,
+      kElasticinout = 0x56bb31d9U,
+      kElasticout = 0x21ee68c2U,
+      kExpin = 0x0f6662e9U,
+      kExpinout = 0xd3e4ce01U,
+      kExpout = 0xfc32daeaU,
+      kLinear = 0x0b7641e0U,
+      kQuadin = 0x17f20ee7U,
+      kQuadinout = 0x72dfe13fU,
+      kQuadout = 0x163406a8U,
+      kQuarticin = 0x944c3515U,
+      kQuarticinout = 0xdde980adU,
+      kQuarticout = 0x1dd2f296U,
+      kQuinticin = 0xf2c97899U,
+      kQuinticinout = 0x2c4c45b1U,
+      kQuinticout = 0x4bf8a69aU,
+      kSinein = 0x1bca5f4bU,
+      kSineinout = 0x33cd0723U,
+      kSineout = 0x9516638cU,
+      // Indices
+      kBackinIndex = 0,
+      kBackinoutIndex,
+      kBackoutIndex,
+      kBounceinIndex,
+      kBounceinoutIndex,
+      kBounceoutIndex,
+      kCircinIndex,
+      kCircinoutIndex,
+      kCircoutIndex,
+      kCubicinIndex,
+      kCubicinoutIndex,
+      kCubicoutIndex,
+      kElasticinIndex,
+      kElasticinoutIndex,
+      kElasticoutIndex,
+      kExpinIndex,
+      kExpinoutIndex,
+      kExpoutIndex,
+      kLinearIndex,
+      kQuadinIndex,
+      kQuadinoutIndex,
+      kQuadoutIndex,
+      kQuarticinIndex,
+      kQuarticinoutIndex,
+      kQuarticoutIndex,
+      kQuinticinIndex,
+      kQuinticinoutIndex,
+      kQuinticoutIndex,
+      kSineinIndex,
+      kSineinoutIndex,
+      kSineoutIndex,
+    };
+
+    static inline rio2d::Script::Index index(rio2d::Hash hash)
+    {
+      switch (hash)
+      {
+      case kBackin:        return kBackinIndex;
+      case kBackinout:     return kBackinoutIndex;
+      case kBackout:       return kBackoutIndex;
+      case kBouncein:      return kBounceinIndex;
+      case kBounceinout:   return kBounceinoutIndex;
+      case kBounceout:     return kBounceoutIndex;
+      case kCircin:        return kCircinIndex;
+      case kCircinout:     return kCircinoutIndex;
+      case kCircout:       return kCircoutIndex;
+      case kCubicin:       return kCubicinIndex;
+      case kCubicinout:    return kCubicinoutIndex;
+      case kCubicout:      return kCubicoutIndex;
+      case kElasticin:     return kElasticinIndex;
+      case kElasticinout:  return kElasticinoutIndex;
+      case kElasticout:    return kElasticoutIndex;
+      case kExpin:         return kExpinIndex;
+      case kExpinout:      return kExpinoutIndex;
+      case kExpout:        return kExpoutIndex;
+      case kLinear:        return kLinearIndex;
+      case kQuadin:        return kQuadinIndex;
+      case kQuadinout:     return kQuadinoutIndex;
+      case kQuadout:       return kQuadoutIndex;
+      case kQuarticin:     return kQuarticinIndex;
+      case kQuarticinout:  return kQuarticinoutIndex;
+      case kQuarticout:    return kQuarticoutIndex;
+      case kQuinticin:     return kQuinticinIndex;
+      case kQuinticinout:  return kQuinticinoutIndex;
+      case kQuinticout:    return kQuinticoutIndex;
+      case kSinein:        return kSineinIndex;
+      case kSineinout:     return kSineinoutIndex;
+      case kSineout:       return kSineoutIndex;
+      default:             return -1;
+      }
+    }
+
+    static inline rio2d::Script::Number evaluate(rio2d::Script::Index index, rio2d::Script::Number p)
+    {
+      typedef rio2d::Script::Number(*Ease)(rio2d::Script::Number);
+
+      static const Ease functions[] =
+      {
+        BackEaseIn,
+        BackEaseInOut,
+        BackEaseOut,
+        BounceEaseIn,
+        BounceEaseInOut,
+        BounceEaseOut,
+        CircularEaseIn,
+        CircularEaseInOut,
+        CircularEaseOut,
+        CubicEaseIn,
+        CubicEaseInOut,
+        CubicEaseOut,
+        ElasticEaseIn,
+        ElasticEaseInOut,
+        ElasticEaseOut,
+        ExponentialEaseIn,
+        ExponentialEaseInOut,
+        ExponentialEaseOut,
+        LinearInterpolation,
+        QuadraticEaseIn,
+        QuadraticEaseInOut,
+        QuadraticEaseOut,
+        QuarticEaseIn,
+        QuarticEaseInOut,
+        QuarticEaseOut,
+        QuinticEaseIn,
+        QuinticEaseInOut,
+        QuinticEaseOut,
+        SineEaseIn,
+        SineEaseInOut,
+        SineEaseOut,
+      };
+
+      CCASSERT(index >= 0 && index < 31, "Invalid ease function index");
+      return functions[index](p);
+    }
+  };
+
+  // Bytecode instructions.
+  struct Insns
+  {
+    enum
+    {
+      kAdd,
+      kCallMethod,
+      kCeil,
+      kCmpEqual,
+      kCmpGreater,
+      kCmpGreaterEqual,
+      kCmpLess,
+      kCmpLessEqual,
+      kCmpNotEqual,
+      kDiv,
+      kFloor,
+      kGetLocal,
+      kGetProp,
+      kJump,
+      kJz,
+      kLogicalAnd,
+      kLogicalNot,
+      kLogicalOr,
+      kModulus,
+      kMul,
+      kNeg,
+      kNext,
+      kPause,
+      kPush,
+      kRand,
+      kRandRange,
+      kSetFrame,
+      kSetLocal,
+      kSetProp,
+      kSignal,
+      kSpawn,
+      kStop,
+      kSub,
+      kTrunc,
+      kVaryAbs,
+      kVaryRel,
+    };
+
+    static inline size_t size(rio2d::Script::Insn insn)
+    {
+      static const uint8_t sizes[] =
+      {
+        1, // kAdd
+        3, // kCallMethod
+        1, // kCeil
+        1, // kCmpEqual
+        1, // kCmpGreater
+        1, // kCmpGreaterEqual
+        1, // kCmpLess
+        1, // kCmpLessEqual
+        1, // kCmpNotEqual
+        1, // kDiv
+        1, // kFloor
+        2, // kGetLocal
+        3, // kGetProp
+        2, // kJump
+        2, // kJz
+        1, // kLogicalAnd
+        1, // kLogicalNot
+        1, // kLogicalOr
+        1, // kModulus
+        1, // kMul
+        1, // kNeg
+        3, // kNext
+        1, // kPause
+        2, // kPush
+        1, // kRand
+        1, // kRandRange
+        3, // kSetFrame
+        2, // kSetLocal
+        3, // kSetProp
+        2, // kSignal
+        2, // kSpawn
+        1, // kStop
+        1, // kSub
+        1, // kTrunc
+        4, // kVaryAbs
+        4, // kVaryRel
+      };
+
+      CCASSERT(insn < sizeof(sizes) / sizeof(sizes[0]), "Invalid instruction");
+      return sizes[insn];
+    };
+
+    // Adds base to all the addresses in the code, used to move code around.
+    static void relocate(rio2d::Script::Bytecode* bc, const rio2d::Script::Bytecode* end, rio2d::Script::Address base)
+    {
+      while (bc < end)
+      {
+        switch (bc->m_insn)
+        {
+        case kJump:
+        case kJz:
+        case kSpawn:
+          bc[1].m_address += base;
+          break;
+
+        case kNext:
+          bc[2].m_address += base;
+          break;
+        }
+
+        bc += size(bc->m_insn);
+      }
+    }
+
+    // How many values the instruction pushes minus how many it pops; methods and varies depend on their field.
+    static int effect(rio2d::Script::Insn insn, rio2d::Script::Index field)
+    {
+      switch (insn)
+      {
+      case kGetLocal:
+      case kGetProp:
+      case kPush:
+      case kRand:
+        return 1;
+
+      case kAdd:
+      case kCmpEqual:
+      case kCmpGreater:
+      case kCmpGreaterEqual:
+      case kCmpLess:
+      case kCmpLessEqual:
+      case kCmpNotEqual:
+      case kDiv:
+      case kJz:
+      case kLogicalAnd:
+      case kLogicalOr:
+      case kModulus:
+      case kMul:
+      case kPause:
+      case kRandRange:
+      case kSetFrame:
+      case kSetLocal:
+      case kSetProp:
+      case kSub:
+        return -1;
+
+      case kNext:
+        return -2;
+
+      case kCallMethod:
+        return field == Fields::kTintIndex ? -3 : -2;
+
+      case kVaryAbs:
+      case kVaryRel:
+        switch (field)
+        {
+        case Fields::kPositionIndex:
+        case Fields::kSkewIndex:
+          return -6;
+
+        case Fields::kTintIndex:
+          return -8;
+        }
+
+        return -4;
+      }
+
+      return 0;
+    }
+
+    // The effect of the instruction at bc, which must have all of its operands.
+    static int effect(const rio2d::Script::Bytecode* bc)
+    {
+      switch (bc->m_insn)
+      {
+      case kCallMethod:
+      case kVaryAbs:
+      case kVaryRel:
+        return effect(bc->m_insn, bc[2].m_index);
+      }
+
+      return effect(bc->m_insn, 0);
+    }
+
+    // The deepest the stack gets. Statements leave the stack as they found it, so the code can be scanned in order
+    // without following the jumps.
+    static size_t depth(const rio2d::Script::Bytecode* bc, const rio2d::Script::Bytecode* end)
+    {
+      int current = 0;
+      int max = 0;
+
+      while (bc < end)
+      {
+        current += effect(bc);
+        max = std::max(max, current);
+        bc += size(bc->m_insn);
+      }
+
+      return (size_t)max;
+    }
+
+    // How many values are on the stack when the code of the subroutine at start reaches target, or -1 if target isn't the
+    // address of an instruction. The code up to target must have been generated or verified.
+    static int depthAt(const rio2d::Script::Bytecode* bytecode, rio2d::Script::Address start, rio2d::Script::Address target)
+    {
+      rio2d::Script::Address pc = start;
+      int depth = 0;
+
+      while (pc < target)
+      {
+        const rio2d::Script::Bytecode* bc = bytecode + pc;
+
+        depth += effect(bc);
+        pc += (rio2d::Script::Address)size(bc->m_insn);
+      }
+
+      return pc == target ? depth : -1;
+    }
+
+#ifndef NDEBUG
+    static void disasm(rio2d::Script::Address addr, const rio2d::Script::Bytecode*& bc, const char* prefix = "")
+    {
+      switch (bc->m_insn)
+      {
+      case kAdd:             CCLOG("%s%04x\t%08x\tadd", prefix, addr, bc->m_insn); bc += 1; break;
+      case kCallMethod:      CCLOG("%s%04x\t%08x\tcall_method l@%d f@%d", prefix, addr, bc->m_insn, bc[1].m_index, bc[2].m_index); bc += 3; break;
+      case kCeil:            CCLOG("%s%04x\t%08x\tceil", prefix, addr, bc->m_insn); bc += 1; break;
+      case kCmpEqual:        CCLOG("%s%04x\t%08x\tcmp_eq", prefix, addr, bc->m_insn); bc += 1; break;
+      case kCmpGreater:      CCLOG("%s%04x\t%08x\tcmp_gt", prefix, addr, bc->m_insn); bc += 1; break;
+      case kCmpGreaterEqual: CCLOG("%s%04x\t%08x\tcmp_ge", prefix, addr, bc->m_insn); bc += 1; break;
+      case kCmpLess:         CCLOG("%s%04x\t%08x\tcmp_lt", prefix, addr, bc->m_insn); bc += 1; break;
+      case kCmpLessEqual:    CCLOG("%s%04x\t%08x\tcmp_le", prefix, addr, bc->m_insn); bc += 1; break;
+      case kCmpNotEqual:     CCLOG("%s%04x\t%08x\tcmp_ne", prefix, addr, bc->m_insn); bc += 1; break;
+      case kDiv:             CCLOG("%s%04x\t%08x\tdiv", prefix, addr, bc->m_insn); bc += 1; break;
+      case kFloor:           CCLOG("%s%04x\t%08x\tfloor", prefix, addr, bc->m_insn); bc += 1; break;
+      case kGetLocal:        CCLOG("%s%04x\t%08x\tget_local l@%d", prefix, addr, bc->m_insn, bc[1].m_index); bc += 2; break;
+      case kGetProp:         CCLOG("%s%04x\t%08x\tget_property l@%d f@%d", prefix, addr, bc->m_insn, bc[1].m_index, bc[2].m_index); bc += 3; break;
+      case kJump:            CCLOG("%s%04x\t%08x\tjump %04x", prefix, addr, bc->m_insn, bc[1].m_address); bc += 2; break;
+      case kJz:              CCLOG("%s%04x\t%08x\tjz %04x", prefix, addr, bc->m_insn, bc[1].m_address); bc += 2; break;
+      case kLogicalAnd:      CCLOG("%s%04x\t%08x\tand", prefix, addr, bc->m_insn); bc += 1; break;
+      case kLogicalNot:      CCLOG("%s%04x\t%08x\tnot", prefix, addr, bc->m_insn); bc += 1; break;
+      case kLogicalOr:       CCLOG("%s%04x\t%08x\tor", prefix, addr, bc->m_insn); bc += 1; break;
+      case kModulus:         CCLOG("%s%04x\t%08x\tmod", prefix, addr, bc->m_insn); bc += 1; break;
+      case kMul:             CCLOG("%s%04x\t%08x\tmul", prefix, addr, bc->m_insn); bc += 1; break;
+      case kNeg:             CCLOG("%s%04x\t%08x\tneg", prefix, addr, bc->m_insn); bc += 1; break;
+      case kNext:            CCLOG("%s%04x\t%08x\tnext l@%d %04x", prefix, addr, bc->m_insn, bc[1].m_index, bc[2].m_address); bc += 3; break;
+      case kPause:           CCLOG("%s%04x\t%08x\tpause", prefix, addr, bc->m_insn); bc += 1; break;
+      case kPush:            CCLOG("%s%04x\t%08x\tpush %f", prefix, addr, bc->m_insn, bc[1].m_number); bc += 2; break;
+      case kRand:            CCLOG("%s%04x\t%08x\trand", prefix, addr, bc->m_insn); bc += 1; break;
+      case kRandRange:       CCLOG("%s%04x\t%08x\trand_range", prefix, addr, bc->m_insn); bc += 1; break;
+      case kSetLocal:        CCLOG("%s%04x\t%08x\tset_local l@%d", prefix, addr, bc->m_insn, bc[1].m_index); bc += 2; break;
+      case kSetFrame:        CCLOG("%s%04x\t%08x\tset_frame l@%d l@%d", prefix, addr, bc->m_insn, bc[1].m_index, bc[2].m_index); bc += 3; break;
+      case kSetProp:         CCLOG("%s%04x\t%08x\tset_property l@%d f@%d", prefix, addr, bc->m_insn, bc[1].m_index, bc[2].m_index); bc += 3; break;
+      case kSignal:          CCLOG("%s%04x\t%08x\tsignal #%08x", prefix, addr, bc->m_insn, bc[1].m_hash); bc += 2; break;
+      case kSpawn:           CCLOG("%s%04x\t%08x\tspawn %04x", prefix, addr, bc->m_insn, bc[1].m_address); bc += 2; break;
+      case kStop:            CCLOG("%s%04x\t%08x\tstop", prefix, addr, bc->m_insn); bc += 1; break;
+      case kSub:             CCLOG("%s%04x\t%08x\tsub", prefix, addr, bc->m_insn); bc += 1; break;
+      case kTrunc:           CCLOG("%s%04x\t%08x\ttrunc", prefix, addr, bc->m_insn); bc += 1; break;
+      case kVaryAbs:         CCLOG("%s%04x\t%08x\tvary_abs l@%d f@%d e@%d", prefix, addr, bc->m_insn, bc[1].m_index, bc[2].m_index, bc[3].m_index); bc += 4; break;
+      case kVaryRel:         CCLOG("%s%04x\t%08x\tvary_rel l@%d f@%d e@%d", prefix, addr, bc->m_insn, bc[1].m_index, bc[2].m_index, bc[3].m_index); bc += 4; break;
+      default:               CCLOG("%s%04x	%08x	unknown", prefix, addr, bc->m_insn); bc += 1; break;
+      }
+    }
+
+    static void disasm(const rio2d::Script::Bytecode* bc, const rio2d::Script::Bytecode* end)
+    {
+      disasm(bc, bc, end);
+    }
+
+    static void disasm(const rio2d::Script::Bytecode* start, const rio2d::Script::Bytecode* bc, const rio2d::Script::Bytecode* end)
+    {
+      while (bc < end)
+      {
+        disasm(bc - start, bc);
+      }
+    }
+#endif
+  };
+
+  // The default allocator.
+  class Heap : public rio2d::Allocator
+  {
+  public:
+    static Heap* get()
+    {
+      static Heap heap;
+      return &heap;
+    }
+
+    virtual void* allocate(size_t size) override
+    {
+      return malloc(size);
+    }
+
+    virtual void deallocate(void* pointer) override
+    {
+      free(pointer);
+    }
+  };
+
+  // All the data of a compiled script in a single allocation starting at m_globals: the subroutines, the names and types
+  // of their locals, an open addressed index over their hashes, how many runners each subroutine has, the code, and a
+  // copy of the source code when compiling lazily.
+  struct Arena
+  {
+    rio2d::Allocator* m_allocator;
+    rio2d::Script::Subroutine* m_globals;
+    rio2d::Script::LocalVar* m_locals;
+    uint16_t* m_index;
+    rio2d::Script::Usage* m_usage;
+    rio2d::Script::Bytecode* m_bytecode;
+    char* m_source;
+    size_t m_size;
+
+    explicit Arena(rio2d::Allocator* allocator = Heap::get())
+      : m_allocator(allocator)
+      , m_globals(nullptr)
+      , m_locals(nullptr)
+      , m_index(nullptr)
+      , m_usage(nullptr)
+      , m_bytecode(nullptr)
+      , m_source(nullptr)
+      , m_size(0)
+    {
+    }
+
+    void release()
+    {
+      m_allocator->deallocate(m_globals);
+      m_globals = nullptr;
+    }
+
+    // Keeps the index at most half full.
+    static size_t indexBits(size_t numGlobals)
+    {
+      unsigned bits = 0;
+
+      while (((size_t)1 << bits) < numGlobals * 2)
+      {
+        bits++;
+      }
+
+      return bits;
+    }
+
+    static size_t align(size_t size)
+    {
+      return (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    }
+
+    bool allocate(size_t numGlobals, size_t numLocals, size_t bcSize, size_t sourceSize)
+    {
+      size_t globalsSize = align(numGlobals * sizeof(rio2d::Script::Subroutine));
+      size_t localsSize = align(numLocals * sizeof(rio2d::Script::LocalVar));
+      size_t indexSize = align(((size_t)1 << indexBits(numGlobals)) * sizeof(uint16_t));
+      size_t usageSize = align(numGlobals * sizeof(rio2d::Script::Usage));
+      size_t bytecodeSize = align(bcSize * sizeof(rio2d::Script::Bytecode));
+
+      m_size = globalsSize + localsSize + indexSize + usageSize + bytecodeSize + sourceSize;
+      char* arena = (char*)m_allocator->allocate(m_size);
+
+      if (arena == nullptr)
+      {
+        return false;
+      }
+
+      m_globals = (rio2d::Script::Subroutine*)arena;
+      arena += globalsSize;
+      m_locals = (rio2d::Script::LocalVar*)arena;
+      arena += localsSize;
+      m_index = (uint16_t*)arena;
+      arena += indexSize;
+      m_usage = (rio2d::Script::Usage*)arena;
+      memset(m_usage, 0, usageSize);
+      arena += usageSize;
+      m_bytecode = (rio2d::Script::Bytecode*)arena;
+      arena += bytecodeSize;
+      m_source = sourceSize != 0 ? arena : nullptr;
+      return true;
+    }
+  };
+
+  // Precompiled scripts. All fields are 32-bit little endian words:
+  //
+  //   Header       magic, version, number of subroutines, stack depth, bytecode size and offset
+  //   Subroutines  hash, address, number of parameters, number of locals, and the hash and type of each local
+  //   Bytecode     aligned to kAlignment bytes from the start of the image, so it can be used in place
+  struct Image
+  {
+    enum
+    {
+      kMagic = 0x326f6972U, // "rio2"
+      kVersion = rio2d::Script::kBytecodeVersion,
+      kAlignment = 16,
+    };
+
+    struct Header
+    {
+      uint32_t m_magic;
+      uint32_t m_version;
+      uint32_t m_numGlobals;
+      uint32_t m_maxStack;
+      uint32_t m_bcSize;
+      uint32_t m_bcOffset;
+    };
+
+    static size_t size(const rio2d::Script::Subroutine* globals, size_t numGlobals, size_t bcSize)
+    {
+      size_t size = sizeof(Header);
+
+      for (size_t i = 0; i < numGlobals; i++)
+      {
+        size += (4 + globals[i].m_numLocals * 2) * sizeof(uint32_t);
+      }
+
+      size = (size + kAlignment - 1) & ~(size_t)(kAlignment - 1);
+      return size + bcSize * sizeof(rio2d::Script::Bytecode);
+    }
+
+    // Writes the image, which must have room for size() bytes; the subroutines must be compiled.
+    static void write(void* image, const rio2d::Script::Bytecode* bytecode, size_t bcSize, const rio2d::Script::Subroutine* globals, size_t numGlobals)
+    {
+      size_t total = size(globals, numGlobals, bcSize);
+      size_t bcOffset = total - bcSize * sizeof(rio2d::Script::Bytecode);
+
+      Header* header = (Header*)image;
+      header->m_magic = kMagic;
+      header->m_version = kVersion;
+      header->m_numGlobals = (uint32_t)numGlobals;
+      header->m_maxStack = (uint32_t)Insns::depth(bytecode, bytecode + bcSize);
+      header->m_bcSize = (uint32_t)bcSize;
+      header->m_bcOffset = (uint32_t)bcOffset;
+
+      uint32_t* word = (uint32_t*)(header + 1);
+
+      for (size_t i = 0; i < numGlobals; i++)
+      {
+        const rio2d::Script::Subroutine* global = globals + i;
+
+        *word++ = global->m_hash;
+        *word++ = global->m_pc;
+        *word++ = (uint32_t)global->m_numParams;
+        *word++ = (uint32_t)global->m_numLocals;
+
+        for (size_t j = 0; j < global->m_numLocals; j++)
+        {
+          *word++ = global->m_locals[j].m_hash;
+          *word++ = global->m_locals[j].m_type;
+        }
+      }
+
+      // Zero the padding so images are reproducible.
+      memset(word, 0, (char*)image + bcOffset - (char*)word);
+      memcpy((char*)image + bcOffset, bytecode, bcSize * sizeof(rio2d::Script::Bytecode));
+    }
+
+    // Validates the image against the limits and decodes the subroutines into the arena; the arena's bytecode points into
+    // the image.
+    static Errors::Enum read(const void* image, size_t size, const rio2d::ScriptBase::Config& config, Arena* arena, size_t* bcSize, size_t* numGlobals)
+    {
+      const Header* header = (const Header*)image;
+
+      if (((uintptr_t)image & (sizeof(uint32_t) - 1)) != 0 || size < sizeof(Header))
+      {
+        return Errors::kInvalidBytecode;
+      }
+
+      // A big endian machine will read a different magic number.
+      if (header->m_magic != kMagic || header->m_version != kVersion)
+      {
+        return Errors::kInvalidBytecode;
+      }
+
+      // The subroutines are between the header and the code.
+      if (header->m_numGlobals > config.m_maxGlobals || header->m_bcOffset < sizeof(Header) || header->m_bcOffset > size || (header->m_bcOffset & (kAlignment - 1)) != 0)
+      {
+        return Errors::kInvalidBytecode;
+      }
+
+      if (header->m_bcSize > (size - header->m_bcOffset) / sizeof(rio2d::Script::Bytecode))
+      {
+        return Errors::kInvalidBytecode;
+      }
+
+      const rio2d::Script::Bytecode* bc = (const rio2d::Script::Bytecode*)((const char*)image + header->m_bcOffset);
+      const uint32_t* word = (const uint32_t*)(header + 1);
+      const uint32_t* end = (const uint32_t*)bc;
+
+      // Count the locals to size the arena.
+      size_t numLocals = 0;
+
+      for (uint32_t i = 0, skip = 0; i < header->m_numGlobals; i++)
+      {
+        if ((size_t)(end - word) < skip + 4 || word[skip + 3] > config.m_maxLocalVars || (size_t)(end - word) < skip + 4 + word[skip + 3] * 2)
+        {
+          return Errors::kInvalidBytecode;
+        }
+
+        numLocals += word[skip + 3];
+        skip += 4 + word[skip + 3] * 2;
+      }
+
+      if (!arena->allocate(header->m_numGlobals, numLocals, 0, 0))
+      {
+        return Errors::kOutOfMemory;
+      }
+
+      rio2d::Script::Subroutine* subs = arena->m_globals;
+      rio2d::Script::LocalVar* locals = arena->m_locals;
+
+      for (uint32_t i = 0; i < header->m_numGlobals; i++)
+      {
+        rio2d::Script::Subroutine* sub = subs + i;
+
+        sub->m_hash = *word++;
+        sub->m_pc = *word++;
+        sub->m_numParams = *word++;
+        sub->m_numLocals = *word++;
+        sub->m_locals = locals;
+        sub->m_source = 0;
+        sub->m_line = 0;
+        sub->m_compiled = true;
+
+        locals += sub->m_numLocals;
+
+        // The first parameter is the target node.
+        if (sub->m_numParams == 0 || sub->m_numLocals < sub->m_numParams)
+        {
+          goto error;
+        }
+
+        for (size_t j = 0; j < sub->m_numLocals; j++)
+        {
+          rio2d::Script::LocalVar* local = sub->m_locals + j;
+
+          local->m_hash = *word++;
+          local->m_type = *word++;
+
+          switch (local->m_type)
+          {
+          case Tokens::kFrames:
+          case Tokens::kNode:
+          case Tokens::kNumber:
+          case Tokens::kSize:
+          case Tokens::kVec2:
+            break;
+
+          default:
+            goto error;
+          }
+        }
+
+        if (sub->m_locals[0].m_type != Tokens::kNode)
+        {
+          goto error;
+        }
+      }
+
+      // Subroutines are laid out in order, each one ending where the next one starts.
+      for (uint32_t i = 0; i < header->m_numGlobals; i++)
+      {
+        rio2d::Script::Address start = subs[i].m_pc;
+        rio2d::Script::Address limit = i + 1 < header->m_numGlobals ? subs[i + 1].m_pc : header->m_bcSize;
+
+        if ((i == 0 && start != 0) || start >= limit || limit > header->m_bcSize || !verify(bc, start, limit, subs[i].m_numLocals))
+        {
+          goto error;
+        }
+      }
+
+      // The runners size their stacks with the depth in the header, so it must be the one of the verified code, which
+      // can't go deeper than the code scanned in order.
+      {
+        size_t depth = Insns::depth(bc, bc + header->m_bcSize);
+
+        if (depth > config.m_maxStack || depth != header->m_maxStack)
+        {
+          goto error;
+        }
+      }
+
+      // The code is never written to after it has been generated.
+      arena->m_bytecode = const_cast<rio2d::Script::Bytecode*>(bc);
+      *bcSize = header->m_bcSize;
+      *numGlobals = header->m_numGlobals;
+      return Errors::kOk;
+
+    error:
+      arena->release();
+      return Errors::kInvalidBytecode;
+    }
+
+  protected:
+    // Checks that the instructions and their operands stay inside the subroutine, and that its code never pops more
+    // values than it pushed and leaves the stack empty at the end. Jumps must land on instructions that expect the
+    // stack they leave, so no loop can grow the stack.
+    static bool verify(const rio2d::Script::Bytecode* bytecode, rio2d::Script::Address start, rio2d::Script::Address limit, size_t numLocals)
+    {
+      rio2d::Script::Address pc = start;
+      int depth = 0;
+
+      while (pc < limit)
+      {
+        rio2d::Script::Insn insn = bytecode[pc].m_insn;
+
+        if (insn > Insns::kVaryRel || limit - pc < Insns::size(insn))
+        {
+          return false;
+        }
+
+        const rio2d::Script::Bytecode* bc = bytecode + pc;
+
+        switch (insn)
+        {
+        case Insns::kJump:
+        case Insns::kJz:
+        case Insns::kSpawn:
+          if (bc[1].m_address < start || bc[1].m_address >= limit)
+          {
+            return false;
+          }
+
+          break;
+
+        case Insns::kNext:
+          if ((size_t)bc[1].m_index >= numLocals || bc[2].m_address < start || bc[2].m_address >= limit)
+          {
+            return false;
+          }
+
+          break;
+
+        case Insns::kSetFrame:
+          if ((size_t)bc[2].m_index >= numLocals)
+          {
+            return false;
+          }
+
+          // fallthrough
+        case Insns::kCallMethod:
+        case Insns::kGetLocal:
+        case Insns::kGetProp:
+        case Insns::kSetLocal:
+        case Insns::kSetProp:
+          if ((size_t)bc[1].m_index >= numLocals)
+          {
+            return false;
+          }
+
+          break;
+
+        case Insns::kVaryAbs:
+        case Insns::kVaryRel:
+          if ((size_t)bc[1].m_index >= numLocals || bc[3].m_index < 0 || bc[3].m_index > (rio2d::Script::Index)Easing::kSineoutIndex)
+          {
+            return false;
+          }
+
+          break;
+        }
+
+        depth += Insns::effect(bc);
+
+        if (depth < 0)
+        {
+          return false;
+        }
+
+        pc += (rio2d::Script::Address)Insns::size(insn);
+      }
+
+      if (depth != 0)
+      {
+        return false;
+      }
+
+      for (pc = start; pc < limit; pc += (rio2d::Script::Address)Insns::size(bytecode[pc].m_insn))
+      {
+        const rio2d::Script::Bytecode* bc = bytecode + pc;
+
+        switch (bc->m_insn)
+        {
+        case Insns::kJump:
+        case Insns::kSpawn:
+          if (Insns::depthAt(bytecode, start, bc[1].m_address) != depth)
+          {
+            return false;
+          }
+
+          break;
+
+        case Insns::kJz:
+          if (Insns::depthAt(bytecode, start, bc[1].m_address) != depth - 1)
+          {
+            return false;
+          }
+
+          break;
+
+        // The loop keeps its limit and step on the stack.
+        case Insns::kNext:
+          if (Insns::depthAt(bytecode, start, bc[2].m_address) != depth)
+          {
+            return false;
+          }
+
+          break;
+        }
+
+        depth += Insns::effect(bc);
+      }
+
+      return true;
+    }
+  };
+
+  class Emitter
+  {
+  public:
+    virtual Errors::Enum addGlobal(rio2d::Hash hash, size_t source, unsigned line) = 0;
+    virtual size_t       numGlobals() const = 0;
+    virtual void         endParams() = 0;
+
+    virtual Errors::Enum addLocal(rio2d::Hash hash, rio2d::Script::Token type) = 0;
+    virtual size_t       numLocals() const = 0;
+    virtual Errors::Enum getIndex(rio2d::Hash hash, rio2d::Script::Index* index) const = 0;
+    virtual Errors::Enum getType(rio2d::Hash hash, rio2d::Script::Token* type) const = 0;
+
+    virtual Errors::Enum           emit(rio2d::Script::Insn insn, va_list args) = 0;
+    virtual rio2d::Script::Address getPC() const = 0;
+    virtual void                   patch(rio2d::Script::Address address, rio2d::Script::Bytecode bc) = 0;
+  };
+
+  // This emitter just collects info about the script without generating any code.
+  class CounterEmitter : public Emitter
+  {
+  public:
+    struct Global
+    {
+      rio2d::Hash m_hash;
+      rio2d::Script::Address m_pc;
+      size_t m_numParams;
+      size_t m_numLocals;
+      size_t m_source;
+      unsigned m_line;
+    };
+
+  protected:
+    struct Local
+    {
+      rio2d::Hash  m_hash;
+      rio2d::Script::Token m_type;
+    };
+
+    Global m_globals[rio2d::ScriptBase::kGlobalsBound];
+    Local  m_locals[rio2d::ScriptBase::kLocalVarsBound];
+    size_t m_numGlobals;
+    size_t m_numLocals;
+    size_t m_maxGlobals;
+    size_t m_maxLocals;
+    size_t m_maxStack;
+    rio2d::Script::Address m_pc;
+
+    // How many values are on the stack after the last instruction.
+    int m_depth;
+
+  public:
+    inline void init(const rio2d::ScriptBase::Config& config)
+    {
+      m_pc = 0;
+      m_depth = 0;
+      m_numGlobals = 0;
+      m_maxGlobals = config.m_maxGlobals;
+      m_maxLocals = config.m_maxLocalVars;
+      m_maxStack = config.m_maxStack;
+    }
+
+    inline const Global* getGlobals() const
+    {
+      return m_globals;
+    }
+
+    // The number of locals of all the subroutines.
+    inline size_t totalLocals() const
+    {
+      size_t total = 0;
+
+      for (size_t i = 0; i < m_numGlobals; i++)
+      {
+        total += m_globals[i].m_numLocals;
+      }
+
+      return total;
+    }
+
+    virtual Errors::Enum addGlobal(rio2d::Hash hash, size_t source, unsigned line) override
+    {
+      if (m_numGlobals < m_maxGlobals)
+      {
+        Global* global = m_globals;
+        const Global* end = global + m_numGlobals;
+
+        while (global < end)
+        {
+          if (global->m_hash == hash)
+          {
+            return Errors::kDuplicateIdentifier;
+          }
+
+          global++;
+        }
+
+        global->m_hash = hash;
+        global->m_pc = m_pc;
+        global->m_numParams = 0;
+        global->m_numLocals = 0;
+        global->m_source = source;
+        global->m_line = line;
+        m_numGlobals++;
+        m_numLocals = 0;
+        return Errors::kOk;
+      }
+
+      return Errors::kOutOfMemory;
+    }
+
+    virtual size_t numGlobals() const override
+    {
+      return m_numGlobals;
+    }
+
+    virtual void endParams() override
+    {
+      m_globals[m_numGlobals - 1].m_numParams = m_numLocals;
+    }
+
+    virtual Errors::Enum addLocal(rio2d::Hash hash, rio2d::Script::Token type) override
+    {
+      if (m_numLocals < m_maxLocals)
+      {
+        Local* local = m_locals;
+        const Local* end = local + m_numLocals;
+
+        while (local < end)
+        {
+          if (local->m_hash == hash)
+          {
+            if (local->m_type == type)
+            {
+              return Errors::kOk;
+            }
+
+            return Errors::kTypeMismatch;
+          }
+
+          local++;
+        }
+
+        local->m_hash = hash;
+        local->m_type = type;
+        m_numLocals++;
+
+        if (m_numGlobals != 0)
+        {
+          m_globals[m_numGlobals - 1].m_numLocals = m_numLocals;
+        }
+
+        return Errors::kOk;
+      }
+
+      return Errors::kOutOfMemory;
+    }
+
+    virtual size_t numLocals() const override
+    {
+      return m_numLocals;
+    }
+
+    virtual Errors::Enum getIndex(rio2d::Hash hash, rio2d::Script::Index* index) const override
+    {
+      const Local* local = m_locals;
+      const Local* end = local + m_numLocals;
+
+      while (local < end)
+      {
+        if (local->m_hash == hash)
+        {
+          *index = local - m_locals;
+          return Errors::kOk;
+        }
+
+        local++;
+      }
+
+      return Errors::kUnknownIdentifier;
+    }
+
+    virtual Errors::Enum getType(rio2d::Hash hash, rio2d::Script::Token* type) const override
+    {
+      const Local* local = m_locals;
+      const Local* end = local + m_numLocals;
+
+      while (local < end)
+      {
+        if (local->m_hash == hash)
+        {
+          *type = local->m_type;
+          return Errors::kOk;
+        }
+
+        local++;
+      }
+
+      return Errors::kUnknownIdentifier;
+    }
+
+    virtual Errors::Enum emit(rio2d::Script::Insn insn, va_list args) override
+    {
+      rio2d::Script::Index field = 0;
+
+      switch (insn)
+      {
+      case Insns::kCallMethod:
+      case Insns::kVaryAbs:
+      case Insns::kVaryRel:
+        va_arg(args, rio2d::Script::Index);
+        field = va_arg(args, rio2d::Script::Index);
+        break;
+      }
+
+      m_pc += Insns::size(insn);
+      m_depth += Insns::effect(insn, field);
+
+      return (size_t)m_depth > m_maxStack ? Errors::kOutOfMemory : Errors::kOk;
+    }
+
+    virtual rio2d::Script::Address getPC() const override
+    {
+      return m_pc;
+    }
+
+    virtual void patch(rio2d::Script::Address address, rio2d::Script::Bytecode bc) override
+    {
+      (void)address;
+      (void)bc;
+    }
+  };
+
+  class CodeEmitter : public Emitter
+  {
+  protected:
+    rio2d::Script::Bytecode* m_bytecode;
+    rio2d::Script::Address m_pc;
+
+    rio2d::Script::Subroutine* m_globals;
+    size_t m_numGlobals;
+
+    // Where the locals of the next subroutine go, the locals of all subroutines are stored one after the other.
+    rio2d::Script::LocalVar* m_locals;
+
+  public:
+    inline void initWithMemory(rio2d::Script::Bytecode* bytecode, rio2d::Script::Subroutine* globals, rio2d::Script::LocalVar* locals)
+    {
+      m_globals = globals;
+      m_numGlobals = 0;
+      m_locals = locals;
+
+      m_bytecode = bytecode;
+      m_pc = 0;
+    }
+
+    // Generates code for only one subroutine, at the address found by the CounterEmitter.
+    inline void initWithSubroutine(rio2d::Script::Bytecode* bytecode, rio2d::Script::Subroutine* global)
+    {
+      m_globals = global;
+      m_numGlobals = 0;
+      m_locals = global->m_locals;
+
+      m_bytecode = bytecode;
+      m_pc = global->m_pc;
+    }
+
+    virtual Errors::Enum addGlobal(rio2d::Hash hash, size_t source, unsigned line) override
+    {
+      rio2d::Script::Subroutine* global = m_globals + m_numGlobals++;
+
+      global->m_hash = hash;
+      global->m_pc = m_pc;
+      global->m_numParams = 0;
+      global->m_numLocals = 0;
+      global->m_locals = m_locals;
+      global->m_source = source;
+      global->m_line = line;
+      global->m_compiled = true;
+
+      return Errors::kOk;
+    }
+
+    virtual size_t numGlobals() const override
+    {
+      return m_numGlobals;
+    }
+
+    virtual void endParams() override
+    {
+      rio2d::Script::Subroutine* global = m_globals + m_numGlobals - 1;
+      global->m_numParams = global->m_numLocals;
+    }
+
+    virtual Errors::Enum addLocal(rio2d::Hash hash, rio2d::Script::Token type) override
+    {
+      if (m_numGlobals != 0)
+      {
+        rio2d::Script::Subroutine* global = m_globals + m_numGlobals - 1;
+        rio2d::Script::LocalVar* local = global->m_locals;
+        const rio2d::Script::LocalVar* end = local + global->m_numLocals;
+
+        while (local < end)
+        {
+          if (local->m_hash == hash)
+          {
+            if (local->m_type == type)
+            {
+              return Errors::kOk;
+            }
+
+            return Errors::kTypeMismatch;
+          }
+
+          local++;
+        }
+
+        local->m_hash = hash;
+        local->m_type = type;
+        global->m_numLocals++;
+        m_locals++;
+      }
+
+      return Errors::kOk;
+    }
+
+    virtual size_t numLocals() const override
+    {
+      if (m_numGlobals != 0)
+      {
+        const rio2d::Script::Subroutine* global = m_globals + m_numGlobals - 1;
+        return global->m_numLocals;
+      }
+
+      return 0;
+    }
+
+    virtual Errors::Enum getIndex(rio2d::Hash hash, rio2d::Script::Index* index) const override
+    {
+      if (m_numGlobals != 0)
+      {
+        const rio2d::Script::Subroutine* global = m_globals + m_numGlobals - 1;
+        const rio2d::Script::LocalVar* local = global->m_locals;
+        const rio2d::Script::LocalVar* end = local + global->m_numLocals;
+
+        while (local < end)
+        {
+          if (local->m_hash == hash)
+          {
+            *index = local - global->m_locals;
+            return Errors::kOk;
+          }
+
+          local++;
+        }
+      }
+
+      return Errors::kUnknownIdentifier;
+    }
+
+    virtual Errors::Enum getType(rio2d::Hash hash, rio2d::Script::Token* type) const override
+    {
+      if (m_numGlobals != 0)
+      {
+        const rio2d::Script::Subroutine* global = m_globals + m_numGlobals - 1;
+        const rio2d::Script::LocalVar* local = global->m_locals;
+        const rio2d::Script::LocalVar* end = local + global->m_numLocals;
+
+        while (local < end)
+        {
+          if (local->m_hash == hash)
+          {
+            *type = local->m_type;
+            return Errors::kOk;
+          }
+
+          local++;
+        }
+      }
+
+      return Errors::kUnknownIdentifier;
+    }
+
+    virtual Errors::Enum emit(rio2d::Script::Insn insn, va_list args) override
+    {
+      switch (insn)
+      {
+      case Insns::kAdd:
+      case Insns::kCeil:
+      case Insns::kCmpEqual:
+      case Insns::kCmpGreater:
+      case Insns::kCmpGreaterEqual:
+      case Insns::kCmpLess:
+      case Insns::kCmpLessEqual:
+      case Insns::kCmpNotEqual:
+      case Insns::kDiv:
+      case Insns::kFloor:
+      case Insns::kLogicalAnd:
+      case Insns::kLogicalNot:
+      case Insns::kLogicalOr:
+      case Insns::kModulus:
+      case Insns::kMul:
+      case Insns::kNeg:
+      case Insns::kPause:
+      case Insns::kRand:
+      case Insns::kRandRange:
+      case Insns::kStop:
+      case Insns::kSub:
+      case Insns::kTrunc:
+        m_bytecode[m_pc++].m_insn = insn;
+        break;
+
+      case Insns::kJump:
+      case Insns::kJz:
+      case Insns::kSpawn:
+        m_bytecode[m_pc++].m_insn = insn;
+        m_bytecode[m_pc++].m_address = va_arg(args, rio2d::Script::Address);
+        break;
+
+      case Insns::kSignal:
+        m_bytecode[m_pc++].m_insn = insn;
+        m_bytecode[m_pc++].m_hash = va_arg(args, rio2d::Hash);
+        break;
+
+      case Insns::kPush:
+        m_bytecode[m_pc++].m_insn = insn;
+        m_bytecode[m_pc++].m_number = (rio2d::Script::Number)va_arg(args, double);
+        break;
+
+      case Insns::kGetLocal:
+      case Insns::kSetLocal:
+        m_bytecode[m_pc++].m_insn = insn;
+        m_bytecode[m_pc++].m_index = va_arg(args, rio2d::Script::Index);
+        break;
+
+      case Insns::kCallMethod:
+      case Insns::kGetProp:
+      case Insns::kSetFrame:
+      case Insns::kSetProp:
+        m_bytecode[m_pc++].m_insn = insn;
+        m_bytecode[m_pc++].m_index = va_arg(args, rio2d::Script::Index);
+        m_bytecode[m_pc++].m_index = va_arg(args, rio2d::Script::Index);
+        break;
+
+      case Insns::kVaryAbs:
+      case Insns::kVaryRel:
+        m_bytecode[m_pc++].m_insn = insn;
+        m_bytecode[m_pc++].m_index = va_arg(args, rio2d::Script::Index);
+        m_bytecode[m_pc++].m_index = va_arg(args, rio2d::Script::Index);
+        m_bytecode[m_pc++].m_index = va_arg(args, rio2d::Script::Index);
+        break;
+
+      case Insns::kNext:
+        m_bytecode[m_pc++].m_insn = insn;
+        m_bytecode[m_pc++].m_index = va_arg(args, rio2d::Script::Index);
+        m_bytecode[m_pc++].m_address = va_arg(args, rio2d::Script::Address);
+        break;
+
+      default:
+        CCASSERT(0, "Unknown instruction");
+      }
+
+      return Errors::kOk;
+    }
+
+    virtual rio2d::Script::Address getPC() const override
+    {
+      return m_pc;
+    }
+
+    virtual void patch(rio2d::Script::Address address, rio2d::Script::Bytecode bc) override
+    {
+      CCASSERT(address < m_pc, "Invalid address to patch");
+      m_bytecode[address] = bc;
+    }
+  };
+
+  class Parser
+  {
+  protected:
+    const char* m_source;
+    const char* m_current;
+    unsigned m_line;
+
+    const char* m_lexeme;
+    size_t m_length;
+    rio2d::Hash m_hash;
+    rio2d::Script::Token m_token;
+    unsigned m_tokenLine;
+
+    // On Windows it seems exception handling on x86_64 is fine, but it isn't on x86 and
+    // I don't know about other CPUs/architectures. Let's avoid the overhead.
+    jmp_buf m_rollback;
+
+    rio2d::Script::Index m_globalsIndex;
+    rio2d::Script::Bytecode* m_bytecode;
+    rio2d::Script::Subroutine* m_globals;
+
+    Emitter* m_emitter;
+    rio2d::ScriptBase::Config m_config;
+
+#ifndef NDEBUG
+    size_t m_bcSize;
+    size_t m_numGlobals;
+#endif
+
+  public:
+    Parser() : m_config(rio2d::ScriptBase::Config::get<rio2d::DefaultLimits>()) {}
+    explicit Parser(const rio2d::ScriptBase::Config& config) : m_config(config) {}
+
+    struct Split
+    {
+      size_t m_source;
+      unsigned m_line;
+    };
+
+    // Finds where the subroutines start, using the same rules as match() to skip comments and strings.
+    // Returns the number of subroutines found, but only the first max ones are stored in splits.
+    static size_t split(const char* source, Split* splits, size_t max)
+    {
+      const char* current = source;
+      unsigned line = 1;
+      size_t count = 0;
+
+      while (*current != 0)
+      {
+        if (isalpha((unsigned char)*current) || *current == '_')
+        {
+          const char* lexeme = current;
+
+          do
+          {
+            current++;
+          } while (isalnum((unsigned char)*current) || *current == '_');
+
+          if (rio2d::hashLower(lexeme, current - lexeme) == Tokens::kSub)
+          {
+            if (count < max)
+            {
+              splits[count].m_source = lexeme - source;
+              splits[count].m_line = line;
+            }
+
+            count++;
+          }
+        }
+        else if (isdigit((unsigned char)*current))
+        {
+          do
+          {
+            current++;
+          } while (isdigit((unsigned char)*current));
+        }
+        else if (*current == '"')
+        {
+          current++;
+
+          while (*current != 0 && *current != '\n')
+          {
+            if (*current == '"')
+            {
+              if (current[1] == '"')
+              {
+                current++;
+              }
+              else
+              {
+                break;
+              }
+            }
+
+            current++;
+          }
+
+          if (*current == '"')
+          {
+            current++;
+          }
+        }
+        else if (*current == '\'')
+        {
+          while (*current != '\n' && *current != 0) current++;
+        }
+        else
+        {
+          if (*current == '\n')
+          {
+            line++;
+          }
+
+          current++;
+        }
+      }
+
+      return count;
+    }
+
+    // Only checks the source code for errors, without generating any code.
+    Errors::Enum validate(const char* source)
+    {
+      CounterEmitter counter;
+      counter.init(m_config);
+      m_emitter = &counter;
+
+      return compile(source);
+    }
+
+    Errors::Enum initWithSourceAndPointers(const char* source, Arena* arena, size_t* bcSize, size_t* numGlobals, bool lazy)
+    {
+      CounterEmitter counter;
+      counter.init(m_config);
+      m_emitter = &counter;
+
+      Errors::Enum res = compile(source);
+
+      if (res != Errors::kOk)
+      {
+        return res;
+      }
+
+#ifndef NDEBUG
+      m_bcSize = *bcSize = (size_t)counter.getPC();
+      m_numGlobals = *numGlobals = counter.numGlobals();
+#else
+      *bcSize = (size_t)counter.getPC();
+      *numGlobals = counter.numGlobals();
+#endif
+
+      // Keep a copy of the source code around to generate code later when compiling lazily.
+      size_t sourceSize = lazy ? strlen(source) + 1 : 0;
+
+      if (arena->allocate(*numGlobals, counter.totalLocals(), *bcSize, sourceSize))
+      {
+        m_bytecode = arena->m_bytecode;
+        m_globals = arena->m_globals;
+
+        if (lazy)
+        {
+          memcpy(arena->m_source, source, sourceSize);
+
+          // Only record where each subroutine is, its code will be generated on demand.
+          const CounterEmitter::Global* global = counter.getGlobals();
+          rio2d::Script::Subroutine* sub = m_globals;
+          const rio2d::Script::Subroutine* end = sub + *numGlobals;
+          rio2d::Script::LocalVar* locals = arena->m_locals;
+
+          while (sub < end)
+          {
+            sub->m_hash = global->m_hash;
+            sub->m_pc = global->m_pc;
+            sub->m_numParams = global->m_numParams;
+            sub->m_numLocals = 0;
+            sub->m_locals = locals;
+            sub->m_source = global->m_source;
+            sub->m_line = global->m_line;
+            sub->m_compiled = false;
+
+            locals += global->m_numLocals;
+            sub++;
+            global++;
+          }
+
+          return Errors::kOk;
+        }
+
+        CodeEmitter generator;
+        generator.initWithMemory(m_bytecode, m_globals, arena->m_locals);
+        m_emitter = &generator;
+
+        res = compile(source); // This call to compile is bound to return kOk.
+
+#ifndef NDEBUG
+        Insns::disasm(m_bytecode, m_bytecode + *bcSize);
+#endif
+
+        return res;
+      }
+
+      return Errors::kOutOfMemory;
+    }
+
+    Errors::Enum initWithSourceInParallel(const char* source, Arena* arena, size_t* bcSize, size_t* numGlobals)
+    {
+      // Find where each subroutine starts; any code before the first one goes with it.
+      Split splits[rio2d::ScriptBase::kGlobalsBound + 1];
+      size_t count = split(source, splits, m_config.m_maxGlobals + 1);
+
+      if (count > m_config.m_maxGlobals)
+      {
+        locate(source, splits[m_config.m_maxGlobals].m_source, splits[m_config.m_maxGlobals].m_line);
+        return Errors::kOutOfMemory;
+      }
+
+      splits[0].m_source = 0;
+      splits[0].m_line = 1;
+      count = std::max<size_t>(count, 1);
+
+      Chunk* chunks = new (std::nothrow) Chunk[count];
+      Parser* parsers = new (std::nothrow) Parser[count];
+
+      if (chunks == nullptr || parsers == nullptr)
+      {
+        delete[] chunks;
+        delete[] parsers;
+        return Errors::kOutOfMemory;
+      }
+
+      for (size_t i = 0; i < count; i++)
+      {
+        parsers[i].m_config = m_config;
+        chunks[i].m_parser = parsers + i;
+        chunks[i].m_source = splits[i].m_source;
+        chunks[i].m_line = splits[i].m_line;
+        chunks[i].m_end = i + 1 < count ? source + splits[i + 1].m_source : nullptr;
+        chunks[i].m_bytecode = nullptr;
+      }
+
+      // Compile the chunks in a pool of workers, including this thread.
+      std::atomic<size_t> next(0);
+
+      auto worker = [source, chunks, count, &next]()
+      {
+        for (;;)
+        {
+          size_t i = next++;
+
+          if (i >= count)
+          {
+            break;
+          }
+
+          Chunk* chunk = chunks + i;
+          chunk->m_error = chunk->m_parser->initWithChunk(source, chunk);
+        }
+      };
+
+      size_t numWorkers = std::min<size_t>(std::max<unsigned>(std::thread::hardware_concurrency(), 1), count) - 1;
+      std::thread* workers = new (std::nothrow) std::thread[numWorkers];
+
+      if (workers == nullptr)
+      {
+        numWorkers = 0;
+      }
+
+      for (size_t i = 0; i < numWorkers; i++)
+      {
+        workers[i] = std::thread(worker);
+      }
+
+      worker();
+
+      for (size_t i = 0; i < numWorkers; i++)
+      {
+        workers[i].join();
+      }
+
+      delete[] workers;
+
+      // Check for errors in source code order, just like the sequential compiler would.
+      Errors::Enum res = Errors::kOk;
+      size_t total = 0, subs = 0, locals = 0;
+
+      for (size_t i = 0; i < count && res == Errors::kOk; i++)
+      {
+        Chunk* chunk = chunks + i;
+
+        if (chunk->m_error != Errors::kOk)
+        {
+          m_tokenLine = chunk->m_parser->getLine();
+          m_lexeme = chunk->m_parser->getLexeme(&m_length);
+          res = chunk->m_error;
+          break;
+        }
+
+        if (chunk->m_numGlobals != 0)
+        {
+          for (size_t j = 0; j < i; j++)
+          {
+            if (chunks[j].m_numGlobals != 0 && chunks[j].m_global.m_hash == chunk->m_global.m_hash)
+            {
+              locate(source, chunk->m_global.m_source, chunk->m_global.m_line);
+              res = Errors::kDuplicateIdentifier;
+              break;
+            }
+          }
+        }
+
+        total += chunk->m_bcSize;
+        subs += chunk->m_numGlobals;
+        locals += chunk->m_numGlobals != 0 ? chunk->m_global.m_numLocals : 0;
+      }
+
+      if (res == Errors::kOk)
+      {
+#ifndef NDEBUG
+        m_bcSize = *bcSize = total;
+        m_numGlobals = *numGlobals = subs;
+#else
+        *bcSize = total;
+        *numGlobals = subs;
+#endif
+
+        if (arena->allocate(subs, locals, total, 0))
+        {
+          m_bytecode = arena->m_bytecode;
+          m_globals = arena->m_globals;
+
+          // Stitch the chunks together.
+          rio2d::Script::Address base = 0;
+          rio2d::Script::Subroutine* global = m_globals;
+          rio2d::Script::LocalVar* local = arena->m_locals;
+
+          for (size_t i = 0; i < count; i++)
+          {
+            Chunk* chunk = chunks + i;
+            rio2d::Script::Bytecode* bc = m_bytecode + base;
+
+            memcpy(bc, chunk->m_bytecode, chunk->m_bcSize * sizeof(rio2d::Script::Bytecode));
+            Insns::relocate(bc, bc + chunk->m_bcSize, base);
+
+            if (chunk->m_numGlobals != 0)
+            {
+              *global = chunk->m_global;
+              global->m_pc += base;
+              global->m_locals = local;
+
+              memcpy(local, chunk->m_locals, chunk->m_global.m_numLocals * sizeof(rio2d::Script::LocalVar));
+              local += chunk->m_global.m_numLocals;
+              global++;
+            }
+
+            base += chunk->m_bcSize;
+          }
+
+#ifndef NDEBUG
+          Insns::disasm(m_bytecode, m_bytecode + *bcSize);
+#endif
+        }
+        else
+        {
+          res = Errors::kOutOfMemory;
+        }
+      }
+
+      for (size_t i = 0; i < count; i++)
+      {
+        delete[] chunks[i].m_bytecode;
+      }
+
+      delete[] chunks;
+      delete[] parsers;
+      return res;
+    }
+
+    Errors::Enum initWithSubroutine(const char* source, rio2d::Script::Bytecode* bytecode, rio2d::Script::Subroutine* global)
+    {
+      CodeEmitter generator;
+      generator.initWithSubroutine(bytecode, global);
+      m_emitter = &generator;
+
+      // The whole script was already validated, so this is bound to return kOk.
+      Errors::Enum res = compile(source, global->m_source, global->m_line);
+
+#ifndef NDEBUG
+      Insns::disasm(bytecode, bytecode + global->m_pc, bytecode + generator.getPC());
+#endif
+
+      return res;
+    }
+
+    unsigned getLine() const
+    {
+      return m_tokenLine;
+    }
+
+    const char* getLexeme(size_t* length)
+    {
+      if (length)
+      {
+        *length = m_length;
+      }
+
+      return m_lexeme;
+    }
+
+  protected:
+    // A piece of the source code with at most one subroutine, compiled on its own.
+    struct Chunk
+    {
+      size_t m_source;
+      unsigned m_line;
+      const char* m_end;
+
+      Parser* m_parser;
+      Errors::Enum m_error;
+      rio2d::Script::Bytecode* m_bytecode;
+      size_t m_bcSize;
+      rio2d::Script::Subroutine m_global;
+      rio2d::Script::LocalVar m_locals[rio2d::ScriptBase::kLocalVarsBound];
+      size_t m_numGlobals;
+    };
+
+    Errors::Enum initWithChunk(const char* source, Chunk* chunk)
+    {
+      CounterEmitter counter;
+      counter.init(m_config);
+      m_emitter = &counter;
+
+      Errors::Enum res = compile(source, chunk);
+
+      if (res != Errors::kOk)
+      {
+        return res;
+      }
+
+      chunk->m_bcSize = (size_t)counter.getPC();
+      chunk->m_numGlobals = counter.numGlobals();
+      chunk->m_bytecode = new (std::nothrow) rio2d::Script::Bytecode[chunk->m_bcSize];
+
+      if (chunk->m_bytecode == nullptr)
+      {
+        return Errors::kOutOfMemory;
+      }
+
+      CodeEmitter generator;
+      generator.initWithMemory(chunk->m_bytecode, &chunk->m_global, chunk->m_locals);
+      m_emitter = &generator;
+
+      return compile(source, chunk); // This call to compile is bound to return kOk.
+    }
+
+    // Positions the lexer at the name of the subroutine starting at offset, to report errors.
+    void locate(const char* source, size_t offset, unsigned line)
+    {
+      m_source = source;
+      m_current = source + offset;
+      m_line = line;
+
+      if (setjmp(m_rollback) == 0)
+      {
+        match();
+        match();
+      }
+    }
+
+    int raise(Errors::Enum error)
+    {
+      longjmp(m_rollback, (int)error);
+      return 0; // Shut up the compiler.
+    }
+
+    Errors::Enum compile(const char* source)
+    {
+      m_source = source;
+      m_current = source;
+      m_line = 1;
+
+      Errors::Enum res = (Errors::Enum)setjmp(m_rollback);
+
+      if (res != Errors::kOk)
+      {
+        goto out;
+      }
+
+      m_globalsIndex = 0;
+
+      match();
+      parse();
+
+      res = Errors::kOk;
+
+    out:
+      return res;
+    }
+
+    // Compiles a chunk, which must end where the next subroutine starts.
+    Errors::Enum compile(const char* source, const Chunk* chunk)
+    {
+      m_source = source;
+      m_current = source + chunk->m_source;
+      m_line = chunk->m_line;
+
+      Errors::Enum res = (Errors::Enum)setjmp(m_rollback);
+
+      if (res != Errors::kOk)
+      {
+        goto out;
+      }
+
+      match();
+
+      if (m_token == Tokens::kSub)
+      {
+        parseSub();
+      }
+
+      if (m_token != Tokens::kSub)
+      {
+        match(Tokens::kEof);
+      }
+      else if (m_lexeme != chunk->m_end)
+      {
+        // split() and match() disagree on where the subroutine ends.
+        raise(Errors::kUnexpectedToken);
+      }
+
+      res = Errors::kOk;
+
+    out:
+      return res;
+    }
+
+    // Compiles only the subroutine that starts at the given offset.
+    Errors::Enum compile(const char* source, size_t offset, unsigned line)
+    {
+      m_source = source;
+      m_current = source + offset;
+      m_line = line;
+
+      Errors::Enum res = (Errors::Enum)setjmp(m_rollback);
+
+      if (res != Errors::kOk)
+      {
+        goto out;
+      }
+
+      match();
+      parseSub();
+
+      res = Errors::kOk;
+
+    out:
+      return res;
+    }
+
+    void match()
+    {
+    again:
+
+      // Skip spaces.
+      for (;;)
+      {
+        if (isspace(*m_current))
+        {
+          if (*m_current == '\n')
+          {
+            // End of line, increment the line number.
+            m_line++;
+          }
+
+          m_current++; // m_current is a space, can increment directly.
+        }
+        else if (*m_current != 0)
+        {
+          // Not a space, and not the end of the source code.
+          break;
+        }
+        else
+        {
+          // End of the source code, return the kEof token.
+          m_lexeme = "<eof>";
+          m_length = 5;
+          m_token = Tokens::kEof;
+          m_tokenLine = m_line;
+          return;
+        }
+      }
+
+      m_lexeme = m_current;
+      m_tokenLine = m_line;
+
+      // If the character is alphabetic or '_', the token is a keyword or an identifier.
+      if (isalpha(*m_current) || *m_current == '_')
+      {
+        do
+        {
+          m_current++; // m_current is an alphanumeric character, can increment directly.
+        } while (isalnum(*m_current) || *m_current == '_');
+
+        // Evaluate the hash of the identifier to check if it's a keyword.
+        m_hash = rio2d::hashLower(m_lexeme, m_current - m_lexeme);
+
+        if (Tokens::isKeyword(m_hash))
+        {
+          m_token = m_hash;
+        }
+        else
+        {
+          m_token = Tokens::kIdentifier;
+        }
+
+        m_length = m_current - m_lexeme;
+        return;
+      }
+
+      if (isdigit(*m_current))
+      {
+        do
+        {
+          m_current++; // m_current is a decimal digit, can increment directly.
+        } while (isdigit(*m_current));
+
+        if (*m_current == '.')
+        {
+          m_current++; // m_current is '.', can increment directly.
+
+          if (!isdigit(*m_current))
+          {
+            raise(Errors::kMalformedNumber);
+            return; // Not needed, but let's the compiler know we're not going to do any further processing here.
+          }
+
+          do
+          {
+            m_current++; // m_current is a decimal digit, can increment directly.
+          } while (isdigit(*m_current));
+        }
+
+        if (*m_current == 'e' || *m_current == 'E')
+        {
+          m_current++; // m_current is the exponent character, can increment directly.
+
+          if (*m_current == '-' || *m_current == '+')
+          {
+            m_current++; // m_current is a signal, can increment directly.
+          }
+
+          if (!isdigit(*m_current))
+          {
+            raise(Errors::kMalformedNumber);
+            return;
+          }
+
+          do
+          {
+            m_current++; // m_current is a decimal digit, can increment directly.
+          } while (isdigit(*m_current));
+        }
+
+        m_length = m_current - m_lexeme;
+        m_token = Tokens::kNumberConst;
+        return;
+      }
+
+      if (*m_current == '"')
+      {
+        m_current++; // m_current is '"', can increment directly.
+
+        while (*m_current != 0 && *m_current != '\n')
+        {
+          if (*m_current == '"')
+          {
+            if (m_current[1] == '"')
+            {
+              m_current++;
+            }
+            else
+            {
+              break;
+            }
+          }
+
+          m_current++; // m_current cannot be the null terminator, can increment directly.
+        }
+
+        if (*m_current != '"')
+        {
+          raise(Errors::kUnterminatedString);
+          return;
+        }
+
+        m_lexeme++;
+        m_length = m_current++ - m_lexeme; // m_current is '"', can increment directly.
+        m_token = Tokens::kStringConst;
+        m_hash = rio2d::hash(m_lexeme, m_length);
+        return;
+      }
+
+      switch (*m_current)
+      {
+      case '+':
+      case '-':
+      case '*':
+      case '/':
+      case '=':
+      case '.':
+      case ',':
+      case '(':
+      case ')':
+        m_length = 1;
+        m_token = *m_current++; // m_current cannot be the null terminator, can increment directly.
+        return;
+
+      case '<':
+        m_token = *m_current++; // m_current cannot be the null terminator, can increment directly.
+
+        if (*m_current == '>')
+        {
+          m_current++; // m_current cannot be the null terminator, can increment directly.
+          m_token = Tokens::kNotEqual;
+        }
+        else if (*m_current == '=')
+        {
+          m_current++; // m_current cannot be the null terminator, can increment directly.
+          m_token = Tokens::kLessEqual;
+        }
+
+        m_length = m_current - m_lexeme;
+        return;
+
+      case '>':
+        m_token = *m_current++; // m_current cannot be the null terminator, can increment directly.
+
+        if (*m_current == '=')
+        {
+          m_current++; // m_current cannot be the null terminator, can increment directly.
+          m_token = Tokens::kGreaterEqual;
+        }
+
+        m_length = m_current - m_lexeme;
+        return;
+
+      case '\'':
+        // Comment.
+        while (*m_current != '\n' && *m_current != 0) m_current++;
+
+        // Could be return next(...) since compilers do tail call optimization blah blah blah,
+        // but the optimization would be just a jump anyway, just like this goto here :P
+        goto again;
+      }
+
+      if (*m_current == 0)
+      {
+        raise(Errors::kUnexpectedEOF);
+        return;
+      }
+
+      raise(Errors::kInvalidCharacterInInput);
+    }
+
+    void match(rio2d::Script::Token token)
+    {
+      if (m_token != token)
+      {
+        raise(Errors::kUnexpectedToken);
+        return;
+      }
+
+      match();
+    }
+
+    void emit(rio2d::Script::Insn insn, ...)
+    {
+      va_list args;
+      va_start(args, insn);
+
+      Errors::Enum error = m_emitter->emit(insn, args);
+
+      va_end(args);
+
+      if (error != Errors::kOk)
+      {
+        raise(error);
+      }
+    }
+
+    void emitNodeVary(bool absolute, rio2d::Script::Index index)
+    {
+      rio2d::Script::Index field = Fields::index(m_hash);
+      unsigned params = 0;
+
+      switch (field)
+      {
+      case Fields::kFadeinIndex:
+        field = Fields::kOpacityIndex;
+        emit(Insns::kPush, 0.0f);
+        emit(Insns::kPush, 255.0f);
+        params = 0;
+        break;
+
+      case Fields::kFadeoutIndex:
+        field = Fields::kOpacityIndex;
+        emit(Insns::kPush, 255.0f);
+        emit(Insns::kPush, 0.0f);
+        params = 0;
+        break;
+
+      case Fields::kFadetoIndex:
+        field = Fields::kOpacityIndex;
+        emit(Insns::kGetProp, index, field);
+        params = 1;
+        break;
+
+      case Fields::kRotatebyIndex:
+      case Fields::kRotatetoIndex:
+        field = Fields::kRotationIndex;
+        emit(Insns::kGetProp, index, field);
+        params = 1;
+        break;
+
+      case Fields::kScalebyIndex:
+      case Fields::kScaletoIndex:
+        field = Fields::kScaleIndex;
+        emit(Insns::kGetProp, index, field);
+        params = 1;
+        break;
+
+      case Fields::kMovebyIndex:
+      case Fields::kMovetoIndex:
+        field = Fields::kPositionIndex;
+        emit(Insns::kGetProp, index, Fields::kXIndex);
+        emit(Insns::kGetProp, index, Fields::kYIndex);
+        params = 2;
+        break;
+
+      case Fields::kSkewbyIndex:
+      case Fields::kSkewtoIndex:
+        field = Fields::kSkewIndex;
+        emit(Insns::kGetProp, index, Fields::kSkewxIndex);
+        emit(Insns::kGetProp, index, Fields::kSkewyIndex);
+        params = 2;
+        break;
+
+      case Fields::kTintbyIndex:
+      case Fields::kTinttoIndex:
+        field = Fields::kTintIndex;
+        emit(Insns::kGetProp, index, Fields::kRedIndex);
+        emit(Insns::kGetProp, index, Fields::kGreenIndex);
+        emit(Insns::kGetProp, index, Fields::kBlueIndex);
+        params = 3;
+        break;
+      }
+
+      match(Tokens::kIdentifier);
+      parseExpressions(params, Tokens::kNumber);
+      match(Tokens::kIn);
+
+      // Push the elapsed time.
+      emit(Insns::kPush, 0.0f);
+
+      parseExpressions(1, Tokens::kNumber);
+      match(Tokens::kSecs);
+
+      rio2d::Script::Index ease = Easing::kLinearIndex;
+
+      if (m_token == Tokens::kWith)
+      {
+        match();
+        ease = Easing::index(m_hash);
+
+        if (ease == -1)
+        {
+          raise(Errors::kUnknownEaseFunc);
+        }
+
+        match(Tokens::kIdentifier);
+      }
+
+      emit(absolute ? Insns::kVaryAbs : Insns::kVaryRel, index, field, ease);
+    }
+
+    void emitSetNodeProp(rio2d::Script::Index index)
+    {
+      rio2d::Script::Index field = Fields::index(m_hash);
+      rio2d::Hash type;
+      rio2d::Script::Index frames = 0;
+      int error;
+
+      switch (field)
+      {
+      case Fields::kBboxheightIndex:
+      case Fields::kBboxwidthIndex:
+      case Fields::kBlueIndex:
+      case Fields::kGreenIndex:
+      case Fields::kHeightIndex:
+      case Fields::kOpacityIndex:
+      case Fields::kRedIndex:
+      case Fields::kRotationIndex:
+      case Fields::kScaleIndex:
+      case Fields::kSkewxIndex:
+      case Fields::kSkewyIndex:
+      case Fields::kWidthIndex:
+      case Fields::kXIndex:
+      case Fields::kYIndex:
+        match(Tokens::kIdentifier);
+        match('=');
+        parseExpressions(1, Tokens::kNumber);
+        emit(Insns::kSetProp, index, field);
+        break;
+
+      case Fields::kFlipxIndex:
+      case Fields::kFlipyIndex:
+      case Fields::kVisibleIndex:
+        match(Tokens::kIdentifier);
+        match('=');
+        parseExpressions(1, Tokens::kTrue);
+        emit(Insns::kSetProp, index, field);
+        break;
+
+      case Fields::kPlaceIndex:
+      case Fields::kSkewIndex:
+        match(Tokens::kIdentifier);
+        parseExpressions(2, Tokens::kNumber);
+        emit(Insns::kCallMethod, index, field);
+        break;
+
+      case Fields::kSetframeIndex:
+        match(Tokens::kIdentifier);
+        error = m_emitter->getType(m_hash, &type);
+
+        if (error != Errors::kOk)
+        {
+          raise(Errors::kUnknownIdentifier);
+          return;
+        }
+
+        if (type != Tokens::kFrames)
+        {
+          raise(Errors::kTypeMismatch);
+          return;
+        }
+
+        m_emitter->getIndex(m_hash, &frames);
+        match(Tokens::kIdentifier);
+        match(',');
+        parseExpressions(1, Tokens::kNumber);
+        emit(Insns::kSetFrame, index, frames);
+        break;
+
+      case Fields::kTintIndex:
+        match(Tokens::kIdentifier);
+        parseExpressions(3, Tokens::kNumber);
+        emit(Insns::kCallMethod, index, field);
+        break;
+
+      case Fields::kMovebyIndex:
+      case Fields::kRotatebyIndex:
+      case Fields::kScalebyIndex:
+      case Fields::kSkewbyIndex:
+      case Fields::kTintbyIndex:
+        emitNodeVary(false, index);
+        break;
+
+      case Fields::kFadeinIndex:
+      case Fields::kFadeoutIndex:
+      case Fields::kFadetoIndex:
+      case Fields::kMovetoIndex:
+      case Fields::kRotatetoIndex:
+      case Fields::kScaletoIndex:
+      case Fields::kSkewtoIndex:
+      case Fields::kTinttoIndex:
+        emitNodeVary(true, index);
+        break;
+
+      default:
+        raise(Errors::kUnknownField);
+        return;
+      }
+    }
+
+    void emitSetVec2Prop(rio2d::Script::Index index)
+    {
+      rio2d::Script::Index field = Fields::index(m_hash);
+
+      switch (field)
+      {
+      case Fields::kXIndex:
+      case Fields::kYIndex:
+        match(Tokens::kIdentifier);
+        match('=');
+        parseExpressions(1, Tokens::kNumber);
+        emit(Insns::kSetProp, index, field);
+        break;
+
+      default:
+        raise(Errors::kUnknownField);
+        return;
+      }
+    }
+
+    void emitSetSizeProp(rio2d::Script::Index index)
+    {
+      rio2d::Script::Index field = Fields::index(m_hash);
+
+      switch (field)
+      {
+      case Fields::kHeightIndex:
+      case Fields::kWidthIndex:
+        match(Tokens::kIdentifier);
+        match('=');
+        parseExpressions(1, Tokens::kNumber);
+        emit(Insns::kSetProp, index, field);
+        break;
+
+      default:
+        raise(Errors::kUnknownField);
+        return;
+      }
+    }
+
+    rio2d::Script::Token emitGetNodeProp(rio2d::Script::Index index)
+    {
+      rio2d::Script::Index field = Fields::index(m_hash);
+
+      switch (field)
+      {
+      case Fields::kBboxheightIndex:
+      case Fields::kBboxwidthIndex:
+      case Fields::kBlueIndex:
+      case Fields::kGreenIndex:
+      case Fields::kHeightIndex:
+      case Fields::kOpacityIndex:
+      case Fields::kRotationIndex:
+      case Fields::kScaleIndex:
+      case Fields::kSkewxIndex:
+      case Fields::kSkewyIndex:
+      case Fields::kWidthIndex:
+      case Fields::kXIndex:
+      case Fields::kYIndex:
+        match(Tokens::kIdentifier);
+        emit(Insns::kGetProp, index, field);
+        return Tokens::kNumber;
+
+      case Fields::kFlipxIndex:
+      case Fields::kFlipyIndex:
+      case Fields::kVisibleIndex:
+        match(Tokens::kIdentifier);
+        emit(Insns::kGetProp, index, field);
+        return Tokens::kTrue;
+
+      default:
+        return raise(Errors::kUnknownField);
+      }
+    }
+
+    rio2d::Script::Token emitGetVec2Prop(rio2d::Script::Index index)
+    {
+      rio2d::Script::Index field = Fields::index(m_hash);
+
+      switch (field)
+      {
+      case Fields::kXIndex:
+      case Fields::kYIndex:
+        match(Tokens::kIdentifier);
+        emit(Insns::kGetProp, index, field);
+        return Tokens::kNumber;
+
+      default:
+        return raise(Errors::kUnknownField);
+      }
+    }
+
+    rio2d::Script::Token emitGetSizeProp(rio2d::Script::Index index)
+    {
+      rio2d::Script::Index field = Fields::index(m_hash);
+
+      switch (field)
+      {
+      case Fields::kHeightIndex:
+      case Fields::kWidthIndex:
+        match(Tokens::kIdentifier);
+        emit(Insns::kGetProp, index, field);
+        return Tokens::kNumber;
+
+      default:
+        return raise(Errors::kUnknownField);
+      }
+    }
+
+    rio2d::Script::Token emitGetFramesProp(rio2d::Script::Index index)
+    {
+      rio2d::Script::Index field = Fields::index(m_hash);
+
+      switch (field)
+      {
+      case Fields::kLengthIndex:
+        match(Tokens::kIdentifier);
+        emit(Insns::kGetProp, index, field);
+        return Tokens::kNumber;
+
+      default:
+        return raise(Errors::kUnknownField);
+      }
+    }
+
+    void parse()
+    {
+      while (m_token == Tokens::kSub)
+      {
+        parseSub();
+      }
+
+      match(Tokens::kEof);
+    }
+
+    void parseSub()
+    {
+      size_t source = m_lexeme - m_source;
+      unsigned line = m_tokenLine;
+      match();
+
+      Errors::Enum error = m_emitter->addGlobal(m_hash, source, line);
+
+      if (error != Errors::kOk)
+      {
+        raise(error);
+        return;
+      }
+
+      match(Tokens::kIdentifier);
+
+      match('(');
+
+      rio2d::Hash hash = m_hash;
+      match(Tokens::kIdentifier);
+
+      match(Tokens::kAs);
+
+      rio2d::Hash type = m_token;
+
+      if (type != Tokens::kNode)
+      {
+        raise(Errors::kFirstParamNotANode);
+        return;
+      }
+
+      match();
+      m_emitter->addLocal(hash, type);
+
+      while (m_token == ',')
+      {
+        match();
+
+        hash = m_hash;
+        match(Tokens::kIdentifier);
+
+        match(Tokens::kAs);
+
+        type = m_token;
+
+        switch (type)
+        {
+        case Tokens::kFrames:
+        case Tokens::kNode:
+        case Tokens::kNumber:
+        case Tokens::kSize:
+        case Tokens::kVec2:
+          match();
+          m_emitter->addLocal(hash, type);
+          break;
+
+        default:
+          raise(Errors::kUnknownType);
+          return;
+        }
+      }
+
+      match(')');
+      m_emitter->endParams();
+
+      for (;;)
+      {
+        switch (m_token)
+        {
+        case Tokens::kFor:        parseFor(); break;
+        case Tokens::kForever:    parseForever(); goto out; // Forever can only be the last statement in a define.
+        case Tokens::kIdentifier: parseAssign(); break;
+        case Tokens::kIf:         parseIf(); break;
+        case Tokens::kParallel:   parseParallel(); break;
+        case Tokens::kPause:      parsePause(); break;
+        case Tokens::kRepeat:     parseRepeat(); break;
+        case Tokens::kSequence:   parseSequence(); break;
+        case Tokens::kSignal:     parseSignal(); break;
+        case Tokens::kWhile:      parseWhile(); break;
+        default:                  emit(Insns::kStop); goto out; // Let match(kEnd) raise the error, if any.
+        }
+      }
+
+    out:
+      match(Tokens::kEnd);
+    }
+
+    void parseFor()
+    {
+      match();
+
+      rio2d::Hash hash = m_hash;
+      match(Tokens::kIdentifier);
+      match('=');
+
+      parseExpressions(1, Tokens::kNumber);
+
+      rio2d::Script::Token idType;
+      Errors::Enum error = m_emitter->getType(hash, &idType);
+
+      if (error == Errors::kUnknownIdentifier)
+      {
+        m_emitter->addLocal(hash, Tokens::kNumber);
+      }
+      else if (error == Errors::kOk)
+      {
+        if (idType != Tokens::kNumber)
+        {
+          raise(Errors::kTypeMismatch);
+          return;
+        }
+      }
+      else
+      {
+        raise(error);
+        return;
+      }
+
+      rio2d::Script::Index index;
+      error = m_emitter->getIndex(hash, &index);
+
+      if (error != Errors::kOk)
+      {
+        raise(error);
+        return;
+      }
+
+      emit(Insns::kSetLocal, index);
+
+      match(Tokens::kTo);
+      parseExpressions(1, Tokens::kNumber);
+
+      if (m_token == Tokens::kStep)
+      {
+        match();
+        parseExpressions(1, Tokens::kNumber);
+      }
+      else
+      {
+        emit(Insns::kPush, 1.0f);
+      }
+
+      rio2d::Script::Address again = m_emitter->getPC();
+
+      for (;;)
+      {
+        switch (m_token)
+        {
+        case Tokens::kFor:        parseFor(); break;
+        case Tokens::kForever:    parseForever(); goto out; // Forever can only be the last statement in a "forever" sequence.
+        case Tokens::kIdentifier: parseAssign(); break;
+        case Tokens::kIf:         parseIf(); break;
+        case Tokens::kParallel:   parseParallel(); break;
+        case Tokens::kPause:      parsePause(); break;
+        case Tokens::kRepeat:     parseRepeat(); break;
+        case Tokens::kSequence:   parseSequence(); break;
+        case Tokens::kSignal:     parseSignal(); break;
+        case Tokens::kWhile:      parseWhile(); break;
+        default:                  goto out; // Let match(kNext) raise the error, if any.
+        }
+      }
+
+    out:
+      match(Tokens::kNext);
+      emit(Insns::kNext, index, again);
+    }
+
+    void parseForever()
+    {
+      match();
+
+      rio2d::Script::Address again = m_emitter->getPC();
+
+      for (;;)
+      {
+        switch (m_token)
+        {
+        case Tokens::kFor:        parseFor(); break;
+        case Tokens::kForever:    parseForever(); goto out; // Forever can only be the last statement in a "forever" sequence.
+        case Tokens::kIdentifier: parseAssign(); break;
+        case Tokens::kIf:         parseIf(); break;
+        case Tokens::kParallel:   parseParallel(); break;
+        case Tokens::kPause:      parsePause(); break;
+        case Tokens::kRepeat:     parseRepeat(); break;
+        case Tokens::kSequence:   parseSequence(); break;
+        case Tokens::kSignal:     parseSignal(); break;
+        case Tokens::kWhile:      parseWhile(); break;
+        default:                  goto out; // Let match(kEnd) raise the error, if any.
+        }
+      }
+
+    out:
+      match(Tokens::kEnd);
+      emit(Insns::kJump, again);
+    }
+
+    void parseParallel()
+    {
+      match();
+
+      rio2d::Script::Address patch = m_emitter->getPC();
+      emit(Insns::kJump, 0);
+
+      rio2d::Script::Address entries[rio2d::ScriptBase::kThreadsBound - 1];
+      size_t count = 0;
+
+      for (;;)
+      {
+        switch (m_token)
+        {
+        case Tokens::kForever:
+        case Tokens::kParallel:
+        case Tokens::kRepeat:
+        case Tokens::kSequence:
+          // One thread must be available to spawn the others.
+          if (count == m_config.m_maxThreads - 1)
+          {
+            raise(Errors::kOutOfMemory);
+            return;
+          }
+
+          entries[count++] = m_emitter->getPC();
+        }
+
+        switch (m_token)
+        {
+        case Tokens::kForever:  parseForever(); break;
+        case Tokens::kParallel: parseParallel(); emit(Insns::kStop); break;
+        case Tokens::kSequence: parseSequence(); emit(Insns::kStop); break;
+        default:                goto out; // Let match(kEnd) raise the error, if any.
+        }
+      }
+
+    out:
+      match(Tokens::kEnd);
+
+      rio2d::Script::Bytecode bc;
+      bc.m_address = m_emitter->getPC();
+      m_emitter->patch(patch + 1, bc);
+
+      for (size_t i = 0; i < count; i++)
+      {
+        emit(Insns::kSpawn, entries[i]);
+      }
+    }
+
+    void parseRepeat()
+    {
+      match();
+
+      rio2d::Script::Address again = m_emitter->getPC();
+
+      for (;;)
+      {
+        switch (m_token)
+        {
+        case Tokens::kFor:        parseFor(); break;
+        case Tokens::kForever:    parseForever(); goto out; // Forever can only be the last statement in a sequence.
+        case Tokens::kIdentifier: parseAssign(); break;
+        case Tokens::kIf:         parseIf(); break;
+        case Tokens::kParallel:   parseParallel(); break;
+        case Tokens::kPause:      parsePause(); break;
+        case Tokens::kRepeat:     parseRepeat(); break;
+        case Tokens::kSequence:   parseSequence(); break;
+        case Tokens::kSignal:     parseSignal(); break;
+        case Tokens::kWhile:      parseWhile(); break;
+        default:                  goto out; // Let match(kUntil) raise the error, if any.
+        }
+      }
+
+    out:
+      match(Tokens::kUntil);
+      parseExpressions(1, Tokens::kTrue);
+      emit(Insns::kJz, again);
+    }
+
+    void parseSequence()
+    {
+      match();
+
+      for (;;)
+      {
+        switch (m_token)
+        {
+        case Tokens::kFor:        parseFor(); break;
+        case Tokens::kForever:    parseForever(); goto out; // Forever can only be the last statement in a sequence.
+        case Tokens::kIdentifier: parseAssign(); break;
+        case Tokens::kIf:         parseIf(); break;
+        case Tokens::kParallel:   parseParallel(); break;
+        case Tokens::kPause:      parsePause(); break;
+        case Tokens::kRepeat:     parseRepeat(); break;
+        case Tokens::kSequence:   parseSequence(); break;
+        case Tokens::kSignal:     parseSignal(); break;
+        case Tokens::kWhile:      parseWhile(); break;
+        default:                  goto out; // Let match(kEnd) raise the error, if any.
+        }
+      }
+
+    out:
+      match(Tokens::kEnd);
+    }
+
+    void parseWhile()
+    {
+      match();
+
+      rio2d::Script::Address again = m_emitter->getPC();
+
+      parseExpressions(1, Tokens::kTrue);
+      rio2d::Script::Address patch = m_emitter->getPC();
+      emit(Insns::kJz, 0);
+
+      for (;;)
+      {
+        switch (m_token)
+        {
+        case Tokens::kFor:        parseFor(); break;
+        case Tokens::kForever:    parseForever(); goto out; // Forever can only be the last statement in a sequence.
+        case Tokens::kIdentifier: parseAssign(); break;
+        case Tokens::kIf:         parseIf(); break;
+        case Tokens::kParallel:   parseParallel(); break;
+        case Tokens::kPause:      parsePause(); break;
+        case Tokens::kRepeat:     parseRepeat(); break;
+        case Tokens::kSequence:   parseSequence(); break;
+        case Tokens::kSignal:     parseSignal(); break;
+        case Tokens::kWhile:      parseWhile(); break;
+        default:                  goto out; // Let match(kEnd) raise the error, if any.
+        }
+      }
+
+    out:
+      match(Tokens::kEnd);
+      emit(Insns::kJump, again);
+
+      rio2d::Script::Bytecode bc;
+      bc.m_address = m_emitter->getPC();
+      m_emitter->patch(patch + 1, bc);
+    }
+
+    void parseAssign()
+    {
+      rio2d::Hash hash = m_hash;
+      match(Tokens::kIdentifier);
+
+      if (m_token == '=')
+      {
+        match();
+
+        rio2d::Script::Token type = parseExpression();
+
+        rio2d::Script::Token idType;
+        Errors::Enum error = m_emitter->getType(hash, &idType);
+
+        if (error == Errors::kUnknownIdentifier)
+        {
+          m_emitter->addLocal(hash, type);
+        }
+        else if (error == Errors::kOk)
+        {
+          if (idType != type)
+          {
+            raise(Errors::kTypeMismatch);
+            return;
+          }
+        }
+        else
+        {
+          raise(error);
+          return;
+        }
+
+        rio2d::Script::Index index;
+        error = m_emitter->getIndex(hash, &index);
+
+        if (error != Errors::kOk)
+        {
+          raise(error);
+          return;
+        }
+
+        emit(Insns::kSetLocal, index);
+      }
+      else
+      {
+        rio2d::Script::Token type;
+        Errors::Enum error = m_emitter->getType(hash, &type);
+
+        if (error != Errors::kOk)
+        {
+          raise(error);
+          return;
+        }
+
+        rio2d::Script::Index index;
+        error = m_emitter->getIndex(hash, &index);
+
+        if (error != Errors::kOk)
+        {
+          raise(error);
+          return;
+        }
+
+        match('.');
+
+        switch (type)
+        {
+        case Tokens::kNode: emitSetNodeProp(index); break;
+        case Tokens::kVec2: emitSetVec2Prop(index); break;
+        case Tokens::kSize: emitSetSizeProp(index); break;
+        }
+      }
+    }
+
+    void parseIf()
+    {
+      match();
+
+      parseExpressions(1, Tokens::kTrue);
+      match(Tokens::kThen);
+
+      rio2d::Script::Address patch = m_emitter->getPC();
+      emit(Insns::kJz, 0);
+
+      // then
+      for (;;)
+      {
+        switch (m_token)
+        {
+        case Tokens::kFor:        parseFor(); break;
+        case Tokens::kForever:    parseForever(); goto out; // Forever can only be the last statement in a sequence.
+        case Tokens::kIdentifier: parseAssign(); break;
+        case Tokens::kIf:         parseIf(); break;
+        case Tokens::kParallel:   parseParallel(); break;
+        case Tokens::kPause:      parsePause(); break;
+        case Tokens::kRepeat:     parseRepeat(); break;
+        case Tokens::kSequence:   parseSequence(); break;
+        case Tokens::kSignal:     parseSignal(); break;
+        case Tokens::kWhile:      parseWhile(); break;
+        default:                  goto out; // Let match(kEnd) raise the error, if any.
+        }
+      }
+
+    out:
+      if (m_token == Tokens::kEnd)
+      {
+        // No else, finish the 'if'.
+        rio2d::Script::Bytecode bc;
+        bc.m_address = m_emitter->getPC();
+        m_emitter->patch(patch + 1, bc);
+      }
+      else
+      {
+        match(Tokens::kElse);
+
+        rio2d::Script::Address patch2 = m_emitter->getPC();
+        emit(Insns::kJump, 0);
+
+        rio2d::Script::Bytecode bc;
+        bc.m_address = m_emitter->getPC();
+        m_emitter->patch(patch + 1, bc);
+
+        // else
+        for (;;)
+        {
+          switch (m_token)
+          {
+          case Tokens::kFor:        parseFor(); break;
+          case Tokens::kForever:    parseForever(); goto out2; // Forever can only be the last statement in a sequence.
+          case Tokens::kIdentifier: parseAssign(); break;
+          case Tokens::kIf:         parseIf(); break;
+          case Tokens::kParallel:   parseParallel(); break;
+          case Tokens::kPause:      parsePause(); break;
+          case Tokens::kRepeat:     parseRepeat(); break;
+          case Tokens::kSequence:   parseSequence(); break;
+          case Tokens::kSignal:     parseSignal(); break;
+          case Tokens::kWhile:      parseWhile(); break;
+          default:                  goto out2; // Let match(kEnd) raise the error, if any.
+          }
+        }
+
+      out2:
+        bc.m_address = m_emitter->getPC();
+        m_emitter->patch(patch2 + 1, bc);
+      }
+
+      match(Tokens::kEnd);
+    }
+
+    void parseSignal()
+    {
+      match();
+      rio2d::Hash hash = m_hash;
+      match(Tokens::kStringConst);
+      emit(Insns::kSignal, hash);
+    }
+
+    void parsePause()
+    {
+      match();
+      parseExpressions(1, Tokens::kNumber);
+      match(Tokens::kSecs);
+
+      emit(Insns::kPause);
+    }
+
+    void parseExpressions(unsigned count, rio2d::Script::Token type)
+    {
+      if (count != 0)
+      {
+        if (parseExpression() != type)
+        {
+          raise(Errors::kTypeMismatch);
+          return;
+        }
+
+        while (--count != 0)
+        {
+          match(',');
+
+          if (parseExpression() != type)
+          {
+            raise(Errors::kTypeMismatch);
+            return;
+          }
+        }
+      }
+    }
+
+    rio2d::Script::Token parseExpression()
+    {
+      return parseLogicalOr();
+    }
+
+    rio2d::Script::Token parseLogicalOr()
+    {
+      rio2d::Script::Token type1 = parseLogicalAnd();
+
+      while (m_token == Tokens::kOr)
+      {
+        match();
+
+        rio2d::Script::Token type2 = parseLogicalAnd();
+
+        if (type1 == Tokens::kTrue && type2 == Tokens::kTrue)
+        {
+          emit(Insns::kLogicalOr);
+        }
+        else
+        {
+          return raise(Errors::kTypeMismatch);
+        }
+      }
+
+      return type1;
+    }
+
+    rio2d::Script::Token parseLogicalAnd()
+    {
+      rio2d::Script::Token type1 = parseRelational();
+
+      while (m_token == Tokens::kAnd)
+      {
+        match();
+
+        rio2d::Script::Token type2 = parseRelational();
+
+        if (type1 == Tokens::kTrue && type2 == Tokens::kTrue)
+        {
+          emit(Insns::kLogicalAnd);
+        }
+        else
+        {
+          return raise(Errors::kTypeMismatch);
+        }
+      }
+
+      return type1;
+    }
+
+    rio2d::Script::Token parseRelational()
+    {
+      rio2d::Script::Token type1 = parseTerm();
+
+      while (m_token == '=' || m_token == '<' || m_token == '>' || m_token == Tokens::kNotEqual || m_token == Tokens::kLessEqual || m_token == Tokens::kGreaterEqual)
+      {
+        rio2d::Script::Token op = m_token;
+        match();
+
+        rio2d::Script::Token type2 = parseTerm();
+
+        if (type1 == Tokens::kNumber && type2 == Tokens::kNumber)
+        {
+          switch (op)
+          {
+          case '=':                   emit(Insns::kCmpEqual); break;
+          case '<':                   emit(Insns::kCmpLess);  break;
+          case '>':                   emit(Insns::kCmpGreater); break;
+          case Tokens::kNotEqual:     emit(Insns::kCmpNotEqual); break;
+          case Tokens::kLessEqual:    emit(Insns::kCmpLessEqual); break;
+          case Tokens::kGreaterEqual: emit(Insns::kCmpGreaterEqual); break;
+          }
+
+          type1 = Tokens::kTrue;
+        }
+        else
+        {
+          return raise(Errors::kTypeMismatch);
+        }
+      }
+
+      return type1;
+    }
+
+    rio2d::Script::Token parseTerm()
+    {
+      rio2d::Script::Token type1 = parseFactor();
+
+      while (m_token == '+' || m_token == '-')
+      {
+        rio2d::Script::Token op = m_token;
+        match();
+
+        rio2d::Script::Token type2 = parseFactor();
+
+        if (type1 == Tokens::kNumber && type2 == Tokens::kNumber)
+        {
+          switch (op)
+          {
+          case '+': emit(Insns::kAdd); break;
+          case '-': emit(Insns::kSub); break;
+          }
+        }
+        else
+        {
+          return raise(Errors::kTypeMismatch);
+        }
+      }
+
+      return type1;
+    }
+
+    rio2d::Script::Token parseFactor()
+    {
+      rio2d::Script::Token type1 = parseUnary();
+
+      while (m_token == '*' || m_token == '/' || m_token == Tokens::kMod)
+      {
+        rio2d::Script::Token op = m_token;
+        match();
+
+        rio2d::Script::Token type2 = parseUnary();
+
+        if (type1 == Tokens::kNumber && type2 == Tokens::kNumber)
+        {
+          switch (op)
+          {
+          case '*':          emit(Insns::kMul); break;
+          case '/':          emit(Insns::kDiv);  break;
+          case Tokens::kMod: emit(Insns::kModulus); break;
+          }
+        }
+        else
+        {
+          return raise(Errors::kTypeMismatch);
+        }
+      }
+
+      return type1;
+    }
+
+    rio2d::Script::Token parseUnary()
+    {
+      rio2d::Script::Token type;
+
+      switch (m_token)
+      {
+      case '-':
+        match();
+        type = parseTerminal();
+
+        if (type != Tokens::kNumber)
+        {
+          return raise(Errors::kTypeMismatch);
+        }
+
+        emit(Insns::kNeg);
+        break;
+
+      case '+':
+        match();
+        type = parseTerminal();
+
+        if (type != Tokens::kNumber)
+        {
+          return raise(Errors::kTypeMismatch);
+        }
+
+        break;
+
+      case Tokens::kNot:
+        match();
+        type = parseTerminal();
+
+        if (type != Tokens::kTrue)
+        {
+          return raise(Errors::kTypeMismatch);
+        }
+
+        emit(Insns::kLogicalNot);
+        break;
+
+      default:
+        type = parseTerminal();
+        break;
+      }
+
+      return type;
+    }
+
+    rio2d::Script::Token parseTerminal()
+    {
+      switch (m_token)
+      {
+      case Tokens::kNumberConst:
+      {
+        char* end;
+        rio2d::Script::Number number = strtof(m_lexeme, &end);
+
+        if ((size_t)(end - m_lexeme) != m_length)
+        {
+          return raise(Errors::kMalformedNumber);
+        }
+
+        match();
+        emit(Insns::kPush, number);
+        return Tokens::kNumber;
+      }
+
+      case Tokens::kTrue:
+        match();
+        emit(Insns::kPush, 1.0f);
+        return Tokens::kTrue;
+
+      case Tokens::kFalse:
+        match();
+        emit(Insns::kPush, 0.0f);
+        return Tokens::kTrue; // kTrue flags a boolean expression
+
+      case '(':
+      {
+        match();
+        rio2d::Script::Token type = parseExpression();
+        match(')');
+        return type;
+      }
+
+      case Tokens::kIdentifier:
+      {
+        rio2d::Script::Index index;
+        Errors::Enum error = m_emitter->getIndex(m_hash, &index);
+
+        if (error != Errors::kOk)
+        {
+          return raise(error);
+        }
+
+        rio2d::Script::Token type = Tokens::kNumber;
+        m_emitter->getType(m_hash, &type);
+
+        match();
+
+        if (m_token == '.')
+        {
+          match();
+
+          switch (type)
+          {
+          case Tokens::kNode:   return emitGetNodeProp(index); break;
+          case Tokens::kVec2:   return emitGetVec2Prop(index); break;
+          case Tokens::kSize:   return emitGetSizeProp(index); break;
+          case Tokens::kFrames: return emitGetFramesProp(index); break;
+          }
+
+          return raise(Errors::kTypeMismatch);
+        }
+        else
+        {
+          emit(Insns::kGetLocal, index);
+          return type;
+        }
+      }
+
+      case Tokens::kRand:
+        match();
+
+        if (m_token == '(')
+        {
+          match();
+          parseExpressions(2, Tokens::kNumber);
+          match(')');
+          emit(Insns::kRandRange);
+        }
+        else
+        {
+          emit(Insns::kRand);
+        }
+
+        return Tokens::kNumber;
+
+      case Tokens::kFloor:
+        match();
+        match('(');
+        parseExpressions(1, Tokens::kNumber);
+        match(')');
+        emit(Insns::kFloor);
+        return Tokens::kNumber;
+
+      case Tokens::kCeil:
+        match();
+        match('(');
+        parseExpressions(1, Tokens::kNumber);
+        match(')');
+        emit(Insns::kCeil);
+        return Tokens::kNumber;
+
+      case Tokens::kTrunc:
+        match();
+        match('(');
+        parseExpressions(1, Tokens::kNumber);
+        match(')');
+        emit(Insns::kTrunc);
+        return Tokens::kNumber;
+      }
+
+      return raise(Errors::kUnexpectedToken);
+    }
+  };
+}
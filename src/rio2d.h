@@ -26,38 +26,185 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <vector>
+#include <string>
+#include <future>
+#include <atomic>
+#include <functional>
 
+// Define RIO2D_HEADLESS to only get the types used by the compiler, i.e. in the tools under etc.
+#ifndef RIO2D_HEADLESS
 #include "cocos2d.h"
+#endif
 
 namespace rio2d
 {
   typedef uint32_t Hash;
 
-  Hash hash(const char* str);
-  Hash hashLower(const char* str);
-  Hash hash(const char* str, size_t length);
-  Hash hashLower(const char* str, size_t length);
+  // DJB2 hashes, written as C++11 constexpr functions so the compiler evaluates them when the string is a constant.
+  namespace detail
+  {
+    constexpr uint8_t lower(char c)
+    {
+      return (uint8_t)(c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c);
+    }
+
+    constexpr Hash hash(const char* str, Hash hash)
+    {
+      return *str != 0 ? detail::hash(str + 1, hash * 33 + (uint8_t)*str) : hash;
+    }
+
+    constexpr Hash hashLower(const char* str, Hash hash)
+    {
+      return *str != 0 ? detail::hashLower(str + 1, hash * 33 + lower(*str)) : hash;
+    }
 
-  class Script : public cocos2d::Ref
+    constexpr Hash hash(const char* str, size_t length, Hash hash)
+    {
+      return length != 0 ? detail::hash(str + 1, length - 1, hash * 33 + (uint8_t)*str) : hash;
+    }
+
+    constexpr Hash hashLower(const char* str, size_t length, Hash hash)
+    {
+      return length != 0 ? detail::hashLower(str + 1, length - 1, hash * 33 + lower(*str)) : hash;
+    }
+
+    // Where a hash goes in an open addressed table with 2^bits slots. Fibonacci hashing spreads the DJB2 hashes, whose
+    // low bits depend mostly on the last characters.
+    inline size_t slot(Hash hash, unsigned bits)
+    {
+      return bits == 0 ? 0 : (size_t)((hash * 0x9e3779b1U) >> (32 - bits));
+    }
+  }
+
+  constexpr Hash hash(const char* str)
+  {
+    return detail::hash(str, 5381);
+  }
+
+  // Subroutine names are case insensitive, use hashLower to hash them.
+  constexpr Hash hashLower(const char* str)
+  {
+    return detail::hashLower(str, 5381);
+  }
+
+  constexpr Hash hash(const char* str, size_t length)
+  {
+    return detail::hash(str, length, 5381);
+  }
+
+  constexpr Hash hashLower(const char* str, size_t length)
+  {
+    return detail::hashLower(str, length, 5381);
+  }
+
+  // A subroutine name hashed at compile time, i.e. "swingHealth"_rio.
+  struct Name
+  {
+    Hash m_hash;
+
+    constexpr explicit Name(Hash hash) : m_hash(hash) {}
+  };
+
+  inline namespace literals
+  {
+    constexpr Name operator"" _rio(const char* str, size_t length)
+    {
+      return Name(hashLower(str, length));
+    }
+  }
+
+  // Where rio2d gets the memory for compiled scripts, runners and cached images from.
+  class Allocator
   {
   public:
-    // Compile-time configuration, change at will.
-    enum Config
+    virtual ~Allocator() {}
+
+    // Must return memory aligned to 16 bytes, or nullptr.
+    virtual void* allocate(size_t size) = 0;
+    virtual void deallocate(void* pointer) = 0;
+  };
+
+#ifndef RIO2D_HEADLESS
+  // Sets the allocator used from now on, nullptr restores the default one that uses malloc and free. Memory is always
+  // returned to the allocator it came from.
+  void setAllocator(Allocator* allocator);
+  Allocator* getAllocator();
+#endif
+
+  // The limits of a script, see BasicScript.
+  template<unsigned Globals, unsigned LocalVars, unsigned Threads, unsigned Stack>
+  struct Limits
+  {
+    enum
     {
       // Maximum number of subroutines in a script.
-      kMaxGlobals = 128,
+      kMaxGlobals = Globals,
 
       // Maximum number of arguments to a subroutine.
-      kMaxLocalVars = 32,
+      kMaxLocalVars = LocalVars,
 
       // Maximum number of statements running in parallel.
-      kMaxThreads = 32,
+      kMaxThreads = Threads,
 
       // Maximum stack depth.
-      kMaxStack = 16,
+      kMaxStack = Stack,
+    };
+  };
+
+  typedef Limits<128, 32, 32, 16> DefaultLimits;
+
+  // Everything that doesn't depend on the limits of the script, use Script or BasicScript to create scripts.
+#ifndef RIO2D_HEADLESS
+  class ScriptBase : public cocos2d::Ref
+#else
+  class ScriptBase
+#endif
+  {
+  public:
+    // Upper bounds for the limits of all scripts, they size the compiler's tables and the runner size classes.
+    enum Bounds
+    {
+      kGlobalsBound = 256,
+      kLocalVarsBound = 64,
+      kThreadsBound = 64,
+      kStackBound = 64,
+    };
+
+    // The limits of a script at runtime.
+    struct Config
+    {
+      unsigned m_maxGlobals;
+      unsigned m_maxLocalVars;
+      unsigned m_maxThreads;
+      unsigned m_maxStack;
+
+      template<typename L>
+      static Config get()
+      {
+        Config config = {L::kMaxGlobals, L::kMaxLocalVars, L::kMaxThreads, L::kMaxStack};
+        return config;
+      }
+    };
+
+    // Compilation options.
+    enum Options
+    {
+      // Only validate the script, generating the code for each subroutine the first time it's run.
+      kCompileLazily = 1 << 0,
+
+      // Compile each subroutine in a worker thread, ignored when compiling lazily.
+      kCompileInParallel = 1 << 1,
+    };
+
+    // Version of the precompiled bytecode, bump it when the instructions or the image layout change.
+    enum
+    {
+      kBytecodeVersion = 2,
     };
 
+#ifndef RIO2D_HEADLESS
     typedef std::vector<cocos2d::SpriteFrame*> Frames;
+#endif
 
     typedef uint32_t Insn;
     typedef int      Index;
@@ -74,49 +221,448 @@ namespace rio2d
       Hash    m_hash;
     };
 
+#ifndef RIO2D_HEADLESS
     typedef void (cocos2d::Ref::*NotifyFunc)(cocos2d::Node*, Hash);
+#endif
 
+    // The name and type of a local variable, shared by all the runners of the subroutine.
     struct LocalVar
     {
       Hash  m_hash;
       Token m_type;
+    };
+
+    // The value of a local variable in a runner.
+    union Value
+    {
+      Number m_number;
+      void*  m_pointer;
+    };
+
+    struct Subroutine
+    {
+      Hash      m_hash;
+      Address   m_pc;
+      size_t    m_numParams;
+      size_t    m_numLocals;
+      LocalVar* m_locals;
+
+      // Where the subroutine starts in the source code, used when compiling lazily.
+      size_t    m_source;
+      unsigned  m_line;
+      bool      m_compiled;
+    };
+
+    // How many runners a subroutine has, kept apart from the code since it changes as they start and end.
+    struct Usage
+    {
+      size_t m_numRunners;
+      size_t m_peakRunners;
+    };
+
+#ifndef RIO2D_HEADLESS
+    // Writes the precompiled image if it fits in size bytes, and returns its size. Returns 0 if the script was compiled lazily.
+    size_t writeBytecode(void* image, size_t size) const;
+
+    const Config& getConfig() const
+    {
+      return m_config;
+    }
+
+    // An argument to a subroutine, tagged with the hash of its type as written in the subroutine's signature.
+    struct Argument
+    {
+      Hash m_type;
 
       union
       {
         Number m_number;
         void*  m_pointer;
       };
+
+      Argument() : m_type(0), m_pointer(nullptr) {}
+      Argument(double number) : m_type(hashLower("number")), m_number((Number)number) {}
+      Argument(cocos2d::Node* node) : m_type(hashLower("node")), m_pointer(node) {}
+      Argument(cocos2d::Size* size) : m_type(hashLower("size")), m_pointer(size) {}
+      Argument(cocos2d::Vec2* vec2) : m_type(hashLower("vec2")), m_pointer(vec2) {}
+      Argument(Frames* frames) : m_type(hashLower("frames")), m_pointer(frames) {}
     };
 
-    struct Subroutine
+    // The arguments are checked against the subroutine's parameters, these return false if they don't match.
+    template<typename... Args>
+    bool runAction(Hash hash, cocos2d::Node* target, Args&&... args)
     {
-      Hash     m_hash;
-      Address  m_pc;
-      size_t   m_numLocals;
-      LocalVar m_locals[kMaxLocalVars];
-    };
+      const Argument argv[sizeof...(Args) + 1] = {std::forward<Args>(args)...};
+      return runActionArgs(nullptr, nullptr, hash, target, argv, sizeof...(Args));
+    }
+
+    template<typename... Args>
+    bool runAction(Name name, cocos2d::Node* target, Args&&... args)
+    {
+      const Argument argv[sizeof...(Args) + 1] = {std::forward<Args>(args)...};
+      return runActionArgs(nullptr, nullptr, name.m_hash, target, argv, sizeof...(Args));
+    }
+
+    template<typename... Args>
+    bool runAction(const char* name, cocos2d::Node* target, Args&&... args)
+    {
+      const Argument argv[sizeof...(Args) + 1] = {std::forward<Args>(args)...};
+      return runActionArgs(nullptr, nullptr, hashLower(name), target, argv, sizeof...(Args));
+    }
+
+    template<typename... Args>
+    bool runActionWithListener(cocos2d::Ref* listener, NotifyFunc port, Hash hash, cocos2d::Node* target, Args&&... args)
+    {
+      const Argument argv[sizeof...(Args) + 1] = {std::forward<Args>(args)...};
+      return runActionArgs(listener, port, hash, target, argv, sizeof...(Args));
+    }
 
-    static inline Script* initWithSource(const char* source)
+    template<typename... Args>
+    bool runActionWithListener(cocos2d::Ref* listener, NotifyFunc port, Name name, cocos2d::Node* target, Args&&... args)
     {
-      return initWithSource(source, nullptr, 0);
+      const Argument argv[sizeof...(Args) + 1] = {std::forward<Args>(args)...};
+      return runActionArgs(listener, port, name.m_hash, target, argv, sizeof...(Args));
     }
 
-    static Script* initWithSource(const char* source, char* error, size_t size);
+    template<typename... Args>
+    bool runActionWithListener(cocos2d::Ref* listener, NotifyFunc port, const char* name, cocos2d::Node* target, Args&&... args)
+    {
+      const Argument argv[sizeof...(Args) + 1] = {std::forward<Args>(args)...};
+      return runActionArgs(listener, port, hashLower(name), target, argv, sizeof...(Args));
+    }
 
-    bool runAction(Hash hash, cocos2d::Node* target, ...);
-    bool runAction(const char* name, cocos2d::Node* target, ...);
-    bool runActionWithListener(cocos2d::Ref* listener, NotifyFunc port, Hash hash, cocos2d::Node* target, ...);
-    bool runActionWithListener(cocos2d::Ref* listener, NotifyFunc port, const char* name, cocos2d::Node* target, ...);
+    // Runs the subroutine on count targets with a single allocation. args has numArgs arguments for each target, one
+    // target after the other.
+    bool runActionBatch(Hash hash, cocos2d::Node* const* targets, size_t count, const Argument* args, size_t numArgs);
+    bool runActionBatch(Name name, cocos2d::Node* const* targets, size_t count, const Argument* args, size_t numArgs);
+    bool runActionBatch(const char* name, cocos2d::Node* const* targets, size_t count, const Argument* args, size_t numArgs);
+
+    // Runners are recycled when they're done, prewarm makes sure count runners of the subroutine can be started without
+    // allocating memory. Only call these from the cocos2d thread.
+    bool prewarm(Hash hash, size_t count);
+    bool prewarm(Name name, size_t count);
+    bool prewarm(const char* name, size_t count);
+
+    // Frees the memory of all recycled runners.
+    static void purgeRunners();
+
+    // A subroutine resolved once, to run it many times without looking it up. Keeps a reference to the script, and refuses
+    // to run after a live reload replaced it.
+    class Callable
+    {
+    public:
+      Callable();
+      Callable(const Callable& other);
+      ~Callable();
+
+      Callable& operator=(const Callable& other);
+
+      // False if the subroutine wasn't found, or if the script was replaced and must be prepared again.
+      bool isValid() const;
+
+      template<typename... Args>
+      bool run(cocos2d::Node* target, Args&&... args) const
+      {
+        const Argument argv[sizeof...(Args) + 1] = {std::forward<Args>(args)...};
+        return isValid() && m_script->runActionArgs(nullptr, nullptr, m_global, target, argv, sizeof...(Args));
+      }
+
+      template<typename... Args>
+      bool runWithListener(cocos2d::Ref* listener, NotifyFunc port, cocos2d::Node* target, Args&&... args) const
+      {
+        const Argument argv[sizeof...(Args) + 1] = {std::forward<Args>(args)...};
+        return isValid() && m_script->runActionArgs(listener, port, m_global, target, argv, sizeof...(Args));
+      }
+
+    protected:
+      friend class ScriptBase;
+
+      ScriptBase* m_script;
+      Subroutine* m_global;
+    };
+
+    Callable prepare(Hash hash);
+    Callable prepare(Name name);
+    Callable prepare(const char* name);
+
+    // Marks the script as replaced by a live reload, prepared subroutines won't run anymore.
+    void invalidate();
+    bool isStale() const;
+
+    // Map the nodes in snapshots to IDs and back. They're never called for null nodes.
+    typedef std::function<uint32_t(cocos2d::Node*)> NodeToId;
+    typedef std::function<cocos2d::Node*(uint32_t)> IdToNode;
+
+    // Writes the state of all the running runners of the script if it fits in size bytes, and returns its size. Only
+    // valid for this script, and pointers to sizes, vectors and frames are written as is.
+    size_t snapshotRunners(void* buffer, size_t size, const NodeToId& toId) const;
+
+    // Starts the runners in a snapshot from snapshotRunners or Runner::snapshot where they were. Returns false if the
+    // snapshot is not valid for the script, without starting any runners, or if a target is missing or there's no memory,
+    // after starting the runners before it. Runners that are already running are not stopped.
+    bool restoreRunners(const void* buffer, size_t size, const IdToNode& toNode, cocos2d::Ref* listener = nullptr, NotifyFunc port = nullptr);
+
+    // The memory used by the script and its runners. Peaks are since the script was created or resetPeaks was called.
+    struct MemoryStats
+    {
+      size_t m_scriptBytes;
+      size_t m_bytecodeBytes;
+      size_t m_globalsBytes;
+      size_t m_numRunners;
+      size_t m_runnerBytes;
+      size_t m_peakRunners;
+      size_t m_peakRunnerBytes;
+    };
+
+    struct SubroutineStats
+    {
+      Hash   m_hash;
+      size_t m_numRunners;
+      size_t m_runnerBytes;
+      size_t m_peakRunners;
+    };
+
+    void getMemoryStats(MemoryStats* stats) const;
+
+    // Writes the stats of up to count subroutines, and returns the number of subroutines.
+    size_t getSubroutineStats(SubroutineStats* stats, size_t count) const;
+
+    // Starts measuring the peaks from the current values, i.e. at the start of every frame.
+    void resetPeaks();
+
+    // The bytes of the blocks of recycled runners of all the scripts, in use or free.
+    static size_t getPooledBytes();
 
   protected:
-    bool init(const char* source, char* error, size_t size);
-    bool runActionV(cocos2d::Ref* listener, NotifyFunc port, Hash hash, cocos2d::Node* target, va_list args);
+    explicit ScriptBase(const Config& config);
+    ~ScriptBase();
+
+    bool init(const char* source, char* error, size_t size, unsigned options);
+    bool initBytecode(const void* image, size_t size);
+
+    // Initializes self from the source code in a worker thread, and calls func in the cocos2d thread with self
+    // autoreleased, or with nullptr and the error message. self can be nullptr if it couldn't be created.
+    static void compileInWorker(ScriptBase* self, const char* source, size_t length, const std::function<void(ScriptBase*, const char*)>& func, unsigned options);
+
+    bool runActionArgs(cocos2d::Ref* listener, NotifyFunc port, Hash hash, cocos2d::Node* target, const Argument* args, size_t count);
+    bool runActionArgs(cocos2d::Ref* listener, NotifyFunc port, Subroutine* global, cocos2d::Node* target, const Argument* args, size_t count);
+    void compile(Subroutine* global);
+    void buildIndex();
+    Subroutine* find(Hash hash) const;
+
+    Config m_config;
+
+    // The subroutines, their index, the code and the source code are all in a single allocation starting at m_globals,
+    // see Arena. A copy of the source code is only kept when compiling lazily.
+    char* m_source;
+
+    // The image the code is in, if it was loaded from one, and whether the script owns it.
+    const void* m_image;
+    size_t m_imageSize;
+    bool m_ownsImage;
+
+    // Where the arena and the owned image came from.
+    Allocator* m_allocator;
 
     Bytecode* m_bytecode;
     size_t m_bcSize;
 
     Subroutine* m_globals;
     size_t m_numGlobals;
+
+    // The runners of each subroutine, and of the whole script.
+    Usage* m_usage;
+    size_t m_numRunners;
+    size_t m_runnerBytes;
+    size_t m_peakRunners;
+    size_t m_peakRunnerBytes;
+    size_t m_arenaSize;
+
+    // Open addressed index of the subroutines by their hashes, each slot is the subroutine index plus one or zero if empty.
+    uint16_t* m_index;
+    unsigned m_indexBits;
+
+    std::atomic<bool> m_stale;
+
+    friend class Runner;
+#endif
+  };
+
+  // A script with the limits in L, i.e. BasicScript<Limits<16, 8, 2, 4>> for small UI scripts. Only the runners and the
+  // compiler's checks depend on the limits, so scripts with different limits can be used side by side.
+  template<typename L>
+  class BasicScript : public ScriptBase
+  {
+  public:
+    enum
+    {
+      kMaxGlobals = L::kMaxGlobals,
+      kMaxLocalVars = L::kMaxLocalVars,
+      kMaxThreads = L::kMaxThreads,
+      kMaxStack = L::kMaxStack,
+    };
+
+    static_assert(kMaxGlobals >= 1 && (unsigned)kMaxGlobals <= (unsigned)kGlobalsBound, "kMaxGlobals out of bounds");
+    static_assert(kMaxLocalVars >= 1 && (unsigned)kMaxLocalVars <= (unsigned)kLocalVarsBound, "kMaxLocalVars out of bounds");
+    static_assert(kMaxThreads >= 1 && (unsigned)kMaxThreads <= (unsigned)kThreadsBound, "kMaxThreads out of bounds");
+    static_assert(kMaxStack >= 1 && (unsigned)kMaxStack <= (unsigned)kStackBound, "kMaxStack out of bounds");
+
+#ifndef RIO2D_HEADLESS
+    // Receives the compiled script, or nullptr and the error message.
+    typedef std::function<void(BasicScript*, const char*)> CompileFunc;
+
+    static inline BasicScript* initWithSource(const char* source)
+    {
+      return initWithSource(source, nullptr, 0, 0);
+    }
+
+    static inline BasicScript* initWithSource(const char* source, char* error, size_t size)
+    {
+      return initWithSource(source, error, size, 0);
+    }
+
+    static BasicScript* initWithSource(const char* source, char* error, size_t size, unsigned options)
+    {
+      BasicScript* self = newWithSource(source, error, size, options);
+
+      if (self)
+      {
+        self->autorelease();
+      }
+
+      return self;
+    }
+
+    // Same as initWithSource, but the instance is not autoreleased so it can be called from any thread.
+    static BasicScript* newWithSource(const char* source, char* error, size_t size, unsigned options)
+    {
+      BasicScript* self = new (std::nothrow) BasicScript();
+
+      if (self && self->init(source, error, size, options))
+      {
+        return self;
+      }
+
+      CC_SAFE_DELETE(self);
+      return nullptr;
+    }
+
+    // Loads a precompiled script image; the code is used in place so the image must outlive the script.
+    static BasicScript* initWithBytecode(const void* image, size_t size)
+    {
+      BasicScript* self = newWithBytecode(image, size);
+
+      if (self)
+      {
+        self->autorelease();
+      }
+
+      return self;
+    }
+
+    static BasicScript* newWithBytecode(const void* image, size_t size)
+    {
+      BasicScript* self = new (std::nothrow) BasicScript();
+
+      if (self && self->initBytecode(image, size))
+      {
+        return self;
+      }
+
+      CC_SAFE_DELETE(self);
+      return nullptr;
+    }
+
+    // Same as newWithBytecode, but the script takes ownership of the image, which must have been allocated with the
+    // current allocator.
+    static BasicScript* newWithOwnedBytecode(void* image, size_t size)
+    {
+      BasicScript* self = newWithBytecode(image, size);
+
+      if (self)
+      {
+        self->m_ownsImage = true;
+      }
+      else
+      {
+        getAllocator()->deallocate(image);
+      }
+
+      return self;
+    }
+
+    // Compiles the script in a worker thread, and calls func in the cocos2d thread with an autoreleased script.
+    static void compileAsync(const char* source, size_t length, const CompileFunc& func, unsigned options = 0)
+    {
+      compileInWorker(new (std::nothrow) BasicScript(), source, length, [func](ScriptBase* self, const char* error)
+      {
+        func(static_cast<BasicScript*>(self), error);
+      }, options);
+    }
+
+  protected:
+    BasicScript() : ScriptBase(Config::get<L>()) {}
+    ~BasicScript() {}
+#endif
+  };
+
+  typedef BasicScript<DefaultLimits> Script;
+
+#ifndef RIO2D_HEADLESS
+  // The action that runs a subroutine. Its tag is tagOf the hash of the subroutine, so it can also be found with
+  // cocos2d::Node::getActionByTag.
+  class Runner : public cocos2d::ActionInterval
+  {
+  public:
+    // Returns the runner of the subroutine on node, or nullptr.
+    static Runner* find(cocos2d::Node* node, Hash hash);
+
+    // The tag of the runners of a subroutine, which is its hash except for the hash that is cocos2d::Action::INVALID_TAG;
+    // that one gets the tag of the hash before it.
+    static int tagOf(Hash hash);
+
+    virtual Hash getHash() const = 0;
+
+    // Starts a copy of the runner on target from where the runner is: the threads, their stacks and the locals are
+    // copied and the code is shared. Returns false if there's no memory for the copy.
+    virtual bool cloneOnto(cocos2d::Node* target) const = 0;
+
+    // Writes the state of the runner if it fits in size bytes and returns its size, see ScriptBase::snapshotRunners.
+    virtual size_t snapshot(void* buffer, size_t size, const ScriptBase::NodeToId& toId) const = 0;
+
+    virtual ScriptBase* getScript() const = 0;
+
+  protected:
+    // Accounts the runners to their scripts and subroutines.
+    static void addRunner(ScriptBase* script, const ScriptBase::Subroutine* global, size_t bytes);
+    static void removeRunner(ScriptBase* script, const ScriptBase::Subroutine* global, size_t bytes);
+
+    // Runners are recycled in a pool per allocator, the one their script was created with.
+    static Allocator* getScriptAllocator(const ScriptBase* script);
+  };
+
+  // Hands out memory from a single buffer by bumping a pointer. Deallocating does nothing, and reset releases everything
+  // at once, i.e. when a scene ends. Can be used from any thread. Destroying it is subject to the same rules as reset.
+  class BumpAllocator : public Allocator
+  {
+  public:
+    explicit BumpAllocator(size_t capacity);
+    ~BumpAllocator();
+
+    virtual void* allocate(size_t size) override;
+    virtual void deallocate(void* pointer) override;
+
+    // Nothing allocated so far can be used after this, including the recycled runners of the scripts created with the
+    // allocator, which must not be running. Only call it from the cocos2d thread.
+    void reset();
+
+    size_t used() const;
+    size_t capacity() const;
+
+  protected:
+    char* m_buffer;
+    size_t m_capacity;
+    std::atomic<size_t> m_used;
   };
 
   namespace Webserver
@@ -124,6 +670,13 @@ namespace rio2d
     bool init(short port);
     void destroy();
 
+    // Mounts a bundle of precompiled scripts, which getScript and preload look into before the file system.
+    bool mount(const char* filename);
+
     Script* getScript(const char* filename);
+
+    // Compiles the scripts in worker threads, the future is true if all of them were compiled.
+    std::future<bool> preload(const std::vector<std::string>& filenames);
   }
+#endif
 }
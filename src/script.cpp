@@ -21,3511 +21,2461 @@
 * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 ******************************************************************************/
 
-#include <setjmp.h>
 #include <math.h>
 
 #include "rio2d.h"
 
-// Include easing functions taken from https://github.com/warrenm/AHEasing/blob/master/AHEasing/easing.c
-#include "easing.inl"
+// Include the compiler, which is shared with the tools under etc.
+#include "compiler.inl"
 
+// Arguments are tagged with the hashes of the parameter types, which must be the same as the tokens.
+static_assert(rio2d::hashLower("frames") == Tokens::kFrames, "Argument type mismatch");
+static_assert(rio2d::hashLower("node") == Tokens::kNode, "Argument type mismatch");
+static_assert(rio2d::hashLower("number") == Tokens::kNumber, "Argument type mismatch");
+static_assert(rio2d::hashLower("size") == Tokens::kSize, "Argument type mismatch");
+static_assert(rio2d::hashLower("vec2") == Tokens::kVec2, "Argument type mismatch");
 
-rio2d::Hash rio2d::hash(const char* str)
+namespace // Anonymous namespace to hyde the implementation details
 {
-  rio2d::Hash hash = 5381;
-
-  if (*str != 0)
+  class RunnerImpl : public rio2d::Runner
   {
-    do
+  protected:
+    // Threads stay in their slots with their stacks. The running ones are linked in the order they were started, the ones
+    // sleeping in a pause are parked in a timer wheel, and the others are in a free list.
+    struct Thread
     {
-      hash = hash * 33 + (uint8_t)*str++;
-    } while (*str != 0);
-  }
-
-  return hash;
-}
+      rio2d::Script::Address m_pc;
+      float m_dt;
+      unsigned m_sp;
+      uint32_t m_order;
+      rio2d::Script::Number* m_stack;
+      Thread* m_next;
+      // When a parked thread is due in the runner's clock, negative if it's not parked.
+      double m_wake;
+    };
 
-rio2d::Hash rio2d::hashLower(const char* str)
-{
-  rio2d::Hash hash = 5381;
+    struct Pool;
 
-  if (*str != 0)
-  {
-    do
+    // Runners are allocated in blocks of the same size class, and are recycled through a free list per class. Each runner
+    // is preceded by a pointer to its block and followed by its threads, their stacks and its locals, sized by the limits
+    // of the script.
+    struct Block
     {
-      hash = hash * 33 + (uint8_t)tolower(*str++);
-    } while (*str != 0);
-  }
-
-  return hash;
-}
-
-rio2d::Hash rio2d::hash(const char* str, size_t length)
-{
-  rio2d::Hash hash = 5381;
+      Block* m_next;
+      Pool* m_pool;
+      size_t m_size;
+      size_t m_live;
+      unsigned m_class;
+    };
 
-  if (length != 0)
-  {
-    do
+    enum
     {
-      hash = hash * 33 + (uint8_t)*str++;
-    } while (--length != 0);
-  }
+      // Size classes grow by half and then by a third: 256, 384, 512, 768, 1024... bytes.
+      kMinSize = 256,
+      kNumClasses = 16,
 
-  return hash;
-}
+      // The timer wheel has levels of 16 slots of 1/32, 1/2 and 8 seconds. Threads due later wait in the last level.
+      kTicksPerSecond = 32,
+      kWheelBits = 4,
+      kWheelSlots = 1 << kWheelBits,
+      kWheelLevels = 3,
+      kWheelTicks = 1 << (kWheelBits * kWheelLevels),
+    };
 
-rio2d::Hash rio2d::hashLower(const char* str, size_t length)
-{
-  rio2d::Hash hash = 5381;
+    // Runner clocks stop short of overflowing the ticks.
+    static constexpr double kMaxTime = 65536.0 * 65536.0 / kTicksPerSecond;
 
-  if (length != 0)
-  {
-    do
+    // The blocks and free lists of the runners of the scripts created with an allocator, which the pool and the blocks
+    // come from. Runners never take slots from other allocators, so resetting one doesn't free runners still in use.
+    struct Pool
     {
-      hash = hash * 33 + (uint8_t)tolower(*str++);
-    } while (--length != 0);
-  }
+      Pool* m_next;
+      rio2d::Allocator* m_allocator;
+      Block* m_blocks;
+      void* m_free[kNumClasses];
+      size_t m_numFree[kNumClasses];
+    };
 
-  return hash;
-}
+    static Pool* s_pools;
 
-namespace // Anonymous namespace to hyde the implementation details
-{
-  // Error codes.
-  struct Errors
-  {
-    enum Enum
-    {
-      kOk,                      // No error
-      kDuplicateIdentifier,     // Attempting to redefine an identifier
-      kFirstParamNotANode,      // The first parameter of a subroutine must be a node
-      kInvalidCharacterInInput, // Extraneous character in input
-      kMalformedNumber,         // A number constant is malformed
-      kOutOfMemory,             // Error allocating memory, or a fixed-size buffer was full
-      kTypeMismatch,            // Wrong type in expression
-      kUnexpectedEOF,           // The end of the file was reached
-      kUnexpectedToken,         // This token wasn't expected here
-      kUnknownEaseFunc,         // Unknown ease function
-      kUnknownField,            // Invalid field for the object
-      kUnknownIdentifier,       // Identifier not declared
-      kUnknownType,             // Unknown data type
-      kUnterminatedString,      // A string constant is unterminated
-    };
-  };
+    // All the runners alive, to take snapshots.
+    static RunnerImpl* s_live;
+    RunnerImpl* m_prevLive;
+    RunnerImpl* m_nextLive;
 
-  // Tokens; the values of the symbols with only one character are their ASCII integer value.
-  struct Tokens
-  {
-    enum
-    {
-      kAnd = 0x0b885e18U,
-      kAs = 0x00597739U,
-      kCeil = 0x7c9514a2U,
-      kElse = 0x7c964c6eU,
-      kEnd = 0x0b886f1cU,
-      kEof = 0,
-      kFalse = 0x0f6bcef0U,
-      kFloor = 0x0f71e367U,
-      kFor = 0x0b88738cU,
-      kForever = 0xbaa8bf3eU,
-      kFrames = 0xfe132c43U,
-      kGreaterEqual = 1,
-      kIdentifier = 2,
-      kIf = 0x00597834U,
-      kIn = 0x0059783cU,
-      kLessEqual = 3,
-      kMod = 0x0b889145U,
-      kMove = 0x7c9abc9cU,
-      kNext = 0x7c9b1ec4U,
-      kNode = 0x7c9b46abU,
-      kNot = 0x0b889596U,
-      kNotEqual = 4,
-      kNumber = 0x10f9208eU,
-      kNumberConst = 5,
-      kOr = 0x00597906U,
-      kParallel = 0x1455e3f2U,
-      kPause = 0x1020ea43U,
-      kRand = 0x7c9d3deaU,
-      kRepeat = 0x192dec66U,
-      kSecs = 0x7c9dd9f3U,
-      kSequence = 0x0c15489eU,
-      kSignal = 0x1bc6ade3U,
-      kSize = 0x7c9dede0U,
-      kStep = 0x7c9e1a01U,
-      kStringConst = 6,
-      kSub = 0x0b88ab8fU,
-      kThen = 0x7c9e7354U,
-      kTo = 0x005979a8U,
-      kTrue = 0x7c9e9fe5U,
-      kTrunc = 0x10729e11U,
-      kUntil = 0x10828031U,
-      kVec2 = 0x7c9f7ed5U,
-      kWhile = 0x10a3387eU,
-      kWith = 0x7ca01ea1U,
-      kXor = 0x0b88c01eU,
-    };
+    rio2d::ScriptBase* m_owner;
+    const rio2d::Script::Subroutine* m_global;
+    // The values of the locals trail the runner, their names and types are in the subroutine.
+    rio2d::Script::Value* m_locals;
+    const rio2d::Script::LocalVar* m_vars;
+    const rio2d::Script::Bytecode* m_bytecode;
+    Thread* m_threads;
+    Thread* m_first;
+    Thread* m_last;
+    Thread* m_free;
+    size_t m_numThreads;
+    uint32_t m_order;
+    // The runner's clock, and the tick the timer wheel is at. The heads of the slots of the wheel are the indices of the
+    // threads plus one, or zero if empty.
+    double m_time;
+    uint32_t m_tick;
+    size_t m_numParked;
+    uint8_t m_wheel[kWheelLevels][kWheelSlots];
+    size_t m_maxThreads;
+    cocos2d::Ref* m_listener;
+    rio2d::Script::NotifyFunc m_port;
 
-    static bool isKeyword(rio2d::Hash hash)
+    RunnerImpl()
+      : m_prevLive(nullptr)
+      , m_nextLive(s_live)
     {
-      switch (hash)
+      if (s_live != nullptr)
       {
-      case Tokens::kAnd:
-      case Tokens::kAs:
-      case Tokens::kCeil:
-      case Tokens::kElse:
-      case Tokens::kEnd:
-      case Tokens::kFalse:
-      case Tokens::kFloor:
-      case Tokens::kFor:
-      case Tokens::kForever:
-      case Tokens::kFrames:
-      case Tokens::kIf:
-      case Tokens::kIn:
-      case Tokens::kMod:
-      case Tokens::kMove:
-      case Tokens::kNext:
-      case Tokens::kNode:
-      case Tokens::kNot:
-      case Tokens::kNumber:
-      case Tokens::kOr:
-      case Tokens::kParallel:
-      case Tokens::kPause:
-      case Tokens::kRand:
-      case Tokens::kRepeat:
-      case Tokens::kSecs:
-      case Tokens::kSequence:
-      case Tokens::kSignal:
-      case Tokens::kSize:
-      case Tokens::kStep:
-      case Tokens::kSub:
-      case Tokens::kThen:
-      case Tokens::kTo:
-      case Tokens::kTrue:
-      case Tokens::kTrunc:
-      case Tokens::kUntil:
-      case Tokens::kVec2:
-      case Tokens::kWhile:
-      case Tokens::kWith:
-      case Tokens::kXor:
-        return true;
+        s_live->m_prevLive = this;
       }
 
-      return false;
+      s_live = this;
     }
-  };
 
-  // Fields that can be addressed with objects.
-  struct Fields
-  {
-    enum
+    ~RunnerImpl()
     {
-      // Hashes
-      kBboxheight = 0xd92bfc69U,
-      kBboxwidth = 0x7c035ed0U,
-      kBlue = 0x7c94a78dU,
-      kFadein = 0xfce10f4cU,
-      kFadeout = 0x990313adU,
-      kFadeto = 0xfce110b8U,
-      kFlipx = 0x0f71ca08U,
-      kFlipy = 0x0f71ca09U,
-      kGreen = 0x0f871a56U,
-      kHeight = 0x01d688deU,
-      kLength = 0x0b2deac7U,
-      kMoveby = 0x0e3c60b7U,
-      kMoveto = 0x0e3c62ffU,
-      kOpacity = 0x70951bfeU,
-      kPlace = 0x10269b4aU,
-      kPosition = 0x4cef7abaU,
-      kRed = 0x0b88a540U,
-      kRotateby = 0x2737766fU,
-      kRotateto = 0x273778b7U,
-      kRotation = 0x27378915U,
-      kScale = 0x1057f68dU,
-      kScaleby = 0x862fdae8U,
-      kScaleto = 0x862fdd30U,
-      kSetframe = 0x120c3ddcU,
-      kSkew = 0x7c9df3bfU,
-      kSkewby = 0x1be9ec9aU,
-      kSkewto = 0x1be9eee2U,
-      kSkewx = 0x105c6c17U,
-      kSkewy = 0x105c6c18U,
-      kTint = 0x7c9e78c4U,
-      kTintby = 0x1e1fc6dfU,
-      kTintto = 0x1e1fc927U,
-      kVisible = 0x7c618d53U,
-      kWidth = 0x10a3b0a5U,
-      kX = 0x0002b61dU,
-      kY = 0x0002b61eU,
-      // Indices
-      kBboxheightIndex = 0,
-      kBboxwidthIndex,
-      kBlueIndex,
-      kFadeinIndex,
-      kFadeoutIndex,
-      kFadetoIndex,
-      kFlipxIndex,
-      kFlipyIndex,
-      kGreenIndex,
-      kHeightIndex,
-      kLengthIndex,
-      kMovebyIndex,
-      kMovetoIndex,
-      kOpacityIndex,
-      kPlaceIndex,
-      kPositionIndex,
-      kRedIndex,
-      kRotatebyIndex,
-      kRotatetoIndex,
-      kRotationIndex,
-      kScaleIndex,
-      kScalebyIndex,
-      kScaletoIndex,
-      kSetframeIndex,
-      kSkewIndex,
-      kSkewbyIndex,
-      kSkewtoIndex,
-      kSkewxIndex,
-      kSkewyIndex,
-      kTintIndex,
-      kTintbyIndex,
-      kTinttoIndex,
-      kVisibleIndex,
-      kWidthIndex,
-      kXIndex,
-      kYIndex,
-    };
+      if (m_prevLive != nullptr)
+      {
+        m_prevLive->m_nextLive = m_nextLive;
+      }
+      else
+      {
+        s_live = m_nextLive;
+      }
 
-    static inline rio2d::Script::Index index(rio2d::Hash hash)
-    {
-      switch (hash)
-      {
-      case kBboxheight:  return kBboxheightIndex;
-      case kBboxwidth:   return kBboxwidthIndex;
-      case kBlue:        return kBlueIndex;
-      case kFadein:      return kFadeinIndex;
-      case kFadeout:     return kFadeoutIndex;
-      case kFadeto:      return kFadetoIndex;
-      case kFlipx:       return kFlipxIndex;
-      case kFlipy:       return kFlipyIndex;
-      case kGreen:       return kGreenIndex;
-      case kHeight:      return kHeightIndex;
-      case kLength:      return kLengthIndex;
-      case kMoveby:      return kMovebyIndex;
-      case kMoveto:      return kMovetoIndex;
-      case kOpacity:     return kOpacityIndex;
-      case kPlace:       return kPlaceIndex;
-      case kPosition:    return kPositionIndex;
-      case kRed:         return kRedIndex;
-      case kRotateby:    return kRotatebyIndex;
-      case kRotateto:    return kRotatetoIndex;
-      case kRotation:    return kRotationIndex;
-      case kScale:       return kScaleIndex;
-      case kScaleby:     return kScalebyIndex;
-      case kScaleto:     return kScaletoIndex;
-      case kSetframe:    return kSetframeIndex;
-      case kSkew:        return kSkewIndex;
-      case kSkewby:      return kSkewbyIndex;
-      case kSkewto:      return kSkewtoIndex;
-      case kSkewx:       return kSkewxIndex;
-      case kSkewy:       return kSkewyIndex;
-      case kTint:        return kTintIndex;
-      case kTintby:      return kTintbyIndex;
-      case kTintto:      return kTinttoIndex;
-      case kVisible:     return kVisibleIndex;
-      case kWidth:       return kWidthIndex;
-      case kX:           return kXIndex;
-      case kY:           return kYIndex;
-      default:           return -1;
+      if (m_nextLive != nullptr)
+      {
+        m_nextLive->m_prevLive = m_prevLive;
       }
+
+      removeRunner(m_owner, m_global, stride(getClass()));
+      m_owner->release();
     }
-  };
 
-  // Available easing functions.
-  struct Easing
-  {
-    enum
+    static size_t align(size_t size)
     {
-      // Hashes
-      kBackin = 0xf38bf9edU,
-      kBackinout = 0xd4b93685U,
-      kBackout = 0x650b526eU,
-      kBouncein = 0x66513df8U,
-      kBounceinout = 0x32ae02b0U,
-      kBounceout = 0x307917d9U,
-      kCircin = 0xf679fe3dU,
-      kCircinout = 0x1b4498d5U,
-      kCircout = 0xc5b9e0beU,
-      kCubicin = 0xe09955e2U,
-      kCubicinout = 0xf5130a5aU,
-      kCubicout = 0xf3c42d03U,
-      kElasticin = 0xd27b95c1U,
-      kElasticinout = 0x56bb31d9U,
-      kElasticout = 0x21ee68c2U,
-      kExpin = 0x0f6662e9U,
-      kExpinout = 0xd3e4ce01U,
-      kExpout = 0xfc32daeaU,
-      kLinear = 0x0b7641e0U,
-      kQuadin = 0x17f20ee7U,
-      kQuadinout = 0x72dfe13fU,
-      kQuadout = 0x163406a8U,
-      kQuarticin = 0x944c3515U,
-      kQuarticinout = 0xdde980adU,
-      kQuarticout = 0x1dd2f296U,
-      kQuinticin = 0xf2c97899U,
-      kQuinticinout = 0x2c4c45b1U,
-      kQuinticout = 0x4bf8a69aU,
-      kSinein = 0x1bca5f4bU,
-      kSineinout = 0x33cd0723U,
-      kSineout = 0x9516638cU,
-      // Indices
-      kBackinIndex = 0,
-      kBackinoutIndex,
-      kBackoutIndex,
-      kBounceinIndex,
-      kBounceinoutIndex,
-      kBounceoutIndex,
-      kCircinIndex,
-      kCircinoutIndex,
-      kCircoutIndex,
-      kCubicinIndex,
-      kCubicinoutIndex,
-      kCubicoutIndex,
-      kElasticinIndex,
-      kElasticinoutIndex,
-      kElasticoutIndex,
-      kExpinIndex,
-      kExpinoutIndex,
-      kExpoutIndex,
-      kLinearIndex,
-      kQuadinIndex,
-      kQuadinoutIndex,
-      kQuadoutIndex,
-      kQuarticinIndex,
-      kQuarticinoutIndex,
-      kQuarticoutIndex,
-      kQuinticinIndex,
-      kQuinticinoutIndex,
-      kQuinticoutIndex,
-      kSineinIndex,
-      kSineinoutIndex,
-      kSineoutIndex,
-    };
-
-    static inline rio2d::Script::Index index(rio2d::Hash hash)
-    {
-      switch (hash)
-      {
-      case kBackin:        return kBackinIndex;
-      case kBackinout:     return kBackinoutIndex;
-      case kBackout:       return kBackoutIndex;
-      case kBouncein:      return kBounceinIndex;
-      case kBounceinout:   return kBounceinoutIndex;
-      case kBounceout:     return kBounceoutIndex;
-      case kCircin:        return kCircinIndex;
-      case kCircinout:     return kCircinoutIndex;
-      case kCircout:       return kCircoutIndex;
-      case kCubicin:       return kCubicinIndex;
-      case kCubicinout:    return kCubicinoutIndex;
-      case kCubicout:      return kCubicoutIndex;
-      case kElasticin:     return kElasticinIndex;
-      case kElasticinout:  return kElasticinoutIndex;
-      case kElasticout:    return kElasticoutIndex;
-      case kExpin:         return kExpinIndex;
-      case kExpinout:      return kExpinoutIndex;
-      case kExpout:        return kExpoutIndex;
-      case kLinear:        return kLinearIndex;
-      case kQuadin:        return kQuadinIndex;
-      case kQuadinout:     return kQuadinoutIndex;
-      case kQuadout:       return kQuadoutIndex;
-      case kQuarticin:     return kQuarticinIndex;
-      case kQuarticinout:  return kQuarticinoutIndex;
-      case kQuarticout:    return kQuarticoutIndex;
-      case kQuinticin:     return kQuinticinIndex;
-      case kQuinticinout:  return kQuinticinoutIndex;
-      case kQuinticout:    return kQuinticoutIndex;
-      case kSinein:        return kSineinIndex;
-      case kSineinout:     return kSineinoutIndex;
-      case kSineout:       return kSineoutIndex;
-      default:             return -1;
-      }
-    }
-
-    static inline rio2d::Script::Number evaluate(rio2d::Script::Index index, rio2d::Script::Number p)
-    {
-      typedef rio2d::Script::Number(*Ease)(rio2d::Script::Number);
-
-      static const Ease functions[] =
-      {
-        BackEaseIn,
-        BackEaseInOut,
-        BackEaseOut,
-        BounceEaseIn,
-        BounceEaseInOut,
-        BounceEaseOut,
-        CircularEaseIn,
-        CircularEaseInOut,
-        CircularEaseOut,
-        CubicEaseIn,
-        CubicEaseInOut,
-        CubicEaseOut,
-        ElasticEaseIn,
-        ElasticEaseInOut,
-        ElasticEaseOut,
-        ExponentialEaseIn,
-        ExponentialEaseInOut,
-        ExponentialEaseOut,
-        LinearInterpolation,
-        QuadraticEaseIn,
-        QuadraticEaseInOut,
-        QuadraticEaseOut,
-        QuarticEaseIn,
-        QuarticEaseInOut,
-        QuarticEaseOut,
-        QuinticEaseIn,
-        QuinticEaseInOut,
-        QuinticEaseOut,
-        SineEaseIn,
-        SineEaseInOut,
-        SineEaseOut,
-      };
-
-      CCASSERT(index >= 0 && index < 31, "Invalid ease function index");
-      return functions[index](p);
+      return (size + alignof(RunnerImpl) - 1) / alignof(RunnerImpl) * alignof(RunnerImpl);
     }
-  };
 
-  // Bytecode instructions.
-  struct Insns
-  {
-    enum
+    static constexpr size_t classSize(unsigned cls)
     {
-      kAdd,
-      kCallMethod,
-      kCeil,
-      kCmpEqual,
-      kCmpGreater,
-      kCmpGreaterEqual,
-      kCmpLess,
-      kCmpLessEqual,
-      kCmpNotEqual,
-      kDiv,
-      kFloor,
-      kGetLocal,
-      kGetProp,
-      kJump,
-      kJz,
-      kLogicalAnd,
-      kLogicalNot,
-      kLogicalOr,
-      kModulus,
-      kMul,
-      kNeg,
-      kNext,
-      kPause,
-      kPush,
-      kRand,
-      kRandRange,
-      kSetFrame,
-      kSetLocal,
-      kSetProp,
-      kSignal,
-      kSpawn,
-      kStop,
-      kSub,
-      kTrunc,
-      kVaryAbs,
-      kVaryRel,
-    };
+      return ((size_t)kMinSize << (cls / 2)) * (2 + (cls & 1)) / 2;
+    }
 
-    static inline size_t size(rio2d::Script::Insn insn)
-    {
-      static const uint8_t sizes[] =
-      {
-        1, // kAdd
-        3, // kCallMethod
-        1, // kCeil
-        1, // kCmpEqual
-        1, // kCmpGreater
-        1, // kCmpGreaterEqual
-        1, // kCmpLess
-        1, // kCmpLessEqual
-        1, // kCmpNotEqual
-        1, // kDiv
-        1, // kFloor
-        2, // kGetLocal
-        3, // kGetProp
-        2, // kJump
-        2, // kJz
-        1, // kLogicalAnd
-        1, // kLogicalNot
-        1, // kLogicalOr
-        1, // kModulus
-        1, // kMul
-        1, // kNeg
-        3, // kNext
-        1, // kPause
-        2, // kPush
-        1, // kRand
-        1, // kRandRange
-        3, // kSetFrame
-        2, // kSetLocal
-        3, // kSetProp
-        2, // kSignal
-        2, // kSpawn
-        1, // kStop
-        1, // kSub
-        1, // kTrunc
-        4, // kVaryAbs
-        4, // kVaryRel
-      };
+    static unsigned sizeClass(size_t size)
+    {
+      static_assert(sizeof(RunnerImpl) + alignof(RunnerImpl) + rio2d::ScriptBase::kThreadsBound * (sizeof(Thread) + rio2d::ScriptBase::kStackBound * sizeof(rio2d::Script::Number)) + rio2d::ScriptBase::kLocalVarsBound * sizeof(rio2d::Script::Value) <= classSize(kNumClasses - 1), "Not enough runner size classes");
 
-      CCASSERT(insn >= 0 && insn < sizeof(sizes) / sizeof(sizes[0]), "Invalid instruction");
-      return sizes[insn];
-    };
+      unsigned cls = 0;
 
-#ifndef NDEBUG
-    static void disasm(rio2d::Script::Address addr, const rio2d::Script::Bytecode*& bc, const char* prefix = "")
-    {
-      switch (bc->m_insn)
-      {
-      case kAdd:             CCLOG("%s%04x\t%08x\tadd", prefix, addr, bc->m_insn); bc += 1; break;
-      case kCallMethod:      CCLOG("%s%04x\t%08x\tcall_method l@%d f@%d", prefix, addr, bc->m_insn, bc[1].m_index, bc[2].m_index); bc += 3; break;
-      case kCeil:            CCLOG("%s%04x\t%08x\tceil", prefix, addr, bc->m_insn); bc += 1; break;
-      case kCmpEqual:        CCLOG("%s%04x\t%08x\tcmp_eq", prefix, addr, bc->m_insn); bc += 1; break;
-      case kCmpGreater:      CCLOG("%s%04x\t%08x\tcmp_gt", prefix, addr, bc->m_insn); bc += 1; break;
-      case kCmpGreaterEqual: CCLOG("%s%04x\t%08x\tcmp_ge", prefix, addr, bc->m_insn); bc += 1; break;
-      case kCmpLess:         CCLOG("%s%04x\t%08x\tcmp_lt", prefix, addr, bc->m_insn); bc += 1; break;
-      case kCmpLessEqual:    CCLOG("%s%04x\t%08x\tcmp_le", prefix, addr, bc->m_insn); bc += 1; break;
-      case kCmpNotEqual:     CCLOG("%s%04x\t%08x\tcmp_ne", prefix, addr, bc->m_insn); bc += 1; break;
-      case kDiv:             CCLOG("%s%04x\t%08x\tdiv", prefix, addr, bc->m_insn); bc += 1; break;
-      case kFloor:           CCLOG("%s%04x\t%08x\tfloor", prefix, addr, bc->m_insn); bc += 1; break;
-      case kGetLocal:        CCLOG("%s%04x\t%08x\tget_local l@%d", prefix, addr, bc->m_insn, bc[1].m_index); bc += 2; break;
-      case kGetProp:         CCLOG("%s%04x\t%08x\tget_property l@%d f@%d", prefix, addr, bc->m_insn, bc[1].m_index, bc[2].m_index); bc += 3; break;
-      case kJump:            CCLOG("%s%04x\t%08x\tjump %04x", prefix, addr, bc->m_insn, bc[1].m_address); bc += 2; break;
-      case kJz:              CCLOG("%s%04x\t%08x\tjz %04x", prefix, addr, bc->m_insn, bc[1].m_address); bc += 2; break;
-      case kLogicalAnd:      CCLOG("%s%04x\t%08x\tand", prefix, addr, bc->m_insn); bc += 1; break;
-      case kLogicalNot:      CCLOG("%s%04x\t%08x\tnot", prefix, addr, bc->m_insn); bc += 1; break;
-      case kLogicalOr:       CCLOG("%s%04x\t%08x\tor", prefix, addr, bc->m_insn); bc += 1; break;
-      case kModulus:         CCLOG("%s%04x\t%08x\tmod", prefix, addr, bc->m_insn); bc += 1; break;
-      case kMul:             CCLOG("%s%04x\t%08x\tmul", prefix, addr, bc->m_insn); bc += 1; break;
-      case kNeg:             CCLOG("%s%04x\t%08x\tneg", prefix, addr, bc->m_insn); bc += 1; break;
-      case kNext:            CCLOG("%s%04x\t%08x\tnext l@%d %04x", prefix, addr, bc->m_insn, bc[1].m_index, bc[2].m_address); bc += 3; break;
-      case kPause:           CCLOG("%s%04x\t%08x\tpause", prefix, addr, bc->m_insn); bc += 1; break;
-      case kPush:            CCLOG("%s%04x\t%08x\tpush %f", prefix, addr, bc->m_insn, bc[1].m_number); bc += 2; break;
-      case kRand:            CCLOG("%s%04x\t%08x\trand", prefix, addr, bc->m_insn); bc += 1; break;
-      case kRandRange:       CCLOG("%s%04x\t%08x\trand_range", prefix, addr, bc->m_insn); bc += 1; break;
-      case kSetLocal:        CCLOG("%s%04x\t%08x\tset_local l@%d", prefix, addr, bc->m_insn, bc[1].m_index); bc += 2; break;
-      case kSetFrame:        CCLOG("%s%04x\t%08x\tset_frame l@%d l@%d", prefix, addr, bc->m_insn, bc[1].m_index, bc[2].m_index); bc += 3; break;
-      case kSetProp:         CCLOG("%s%04x\t%08x\tset_property l@%d f@%d", prefix, addr, bc->m_insn, bc[1].m_index, bc[2].m_index); bc += 3; break;
-      case kSignal:          CCLOG("%s%04x\t%08x\tsignal #%08x", prefix, addr, bc->m_insn, bc[1]); bc += 2; break;
-      case kSpawn:           CCLOG("%s%04x\t%08x\tspawn %04x", prefix, addr, bc->m_insn, bc[1]); bc += 2; break;
-      case kStop:            CCLOG("%s%04x\t%08x\tstop", prefix, addr, bc->m_insn); bc += 1; break;
-      case kSub:             CCLOG("%s%04x\t%08x\tsub", prefix, addr, bc->m_insn); bc += 1; break;
-      case kTrunc:           CCLOG("%s%04x\t%08x\ttrunc", prefix, addr, bc->m_insn); bc += 1; break;
-      case kVaryAbs:         CCLOG("%s%04x\t%08x\tvary_abs l@%d f@%d e@%d", prefix, addr, bc->m_insn, bc[1].m_index, bc[2].m_index, bc[3].m_index); bc += 4; break;
-      case kVaryRel:         CCLOG("%s%04x\t%08x\tvary_rel l@%d f@%d e@%d", prefix, addr, bc->m_insn, bc[1].m_index, bc[2].m_index, bc[3].m_index); bc += 4; break;
-      default:               CCLOG("%s%04x	%08x	unknown", prefix, addr, bc->m_insn); bc += 1; break;
-      }
-    }
-
-    static void disasm(const rio2d::Script::Bytecode* bc, const rio2d::Script::Bytecode* end)
-    {
-      const rio2d::Script::Bytecode* start = bc;
-
-      while (bc < end)
-      {
-        disasm(bc - start, bc);
+      while (classSize(cls) < size)
+      {
+        cls++;
       }
-    }
-#endif
-  };
-
-  class Emitter
-  {
-  public:
-    virtual Errors::Enum addGlobal(rio2d::Hash hash) = 0;
-    virtual size_t       numGlobals() const = 0;
 
-    virtual Errors::Enum addLocal(rio2d::Hash hash, rio2d::Script::Token type) = 0;
-    virtual size_t       numLocals() const = 0;
-    virtual Errors::Enum getIndex(rio2d::Hash hash, rio2d::Script::Index* index) const = 0;
-    virtual Errors::Enum getType(rio2d::Hash hash, rio2d::Script::Token* type) const = 0;
-
-    virtual void                   emit(rio2d::Script::Insn insn, va_list args) = 0;
-    virtual rio2d::Script::Address getPC() const = 0;
-    virtual void                   patch(rio2d::Script::Address address, rio2d::Script::Bytecode bc) = 0;
-  };
+      return cls;
+    }
 
-  // This emitter just collects info about the script without generating any code.
-  class CounterEmitter : public Emitter
-  {
-  protected:
-    struct Local
+    static size_t stride(unsigned cls)
     {
-      rio2d::Hash  m_hash;
-      rio2d::Script::Token m_type;
-    };
+      return align(sizeof(Block*)) + align(classSize(cls));
+    }
 
-    rio2d::Hash m_globals[rio2d::Script::kMaxGlobals];
-    Local  m_locals[rio2d::Script::kMaxLocalVars];
-    size_t m_numGlobals;
-    size_t m_numLocals;
-    rio2d::Script::Address m_pc;
+    unsigned getClass() const
+    {
+      return (*(Block**)((char*)this - sizeof(Block*)))->m_class;
+    }
 
-  public:
-    inline void init()
+    // Takes a reference to the owner and accounts the runner to it.
+    void attach()
     {
-      m_pc = 0;
-      m_numGlobals = 0;
+      m_owner->retain();
+      addRunner(m_owner, m_global, stride(getClass()));
     }
 
-    virtual Errors::Enum addGlobal(rio2d::Hash hash) override
+    static void* take(Pool* pool, unsigned cls)
     {
-      if (m_numGlobals < rio2d::Script::kMaxGlobals)
-      {
-        rio2d::Hash* global = m_globals;
-        const rio2d::Hash* end = global + m_numGlobals;
+      void* slot = pool->m_free[cls];
+      pool->m_free[cls] = *(void**)slot;
+      pool->m_numFree[cls]--;
 
-        while (global < end)
-        {
-          if (*m_globals == hash)
-          {
-            return Errors::kDuplicateIdentifier;
-          }
+      Block* block = *(Block**)((char*)slot - sizeof(Block*));
+      block->m_live++;
+      return slot;
+    }
 
-          global++;
-        }
+  public:
+    static void operator delete(void* runner)
+    {
+      Block* block = *(Block**)((char*)runner - sizeof(Block*));
+      Pool* pool = block->m_pool;
+      block->m_live--;
 
-        *global = hash;
-        m_numGlobals++;
-        m_numLocals = 0;
-        return Errors::kOk;
-      }
+      *(void**)runner = pool->m_free[block->m_class];
+      pool->m_free[block->m_class] = runner;
+      pool->m_numFree[block->m_class]++;
+    }
 
-      return Errors::kOutOfMemory;
+    // The size of a runner and everything that trails it.
+    static size_t size(const rio2d::ScriptBase::Config& config, size_t numLocals)
+    {
+      size_t threads = config.m_maxThreads * (sizeof(Thread) + config.m_maxStack * sizeof(rio2d::Script::Number));
+      return align(sizeof(RunnerImpl) + threads) + numLocals * sizeof(rio2d::Script::Value);
     }
 
-    virtual size_t numGlobals() const override
+    // The memory a runner takes in its block.
+    static size_t slotSize(const rio2d::ScriptBase::Config& config, size_t numLocals)
     {
-      return m_numGlobals;
+      return stride(sizeClass(size(config, numLocals)));
     }
 
-    virtual Errors::Enum addLocal(rio2d::Hash hash, rio2d::Script::Token type) override
+    // Makes sure the pool of allocator has at least count free runners of size bytes, allocating the missing ones in a
+    // single block. Returns the pool, or nullptr if there's no memory.
+    static Pool* reserve(rio2d::Allocator* allocator, size_t size, size_t count)
     {
-      if (m_numLocals < rio2d::Script::kMaxLocalVars)
-      {
-        Local* local = m_locals;
-        const Local* end = local + m_numLocals;
+      Pool* pool = s_pools;
 
-        while (local < end)
-        {
-          if (local->m_hash == hash)
-          {
-            if (local->m_type == type)
-            {
-              return Errors::kOk;
-            }
+      while (pool != nullptr && pool->m_allocator != allocator)
+      {
+        pool = pool->m_next;
+      }
 
-            return Errors::kTypeMismatch;
-          }
+      if (pool == nullptr)
+      {
+        pool = (Pool*)allocator->allocate(sizeof(Pool));
 
-          local++;
+        if (pool == nullptr)
+        {
+          return nullptr;
         }
 
-        local->m_hash = hash;
-        local->m_type = type;
-        m_numLocals++;
-        return Errors::kOk;
+        memset(pool, 0, sizeof(Pool));
+        pool->m_allocator = allocator;
+        pool->m_next = s_pools;
+        s_pools = pool;
       }
 
-      return Errors::kOutOfMemory;
-    }
+      unsigned cls = sizeClass(size);
 
-    virtual size_t numLocals() const override
-    {
-      return m_numLocals;
-    }
+      if (pool->m_numFree[cls] >= count)
+      {
+        return pool;
+      }
 
-    virtual Errors::Enum getIndex(rio2d::Hash hash, rio2d::Script::Index* index) const override
-    {
-      const Local* local = m_locals;
-      const Local* end = local + m_numLocals;
+      count -= pool->m_numFree[cls];
+      size_t step = stride(cls);
+      size_t bytes = align(sizeof(Block)) + step * count;
+      Block* block = (Block*)allocator->allocate(bytes);
 
-      while (local < end)
+      if (block == nullptr)
       {
-        if (local->m_hash == hash)
-        {
-          *index = local - m_locals;
-          return Errors::kOk;
-        }
+        return nullptr;
+      }
 
-        local++;
+      block->m_pool = pool;
+      block->m_size = bytes;
+      block->m_next = pool->m_blocks;
+      block->m_live = 0;
+      block->m_class = cls;
+      pool->m_blocks = block;
+
+      char* slot = (char*)block + align(sizeof(Block)) + align(sizeof(Block*));
+
+      for (size_t i = 0; i < count; i++, slot += step)
+      {
+        *(Block**)(slot - sizeof(Block*)) = block;
+        *(void**)slot = pool->m_free[cls];
+        pool->m_free[cls] = slot;
       }
 
-      return Errors::kUnknownIdentifier;
+      pool->m_numFree[cls] += count;
+      return pool;
     }
 
-    virtual Errors::Enum getType(rio2d::Hash hash, rio2d::Script::Token* type) const override
+    static size_t pooled()
     {
-      const Local* local = m_locals;
-      const Local* end = local + m_numLocals;
+      size_t bytes = 0;
 
-      while (local < end)
+      for (const Pool* pool = s_pools; pool != nullptr; pool = pool->m_next)
       {
-        if (local->m_hash == hash)
+        for (const Block* block = pool->m_blocks; block != nullptr; block = block->m_next)
         {
-          *type = local->m_type;
-          return Errors::kOk;
+          bytes += block->m_size;
         }
-
-        local++;
       }
 
-      return Errors::kUnknownIdentifier;
+      return bytes;
     }
 
-    virtual void emit(rio2d::Script::Insn insn, va_list args) override
+    static void purge(Pool* pool)
     {
-      m_pc += Insns::size(insn);
-    }
-
-    virtual rio2d::Script::Address getPC() const override
-    {
-      return m_pc;
-    }
+      for (unsigned cls = 0; cls < kNumClasses; cls++)
+      {
+        void** link = &pool->m_free[cls];
 
-    virtual void patch(rio2d::Script::Address address, rio2d::Script::Bytecode bc) override
-    {
-      (void)address;
-      (void)bc;
-    }
-  };
+        while (*link != nullptr)
+        {
+          Block* block = *(Block**)((char*)*link - sizeof(Block*));
 
-  class CodeEmitter : public Emitter
-  {
-  protected:
-    rio2d::Script::Bytecode* m_bytecode;
-    rio2d::Script::Address m_pc;
+          if (block->m_live == 0)
+          {
+            *link = *(void**)*link;
+            pool->m_numFree[cls]--;
+          }
+          else
+          {
+            link = (void**)*link;
+          }
+        }
+      }
 
-    rio2d::Script::Subroutine* m_globals;
-    size_t m_numGlobals;
+      Block** link = &pool->m_blocks;
 
-  public:
-    inline void initWithMemory(rio2d::Script::Bytecode* bytecode, rio2d::Script::Subroutine* globals)
-    {
-      m_globals = globals;
-      m_numGlobals = 0;
+      while (*link != nullptr)
+      {
+        Block* block = *link;
 
-      m_bytecode = bytecode;
-      m_pc = 0;
+        if (block->m_live == 0)
+        {
+          *link = block->m_next;
+          pool->m_allocator->deallocate(block);
+        }
+        else
+        {
+          link = &block->m_next;
+        }
+      }
     }
 
-    virtual Errors::Enum addGlobal(rio2d::Hash hash) override
+    // Frees the blocks that don't have runners in use, and the pools left without blocks.
+    static void purge()
     {
-      rio2d::Script::Subroutine* global = m_globals + m_numGlobals++;
+      Pool** link = &s_pools;
 
-      global->m_hash = hash;
-      global->m_pc = m_pc;
-      global->m_numLocals = 0;
+      while (*link != nullptr)
+      {
+        Pool* pool = *link;
+        purge(pool);
 
-      return Errors::kOk;
+        if (pool->m_blocks == nullptr)
+        {
+          *link = pool->m_next;
+          pool->m_allocator->deallocate(pool);
+        }
+        else
+        {
+          link = &pool->m_next;
+        }
+      }
     }
 
-    virtual size_t numGlobals() const override
+    // Forgets the pool of an allocator that is about to be reset or destroyed, which frees all of its blocks.
+    static void forget(rio2d::Allocator* allocator)
     {
-      return m_numGlobals;
-    }
+      Pool** link = &s_pools;
 
-    virtual Errors::Enum addLocal(rio2d::Hash hash, rio2d::Script::Token type) override
-    {
-      if (m_numGlobals != 0)
+      while (*link != nullptr)
       {
-        rio2d::Script::Subroutine* global = m_globals + m_numGlobals - 1;
-        rio2d::Script::LocalVar* local = global->m_locals;
-        const rio2d::Script::LocalVar* end = local + global->m_numLocals;
+        Pool* pool = *link;
 
-        while (local < end)
+        if (pool->m_allocator == allocator)
         {
-          if (local->m_hash == hash)
+#ifndef NDEBUG
+          for (const Block* block = pool->m_blocks; block != nullptr; block = block->m_next)
           {
-            if (local->m_type == type)
-            {
-              return Errors::kOk;
-            }
-
-            return Errors::kTypeMismatch;
+            CCASSERT(block->m_live == 0, "Runners are still running in the memory being reset");
           }
+#endif
 
-          local++;
+          *link = pool->m_next;
+          return;
         }
 
-        local->m_hash = hash;
-        local->m_type = type;
-        global->m_numLocals++;
+        link = &pool->m_next;
       }
-
-      return Errors::kOk;
     }
 
-    virtual size_t numLocals() const override
+    // Creates a runner for each target and starts them, allocating at most one block. The arguments for each target
+    // follow the previous target's.
+    static bool spawn(rio2d::ScriptBase* owner, const rio2d::Script::Subroutine* global, const rio2d::Script::Bytecode* bytecode, cocos2d::Ref* listener, rio2d::Script::NotifyFunc port, cocos2d::Node* const* targets, size_t count, const rio2d::Script::Argument* args)
     {
-      if (m_numGlobals != 0)
+      size_t bytes = size(owner->getConfig(), global->m_numLocals);
+      Pool* pool = reserve(getScriptAllocator(owner), bytes, count);
+
+      if (pool == nullptr)
       {
-        const rio2d::Script::Subroutine* global = m_globals + m_numGlobals - 1;
-        return global->m_numLocals;
+        return false;
       }
 
-      return 0;
-    }
+      unsigned cls = sizeClass(bytes);
 
-    virtual Errors::Enum getIndex(rio2d::Hash hash, rio2d::Script::Index* index) const override
-    {
-      if (m_numGlobals != 0)
+      for (size_t i = 0; i < count; i++)
       {
-        const rio2d::Script::Subroutine* global = m_globals + m_numGlobals - 1;
-        const rio2d::Script::LocalVar* local = global->m_locals;
-        const rio2d::Script::LocalVar* end = local + global->m_numLocals;
+        RunnerImpl* self = new (take(pool, cls)) RunnerImpl();
+        self->init(owner, global, bytecode, listener, port, targets[i], args);
+        self->attach();
 
-        while (local < end)
-        {
-          if (local->m_hash == hash)
-          {
-            *index = local - global->m_locals;
-            return Errors::kOk;
-          }
+        // The target keeps the only reference.
+        targets[i]->runAction(self);
+        self->release();
 
-          local++;
-        }
+        args += global->m_numParams - 1;
       }
 
-      return Errors::kUnknownIdentifier;
+      return true;
     }
 
-    virtual Errors::Enum getType(rio2d::Hash hash, rio2d::Script::Token* type) const override
+    virtual rio2d::Hash getHash() const override
     {
-      if (m_numGlobals != 0)
-      {
-        const rio2d::Script::Subroutine* global = m_globals + m_numGlobals - 1;
-        const rio2d::Script::LocalVar* local = global->m_locals;
-        const rio2d::Script::LocalVar* end = local + global->m_numLocals;
+      return m_global->m_hash;
+    }
 
-        while (local < end)
-        {
-          if (local->m_hash == hash)
-          {
-            *type = local->m_type;
-            return Errors::kOk;
-          }
+    virtual bool cloneOnto(cocos2d::Node* target) const override
+    {
+      // The copy goes in the same size class.
+      unsigned cls = getClass();
+      Pool* pool = reserve(getScriptAllocator(m_owner), classSize(cls), 1);
 
-          local++;
-        }
+      if (pool == nullptr)
+      {
+        return false;
       }
 
-      return Errors::kUnknownIdentifier;
-    }
-
-    virtual void emit(rio2d::Script::Insn insn, va_list args) override
-    {
-      switch (insn)
-      {
-      case Insns::kAdd:
-      case Insns::kCeil:
-      case Insns::kCmpEqual:
-      case Insns::kCmpGreater:
-      case Insns::kCmpGreaterEqual:
-      case Insns::kCmpLess:
-      case Insns::kCmpLessEqual:
-      case Insns::kCmpNotEqual:
-      case Insns::kDiv:
-      case Insns::kFloor:
-      case Insns::kLogicalAnd:
-      case Insns::kLogicalNot:
-      case Insns::kLogicalOr:
-      case Insns::kModulus:
-      case Insns::kMul:
-      case Insns::kNeg:
-      case Insns::kPause:
-      case Insns::kRand:
-      case Insns::kRandRange:
-      case Insns::kStop:
-      case Insns::kSub:
-      case Insns::kTrunc:
-        m_bytecode[m_pc++].m_insn = insn;
-        break;
-
-      case Insns::kJump:
-      case Insns::kJz:
-      case Insns::kSpawn:
-        m_bytecode[m_pc++].m_insn = insn;
-        m_bytecode[m_pc++].m_address = va_arg(args, rio2d::Script::Address);
-        break;
-
-      case Insns::kSignal:
-        m_bytecode[m_pc++].m_insn = insn;
-        m_bytecode[m_pc++].m_hash = va_arg(args, rio2d::Hash);
-        break;
+      RunnerImpl* self = new (take(pool, cls)) RunnerImpl();
+      self->layout(m_owner->getConfig());
+      self->m_global = m_global;
+      self->m_vars = m_vars;
+      self->m_bytecode = m_bytecode;
+      self->m_listener = m_listener;
+      self->m_port = m_port;
+      self->setTag(getTag());
 
-      case Insns::kPush:
-        m_bytecode[m_pc++].m_insn = insn;
-        m_bytecode[m_pc++].m_number = (rio2d::Script::Number)va_arg(args, double);
-        break;
+      // The copy has the same clock, so parked threads are due at the same time.
+      const Thread* threads[rio2d::ScriptBase::kThreadsBound];
+      size_t count = gather(threads);
+      self->m_time = m_time;
+      self->m_tick = m_tick;
 
-      case Insns::kGetLocal:
-      case Insns::kSetLocal:
-        m_bytecode[m_pc++].m_insn = insn;
-        m_bytecode[m_pc++].m_index = va_arg(args, rio2d::Script::Index);
-        break;
+      for (size_t i = 0; i < count; i++)
+      {
+        const Thread* thread = threads[i];
+        Thread* nt = self->addThread(thread->m_wake);
 
-      case Insns::kCallMethod:
-      case Insns::kGetProp:
-      case Insns::kSetFrame:
-      case Insns::kSetProp:
-        m_bytecode[m_pc++].m_insn = insn;
-        m_bytecode[m_pc++].m_index = va_arg(args, rio2d::Script::Index);
-        m_bytecode[m_pc++].m_index = va_arg(args, rio2d::Script::Index);
-        break;
+        nt->m_pc = thread->m_pc;
+        nt->m_dt = thread->m_dt;
+        nt->m_sp = thread->m_sp;
+        memcpy(nt->m_stack, thread->m_stack, thread->m_sp * sizeof(rio2d::Script::Number));
+      }
 
-      case Insns::kVaryAbs:
-      case Insns::kVaryRel:
-        m_bytecode[m_pc++].m_insn = insn;
-        m_bytecode[m_pc++].m_index = va_arg(args, rio2d::Script::Index);
-        m_bytecode[m_pc++].m_index = va_arg(args, rio2d::Script::Index);
-        m_bytecode[m_pc++].m_index = va_arg(args, rio2d::Script::Index);
-        break;
+      // The target is the first local, so the locals can't be shared.
+      memcpy(self->m_locals, m_locals, m_global->m_numLocals * sizeof(rio2d::Script::Value));
+      self->m_locals->m_pointer = target;
 
-      case Insns::kNext:
-        m_bytecode[m_pc++].m_insn = insn;
-        m_bytecode[m_pc++].m_index = va_arg(args, rio2d::Script::Index);
-        m_bytecode[m_pc++].m_address = va_arg(args, rio2d::Script::Address);
-        break;
+      self->m_owner = m_owner;
+      self->attach();
 
-      default:
-        CCASSERT(0, "Unknown instruction");
-      }
+      target->runAction(self);
+      self->release();
+      return true;
     }
 
-    virtual rio2d::Script::Address getPC() const override
+    virtual rio2d::ScriptBase* getScript() const override
     {
-      return m_pc;
+      return m_owner;
     }
 
-    virtual void patch(rio2d::Script::Address address, rio2d::Script::Bytecode bc) override
+    virtual size_t snapshot(void* buffer, size_t size, const rio2d::ScriptBase::NodeToId& toId) const override
     {
-      CCASSERT(address < m_pc, "Invalid address to patch");
-      m_bytecode[address] = bc;
+      return snapshot(m_owner, this, buffer, size, toId);
     }
-  };
-
-  class Parser
-  {
-  protected:
-    const char* m_current;
-    unsigned m_line;
-
-    const char* m_lexeme;
-    size_t m_length;
-    rio2d::Hash m_hash;
-    rio2d::Script::Token m_token;
-    unsigned m_tokenLine;
-
-    // On Windows it seems exception handling on x86_64 is fine, but it isn't on x86 and
-    // I don't know about other CPUs/architectures. Let's avoid the overhead.
-    jmp_buf m_rollback;
-
-    rio2d::Script::Index m_globalsIndex;
-    rio2d::Script::Bytecode* m_bytecode;
-    rio2d::Script::Subroutine* m_globals;
 
-    Emitter* m_emitter;
-
-#ifndef NDEBUG
-    size_t m_bcSize;
-    size_t m_numGlobals;
-#endif
+    // Snapshots start with a header followed by a record for each runner: the subroutine hash, the number of threads,
+    // the runner's clock, the locals, and each thread with when it's due if it's parked and its stack. Everything is 32
+    // bits wide, except the times that are doubles and pointers that aren't nodes.
+    struct SnapshotHeader
+    {
+      uint32_t m_magic;
+      uint32_t m_version;
+      uint32_t m_count;
+    };
 
-  public:
-    Errors::Enum initWithSourceAndPointers(const char* source, rio2d::Script::Bytecode** bytecode, size_t* bcSize, rio2d::Script::Subroutine** globals, size_t* numGlobals)
+    enum
     {
-      CounterEmitter counter;
-      counter.init();
-      m_emitter = &counter;
+      kSnapshotMagic = 0x70616e73, // "snap"
+      kSnapshotVersion = 2,
+      kNullId = 0xffffffff,
+    };
 
-      Errors::Enum res = compile(source);
+    static void put(char*& out, const void* data, size_t size)
+    {
+      memcpy(out, data, size);
+      out += size;
+    }
 
-      if (res != Errors::kOk)
+    static bool get(const char*& in, const char* end, void* data, size_t size)
+    {
+      if ((size_t)(end - in) < size)
       {
-        return res;
+        return false;
       }
 
-#ifndef NDEBUG
-      m_bcSize = *bcSize = (size_t)counter.getPC();
-      m_numGlobals = *numGlobals = counter.numGlobals();
-#else
-      *bcSize = (size_t)counter.getPC();
-      *numGlobals = counter.numGlobals();
-#endif
+      memcpy(data, in, size);
+      in += size;
+      return true;
+    }
 
-      m_bytecode = new rio2d::Script::Bytecode[*bcSize];
-      m_globals = new rio2d::Script::Subroutine[*numGlobals];
+    // Writes the state of the running runners of owner, or only of runner if it's not null.
+    static size_t snapshot(const rio2d::ScriptBase* owner, const RunnerImpl* runner, void* buffer, size_t size, const rio2d::ScriptBase::NodeToId& toId)
+    {
+      SnapshotHeader header = {kSnapshotMagic, kSnapshotVersion, 0};
+      size_t needed = sizeof(header);
 
-      if (m_bytecode != nullptr && m_globals != nullptr)
+      for (const RunnerImpl* self = s_live; self != nullptr; self = self->m_nextLive)
       {
-        *bytecode = m_bytecode;
-        *globals = m_globals;
-
-        CodeEmitter generator;
-        generator.initWithMemory(m_bytecode, m_globals);
-        m_emitter = &generator;
-
-        res = compile(source); // This call to compile is bound to return kOk.
-
-#ifndef NDEBUG
-        Insns::disasm(m_bytecode, m_bytecode + *bcSize);
-#endif
-
-        return res;
+        if (self->isSnapshot(owner, runner))
+        {
+          needed += self->recordSize();
+          header.m_count++;
+        }
       }
 
-      if (m_bytecode != nullptr)
+      if (needed <= size)
       {
-        delete[] m_bytecode;
-      }
+        char* out = (char*)buffer;
+        put(out, &header, sizeof(header));
 
-      if (m_globals != nullptr)
-      {
-        delete[] m_globals;
+        for (const RunnerImpl* self = s_live; self != nullptr; self = self->m_nextLive)
+        {
+          if (self->isSnapshot(owner, runner))
+          {
+            self->write(out, toId);
+          }
+        }
       }
 
-      return Errors::kOutOfMemory;
+      return needed;
     }
 
-    unsigned getLine() const
+    static bool readHeader(const char*& in, const char* end, uint32_t* count)
     {
-      return m_tokenLine;
-    }
+      SnapshotHeader header;
 
-    const char* getLexeme(size_t* length)
-    {
-      if (length)
+      if (!get(in, end, &header, sizeof(header)) || header.m_magic != kSnapshotMagic || header.m_version != kSnapshotVersion)
       {
-        *length = m_length;
+        return false;
       }
 
-      return m_lexeme;
+      *count = header.m_count;
+      return true;
     }
 
-  protected:
-    int raise(Errors::Enum error)
+    // Reads a record after its hash into self, or only validates it if self is null. The code of the subroutine ends at
+    // limit.
+    static bool read(RunnerImpl* self, const rio2d::Script::Subroutine* global, const rio2d::Script::Bytecode* bytecode, rio2d::Script::Address limit, const rio2d::ScriptBase::Config& config, const char*& in, const char* end, const rio2d::ScriptBase::IdToNode& toNode)
     {
-      longjmp(m_rollback, (int)error);
-      return 0; // Shut up the compiler.
-    }
+      uint32_t numThreads;
+      double time;
 
-    Errors::Enum compile(const char* source)
-    {
-      m_current = source;
-      m_line = 1;
+      if (!get(in, end, &numThreads, sizeof(numThreads)) || numThreads == 0 || numThreads > config.m_maxThreads)
+      {
+        return false;
+      }
 
-      Errors::Enum res = (Errors::Enum)setjmp(m_rollback);
+      if (!get(in, end, &time, sizeof(time)) || !(time >= 0.0 && time < kMaxTime))
+      {
+        return false;
+      }
 
-      if (res != Errors::kOk)
+      if (self != nullptr)
       {
-        goto out;
+        self->m_time = time;
+        self->m_tick = (uint32_t)(time * kTicksPerSecond);
       }
 
-      m_globalsIndex = 0;
+      for (size_t i = 0; i < global->m_numLocals; i++)
+      {
+        rio2d::Script::Value value;
+        uint32_t id;
 
-      match();
-      parse();
+        switch (global->m_locals[i].m_type)
+        {
+        case Tokens::kNumber:
+          if (!get(in, end, &value.m_number, sizeof(value.m_number)))
+          {
+            return false;
+          }
 
-      res = Errors::kOk;
+          break;
 
-    out:
-      return res;
-    }
+        case Tokens::kNode:
+          if (!get(in, end, &id, sizeof(id)))
+          {
+            return false;
+          }
 
-    void match()
-    {
-    again:
+          value.m_pointer = self != nullptr && id != kNullId ? toNode(id) : nullptr;
+          break;
 
-      // Skip spaces.
-      for (;;)
-      {
-        if (isspace(*m_current))
-        {
-          if (*m_current == '\n')
+        default:
+          if (!get(in, end, &value.m_pointer, sizeof(value.m_pointer)))
           {
-            // End of line, increment the line number.
-            m_line++;
+            return false;
           }
 
-          m_current++; // m_current is a space, can increment directly.
-        }
-        else if (*m_current != 0)
-        {
-          // Not a space, and not the end of the source code.
           break;
         }
-        else
+
+        if (self != nullptr)
         {
-          // End of the source code, return the kEof token.
-          m_lexeme = "<eof>";
-          m_length = 5;
-          m_token = Tokens::kEof;
-          m_tokenLine = m_line;
-          return;
+          self->m_locals[i] = value;
         }
       }
 
-      m_lexeme = m_current;
-      m_tokenLine = m_line;
-
-      // If the character is alphabetic or '_', the token is a keyword or an identifier.
-      if (isalpha(*m_current) || *m_current == '_')
+      for (uint32_t i = 0; i < numThreads; i++)
       {
-        do
-        {
-          m_current++; // m_current is an alphanumeric character, can increment directly.
-        } while (isalnum(*m_current) || *m_current == '_');
-
-        // Evaluate the hash of the identifier to check if it's a keyword.
-        m_hash = rio2d::hashLower(m_lexeme, m_current - m_lexeme);
+        uint32_t pc, sp;
+        float dt;
+        double wake;
 
-        if (Tokens::isKeyword(m_hash))
+        if (!get(in, end, &pc, sizeof(pc)) || !get(in, end, &dt, sizeof(dt)) || !get(in, end, &sp, sizeof(sp)) || !get(in, end, &wake, sizeof(wake)))
         {
-          m_token = m_hash;
-        }
-        else
-        {
-          m_token = Tokens::kIdentifier;
+          return false;
         }
 
-        m_length = m_current - m_lexeme;
-        return;
-      }
-
-      if (isdigit(*m_current))
-      {
-        do
+        if (pc < global->m_pc || pc >= limit || sp > config.m_maxStack || (size_t)(end - in) < sp * sizeof(rio2d::Script::Number) || !(wake < kMaxTime))
         {
-          m_current++; // m_current is a decimal digit, can increment directly.
-        } while (isdigit(*m_current));
+          return false;
+        }
 
-        if (*m_current == '.')
+        // Threads stop at the start of an instruction, with the stack the code has there. Parked threads are in a
+        // pause, with its time at the top of the stack.
+        if (Insns::depthAt(bytecode, global->m_pc, pc) != (int)sp || (wake >= 0.0 && (bytecode[pc].m_insn != Insns::kPause || sp == 0)))
         {
-          m_current++; // m_current is '.', can increment directly.
-
-          if (!isdigit(*m_current))
-          {
-            raise(Errors::kMalformedNumber);
-            return; // Not needed, but let's the compiler know we're not going to do any further processing here.
-          }
-
-          do
-          {
-            m_current++; // m_current is a decimal digit, can increment directly.
-          } while (isdigit(*m_current));
+          return false;
         }
 
-        if (*m_current == 'e' || *m_current == 'E')
+        if (self != nullptr)
         {
-          m_current++; // m_current is the exponent character, can increment directly.
+          Thread* thread = self->addThread(wake);
+          thread->m_pc = pc;
+          thread->m_dt = dt;
+          thread->m_sp = sp;
+          memcpy(thread->m_stack, in, sp * sizeof(rio2d::Script::Number));
+        }
 
-          if (*m_current == '-' || *m_current == '+')
-          {
-            m_current++; // m_current is a signal, can increment directly.
-          }
+        in += sp * sizeof(rio2d::Script::Number);
+      }
 
-          if (!isdigit(*m_current))
-          {
-            raise(Errors::kMalformedNumber);
-            return;
-          }
+      return true;
+    }
 
-          do
-          {
-            m_current++; // m_current is a decimal digit, can increment directly.
-          } while (isdigit(*m_current));
-        }
+    // Starts a runner from a record that was already validated.
+    static bool restore(rio2d::ScriptBase* owner, const rio2d::Script::Subroutine* global, const rio2d::Script::Bytecode* bytecode, rio2d::Script::Address limit, const char*& in, const char* end, const rio2d::ScriptBase::IdToNode& toNode, cocos2d::Ref* listener, rio2d::Script::NotifyFunc port)
+    {
+      size_t bytes = size(owner->getConfig(), global->m_numLocals);
+      Pool* pool = reserve(getScriptAllocator(owner), bytes, 1);
 
-        m_length = m_current - m_lexeme;
-        m_token = Tokens::kNumberConst;
-        return;
+      if (pool == nullptr)
+      {
+        return false;
       }
 
-      if (*m_current == '"')
-      {
-        m_current++; // m_current is '"', can increment directly.
+      RunnerImpl* self = new (take(pool, sizeClass(bytes))) RunnerImpl();
+      self->layout(owner->getConfig());
+      self->m_owner = owner;
+      self->m_global = global;
+      self->m_vars = global->m_locals;
+      self->m_bytecode = bytecode;
+      self->m_listener = listener;
+      self->m_port = port;
+      self->setTag(tagOf(global->m_hash));
+      self->attach();
 
-        while (*m_current != 0 && *m_current != '\n')
-        {
-          if (*m_current == '"')
-          {
-            if (m_current[1] == '"')
-            {
-              m_current++;
-            }
-            else
-            {
-              break;
-            }
-          }
+      read(self, global, bytecode, limit, owner->getConfig(), in, end, toNode);
+      cocos2d::Node* target = (cocos2d::Node*)self->m_locals->m_pointer;
 
-          m_current++; // m_current cannot be the null terminator, can increment directly.
-        }
+      if (target == nullptr)
+      {
+        self->release();
+        return false;
+      }
 
-        if (*m_current != '"')
-        {
-          raise(Errors::kUnterminatedString);
-          return;
-        }
+      target->runAction(self);
+      self->release();
+      return true;
+    }
 
-        m_lexeme++;
-        m_length = m_current++ - m_lexeme; // m_current is '"', can increment directly.
-        m_token = Tokens::kStringConst;
-        m_hash = rio2d::hash(m_lexeme, m_length);
-        return;
-      }
+    void step(float dt)
+    {
+      m_time += dt;
+      wake(dt);
+
+      // Threads spawned in this step are appended after last, and only run in the next one.
+      Thread* last = m_last;
+      Thread* prev = nullptr;
+      Thread* thread = m_first;
 
-      switch (*m_current)
+      while (thread != nullptr)
       {
-      case '+':
-      case '-':
-      case '*':
-      case '/':
-      case '=':
-      case '.':
-      case ',':
-      case '(':
-      case ')':
-        m_length = 1;
-        m_token = *m_current++; // m_current cannot be the null terminator, can increment directly.
-        return;
+        thread->m_dt += dt;
 
-      case '<':
-        m_token = *m_current++; // m_current cannot be the null terminator, can increment directly.
+        bool done = consume(thread);
+        Thread* next = thread->m_next;
 
-        if (*m_current == '>')
+        if (done)
         {
-          m_current++; // m_current cannot be the null terminator, can increment directly.
-          m_token = Tokens::kNotEqual;
+          unlink(prev, thread);
+          thread->m_next = m_free;
+          m_free = thread;
+          m_numThreads--;
         }
-        else if (*m_current == '=')
+        else if (m_bytecode[thread->m_pc].m_insn == Insns::kPause)
         {
-          m_current++; // m_current cannot be the null terminator, can increment directly.
-          m_token = Tokens::kLessEqual;
+          unlink(prev, thread);
+          park(thread);
         }
-
-        m_length = m_current - m_lexeme;
-        return;
-
-      case '>':
-        m_token = *m_current++; // m_current cannot be the null terminator, can increment directly.
-
-        if (*m_current == '=')
+        else
         {
-          m_current++; // m_current cannot be the null terminator, can increment directly.
-          m_token = Tokens::kGreaterEqual;
+          prev = thread;
         }
 
-        m_length = m_current - m_lexeme;
-        return;
-
-      case '\'':
-        // Comment.
-        while (*m_current != '\n' && *m_current != 0) m_current++;
-
-        // Could be return next(...) since compilers do tail call optimization blah blah blah,
-        // but the optimization would be just a jump anyway, just like this goto here :P
-        goto again;
-      }
+        if (thread == last)
+        {
+          break;
+        }
 
-      if (*m_current == 0)
-      {
-        raise(Errors::kUnexpectedEOF);
-        return;
+        thread = next;
       }
-
-      raise(Errors::kInvalidCharacterInInput);
     }
 
-    void match(rio2d::Script::Token token)
+    void update(float time)
     {
-      if (m_token != token)
-      {
-        raise(Errors::kUnexpectedToken);
-        return;
-      }
-
-      match();
+      (void)time; // What should we do here???
     }
 
-    void emit(rio2d::Script::Insn insn, ...)
+    bool isDone() const
     {
-      va_list args;
-      va_start(args, insn);
-
-      m_emitter->emit(insn, args);
+      return m_numThreads == 0;
+    }
 
-      va_end(args);
+    bool isSnapshot(const rio2d::ScriptBase* owner, const RunnerImpl* runner) const
+    {
+      return (runner != nullptr ? this == runner : m_owner == owner) && m_numThreads != 0 && getTarget() != nullptr;
     }
 
-    void emitNodeVary(bool absolute, rio2d::Script::Index index)
+    size_t recordSize() const
     {
-      rio2d::Script::Index field = Fields::index(m_hash);
-      unsigned params;
+      size_t size = 2 * sizeof(uint32_t) + sizeof(m_time);
 
-      switch (field)
+      for (size_t i = 0; i < m_global->m_numLocals; i++)
       {
-      case Fields::kFadeinIndex:
-        field = Fields::kOpacityIndex;
-        emit(Insns::kPush, 0.0f);
-        emit(Insns::kPush, 255.0f);
-        params = 0;
-        break;
-
-      case Fields::kFadeoutIndex:
-        field = Fields::kOpacityIndex;
-        emit(Insns::kPush, 255.0f);
-        emit(Insns::kPush, 0.0f);
-        params = 0;
-        break;
-
-      case Fields::kFadetoIndex:
-        field = Fields::kOpacityIndex;
-        emit(Insns::kGetProp, index, field);
-        params = 1;
-        break;
-
-      case Fields::kRotatebyIndex:
-      case Fields::kRotatetoIndex:
-        field = Fields::kRotationIndex;
-        emit(Insns::kGetProp, index, field);
-        params = 1;
-        break;
-
-      case Fields::kScalebyIndex:
-      case Fields::kScaletoIndex:
-        field = Fields::kScaleIndex;
-        emit(Insns::kGetProp, index, field);
-        params = 1;
-        break;
-
-      case Fields::kMovebyIndex:
-      case Fields::kMovetoIndex:
-        field = Fields::kPositionIndex;
-        emit(Insns::kGetProp, index, Fields::kXIndex);
-        emit(Insns::kGetProp, index, Fields::kYIndex);
-        params = 2;
-        break;
-
-      case Fields::kSkewbyIndex:
-      case Fields::kSkewtoIndex:
-        field = Fields::kSkewIndex;
-        emit(Insns::kGetProp, index, Fields::kSkewxIndex);
-        emit(Insns::kGetProp, index, Fields::kSkewyIndex);
-        params = 2;
-        break;
-
-      case Fields::kTintbyIndex:
-      case Fields::kTinttoIndex:
-        field = Fields::kTintIndex;
-        emit(Insns::kGetProp, index, Fields::kRedIndex);
-        emit(Insns::kGetProp, index, Fields::kGreenIndex);
-        emit(Insns::kGetProp, index, Fields::kBlueIndex);
-        params = 3;
-        break;
+        size += m_vars[i].m_type == Tokens::kNumber || m_vars[i].m_type == Tokens::kNode ? sizeof(uint32_t) : sizeof(void*);
       }
 
-      match(Tokens::kIdentifier);
-      parseExpressions(params, Tokens::kNumber);
-      match(Tokens::kIn);
-
-      // Push the elapsed time.
-      emit(Insns::kPush, 0.0f);
+      const Thread* threads[rio2d::ScriptBase::kThreadsBound];
+      size_t count = gather(threads);
 
-      parseExpressions(1, Tokens::kNumber);
-      match(Tokens::kSecs);
-
-      rio2d::Script::Index ease = Easing::kLinearIndex;
-
-      if (m_token == Tokens::kWith)
+      for (size_t i = 0; i < count; i++)
       {
-        match();
-        ease = Easing::index(m_hash);
-
-        if (ease == -1)
-        {
-          raise(Errors::kUnknownEaseFunc);
-        }
-
-        match(Tokens::kIdentifier);
+        size += 3 * sizeof(uint32_t) + sizeof(double) + threads[i]->m_sp * sizeof(rio2d::Script::Number);
       }
 
-      emit(absolute ? Insns::kVaryAbs : Insns::kVaryRel, index, field, ease);
+      return size;
     }
 
-    void emitSetNodeProp(rio2d::Script::Index index)
+    void write(char*& out, const rio2d::ScriptBase::NodeToId& toId) const
     {
-      rio2d::Script::Index field = Fields::index(m_hash);
-      rio2d::Hash type;
-      rio2d::Script::Index frames;
-      int error;
+      uint32_t word = m_global->m_hash;
+      put(out, &word, sizeof(word));
+      word = (uint32_t)m_numThreads;
+      put(out, &word, sizeof(word));
+      put(out, &m_time, sizeof(m_time));
 
-      switch (field)
+      for (size_t i = 0; i < m_global->m_numLocals; i++)
       {
-      case Fields::kBboxheightIndex:
-      case Fields::kBboxwidthIndex:
-      case Fields::kBlueIndex:
-      case Fields::kGreenIndex:
-      case Fields::kHeightIndex:
-      case Fields::kOpacityIndex:
-      case Fields::kRedIndex:
-      case Fields::kRotationIndex:
-      case Fields::kScaleIndex:
-      case Fields::kSkewxIndex:
-      case Fields::kSkewyIndex:
-      case Fields::kWidthIndex:
-      case Fields::kXIndex:
-      case Fields::kYIndex:
-        match(Tokens::kIdentifier);
-        match('=');
-        parseExpressions(1, Tokens::kNumber);
-        emit(Insns::kSetProp, index, field);
-        break;
+        const rio2d::Script::Value* local = m_locals + i;
 
-      case Fields::kFlipxIndex:
-      case Fields::kFlipyIndex:
-      case Fields::kVisibleIndex:
-        match(Tokens::kIdentifier);
-        match('=');
-        parseExpressions(1, Tokens::kTrue);
-        emit(Insns::kSetProp, index, field);
-        break;
-
-      case Fields::kPlaceIndex:
-      case Fields::kSkewIndex:
-        match(Tokens::kIdentifier);
-        parseExpressions(2, Tokens::kNumber);
-        emit(Insns::kCallMethod, index, field);
-        break;
+        switch (m_vars[i].m_type)
+        {
+        case Tokens::kNumber:
+          put(out, &local->m_number, sizeof(local->m_number));
+          break;
 
-      case Fields::kSetframeIndex:
-        match(Tokens::kIdentifier);
-        error = m_emitter->getType(m_hash, &type);
+        case Tokens::kNode:
+          word = local->m_pointer != nullptr ? toId((cocos2d::Node*)local->m_pointer) : (uint32_t)kNullId;
+          put(out, &word, sizeof(word));
+          break;
 
-        if (error != Errors::kOk)
-        {
-          raise(Errors::kUnknownIdentifier);
-          return;
+        default:
+          put(out, &local->m_pointer, sizeof(local->m_pointer));
+          break;
         }
+      }
 
-        if (type != Tokens::kFrames)
-        {
-          raise(Errors::kTypeMismatch);
-          return;
-        }
+      const Thread* threads[rio2d::ScriptBase::kThreadsBound];
+      size_t count = gather(threads);
 
-        m_emitter->getIndex(m_hash, &frames);
-        match(Tokens::kIdentifier);
-        match(',');
-        parseExpressions(1, Tokens::kNumber);
-        emit(Insns::kSetFrame, index, frames);
-        break;
+      for (size_t i = 0; i < count; i++)
+      {
+        const Thread* thread = threads[i];
+        word = thread->m_pc;
+        put(out, &word, sizeof(word));
+        put(out, &thread->m_dt, sizeof(thread->m_dt));
+        word = thread->m_sp;
+        put(out, &word, sizeof(word));
+        put(out, &thread->m_wake, sizeof(thread->m_wake));
+        put(out, thread->m_stack, thread->m_sp * sizeof(rio2d::Script::Number));
+      }
+    }
 
-      case Fields::kTintIndex:
-        match(Tokens::kIdentifier);
-        parseExpressions(3, Tokens::kNumber);
-        emit(Insns::kCallMethod, index, field);
-        break;
+  protected:
+    // Points the threads to their stacks and the locals after them, with all the threads free.
+    void layout(const rio2d::ScriptBase::Config& config)
+    {
+      static_assert(rio2d::ScriptBase::kThreadsBound < 256, "Thread indices don't fit in the timer wheel");
 
-      case Fields::kMovebyIndex:
-      case Fields::kRotatebyIndex:
-      case Fields::kScalebyIndex:
-      case Fields::kSkewbyIndex:
-      case Fields::kTintbyIndex:
-        emitNodeVary(false, index);
-        break;
+      m_threads = (Thread*)(this + 1);
+      m_maxThreads = config.m_maxThreads;
+      m_first = m_last = nullptr;
+      m_free = m_threads;
+      m_numThreads = 0;
+      m_order = 0;
+      m_time = 0.0;
+      m_tick = 0;
+      m_numParked = 0;
+      memset(m_wheel, 0, sizeof(m_wheel));
 
-      case Fields::kFadeinIndex:
-      case Fields::kFadeoutIndex:
-      case Fields::kFadetoIndex:
-      case Fields::kMovetoIndex:
-      case Fields::kRotatetoIndex:
-      case Fields::kScaletoIndex:
-      case Fields::kSkewtoIndex:
-      case Fields::kTinttoIndex:
-        emitNodeVary(true, index);
-        break;
+      rio2d::Script::Number* stack = (rio2d::Script::Number*)(m_threads + m_maxThreads);
 
-      default:
-        raise(Errors::kUnknownField);
-        return;
+      for (size_t i = 0; i < m_maxThreads; i++, stack += config.m_maxStack)
+      {
+        m_threads[i].m_stack = stack;
+        m_threads[i].m_next = i + 1 < m_maxThreads ? m_threads + i + 1 : nullptr;
+        m_threads[i].m_wake = -1.0;
       }
+
+      m_locals = (rio2d::Script::Value*)((char*)this + align((char*)stack - (char*)this));
     }
 
-    void emitSetVec2Prop(rio2d::Script::Index index)
+    // Takes a free thread and appends it to the running ones, or parks it until wake if it's not negative. Returns nullptr
+    // if all the threads are in use.
+    Thread* addThread(double wake = -1.0)
     {
-      rio2d::Script::Index field = Fields::index(m_hash);
+      Thread* thread = m_free;
 
-      switch (field)
+      if (thread == nullptr)
       {
-      case Fields::kXIndex:
-      case Fields::kYIndex:
-        match(Tokens::kIdentifier);
-        match('=');
-        parseExpressions(1, Tokens::kNumber);
-        emit(Insns::kSetProp, index, field);
-        break;
-
-      default:
-        raise(Errors::kUnknownField);
-        return;
+        return nullptr;
       }
-    }
 
-    void emitSetSizeProp(rio2d::Script::Index index)
-    {
-      rio2d::Script::Index field = Fields::index(m_hash);
+      m_free = thread->m_next;
+      thread->m_next = nullptr;
+      thread->m_order = m_order++;
+      m_numThreads++;
 
-      switch (field)
+      if (wake >= 0.0)
       {
-      case Fields::kHeightIndex:
-      case Fields::kWidthIndex:
-        match(Tokens::kIdentifier);
-        match('=');
-        parseExpressions(1, Tokens::kNumber);
-        emit(Insns::kSetProp, index, field);
-        break;
+        thread->m_wake = wake;
+        m_numParked++;
+        schedule(thread);
+        return thread;
+      }
 
-      default:
-        raise(Errors::kUnknownField);
-        return;
+      if (m_last != nullptr)
+      {
+        m_last->m_next = thread;
+      }
+      else
+      {
+        m_first = thread;
       }
+
+      m_last = thread;
+      return thread;
     }
 
-    rio2d::Script::Token emitGetNodeProp(rio2d::Script::Index index)
+    // Unlinks thread from the running ones, prev is the one before it.
+    void unlink(Thread* prev, Thread* thread)
     {
-      rio2d::Script::Index field = Fields::index(m_hash);
-
-      switch (field)
+      if (prev != nullptr)
       {
-      case Fields::kBboxheightIndex:
-      case Fields::kBboxwidthIndex:
-      case Fields::kBlueIndex:
-      case Fields::kGreenIndex:
-      case Fields::kHeightIndex:
-      case Fields::kOpacityIndex:
-      case Fields::kRotationIndex:
-      case Fields::kScaleIndex:
-      case Fields::kSkewxIndex:
-      case Fields::kSkewyIndex:
-      case Fields::kWidthIndex:
-      case Fields::kXIndex:
-      case Fields::kYIndex:
-        match(Tokens::kIdentifier);
-        emit(Insns::kGetProp, index, field);
-        return Tokens::kNumber;
-
-      case Fields::kFlipxIndex:
-      case Fields::kFlipyIndex:
-      case Fields::kVisibleIndex:
-        match(Tokens::kIdentifier);
-        emit(Insns::kGetProp, index, field);
-        return Tokens::kTrue;
+        prev->m_next = thread->m_next;
+      }
+      else
+      {
+        m_first = thread->m_next;
+      }
 
-      default:
-        return raise(Errors::kUnknownField);
+      if (m_last == thread)
+      {
+        m_last = prev;
       }
     }
 
-    rio2d::Script::Token emitGetVec2Prop(rio2d::Script::Index index)
+    // Handles wrapping around, threads are started far less than 2^31 apart.
+    static bool before(const Thread* a, const Thread* b)
     {
-      rio2d::Script::Index field = Fields::index(m_hash);
+      return (int32_t)(a->m_order - b->m_order) < 0;
+    }
 
-      switch (field)
-      {
-      case Fields::kXIndex:
-      case Fields::kYIndex:
-        match(Tokens::kIdentifier);
-        emit(Insns::kGetProp, index, field);
-        return Tokens::kNumber;
+    // Links a woken up thread back in the running ones, where it was when it was parked.
+    void relink(Thread* thread)
+    {
+      Thread* prev = nullptr;
+      Thread* next = m_first;
 
-      default:
-        return raise(Errors::kUnknownField);
+      while (next != nullptr && before(next, thread))
+      {
+        prev = next;
+        next = next->m_next;
       }
-    }
 
-    rio2d::Script::Token emitGetSizeProp(rio2d::Script::Index index)
-    {
-      rio2d::Script::Index field = Fields::index(m_hash);
+      thread->m_next = next;
 
-      switch (field)
+      if (prev != nullptr)
+      {
+        prev->m_next = thread;
+      }
+      else
       {
-      case Fields::kHeightIndex:
-      case Fields::kWidthIndex:
-        match(Tokens::kIdentifier);
-        emit(Insns::kGetProp, index, field);
-        return Tokens::kNumber;
+        m_first = thread;
+      }
 
-      default:
-        return raise(Errors::kUnknownField);
+      if (next == nullptr)
+      {
+        m_last = thread;
       }
     }
 
-    rio2d::Script::Token emitGetFramesProp(rio2d::Script::Index index)
+    // Collects all the threads in the order they run, including the parked ones, and returns how many there are.
+    size_t gather(const Thread** threads) const
     {
-      rio2d::Script::Index field = Fields::index(m_hash);
+      size_t count = 0;
 
-      switch (field)
+      for (const Thread* thread = m_first; thread != nullptr; thread = thread->m_next)
       {
-      case Fields::kLengthIndex:
-        match(Tokens::kIdentifier);
-        emit(Insns::kGetProp, index, field);
-        return Tokens::kNumber;
-
-      default:
-        return raise(Errors::kUnknownField);
+        threads[count++] = thread;
       }
-    }
 
-    void parse()
-    {
-      while (m_token == Tokens::kSub)
+      for (size_t i = 0; i < m_maxThreads; i++)
       {
-        parseSub();
+        const Thread* thread = m_threads + i;
+
+        if (thread->m_wake >= 0.0)
+        {
+          size_t j = count++;
+
+          for (; j > 0 && before(thread, threads[j - 1]); j--)
+          {
+            threads[j] = threads[j - 1];
+          }
+
+          threads[j] = thread;
+        }
       }
 
-      match(Tokens::kEof);
+      return count;
+    }
+
+    // The time left in the pause of a parked thread.
+    rio2d::Script::Number remaining(const Thread* thread) const
+    {
+      return (rio2d::Script::Number)(thread->m_wake - m_time);
     }
 
-    void parseSub()
+    // Parks a thread sleeping in a pause, the time left is at the top of its stack.
+    void park(Thread* thread)
     {
-      match();
+      thread->m_wake = m_time + std::max(thread->m_stack[thread->m_sp - 1], 0.0f);
+      m_numParked++;
+      schedule(thread);
+    }
 
-      m_emitter->addGlobal(m_hash);
-      match(Tokens::kIdentifier);
+    void schedule(Thread* thread)
+    {
+      // Threads due after the last level are rescheduled when they get to it.
+      double ticks = ::floor(thread->m_wake * kTicksPerSecond) - m_tick;
+      uint32_t delta = ticks <= 0.0 ? 0 : ticks >= kWheelTicks ? kWheelTicks - 1 : (uint32_t)ticks;
+      uint32_t tick = m_tick + delta;
+      unsigned level = 0;
 
-      match('(');
+      while (level < kWheelLevels - 1 && delta >= 1U << (kWheelBits * (level + 1)))
+      {
+        level++;
+      }
 
-      rio2d::Hash hash = m_hash;
-      match(Tokens::kIdentifier);
+      uint8_t* head = &m_wheel[level][(tick >> (kWheelBits * level)) & (kWheelSlots - 1)];
+      thread->m_next = *head != 0 ? m_threads + *head - 1 : nullptr;
+      *head = (uint8_t)(thread - m_threads + 1);
+    }
 
-      match(Tokens::kAs);
+    // Takes the threads in a slot of the wheel.
+    Thread* takeSlot(unsigned level, unsigned slot)
+    {
+      uint8_t* head = &m_wheel[level][slot];
+      Thread* thread = *head != 0 ? m_threads + *head - 1 : nullptr;
+      *head = 0;
+      return thread;
+    }
 
-      rio2d::Hash type = m_token;
+    // Moves the parked threads that are due to the running ones. The pause they're in is left with at most dt seconds, so
+    // it ends in this step.
+    void wake(float dt)
+    {
+      uint32_t now = (uint32_t)(m_time * kTicksPerSecond);
 
-      if (type != Tokens::kNode)
+      if (m_numParked == 0)
       {
-        raise(Errors::kFirstParamNotANode);
+        m_tick = now;
         return;
       }
 
-      match();
-      m_emitter->addLocal(hash, type);
-
-      while (m_token == ',')
+      for (;;)
       {
-        match();
+        // All the threads in past ticks are due, the ones in this tick may not be yet.
+        Thread* thread = takeSlot(0, m_tick & (kWheelSlots - 1));
 
-        hash = m_hash;
-        match(Tokens::kIdentifier);
+        while (thread != nullptr)
+        {
+          Thread* next = thread->m_next;
 
-        match(Tokens::kAs);
+          if (m_tick < now || thread->m_wake <= m_time)
+          {
+            thread->m_stack[thread->m_sp - 1] = std::min(remaining(thread) + dt, dt);
+            thread->m_wake = -1.0;
+            m_numParked--;
+            relink(thread);
+          }
+          else
+          {
+            schedule(thread);
+          }
 
-        type = m_token;
+          thread = next;
+        }
 
-        switch (type)
+        if (m_tick == now || m_numParked == 0)
         {
-        case Tokens::kFrames:
-        case Tokens::kNode:
-        case Tokens::kNumber:
-        case Tokens::kSize:
-        case Tokens::kVec2:
-          match();
-          m_emitter->addLocal(hash, type);
-          break;
-
-        default:
-          raise(Errors::kUnknownType);
+          m_tick = now;
           return;
         }
-      }
 
-      match(')');
+        m_tick++;
 
-      for (;;)
-      {
-        switch (m_token)
+        // Move the threads in the slots that start at this tick down, from the top level.
+        unsigned level = 1;
+
+        while (level < kWheelLevels && (m_tick & ((1U << (kWheelBits * level)) - 1)) == 0)
         {
-        case Tokens::kFor:        parseFor(); break;
-        case Tokens::kForever:    parseForever(); goto out; // Forever can only be the last statement in a define.
-        case Tokens::kIdentifier: parseAssign(); break;
-        case Tokens::kIf:         parseIf(); break;
-        case Tokens::kParallel:   parseParallel(); break;
-        case Tokens::kPause:      parsePause(); break;
-        case Tokens::kRepeat:     parseRepeat(); break;
-        case Tokens::kSequence:   parseSequence(); break;
-        case Tokens::kSignal:     parseSignal(); break;
-        case Tokens::kWhile:      parseWhile(); break;
-        default:                  emit(Insns::kStop); goto out; // Let match(kEnd) raise the error, if any.
+          level++;
         }
-      }
 
-    out:
-      match(Tokens::kEnd);
+        while (--level != 0)
+        {
+          thread = takeSlot(level, (m_tick >> (kWheelBits * level)) & (kWheelSlots - 1));
+
+          while (thread != nullptr)
+          {
+            Thread* next = thread->m_next;
+            schedule(thread);
+            thread = next;
+          }
+        }
+      }
     }
 
-    void parseFor()
+    void init(rio2d::ScriptBase* owner, const rio2d::Script::Subroutine* global, const rio2d::Script::Bytecode* bytecode, cocos2d::Ref* listener, rio2d::Script::NotifyFunc port, cocos2d::Node* target, const rio2d::Script::Argument* args)
     {
-      match();
+      layout(owner->getConfig());
+      m_global = global;
+      m_vars = global->m_locals;
 
-      rio2d::Hash hash = m_hash;
-      match(Tokens::kIdentifier);
-      match('=');
+      m_bytecode = bytecode;
+      setTag(tagOf(global->m_hash));
 
-      parseExpressions(1, Tokens::kNumber);
+      Thread* thread = addThread();
+      thread->m_pc = global->m_pc;
+      thread->m_dt = 0.0f;
+      thread->m_sp = 0;
 
-      rio2d::Script::Token idType;
-      Errors::Enum error = m_emitter->getType(hash, &idType);
+      m_listener = listener;
+      m_port = port;
 
-      if (error == Errors::kUnknownIdentifier)
-      {
-        m_emitter->addLocal(hash, Tokens::kNumber);
-      }
-      else if (error == Errors::kOk)
+      // Only the parameters are passed in, the other locals are set by the subroutine.
+      rio2d::Script::Value* local = m_locals;
+      const rio2d::Script::Value* end = local + global->m_numParams;
+
+      local->m_pointer = target;
+      local++;
+
+      // The arguments were already checked against the parameters.
+      while (local < end)
       {
-        if (idType != Tokens::kNumber)
+        if (args->m_type == Tokens::kNumber)
         {
-          raise(Errors::kTypeMismatch);
-          return;
+          local->m_number = args->m_number;
+        }
+        else
+        {
+          local->m_pointer = args->m_pointer;
         }
-      }
-      else
-      {
-        raise(error);
-        return;
-      }
-
-      rio2d::Script::Index index;
-      error = m_emitter->getIndex(hash, &index);
 
-      if (error != Errors::kOk)
-      {
-        raise(error);
-        return;
+        local++;
+        args++;
       }
 
-      emit(Insns::kSetLocal, index);
+      memset(local, 0, (global->m_numLocals - global->m_numParams) * sizeof(rio2d::Script::Value));
+      m_owner = owner;
+    }
 
-      match(Tokens::kTo);
-      parseExpressions(1, Tokens::kNumber);
+    bool add(Thread* thread)
+    {
+      thread->m_stack[thread->m_sp - 2] += thread->m_stack[thread->m_sp - 1];
+      thread->m_sp--;
+      return true; // Continue running
+    }
 
-      if (m_token == Tokens::kStep)
-      {
-        match();
-        parseExpressions(1, Tokens::kNumber);
-      }
-      else
+    void callNodeMethod(Thread* thread, cocos2d::Node* target, rio2d::Script::Index index)
+    {
+      cocos2d::Color3B c;
+
+      switch (index)
       {
-        emit(Insns::kPush, 1.0f);
-      }
+      case Fields::kTintIndex:
+        c.r = (GLubyte)thread->m_stack[thread->m_sp - 3];
+        c.g = (GLubyte)thread->m_stack[thread->m_sp - 2];
+        c.b = (GLubyte)thread->m_stack[thread->m_sp - 1];
+        target->setColor(c);
+        thread->m_sp -= 3;
+        break;
 
-      rio2d::Script::Address again = m_emitter->getPC();
+      case Fields::kPlaceIndex:
+        target->setPosition(thread->m_stack[thread->m_sp - 2], thread->m_stack[thread->m_sp - 1]);
+        thread->m_sp -= 2;
+        break;
 
-      for (;;)
-      {
-        switch (m_token)
-        {
-        case Tokens::kFor:        parseFor(); break;
-        case Tokens::kForever:    parseForever(); goto out; // Forever can only be the last statement in a "forever" sequence.
-        case Tokens::kIdentifier: parseAssign(); break;
-        case Tokens::kIf:         parseIf(); break;
-        case Tokens::kParallel:   parseParallel(); break;
-        case Tokens::kPause:      parsePause(); break;
-        case Tokens::kRepeat:     parseRepeat(); break;
-        case Tokens::kSequence:   parseSequence(); break;
-        case Tokens::kSignal:     parseSignal(); break;
-        case Tokens::kWhile:      parseWhile(); break;
-        default:                  goto out; // Let match(kNext) raise the error, if any.
-        }
+      case Fields::kSkewIndex:
+        target->setSkewX(thread->m_stack[thread->m_sp - 2]);
+        target->setSkewY(thread->m_stack[thread->m_sp - 1]);
+        thread->m_sp -= 2;
+        break;
       }
-
-    out:
-      match(Tokens::kNext);
-      emit(Insns::kNext, index, again);
     }
 
-    void parseForever()
+    bool callMethod(Thread* thread)
     {
-      match();
-
-      rio2d::Script::Address again = m_emitter->getPC();
+      rio2d::Script::Index var = m_bytecode[thread->m_pc++].m_index;
+      rio2d::Script::Index index = m_bytecode[thread->m_pc++].m_index;
+      rio2d::Script::Value* local = m_locals + var;
 
-      for (;;)
+      switch (m_vars[var].m_type)
       {
-        switch (m_token)
-        {
-        case Tokens::kFor:        parseFor(); break;
-        case Tokens::kForever:    parseForever(); goto out; // Forever can only be the last statement in a "forever" sequence.
-        case Tokens::kIdentifier: parseAssign(); break;
-        case Tokens::kIf:         parseIf(); break;
-        case Tokens::kParallel:   parseParallel(); break;
-        case Tokens::kPause:      parsePause(); break;
-        case Tokens::kRepeat:     parseRepeat(); break;
-        case Tokens::kSequence:   parseSequence(); break;
-        case Tokens::kSignal:     parseSignal(); break;
-        case Tokens::kWhile:      parseWhile(); break;
-        default:                  goto out; // Let match(kEnd) raise the error, if any.
-        }
+      case Tokens::kNode:
+        callNodeMethod(thread, (cocos2d::Node*)local->m_pointer, index);
+        break;
+
+      default:
+        CCASSERT(0, "Unknown object type");
       }
 
-    out:
-      match(Tokens::kEnd);
-      emit(Insns::kJump, again);
+      return true;
     }
 
-    void parseParallel()
+    bool ceil(Thread* thread)
     {
-      match();
+      thread->m_stack[thread->m_sp - 1] = ::ceil(thread->m_stack[thread->m_sp - 1]);
+      return true;
+    }
 
-      rio2d::Script::Address patch = m_emitter->getPC();
-      emit(Insns::kJump, 0);
+    bool cmpEqual(Thread* thread)
+    {
+      thread->m_stack[thread->m_sp - 2] = thread->m_stack[thread->m_sp - 2] == thread->m_stack[thread->m_sp - 1];
+      thread->m_sp--;
+      return true;
+    }
 
-      rio2d::Script::Address entries[rio2d::Script::kMaxThreads - 1]; // One thread must be available to spawn the others.
-      size_t count = 0;
+    bool cmpGreater(Thread* thread)
+    {
+      thread->m_stack[thread->m_sp - 2] = thread->m_stack[thread->m_sp - 2] > thread->m_stack[thread->m_sp - 1];
+      thread->m_sp--;
+      return true;
+    }
 
-      for (;;)
-      {
-        switch (m_token)
-        {
-        case Tokens::kForever:
-        case Tokens::kParallel:
-        case Tokens::kRepeat:
-        case Tokens::kSequence:
-          if (count == sizeof(entries) / sizeof(entries[0]))
-          {
-            raise(Errors::kOutOfMemory);
-            return;
-          }
+    bool cmpGreaterEqual(Thread* thread)
+    {
+      thread->m_stack[thread->m_sp - 2] = thread->m_stack[thread->m_sp - 2] >= thread->m_stack[thread->m_sp - 1];
+      thread->m_sp--;
+      return true;
+    }
 
-          entries[count++] = m_emitter->getPC();
-        }
+    bool cmpLess(Thread* thread)
+    {
+      thread->m_stack[thread->m_sp - 2] = thread->m_stack[thread->m_sp - 2] < thread->m_stack[thread->m_sp - 1];
+      thread->m_sp--;
+      return true;
+    }
 
-        switch (m_token)
-        {
-        case Tokens::kForever:  parseForever(); break;
-        case Tokens::kParallel: parseParallel(); emit(Insns::kStop); break;
-        case Tokens::kSequence: parseSequence(); emit(Insns::kStop); break;
-        default:                goto out; // Let match(kEnd) raise the error, if any.
-        }
-      }
+    bool cmpLessEqual(Thread* thread)
+    {
+      thread->m_stack[thread->m_sp - 2] = thread->m_stack[thread->m_sp - 2] <= thread->m_stack[thread->m_sp - 1];
+      thread->m_sp--;
+      return true;
+    }
 
-    out:
-      match(Tokens::kEnd);
+    bool cmpNotEqual(Thread* thread)
+    {
+      thread->m_stack[thread->m_sp - 2] = thread->m_stack[thread->m_sp - 2] != thread->m_stack[thread->m_sp - 1];
+      thread->m_sp--;
+      return true;
+    }
 
-      rio2d::Script::Bytecode bc;
-      bc.m_address = m_emitter->getPC();
-      m_emitter->patch(patch + 1, bc);
+    bool div(Thread* thread)
+    {
+      thread->m_stack[thread->m_sp - 2] /= thread->m_stack[thread->m_sp - 1];
+      thread->m_sp--;
+      return true;
+    }
 
-      for (size_t i = 0; i < count; i++)
-      {
-        emit(Insns::kSpawn, entries[i]);
-      }
+    bool floor(Thread* thread)
+    {
+      thread->m_stack[thread->m_sp - 1] = ::floor(thread->m_stack[thread->m_sp - 1]);
+      return true;
     }
 
-    void parseRepeat()
+    bool getLocal(Thread* thread)
     {
-      match();
+      rio2d::Script::Value* local = m_locals + m_bytecode[thread->m_pc++].m_index;
+      thread->m_stack[thread->m_sp++] = local->m_number;
+      return true;
+    }
 
-      rio2d::Script::Address again = m_emitter->getPC();
+    void getNodeProp(Thread* thread, cocos2d::Node* obj, rio2d::Script::Index field)
+    {
+      float value;
 
-      for (;;)
+      switch (field)
       {
-        switch (m_token)
-        {
-        case Tokens::kFor:        parseFor(); break;
-        case Tokens::kForever:    parseForever(); goto out; // Forever can only be the last statement in a sequence.
-        case Tokens::kIdentifier: parseAssign(); break;
-        case Tokens::kIf:         parseIf(); break;
-        case Tokens::kParallel:   parseParallel(); break;
-        case Tokens::kPause:      parsePause(); break;
-        case Tokens::kRepeat:     parseRepeat(); break;
-        case Tokens::kSequence:   parseSequence(); break;
-        case Tokens::kSignal:     parseSignal(); break;
-        case Tokens::kWhile:      parseWhile(); break;
-        default:                  goto out; // Let match(kUntil) raise the error, if any.
-        }
+      case Fields::kBboxheightIndex: value = obj->getBoundingBox().size.height; break;
+      case Fields::kBboxwidthIndex:  value = obj->getBoundingBox().size.width; break;
+      case Fields::kBlueIndex:       value = (float)obj->getColor().b; break;
+      case Fields::kGreenIndex:      value = (float)obj->getColor().g; break;
+      case Fields::kFlipxIndex:      value = dynamic_cast<cocos2d::Sprite*>(obj)->isFlippedX() ? 1.0f : 0.0f; break;
+      case Fields::kFlipyIndex:      value = dynamic_cast<cocos2d::Sprite*>(obj)->isFlippedY() ? 1.0f : 0.0f; break;
+      case Fields::kHeightIndex:     value = obj->getContentSize().height; break;
+      case Fields::kOpacityIndex:    value = obj->getOpacity(); break;
+      case Fields::kRedIndex:        value = (float)obj->getColor().r; break;
+      case Fields::kRotationIndex:   value = obj->getRotation(); break;
+      case Fields::kScaleIndex:      value = obj->getScale(); break;
+      case Fields::kSkewxIndex:      value = obj->getSkewX(); break;
+      case Fields::kSkewyIndex:      value = obj->getSkewY(); break;
+      case Fields::kWidthIndex:      value = obj->getContentSize().width; break;
+      case Fields::kXIndex:          value = obj->getPositionX(); break;
+      case Fields::kYIndex:          value = obj->getPositionY(); break;
+      case Fields::kVisibleIndex:    value = obj->isVisible() ? 1.0f : 0.0f; break;
+      default:                       CCASSERT(0, "Unknown property for Node instance");
       }
 
-    out:
-      match(Tokens::kUntil);
-      parseExpressions(1, Tokens::kTrue);
-      emit(Insns::kJz, again);
+      thread->m_stack[thread->m_sp++] = value;
     }
 
-    void parseSequence()
+    void getVec2Prop(Thread* thread, cocos2d::Vec2* obj, rio2d::Script::Index field)
     {
-      match();
+      float value;
 
-      for (;;)
+      switch (field)
       {
-        switch (m_token)
-        {
-        case Tokens::kFor:        parseFor(); break;
-        case Tokens::kForever:    parseForever(); goto out; // Forever can only be the last statement in a sequence.
-        case Tokens::kIdentifier: parseAssign(); break;
-        case Tokens::kIf:         parseIf(); break;
-        case Tokens::kParallel:   parseParallel(); break;
-        case Tokens::kPause:      parsePause(); break;
-        case Tokens::kRepeat:     parseRepeat(); break;
-        case Tokens::kSequence:   parseSequence(); break;
-        case Tokens::kSignal:     parseSignal(); break;
-        case Tokens::kWhile:      parseWhile(); break;
-        default:                  goto out; // Let match(kEnd) raise the error, if any.
-        }
+      case Fields::kXIndex: value = obj->x; break;
+      case Fields::kYIndex: value = obj->y; break;
+      default:              CCASSERT(0, "Unknown property for Vec2 instance");
       }
 
-    out:
-      match(Tokens::kEnd);
+      thread->m_stack[thread->m_sp++] = value;
     }
 
-    void parseWhile()
+    void getSizeProp(Thread* thread, cocos2d::Size* obj, rio2d::Script::Index field)
     {
-      match();
-
-      rio2d::Script::Address again = m_emitter->getPC();
-
-      parseExpressions(1, Tokens::kTrue);
-      rio2d::Script::Address patch = m_emitter->getPC();
-      emit(Insns::kJz, 0);
+      float value;
 
-      for (;;)
+      switch (field)
       {
-        switch (m_token)
-        {
-        case Tokens::kFor:        parseFor(); break;
-        case Tokens::kForever:    parseForever(); goto out; // Forever can only be the last statement in a sequence.
-        case Tokens::kIdentifier: parseAssign(); break;
-        case Tokens::kIf:         parseIf(); break;
-        case Tokens::kParallel:   parseParallel(); break;
-        case Tokens::kPause:      parsePause(); break;
-        case Tokens::kRepeat:     parseRepeat(); break;
-        case Tokens::kSequence:   parseSequence(); break;
-        case Tokens::kSignal:     parseSignal(); break;
-        case Tokens::kWhile:      parseWhile(); break;
-        default:                  goto out; // Let match(kEnd) raise the error, if any.
-        }
+      case Fields::kHeightIndex: value = obj->height; break;
+      case Fields::kWidthIndex:  value = obj->width; break;
+      default:                   CCASSERT(0, "Unknown property for Size instance");
       }
 
-    out:
-      match(Tokens::kEnd);
-      emit(Insns::kJump, again);
-
-      rio2d::Script::Bytecode bc;
-      bc.m_address = m_emitter->getPC();
-      m_emitter->patch(patch + 1, bc);
+      thread->m_stack[thread->m_sp++] = value;
     }
 
-    void parseAssign()
+    void getFramesProp(Thread* thread, rio2d::Script::Frames* obj, rio2d::Script::Index field)
     {
-      rio2d::Hash hash = m_hash;
-      match(Tokens::kIdentifier);
+      float value;
 
-      if (m_token == '=')
+      switch (field)
       {
-        match();
-
-        rio2d::Script::Token type = parseExpression();
-
-        rio2d::Script::Token idType;
-        Errors::Enum error = m_emitter->getType(hash, &idType);
-
-        if (error == Errors::kUnknownIdentifier)
-        {
-          m_emitter->addLocal(hash, type);
-        }
-        else if (error == Errors::kOk)
-        {
-          if (idType != type)
-          {
-            raise(Errors::kTypeMismatch);
-            return;
-          }
-        }
-        else
-        {
-          raise(error);
-          return;
-        }
+      case Fields::kLengthIndex: value = (float)obj->size(); break;
+      default:                   CCASSERT(0, "Unknown property for Frames instance");
+      }
 
-        rio2d::Script::Index index;
-        error = m_emitter->getIndex(hash, &index);
+      thread->m_stack[thread->m_sp++] = value;
+    }
 
-        if (error != Errors::kOk)
-        {
-          raise(error);
-          return;
-        }
+    bool getProp(Thread* thread)
+    {
+      rio2d::Script::Index var = m_bytecode[thread->m_pc++].m_index;
+      rio2d::Script::Index field = m_bytecode[thread->m_pc++].m_index;
+      rio2d::Script::Value* local = m_locals + var;
 
-        emit(Insns::kSetLocal, index);
-      }
-      else
+      switch (m_vars[var].m_type)
       {
-        rio2d::Script::Token type;
-        Errors::Enum error = m_emitter->getType(hash, &type);
-
-        if (error != Errors::kOk)
-        {
-          raise(error);
-          return;
-        }
+      case Tokens::kNode:
+        getNodeProp(thread, (cocos2d::Node*)local->m_pointer, field);
+        break;
 
-        rio2d::Script::Index index;
-        error = m_emitter->getIndex(hash, &index);
+      case Tokens::kSize:
+        getSizeProp(thread, (cocos2d::Size*)local->m_pointer, field);
+        break;
 
-        if (error != Errors::kOk)
-        {
-          raise(error);
-          return;
-        }
+      case Tokens::kVec2:
+        getVec2Prop(thread, (cocos2d::Vec2*)local->m_pointer, field);
+        break;
 
-        match('.');
+      case Tokens::kFrames:
+        getFramesProp(thread, (rio2d::Script::Frames*)local->m_pointer, field);
+        break;
 
-        switch (type)
-        {
-        case Tokens::kNode: emitSetNodeProp(index); break;
-        case Tokens::kVec2: emitSetVec2Prop(index); break;
-        case Tokens::kSize: emitSetSizeProp(index); break;
-        }
+      default:
+        CCASSERT(0, "Unknown object type");
       }
+
+      return true;
     }
 
-    void parseIf()
+    bool jump(Thread* thread)
     {
-      match();
-
-      parseExpressions(1, Tokens::kTrue);
-      match(Tokens::kThen);
-
-      rio2d::Script::Address patch = m_emitter->getPC();
-      emit(Insns::kJz, 0);
-
-      // then
-      for (;;)
-      {
-        switch (m_token)
-        {
-        case Tokens::kFor:        parseFor(); break;
-        case Tokens::kForever:    parseForever(); goto out; // Forever can only be the last statement in a sequence.
-        case Tokens::kIdentifier: parseAssign(); break;
-        case Tokens::kIf:         parseIf(); break;
-        case Tokens::kParallel:   parseParallel(); break;
-        case Tokens::kPause:      parsePause(); break;
-        case Tokens::kRepeat:     parseRepeat(); break;
-        case Tokens::kSequence:   parseSequence(); break;
-        case Tokens::kSignal:     parseSignal(); break;
-        case Tokens::kWhile:      parseWhile(); break;
-        default:                  goto out; // Let match(kEnd) raise the error, if any.
-        }
-      }
+      thread->m_pc = m_bytecode[thread->m_pc].m_address;
+      return true;
+    }
 
-    out:
-      if (m_token == Tokens::kEnd)
+    bool jz(Thread* thread)
+    {
+      if (thread->m_stack[--thread->m_sp] == 0.0f)
       {
-        // No else, finish the 'if'.
-        rio2d::Script::Bytecode bc;
-        bc.m_address = m_emitter->getPC();
-        m_emitter->patch(patch + 1, bc);
+        thread->m_pc = m_bytecode[thread->m_pc].m_address;
       }
       else
       {
-        match(Tokens::kElse);
-
-        rio2d::Script::Address patch2 = m_emitter->getPC();
-        emit(Insns::kJump, 0);
-
-        rio2d::Script::Bytecode bc;
-        bc.m_address = m_emitter->getPC();
-        m_emitter->patch(patch + 1, bc);
-
-        // else
-        for (;;)
-        {
-          switch (m_token)
-          {
-          case Tokens::kFor:        parseFor(); break;
-          case Tokens::kForever:    parseForever(); goto out2; // Forever can only be the last statement in a sequence.
-          case Tokens::kIdentifier: parseAssign(); break;
-          case Tokens::kIf:         parseIf(); break;
-          case Tokens::kParallel:   parseParallel(); break;
-          case Tokens::kPause:      parsePause(); break;
-          case Tokens::kRepeat:     parseRepeat(); break;
-          case Tokens::kSequence:   parseSequence(); break;
-          case Tokens::kSignal:     parseSignal(); break;
-          case Tokens::kWhile:      parseWhile(); break;
-          default:                  goto out2; // Let match(kEnd) raise the error, if any.
-          }
-        }
-
-      out2:
-        bc.m_address = m_emitter->getPC();
-        m_emitter->patch(patch2 + 1, bc);
+        thread->m_pc++;
       }
 
-      match(Tokens::kEnd);
+      return true;
     }
 
-    void parseSignal()
+    bool logicalAnd(Thread* thread)
     {
-      match();
-      rio2d::Hash hash = m_hash;
-      match(Tokens::kStringConst);
-      emit(Insns::kSignal, hash);
+      thread->m_stack[thread->m_sp - 2] = thread->m_stack[thread->m_sp - 2] != 0.0f && thread->m_stack[thread->m_sp - 1] != 0.0f;
+      thread->m_sp--;
+      return true;
     }
 
-    void parsePause()
+    bool logicalNot(Thread* thread)
     {
-      match();
-      parseExpressions(1, Tokens::kNumber);
-      match(Tokens::kSecs);
-
-      emit(Insns::kPause);
+      thread->m_stack[thread->m_sp - 1] = thread->m_stack[thread->m_sp - 1] != 0.0f ? 0.0f : 1.0f;
+      return true;
     }
 
-    void parseExpressions(unsigned count, rio2d::Script::Token type)
+    bool logicalOr(Thread* thread)
     {
-      if (count != 0)
-      {
-        if (parseExpression() != type)
-        {
-          raise(Errors::kTypeMismatch);
-          return;
-        }
-
-        while (--count != 0)
-        {
-          match(',');
+      thread->m_stack[thread->m_sp - 2] = thread->m_stack[thread->m_sp - 2] != 0.0f || thread->m_stack[thread->m_sp - 1] != 0.0f;
+      thread->m_sp--;
+      return true;
+    }
 
-          if (parseExpression() != type)
-          {
-            raise(Errors::kTypeMismatch);
-            return;
-          }
-        }
-      }
+    bool modulus(Thread* thread)
+    {
+      thread->m_stack[thread->m_sp - 2] = fmod(thread->m_stack[thread->m_sp - 2], thread->m_stack[thread->m_sp - 1] != 0.0f);
+      thread->m_sp--;
+      return true;
     }
 
-    rio2d::Script::Token parseExpression()
+    bool mul(Thread* thread)
     {
-      return parseLogicalOr();
+      thread->m_stack[thread->m_sp - 2] *= thread->m_stack[thread->m_sp - 1];
+      thread->m_sp--;
+      return true;
     }
 
-    rio2d::Script::Token parseLogicalOr()
+    bool neg(Thread* thread)
     {
-      rio2d::Script::Token type1 = parseLogicalAnd();
+      thread->m_stack[thread->m_sp - 1] = -thread->m_stack[thread->m_sp - 1];
+      return true;
+    }
 
-      while (m_token == Tokens::kOr)
+    bool next(Thread* thread)
+    {
+      struct Next
       {
-        match();
+        rio2d::Script::Number m_limit;
+        rio2d::Script::Number m_step;
+      };
 
-        rio2d::Script::Token type2 = parseLogicalAnd();
+      rio2d::Script::Value* local = m_locals + m_bytecode[thread->m_pc].m_index;
+      Next* args = (Next*)((char*)(thread->m_stack + thread->m_sp) - sizeof(Next));
 
-        if (type1 == Tokens::kTrue && type2 == Tokens::kTrue)
-        {
-          emit(Insns::kLogicalOr);
-        }
-        else
-        {
-          return raise(Errors::kTypeMismatch);
-        }
+      local->m_number += args->m_step;
+
+      if (local->m_number <= args->m_limit)
+      {
+        thread->m_pc = m_bytecode[thread->m_pc + 1].m_address;
+      }
+      else
+      {
+        thread->m_sp -= 2;
+        thread->m_pc += 2;
       }
 
-      return type1;
+      return true;
     }
 
-    rio2d::Script::Token parseLogicalAnd()
+    bool pause(Thread* thread)
     {
-      rio2d::Script::Token type1 = parseRelational();
+      float time = thread->m_stack[thread->m_sp - 1] -= thread->m_dt;
 
-      while (m_token == Tokens::kAnd)
+      if (time > 0.0f)
       {
-        match();
-
-        rio2d::Script::Token type2 = parseRelational();
-
-        if (type1 == Tokens::kTrue && type2 == Tokens::kTrue)
-        {
-          emit(Insns::kLogicalAnd);
-        }
-        else
-        {
-          return raise(Errors::kTypeMismatch);
-        }
+        return false; // Put this thread to sleep.
       }
 
-      return type1;
+      thread->m_dt = -time;
+      thread->m_sp--;
+      return true;
     }
 
-    rio2d::Script::Token parseRelational()
+    bool push(Thread* thread)
     {
-      rio2d::Script::Token type1 = parseTerm();
-
-      while (m_token == '=' || m_token == '<' || m_token == '>' || m_token == Tokens::kNotEqual || m_token == Tokens::kLessEqual || m_token == Tokens::kGreaterEqual)
-      {
-        rio2d::Script::Token op = m_token;
-        match();
+      thread->m_stack[thread->m_sp++] = m_bytecode[thread->m_pc++].m_number;
+      return true;
+    }
 
-        rio2d::Script::Token type2 = parseTerm();
+    inline float rnd()
+    {
+      return (float)::rand() / (float)(RAND_MAX + 1);
+    }
 
-        if (type1 == Tokens::kNumber && type2 == Tokens::kNumber)
-        {
-          switch (op)
-          {
-          case '=':                   emit(Insns::kCmpEqual); break;
-          case '<':                   emit(Insns::kCmpLess);  break;
-          case '>':                   emit(Insns::kCmpGreater); break;
-          case Tokens::kNotEqual:     emit(Insns::kCmpNotEqual); break;
-          case Tokens::kLessEqual:    emit(Insns::kCmpLessEqual); break;
-          case Tokens::kGreaterEqual: emit(Insns::kCmpGreaterEqual); break;
-          }
+    bool rand(Thread* thread)
+    {
+      thread->m_stack[thread->m_sp++] = rnd();
+      return true;
+    }
 
-          type1 = Tokens::kTrue;
-        }
-        else
-        {
-          return raise(Errors::kTypeMismatch);
-        }
-      }
+    bool randRange(Thread* thread)
+    {
+      float a = ::floor(thread->m_stack[thread->m_sp - 2]);
+      float b = ::floor(thread->m_stack[thread->m_sp - 1]) + 1.0f;
 
-      return type1;
+      thread->m_stack[thread->m_sp - 2] = ::floor(a + rnd() * (b - a));
+      thread->m_sp--;
+      return true;
     }
 
-    rio2d::Script::Token parseTerm()
+    bool setLocal(Thread* thread)
     {
-      rio2d::Script::Token type1 = parseFactor();
-
-      while (m_token == '+' || m_token == '-')
-      {
-        rio2d::Script::Token op = m_token;
-        match();
+      rio2d::Script::Value* local = m_locals + m_bytecode[thread->m_pc++].m_index;
+      local->m_number = thread->m_stack[--thread->m_sp];
+      return true;
+    }
 
-        rio2d::Script::Token type2 = parseFactor();
+    bool setFrame(Thread* thread)
+    {
+      rio2d::Script::Value* local = m_locals + m_bytecode[thread->m_pc++].m_index;
+      rio2d::Script::Value* frms = m_locals + m_bytecode[thread->m_pc++].m_index;
 
-        if (type1 == Tokens::kNumber && type2 == Tokens::kNumber)
-        {
-          switch (op)
-          {
-          case '+': emit(Insns::kAdd); break;
-          case '-': emit(Insns::kSub); break;
-          }
-        }
-        else
-        {
-          return raise(Errors::kTypeMismatch);
-        }
-      }
+      auto node = (cocos2d::Node*)local->m_pointer;
+      auto obj = dynamic_cast<cocos2d::Sprite*>(node);
+      auto frames = (rio2d::Script::Frames*)frms->m_pointer;
+      auto index = (size_t)thread->m_stack[--thread->m_sp];
 
-      return type1;
+      CC_ASSERT(index >= 0 && index < frames->size());
+      obj->setSpriteFrame(frames->at(index));
+      return true;
     }
 
-    rio2d::Script::Token parseFactor()
+    void setNodeProp(Thread* thread, cocos2d::Node* obj, rio2d::Script::Index field)
     {
-      rio2d::Script::Token type1 = parseUnary();
+      rio2d::Script::Number value = thread->m_stack[--thread->m_sp];
+      cocos2d::Color3B c;
 
-      while (m_token == '*' || m_token == '/' || m_token == Tokens::kMod)
+      switch (field)
       {
-        rio2d::Script::Token op = m_token;
-        match();
-
-        rio2d::Script::Token type2 = parseUnary();
-
-        if (type1 == Tokens::kNumber && type2 == Tokens::kNumber)
-        {
-          switch (op)
-          {
-          case '*':          emit(Insns::kMul); break;
-          case '/':          emit(Insns::kDiv);  break;
-          case Tokens::kMod: emit(Insns::kModulus); break;
-          }
-        }
-        else
-        {
-          return raise(Errors::kTypeMismatch);
-        }
+      case Fields::kBlueIndex:     c = obj->getColor(); c.b = (GLubyte)value; obj->setColor(c); break;
+      case Fields::kGreenIndex:    c = obj->getColor(); c.g = (GLubyte)value; obj->setColor(c); break;
+      case Fields::kFlipxIndex:    dynamic_cast<cocos2d::Sprite*>(obj)->setFlippedX(value != 0.0f); break;
+      case Fields::kFlipyIndex:    dynamic_cast<cocos2d::Sprite*>(obj)->setFlippedY(value != 0.0f); break;
+      case Fields::kOpacityIndex:  obj->setOpacity(value); break;
+      case Fields::kRedIndex:      c = obj->getColor(); c.r = (GLubyte)value; obj->setColor(c); break;
+      case Fields::kRotationIndex: obj->setRotation(value); break;
+      case Fields::kScaleIndex:    obj->setScale(value); break;
+      case Fields::kSkewxIndex:    obj->setSkewX(value); break;
+      case Fields::kSkewyIndex:    obj->setSkewY(value); break;
+      case Fields::kXIndex:        obj->setPositionX(value); break;
+      case Fields::kYIndex:        obj->setPositionY(value); break;
+      case Fields::kVisibleIndex:  obj->setVisible(value != 0.0f); break;
+      default:                     CCASSERT(0, "Unknown Node property");
       }
-
-      return type1;
     }
 
-    rio2d::Script::Token parseUnary()
+    bool setProp(Thread* thread)
     {
-      rio2d::Script::Token type;
+      rio2d::Script::Index var = m_bytecode[thread->m_pc++].m_index;
+      rio2d::Script::Index field = m_bytecode[thread->m_pc++].m_index;
+      rio2d::Script::Value* local = m_locals + var;
 
-      switch (m_token)
+      switch (m_vars[var].m_type)
       {
-      case '-':
-        match();
-        type = parseTerminal();
-
-        if (type != Tokens::kNumber)
-        {
-          return raise(Errors::kTypeMismatch);
-        }
-
-        emit(Insns::kNeg);
-        break;
-
-      case '+':
-        match();
-        type = parseTerminal();
-
-        if (type != Tokens::kNumber)
-        {
-          return raise(Errors::kTypeMismatch);
-        }
-
-        break;
-
-      case Tokens::kNot:
-        match();
-        type = parseTerminal();
-
-        if (type != Tokens::kTrue)
-        {
-          return raise(Errors::kTypeMismatch);
-        }
-
-        emit(Insns::kLogicalNot);
+      case Tokens::kNode:
+        setNodeProp(thread, (cocos2d::Node*)local->m_pointer, field);
         break;
 
       default:
-        type = parseTerminal();
-        break;
+        CCASSERT(0, "Unknown object type");
       }
 
-      return type;
+      return true;
     }
 
-    rio2d::Script::Token parseTerminal()
+    bool signal(Thread* thread)
     {
-      switch (m_token)
-      {
-      case Tokens::kNumberConst:
-      {
-        char* end;
-        rio2d::Script::Number number = strtof(m_lexeme, &end);
-
-        if (end - m_lexeme != m_length)
-        {
-          return raise(Errors::kMalformedNumber);
-        }
-
-        match();
-        emit(Insns::kPush, number);
-        return Tokens::kNumber;
-      }
-
-      case Tokens::kTrue:
-        match();
-        emit(Insns::kPush, 1.0f);
-        return Tokens::kTrue;
-
-      case Tokens::kFalse:
-        match();
-        emit(Insns::kPush, 0.0f);
-        return Tokens::kTrue; // kTrue flags a boolean expression
-
-      case '(':
-      {
-        match();
-        rio2d::Script::Token type = parseExpression();
-        match(')');
-        return type;
-      }
+      rio2d::Hash hash = m_bytecode[thread->m_pc++].m_hash;
 
-      case Tokens::kIdentifier:
+      if (m_listener != nullptr)
       {
-        rio2d::Script::Index index;
-        Errors::Enum error = m_emitter->getIndex(m_hash, &index);
-
-        if (error != Errors::kOk)
-        {
-          return raise(error);
-        }
-
-        rio2d::Script::Token type;
-        m_emitter->getType(m_hash, &type);
-
-        match();
-
-        if (m_token == '.')
-        {
-          match();
-
-          switch (type)
-          {
-          case Tokens::kNode:   return emitGetNodeProp(index); break;
-          case Tokens::kVec2:   return emitGetVec2Prop(index); break;
-          case Tokens::kSize:   return emitGetSizeProp(index); break;
-          case Tokens::kFrames: return emitGetFramesProp(index); break;
-          }
-        }
-        else
-        {
-          emit(Insns::kGetLocal, index);
-          return type;
-        }
+        cocos2d::Node* target = (cocos2d::Node*)m_locals->m_pointer;
+        (m_listener->*m_port)(target, hash);
       }
 
-      case Tokens::kRand:
-        match();
-
-        if (m_token == '(')
-        {
-          match();
-          parseExpressions(2, Tokens::kNumber);
-          match(')');
-          emit(Insns::kRandRange);
-        }
-        else
-        {
-          emit(Insns::kRand);
-        }
-
-        return Tokens::kNumber;
+      return true;
+    }
 
-      case Tokens::kFloor:
-        match();
-        match('(');
-        parseExpressions(1, Tokens::kNumber);
-        match(')');
-        emit(Insns::kFloor);
-        return Tokens::kNumber;
+    bool spawn(Thread* thread)
+    {
+      rio2d::Script::Address pc = m_bytecode[thread->m_pc++].m_address;
 
-      case Tokens::kCeil:
-        match();
-        match('(');
-        parseExpressions(1, Tokens::kNumber);
-        match(')');
-        emit(Insns::kCeil);
-        return Tokens::kNumber;
+      Thread* nt = addThread();
 
-      case Tokens::kTrunc:
-        match();
-        match('(');
-        parseExpressions(1, Tokens::kNumber);
-        match(')');
-        emit(Insns::kTrunc);
-        return Tokens::kNumber;
+      if (nt != nullptr)
+      {
+        nt->m_pc = pc;
+        nt->m_dt = thread->m_dt;
+        nt->m_sp = thread->m_sp;
+        memcpy(nt->m_stack, thread->m_stack, thread->m_sp * sizeof(rio2d::Script::Number));
       }
 
-      return raise(Errors::kUnexpectedToken);
+      return true;
     }
-  };
 
-  class Runner : public cocos2d::ActionInterval
-  {
-  protected:
-    struct Thread
+    bool stop(Thread* thread)
     {
-      rio2d::Script::Address m_pc;
-      float m_dt;
-      unsigned m_sp;
-      rio2d::Script::Number m_stack[rio2d::Script::kMaxStack];
-    };
-
-    cocos2d::Ref* m_owner;
-    rio2d::Script::LocalVar* m_locals;
-    size_t m_numLocals;
-    const rio2d::Script::Bytecode* m_bytecode;
-    Thread m_threads[rio2d::Script::kMaxThreads];
-    size_t m_numThreads;
-    cocos2d::Ref* m_listener;
-    rio2d::Script::NotifyFunc m_port;
+      return false;
+    }
 
-    ~Runner()
+    bool sub(Thread* thread)
     {
-      delete[] m_locals;
-      m_owner->release();
+      thread->m_stack[thread->m_sp - 2] -= thread->m_stack[thread->m_sp - 1];
+      thread->m_sp--;
+      return true;
     }
 
-  public:
-    static Runner* create(cocos2d::Ref* owner, rio2d::Script::LocalVar* locals, size_t numLocals, const rio2d::Script::Bytecode* bytecode, rio2d::Script::Address pc, cocos2d::Ref* listener, rio2d::Script::NotifyFunc port, cocos2d::Node* target, va_list args)
+    bool trunc(Thread* thread)
     {
-      Runner *self = new (std::nothrow) Runner();
-
-      if (self && self->init(owner, locals, numLocals, bytecode, pc, listener, port, target, args))
+      thread->m_stack[thread->m_sp - 1] = ::trunc(thread->m_stack[thread->m_sp - 1]);
+      return true;
+    }
+
+    inline void setField(cocos2d::Node* node, rio2d::Script::Index field, float a)
+    {
+      switch (field)
       {
-        self->autorelease();
-        owner->retain();
-        return self;
+      case Fields::kOpacityIndex:  node->setOpacity(a); break;
+      case Fields::kRotationIndex: node->setRotation(a); break;
+      case Fields::kScaleIndex:    node->setScale(a); break;
       }
-
-      CC_SAFE_DELETE(self);
-      return nullptr;
     }
 
-    void step(float dt)
+    inline void setField(cocos2d::Node* node, rio2d::Script::Index field, float a, float b)
     {
-      Thread* thread = m_threads;
-      Thread* current = m_threads;
-      const Thread* end = m_threads + m_numThreads;
-
-      while (thread < end)
+      switch (field)
       {
-        if (thread != current)
-        {
-          *current = *thread;
-        }
-
-        current->m_dt += dt;
-
-        if (!consume(current))
-        {
-          // Do not stop this thread.
-          current++;
-        }
-
-        thread++;
+      case Fields::kPositionIndex: node->setPositionX(a); node->setPositionY(b); break;
+      case Fields::kSkewIndex:     node->setSkewX(a); node->setSkewY(b); break;
       }
+    }
 
-      // This can be larger if new threads were spawned.
-      end = m_threads + m_numThreads;
+    inline void setField(cocos2d::Node* node, rio2d::Script::Index field, float a, float b, float c)
+    {
+      cocos2d::Color3B d;
 
-      if (thread != current)
-      {
-        while (thread < end)
-        {
-          *current++ = *thread++;
-        }
-      }
-      else
+      switch (field)
       {
-        current += end - thread;
+      case Fields::kTintIndex: d.r = (GLubyte)a; d.g = (GLubyte)b; d.b = (GLubyte)c; node->setColor(d); break;
       }
-
-      m_numThreads = current - m_threads;
     }
 
-    void update(float time)
+    struct VaryArgs1
     {
-      (void)time; // What should we do here???
-    }
+      rio2d::Script::Number m_sourceA;
+      rio2d::Script::Number m_destA;
+      rio2d::Script::Number m_sourceT;
+      rio2d::Script::Number m_destT;
+    };
 
-    bool isDone() const
+    struct VaryArgs2
     {
-      return m_numThreads == 0;
-    }
+      rio2d::Script::Number m_sourceA;
+      rio2d::Script::Number m_sourceB;
+      rio2d::Script::Number m_destA;
+      rio2d::Script::Number m_destB;
+      rio2d::Script::Number m_sourceT;
+      rio2d::Script::Number m_destT;
+    };
 
-  protected:
-    bool init(cocos2d::Ref* owner, rio2d::Script::LocalVar* locals, size_t numLocals, const rio2d::Script::Bytecode* bytecode, size_t pc, cocos2d::Ref* listener, rio2d::Script::NotifyFunc port, cocos2d::Node* target, va_list args)
+    struct VaryArgs3
     {
-      m_locals = new rio2d::Script::LocalVar[numLocals];
+      rio2d::Script::Number m_sourceA;
+      rio2d::Script::Number m_sourceB;
+      rio2d::Script::Number m_sourceC;
+      rio2d::Script::Number m_destA;
+      rio2d::Script::Number m_destB;
+      rio2d::Script::Number m_destC;
+      rio2d::Script::Number m_sourceT;
+      rio2d::Script::Number m_destT;
+    };
 
-      if (m_locals == nullptr)
-      {
-        return false;
-      }
+    bool varyAbs(Thread* thread)
+    {
+      rio2d::Script::Index index = m_bytecode[thread->m_pc].m_index;
+      rio2d::Script::Index field = m_bytecode[thread->m_pc + 1].m_index;
+      rio2d::Script::Index ease = m_bytecode[thread->m_pc + 2].m_index;
 
-      memcpy(m_locals, locals, sizeof(rio2d::Script::LocalVar) * numLocals);
-      m_numLocals = numLocals;
+      rio2d::Script::Value* local = m_locals + index;
+      cocos2d::Node* node = (cocos2d::Node*)local->m_pointer;
 
-      m_bytecode = bytecode;
+      switch (field)
+      {
+      case Fields::kOpacityIndex:
+      case Fields::kRotationIndex:
+      case Fields::kScaleIndex:
+      {
+        VaryArgs1* args = (VaryArgs1*)((char*)(thread->m_stack + thread->m_sp) - sizeof(VaryArgs1));
+        args->m_sourceT += thread->m_dt;
 
-      m_threads[0].m_pc = pc;
-      m_threads[0].m_dt = 0.0f;
-      m_threads[0].m_sp = 0;
+        if (args->m_sourceT < args->m_destT)
+        {
+          rio2d::Script::Number time = Easing::evaluate(ease, args->m_sourceT / args->m_destT);
+          setField(node, field, args->m_sourceA + time * (args->m_destA - args->m_sourceA));
+          return false;
+        }
+        else
+        {
+          setField(node, field, args->m_destA);
+          thread->m_dt = args->m_sourceT - args->m_destT;
+          thread->m_sp -= 4;
+          thread->m_pc += 3;
+          return true;
+        }
 
-      m_listener = listener;
-      m_port = port;
+        break;
+      }
 
-      m_numThreads = 1;
+      case Fields::kPositionIndex:
+      case Fields::kSkewIndex:
+      {
+        VaryArgs2* args = (VaryArgs2*)((char*)(thread->m_stack + thread->m_sp) - sizeof(VaryArgs2));
+        args->m_sourceT += thread->m_dt;
 
-      rio2d::Script::LocalVar* local = m_locals;
-      const rio2d::Script::LocalVar* end = local + m_numLocals;
+        if (args->m_sourceT < args->m_destT)
+        {
+          rio2d::Script::Number time = Easing::evaluate(ease, args->m_sourceT / args->m_destT);
+          float a = args->m_sourceA + time * (args->m_destA - args->m_sourceA);
+          float b = args->m_sourceB + time * (args->m_destB - args->m_sourceB);
+          setField(node, field, a, b);
+          return false;
+        }
+        else
+        {
+          setField(node, field, args->m_destA, args->m_destB);
+          thread->m_dt = args->m_sourceT - args->m_destT;
+          thread->m_sp -= 6;
+          thread->m_pc += 3;
+          return true;
+        }
 
-      local->m_pointer = target;
-      local++;
+        break;
+      }
 
-      while (local < end)
+      case Fields::kTintIndex:
       {
-        switch (local->m_type)
+        VaryArgs3* args = (VaryArgs3*)((char*)(thread->m_stack + thread->m_sp) - sizeof(VaryArgs3));
+        args->m_sourceT += thread->m_dt;
+
+        if (args->m_sourceT < args->m_destT)
+        {
+          rio2d::Script::Number time = Easing::evaluate(ease, args->m_sourceT / args->m_destT);
+          float a = args->m_sourceA + time * (args->m_destA - args->m_sourceA);
+          float b = args->m_sourceB + time * (args->m_destB - args->m_sourceB);
+          float c = args->m_sourceC + time * (args->m_destC - args->m_sourceC);
+          setField(node, field, a, b, c);
+          return false;
+        }
+        else
         {
-        case Tokens::kFrames: local->m_pointer = va_arg(args, rio2d::Script::Frames*); break;
-        case Tokens::kNode:   local->m_pointer = va_arg(args, cocos2d::Node*); break;
-        case Tokens::kNumber: local->m_number = (rio2d::Script::Number)va_arg(args, double); break;
-        case Tokens::kSize:   local->m_pointer = va_arg(args, cocos2d::Size*); break;
-        case Tokens::kVec2:   local->m_pointer = va_arg(args, cocos2d::Vec2*); break;
+          setField(node, field, args->m_destA, args->m_destB, args->m_destC);
+          thread->m_dt = args->m_sourceT - args->m_destT;
+          thread->m_sp -= 8;
+          thread->m_pc += 3;
+          return true;
         }
 
-        local++;
+        break;
+      }
       }
 
-      m_owner = owner;
       return true;
     }
 
-    bool add(Thread* thread)
+    bool varyRel(Thread* thread)
     {
-      thread->m_stack[thread->m_sp - 2] += thread->m_stack[thread->m_sp - 1];
-      thread->m_sp--;
-      return true; // Continue running
-    }
+      rio2d::Script::Index index = m_bytecode[thread->m_pc].m_index;
+      rio2d::Script::Index field = m_bytecode[thread->m_pc + 1].m_index;
+      rio2d::Script::Index ease = m_bytecode[thread->m_pc + 2].m_index;
 
-    void callNodeMethod(Thread* thread, cocos2d::Node* target, rio2d::Script::Index index)
-    {
-      cocos2d::Color3B c;
+      rio2d::Script::Value* local = m_locals + index;
+      cocos2d::Node* node = (cocos2d::Node*)local->m_pointer;
 
-      switch (index)
+      switch (field)
       {
-      case Fields::kTintIndex:
-        c.r = (GLubyte)thread->m_stack[thread->m_sp - 3];
-        c.g = (GLubyte)thread->m_stack[thread->m_sp - 2];
-        c.b = (GLubyte)thread->m_stack[thread->m_sp - 1];
-        target->setColor(c);
-        thread->m_sp -= 3;
-        break;
+      case Fields::kPositionIndex:
+      {
+        VaryArgs2* args = (VaryArgs2*)((char*)(thread->m_stack + thread->m_sp) - sizeof(VaryArgs2));
+        args->m_sourceT += thread->m_dt;
 
-      case Fields::kPlaceIndex:
-        target->setPosition(thread->m_stack[thread->m_sp - 2], thread->m_stack[thread->m_sp - 1]);
-        thread->m_sp -= 2;
-        break;
+        if (args->m_sourceT < args->m_destT)
+        {
+          rio2d::Script::Number time = Easing::evaluate(ease, args->m_sourceT / args->m_destT);
+          node->setPositionX(args->m_sourceA + time * args->m_destA);
+          node->setPositionY(args->m_sourceB + time * args->m_destB);
+          return false;
+        }
+        else
+        {
+          node->setPositionX(args->m_sourceA + args->m_destA);
+          node->setPositionY(args->m_sourceB + args->m_destB);
+          thread->m_dt = args->m_sourceT - args->m_destT;
+          thread->m_sp -= 6;
+          thread->m_pc += 3;
+          return true;
+        }
 
-      case Fields::kSkewIndex:
-        target->setSkewX(thread->m_stack[thread->m_sp - 2]);
-        target->setSkewY(thread->m_stack[thread->m_sp - 1]);
-        thread->m_sp -= 2;
         break;
       }
-    }
-
-    bool callMethod(Thread* thread)
-    {
-      rio2d::Script::LocalVar* local = m_locals + m_bytecode[thread->m_pc++].m_index;
-      rio2d::Script::Index index = m_bytecode[thread->m_pc++].m_index;
 
-      switch (local->m_type)
+      case Fields::kRotationIndex:
+      case Fields::kScaleIndex:
       {
-      case Tokens::kNode:
-        callNodeMethod(thread, (cocos2d::Node*)local->m_pointer, index);
-        break;
+        VaryArgs1* args = (VaryArgs1*)((char*)(thread->m_stack + thread->m_sp) - sizeof(VaryArgs1));
+        args->m_sourceT += thread->m_dt;
 
-      default:
-        CCASSERT(0, "Unknown object type");
-      }
+        if (args->m_sourceT < args->m_destT)
+        {
+          rio2d::Script::Number time = Easing::evaluate(ease, args->m_sourceT / args->m_destT);
+          setField(node, field, args->m_sourceA + time * args->m_destA);
+          return false;
+        }
+        else
+        {
+          setField(node, field, args->m_sourceA + args->m_destA);
+          thread->m_dt = args->m_sourceT - args->m_destT;
+          thread->m_sp -= 4;
+          thread->m_pc += 3;
+          return true;
+        }
 
-      return true;
-    }
+        break;
+      }
+      }
 
-    bool ceil(Thread* thread)
-    {
-      thread->m_stack[thread->m_sp - 1] = ::ceil(thread->m_stack[thread->m_sp - 1]);
       return true;
     }
 
-    bool cmpEqual(Thread* thread)
+    bool consume(Thread* thread)
     {
-      thread->m_stack[thread->m_sp - 2] = thread->m_stack[thread->m_sp - 2] == thread->m_stack[thread->m_sp - 1];
-      thread->m_sp--;
-      return true;
-    }
+      // Execute a thread until an insn that consumes time.
+      // If the thread executes the same address twice while in here, stop it (infinite loop).
 
-    bool cmpGreater(Thread* thread)
-    {
-      thread->m_stack[thread->m_sp - 2] = thread->m_stack[thread->m_sp - 2] > thread->m_stack[thread->m_sp - 1];
-      thread->m_sp--;
-      return true;
-    }
+      rio2d::Script::Address saved_pc = thread->m_pc;
 
-    bool cmpGreaterEqual(Thread* thread)
-    {
-      thread->m_stack[thread->m_sp - 2] = thread->m_stack[thread->m_sp - 2] >= thread->m_stack[thread->m_sp - 1];
-      thread->m_sp--;
-      return true;
-    }
-
-    bool cmpLess(Thread* thread)
-    {
-      thread->m_stack[thread->m_sp - 2] = thread->m_stack[thread->m_sp - 2] < thread->m_stack[thread->m_sp - 1];
-      thread->m_sp--;
-      return true;
-    }
-
-    bool cmpLessEqual(Thread* thread)
-    {
-      thread->m_stack[thread->m_sp - 2] = thread->m_stack[thread->m_sp - 2] <= thread->m_stack[thread->m_sp - 1];
-      thread->m_sp--;
-      return true;
-    }
-
-    bool cmpNotEqual(Thread* thread)
-    {
-      thread->m_stack[thread->m_sp - 2] = thread->m_stack[thread->m_sp - 2] != thread->m_stack[thread->m_sp - 1];
-      thread->m_sp--;
-      return true;
-    }
-
-    bool div(Thread* thread)
-    {
-      thread->m_stack[thread->m_sp - 2] /= thread->m_stack[thread->m_sp - 1];
-      thread->m_sp--;
-      return true;
-    }
-
-    bool floor(Thread* thread)
-    {
-      thread->m_stack[thread->m_sp - 1] = ::floor(thread->m_stack[thread->m_sp - 1]);
-      return true;
-    }
-
-    bool getLocal(Thread* thread)
-    {
-      rio2d::Script::LocalVar* local = m_locals + m_bytecode[thread->m_pc++].m_index;
-      thread->m_stack[thread->m_sp++] = local->m_number;
-      return true;
-    }
-
-    void getNodeProp(Thread* thread, cocos2d::Node* obj, rio2d::Script::Index field)
-    {
-      float value;
-
-      switch (field)
-      {
-      case Fields::kBboxheightIndex: value = obj->getBoundingBox().size.height; break;
-      case Fields::kBboxwidthIndex:  value = obj->getBoundingBox().size.width; break;
-      case Fields::kBlueIndex:       value = (float)obj->getColor().b; break;
-      case Fields::kGreenIndex:      value = (float)obj->getColor().g; break;
-      case Fields::kFlipxIndex:      value = dynamic_cast<cocos2d::Sprite*>(obj)->isFlippedX() ? 1.0f : 0.0f; break;
-      case Fields::kFlipyIndex:      value = dynamic_cast<cocos2d::Sprite*>(obj)->isFlippedY() ? 1.0f : 0.0f; break;
-      case Fields::kHeightIndex:     value = obj->getContentSize().height; break;
-      case Fields::kOpacityIndex:    value = obj->getOpacity(); break;
-      case Fields::kRedIndex:        value = (float)obj->getColor().r; break;
-      case Fields::kRotationIndex:   value = obj->getRotation(); break;
-      case Fields::kScaleIndex:      value = obj->getScale(); break;
-      case Fields::kSkewxIndex:      value = obj->getSkewX(); break;
-      case Fields::kSkewyIndex:      value = obj->getSkewY(); break;
-      case Fields::kWidthIndex:      value = obj->getContentSize().width; break;
-      case Fields::kXIndex:          value = obj->getPositionX(); break;
-      case Fields::kYIndex:          value = obj->getPositionY(); break;
-      case Fields::kVisibleIndex:    value = obj->isVisible() ? 1.0f : 0.0f; break;
-      default:                       CCASSERT(0, "Unknown property for Node instance");
-      }
-
-      thread->m_stack[thread->m_sp++] = value;
-    }
-
-    void getVec2Prop(Thread* thread, cocos2d::Vec2* obj, rio2d::Script::Index field)
-    {
-      float value;
-
-      switch (field)
-      {
-      case Fields::kXIndex: value = obj->x; break;
-      case Fields::kYIndex: value = obj->y; break;
-      default:              CCASSERT(0, "Unknown property for Vec2 instance");
-      }
-
-      thread->m_stack[thread->m_sp++] = value;
-    }
-
-    void getSizeProp(Thread* thread, cocos2d::Size* obj, rio2d::Script::Index field)
-    {
-      float value;
-
-      switch (field)
-      {
-      case Fields::kHeightIndex: value = obj->height; break;
-      case Fields::kWidthIndex:  value = obj->width; break;
-      default:                   CCASSERT(0, "Unknown property for Size instance");
-      }
-
-      thread->m_stack[thread->m_sp++] = value;
-    }
-
-    void getFramesProp(Thread* thread, rio2d::Script::Frames* obj, rio2d::Script::Index field)
-    {
-      float value;
-
-      switch (field)
-      {
-      case Fields::kLengthIndex: value = (float)obj->size(); break;
-      default:                   CCASSERT(0, "Unknown property for Frames instance");
-      }
-
-      thread->m_stack[thread->m_sp++] = value;
-    }
-
-    bool getProp(Thread* thread)
-    {
-      rio2d::Script::LocalVar* local = m_locals + m_bytecode[thread->m_pc++].m_index;
-      rio2d::Script::Index field = m_bytecode[thread->m_pc++].m_index;
-
-      switch (local->m_type)
-      {
-      case Tokens::kNode:
-        getNodeProp(thread, (cocos2d::Node*)local->m_pointer, field);
-        break;
-
-      case Tokens::kSize:
-        getSizeProp(thread, (cocos2d::Size*)local->m_pointer, field);
-        break;
-
-      case Tokens::kVec2:
-        getVec2Prop(thread, (cocos2d::Vec2*)local->m_pointer, field);
-        break;
-
-      case Tokens::kFrames:
-        getFramesProp(thread, (rio2d::Script::Frames*)local->m_pointer, field);
-        break;
-
-      default:
-        CCASSERT(0, "Unknown object type");
-      }
-
-      return true;
-    }
-
-    bool jump(Thread* thread)
-    {
-      thread->m_pc = m_bytecode[thread->m_pc].m_address;
-      return true;
-    }
-
-    bool jz(Thread* thread)
-    {
-      if (thread->m_stack[--thread->m_sp] == 0.0f)
-      {
-        thread->m_pc = m_bytecode[thread->m_pc].m_address;
-      }
-      else
+      do
       {
-        thread->m_pc++;
-      }
+        bool cont;
 
-      return true;
-    }
+        switch (m_bytecode[thread->m_pc++].m_insn)
+        {
+        // Insns that take 0 time.
+        case Insns::kAdd:             cont = add(thread); break;
+        case Insns::kCallMethod:      cont = callMethod(thread); break;
+        case Insns::kCeil:            cont = ceil(thread); break;
+        case Insns::kCmpEqual:        cont = cmpEqual(thread); break;
+        case Insns::kCmpGreater:      cont = cmpGreater(thread); break;
+        case Insns::kCmpGreaterEqual: cont = cmpGreaterEqual(thread); break;
+        case Insns::kCmpLess:         cont = cmpLess(thread); break;
+        case Insns::kCmpLessEqual:    cont = cmpLessEqual(thread); break;
+        case Insns::kCmpNotEqual:     cont = cmpNotEqual(thread); break;
+        case Insns::kDiv:             cont = div(thread); break;
+        case Insns::kFloor:           cont = floor(thread); break;
+        case Insns::kGetLocal:        cont = getLocal(thread); break;
+        case Insns::kGetProp:         cont = getProp(thread); break;
+        case Insns::kLogicalAnd:      cont = logicalAnd(thread); break;
+        case Insns::kLogicalNot:      cont = logicalNot(thread); break;
+        case Insns::kLogicalOr:       cont = logicalOr(thread); break;
+        case Insns::kModulus:         cont = modulus(thread); break;
+        case Insns::kMul:             cont = mul(thread); break;
+        case Insns::kNeg:             cont = neg(thread); break;
+        case Insns::kPush:            cont = push(thread); break;
+        case Insns::kRand:            cont = rand(thread); break;
+        case Insns::kRandRange:       cont = randRange(thread); break;
+        case Insns::kSetLocal:        cont = setLocal(thread); break;
+        case Insns::kSetFrame:        cont = setFrame(thread); break;
+        case Insns::kSetProp:         cont = setProp(thread); break;
+        case Insns::kSignal:          cont = signal(thread); break;
+        case Insns::kSpawn:           cont = spawn(thread); break;
+        case Insns::kSub:             cont = sub(thread); break;
+        case Insns::kTrunc:           cont = trunc(thread); break;
 
-    bool logicalAnd(Thread* thread)
-    {
-      thread->m_stack[thread->m_sp - 2] = thread->m_stack[thread->m_sp - 2] != 0.0f && thread->m_stack[thread->m_sp - 1] != 0.0f;
-      thread->m_sp--;
-      return true;
-    }
+        // Insns that consume time.
+        case Insns::kPause:           cont = pause(thread); break;
+        case Insns::kVaryAbs:         cont = varyAbs(thread); break;
+        case Insns::kVaryRel:         cont = varyRel(thread); break;
 
-    bool logicalNot(Thread* thread)
-    {
-      thread->m_stack[thread->m_sp - 1] = thread->m_stack[thread->m_sp - 1] != 0.0f ? 0.0f : 1.0f;
-      return true;
-    }
+        // Insns that jump in into the code.
+        case Insns::kJump:            cont = jump(thread); break;
+        case Insns::kJz:              cont = jz(thread); break;
+        case Insns::kNext:            cont = next(thread); break;
 
-    bool logicalOr(Thread* thread)
-    {
-      thread->m_stack[thread->m_sp - 2] = thread->m_stack[thread->m_sp - 2] != 0.0f || thread->m_stack[thread->m_sp - 1] != 0.0f;
-      thread->m_sp--;
-      return true;
-    }
+        default:                      CCASSERT(0, "Unknown instruction");
+        case Insns::kStop:            return true;
+        }
 
-    bool modulus(Thread* thread)
-    {
-      thread->m_stack[thread->m_sp - 2] = fmod(thread->m_stack[thread->m_sp - 2], thread->m_stack[thread->m_sp - 1] != 0.0f);
-      thread->m_sp--;
-      return true;
-    }
+        if (!cont)
+        {
+          thread->m_pc--;
+          thread->m_dt = 0.0f;
+          return false;
+        }
 
-    bool mul(Thread* thread)
-    {
-      thread->m_stack[thread->m_sp - 2] *= thread->m_stack[thread->m_sp - 1];
-      thread->m_sp--;
-      return true;
-    }
+        if (thread->m_pc == saved_pc)
+        {
+          // Avoid infinite loops.
+          thread->m_dt = 0.0f;
+          return false;
+        }
+      } while (thread->m_dt > 0.0f);
 
-    bool neg(Thread* thread)
-    {
-      thread->m_stack[thread->m_sp - 1] = -thread->m_stack[thread->m_sp - 1];
-      return true;
+      return false;
     }
+  };
 
-    bool next(Thread* thread)
-    {
-      struct Next
-      {
-        rio2d::Script::Number m_limit;
-        rio2d::Script::Number m_step;
-      };
-
-      rio2d::Script::LocalVar* local = m_locals + m_bytecode[thread->m_pc].m_index;
-      Next* args = (Next*)((char*)(thread->m_stack + thread->m_sp) - sizeof(Next));
-
-      local->m_number += args->m_step;
+  RunnerImpl::Pool* RunnerImpl::s_pools;
+  RunnerImpl* RunnerImpl::s_live;
 
-      if (local->m_number <= args->m_limit)
-      {
-        thread->m_pc = m_bytecode[thread->m_pc + 1].m_address;
-      }
-      else
-      {
-        thread->m_sp -= 2;
-        thread->m_pc += 2;
-      }
+  std::atomic<rio2d::Allocator*> s_allocator(nullptr);
+}
 
-      return true;
-    }
+rio2d::Runner* rio2d::Runner::find(cocos2d::Node* node, Hash hash)
+{
+  Runner* runner = dynamic_cast<Runner*>(node->getActionByTag(tagOf(hash)));
 
-    bool pause(Thread* thread)
-    {
-      float time = thread->m_stack[thread->m_sp - 1] -= thread->m_dt;
+  // Two subroutines share the tag before the invalid one.
+  return runner != nullptr && runner->getHash() == hash ? runner : nullptr;
+}
 
-      if (time > 0.0f)
-      {
-        return false; // Put this thread to sleep.
-      }
+int rio2d::Runner::tagOf(Hash hash)
+{
+  int tag = (int)hash;
+  return tag != cocos2d::Action::INVALID_TAG ? tag : tag - 1;
+}
 
-      thread->m_dt = -time;
-      thread->m_sp--;
-      return true;
-    }
+void rio2d::Runner::addRunner(ScriptBase* script, const ScriptBase::Subroutine* global, size_t bytes)
+{
+  ScriptBase::Usage* usage = script->m_usage + (global - script->m_globals);
+  usage->m_numRunners++;
+  usage->m_peakRunners = std::max(usage->m_peakRunners, usage->m_numRunners);
+
+  script->m_numRunners++;
+  script->m_runnerBytes += bytes;
+  script->m_peakRunners = std::max(script->m_peakRunners, script->m_numRunners);
+  script->m_peakRunnerBytes = std::max(script->m_peakRunnerBytes, script->m_runnerBytes);
+}
 
-    bool push(Thread* thread)
-    {
-      thread->m_stack[thread->m_sp++] = m_bytecode[thread->m_pc++].m_number;
-      return true;
-    }
+rio2d::Allocator* rio2d::Runner::getScriptAllocator(const ScriptBase* script)
+{
+  return script->m_allocator;
+}
 
-    inline float rnd()
-    {
-      return (float)::rand() / (float)(RAND_MAX + 1);
-    }
+void rio2d::Runner::removeRunner(ScriptBase* script, const ScriptBase::Subroutine* global, size_t bytes)
+{
+  script->m_usage[global - script->m_globals].m_numRunners--;
+  script->m_numRunners--;
+  script->m_runnerBytes -= bytes;
+}
 
-    bool rand(Thread* thread)
-    {
-      thread->m_stack[thread->m_sp++] = rnd();
-      return true;
-    }
+rio2d::BumpAllocator::BumpAllocator(size_t capacity)
+  : m_buffer((char*)malloc(capacity))
+  , m_capacity(m_buffer != nullptr ? capacity : 0)
+  , m_used(0)
+{
+}
 
-    bool randRange(Thread* thread)
-    {
-      float a = ::floor(thread->m_stack[thread->m_sp - 2]);
-      float b = ::floor(thread->m_stack[thread->m_sp - 1]) + 1.0f;
+rio2d::BumpAllocator::~BumpAllocator()
+{
+  // The pool of the allocator lives in the buffer.
+  RunnerImpl::forget(this);
+  free(m_buffer);
+}
 
-      thread->m_stack[thread->m_sp - 2] = ::floor(a + rnd() * (b - a));
-      thread->m_sp--;
-      return true;
-    }
+void* rio2d::BumpAllocator::allocate(size_t size)
+{
+  size = (size + 15) & ~(size_t)15;
+  size_t used = m_used.load(std::memory_order_relaxed);
 
-    bool setLocal(Thread* thread)
+  do
+  {
+    if (size > m_capacity - used)
     {
-      rio2d::Script::LocalVar* local = m_locals + m_bytecode[thread->m_pc++].m_index;
-      local->m_number = thread->m_stack[--thread->m_sp];
-      return true;
+      return nullptr;
     }
+  } while (!m_used.compare_exchange_weak(used, used + size, std::memory_order_relaxed));
 
-    bool setFrame(Thread* thread)
-    {
-      rio2d::Script::LocalVar* local = m_locals + m_bytecode[thread->m_pc++].m_index;
-      rio2d::Script::LocalVar* frms = m_locals + m_bytecode[thread->m_pc++].m_index;
+  return m_buffer + used;
+}
 
-      auto node = (cocos2d::Node*)local->m_pointer;
-      auto obj = dynamic_cast<cocos2d::Sprite*>(node);
-      auto frames = (rio2d::Script::Frames*)frms->m_pointer;
-      auto index = (size_t)thread->m_stack[--thread->m_sp];
+void rio2d::BumpAllocator::deallocate(void* pointer)
+{
+  // Memory is only given back on reset.
+  (void)pointer;
+}
 
-      CC_ASSERT(index >= 0 && index < frames->size());
-      obj->setSpriteFrame(frames->at(index));
-      return true;
-    }
+void rio2d::BumpAllocator::reset()
+{
+  // The recycled runners in the buffer go away too.
+  RunnerImpl::forget(this);
+  m_used = 0;
+}
 
-    void setNodeProp(Thread* thread, cocos2d::Node* obj, rio2d::Script::Index field)
-    {
-      rio2d::Script::Number value = thread->m_stack[--thread->m_sp];
-      cocos2d::Color3B c;
+size_t rio2d::BumpAllocator::used() const
+{
+  return m_used;
+}
 
-      switch (field)
-      {
-      case Fields::kBlueIndex:     c = obj->getColor(); c.b = (GLubyte)value; obj->setColor(c); break;
-      case Fields::kGreenIndex:    c = obj->getColor(); c.g = (GLubyte)value; obj->setColor(c); break;
-      case Fields::kFlipxIndex:    dynamic_cast<cocos2d::Sprite*>(obj)->setFlippedX(value != 0.0f); break;
-      case Fields::kFlipyIndex:    dynamic_cast<cocos2d::Sprite*>(obj)->setFlippedY(value != 0.0f); break;
-      case Fields::kOpacityIndex:  obj->setOpacity(value); break;
-      case Fields::kRedIndex:      c = obj->getColor(); c.r = (GLubyte)value; obj->setColor(c); break;
-      case Fields::kRotationIndex: obj->setRotation(value); break;
-      case Fields::kScaleIndex:    obj->setScale(value); break;
-      case Fields::kSkewxIndex:    obj->setSkewX(value); break;
-      case Fields::kSkewyIndex:    obj->setSkewY(value); break;
-      case Fields::kXIndex:        obj->setPositionX(value); break;
-      case Fields::kYIndex:        obj->setPositionY(value); break;
-      case Fields::kVisibleIndex:  obj->setVisible(value != 0.0f); break;
-      default:                     CCASSERT(0, "Unknown Node property");
-      }
-    }
+size_t rio2d::BumpAllocator::capacity() const
+{
+  return m_capacity;
+}
 
-    bool setProp(Thread* thread)
-    {
-      rio2d::Script::LocalVar* local = m_locals + m_bytecode[thread->m_pc++].m_index;
-      rio2d::Script::Index field = m_bytecode[thread->m_pc++].m_index;
+void rio2d::setAllocator(Allocator* allocator)
+{
+  s_allocator = allocator;
+}
 
-      switch (local->m_type)
-      {
-      case Tokens::kNode:
-        setNodeProp(thread, (cocos2d::Node*)local->m_pointer, field);
-        break;
+rio2d::Allocator* rio2d::getAllocator()
+{
+  Allocator* allocator = s_allocator;
+  return allocator != nullptr ? allocator : Heap::get();
+}
 
-      default:
-        CCASSERT(0, "Unknown object type");
-      }
+rio2d::ScriptBase::ScriptBase(const Config& config)
+  : m_config(config)
+  , m_source(nullptr)
+  , m_image(nullptr)
+  , m_imageSize(0)
+  , m_ownsImage(false)
+  , m_allocator(getAllocator())
+  , m_bytecode(nullptr)
+  , m_bcSize(0)
+  , m_globals(nullptr)
+  , m_numGlobals(0)
+  , m_usage(nullptr)
+  , m_numRunners(0)
+  , m_runnerBytes(0)
+  , m_peakRunners(0)
+  , m_peakRunnerBytes(0)
+  , m_arenaSize(0)
+  , m_index(nullptr)
+  , m_indexBits(0)
+  , m_stale(false)
+{
+}
 
-      return true;
-    }
+rio2d::ScriptBase::~ScriptBase()
+{
+  if (m_ownsImage)
+  {
+    m_allocator->deallocate((void*)m_image);
+  }
 
-    bool signal(Thread* thread)
-    {
-      rio2d::Hash hash = m_bytecode[thread->m_pc++].m_hash;
+  // The subroutines are at the start of the arena.
+  if (m_globals != nullptr)
+  {
+    m_allocator->deallocate(m_globals);
+  }
+}
 
-      if (m_listener != nullptr)
-      {
-        cocos2d::Node* target = (cocos2d::Node*)m_locals->m_pointer;
-        (m_listener->*m_port)(target, hash);
-      }
+size_t rio2d::ScriptBase::writeBytecode(void* image, size_t size) const
+{
+  // Lazily compiled scripts don't have all the code.
+  if (m_source != nullptr)
+  {
+    return 0;
+  }
 
-      return true;
-    }
+  size_t needed = Image::size(m_globals, m_numGlobals, m_bcSize);
 
-    bool spawn(Thread* thread)
-    {
-      if (m_numThreads < rio2d::Script::kMaxThreads)
-      {
-        Thread* nt = m_threads + m_numThreads++;
-        *nt = *thread;
+  if (needed <= size)
+  {
+    Image::write(image, m_bytecode, m_bcSize, m_globals, m_numGlobals);
+  }
 
-        nt->m_pc = m_bytecode[thread->m_pc++].m_address;
-        nt->m_dt = thread->m_dt;
-      }
+  return needed;
+}
 
-      return true;
-    }
+void rio2d::ScriptBase::compileInWorker(ScriptBase* self, const char* source, size_t length, const std::function<void(ScriptBase*, const char*)>& func, unsigned options)
+{
+  // The caller's buffer may be gone by the time the worker runs.
+  std::string copy(source, length);
 
-    bool stop(Thread* thread)
-    {
-      return false;
-    }
+  std::thread worker([self, copy, func, options]() mutable
+  {
+    char error[256];
+    std::string message;
 
-    bool sub(Thread* thread)
+    if (self == nullptr)
     {
-      thread->m_stack[thread->m_sp - 2] -= thread->m_stack[thread->m_sp - 1];
-      thread->m_sp--;
-      return true;
+      message = Errors::describe(Errors::kOutOfMemory);
     }
-
-    bool trunc(Thread* thread)
+    else if (!self->init(copy.c_str(), error, sizeof(error), options))
     {
-      thread->m_stack[thread->m_sp - 1] = ::trunc(thread->m_stack[thread->m_sp - 1]);
-      return true;
+      delete self;
+      self = nullptr;
+      message = error;
     }
 
-    inline void setField(cocos2d::Node* node, rio2d::Script::Index field, float a)
+    // Reference counting and the callback must happen in the cocos2d thread.
+    cocos2d::Director::getInstance()->getScheduler()->performFunctionInCocosThread([self, message, func]()
     {
-      switch (field)
+      if (self != nullptr)
       {
-      case Fields::kOpacityIndex:  node->setOpacity(a); break;
-      case Fields::kRotationIndex: node->setRotation(a); break;
-      case Fields::kScaleIndex:    node->setScale(a); break;
+        self->autorelease();
+        func(self, nullptr);
       }
-    }
-
-    inline void setField(cocos2d::Node* node, rio2d::Script::Index field, float a, float b)
-    {
-      switch (field)
+      else
       {
-      case Fields::kPositionIndex: node->setPositionX(a); node->setPositionY(b); break;
-      case Fields::kSkewIndex:     node->setSkewX(a); node->setSkewY(b); break;
+        func(nullptr, message.c_str());
       }
-    }
+    });
+  });
 
-    inline void setField(cocos2d::Node* node, rio2d::Script::Index field, float a, float b, float c)
-    {
-      cocos2d::Color3B d;
+  worker.detach();
+}
 
-      switch (field)
-      {
-      case Fields::kTintIndex: d.r = (GLubyte)a; d.g = (GLubyte)b; d.b = (GLubyte)c; node->setColor(d); break;
-      }
-    }
+bool rio2d::ScriptBase::runActionArgs(cocos2d::Ref* listener, NotifyFunc port, Hash hash, cocos2d::Node* target, const Argument* args, size_t count)
+{
+  Subroutine* global = find(hash);
 
-    struct VaryArgs1
-    {
-      rio2d::Script::Number m_sourceA;
-      rio2d::Script::Number m_destA;
-      rio2d::Script::Number m_sourceT;
-      rio2d::Script::Number m_destT;
-    };
+  if (global == nullptr)
+  {
+    return false;
+  }
 
-    struct VaryArgs2
-    {
-      rio2d::Script::Number m_sourceA;
-      rio2d::Script::Number m_sourceB;
-      rio2d::Script::Number m_destA;
-      rio2d::Script::Number m_destB;
-      rio2d::Script::Number m_sourceT;
-      rio2d::Script::Number m_destT;
-    };
+  if (!global->m_compiled)
+  {
+    compile(global);
+  }
 
-    struct VaryArgs3
-    {
-      rio2d::Script::Number m_sourceA;
-      rio2d::Script::Number m_sourceB;
-      rio2d::Script::Number m_sourceC;
-      rio2d::Script::Number m_destA;
-      rio2d::Script::Number m_destB;
-      rio2d::Script::Number m_destC;
-      rio2d::Script::Number m_sourceT;
-      rio2d::Script::Number m_destT;
-    };
+  return runActionArgs(listener, port, global, target, args, count);
+}
 
-    bool varyAbs(Thread* thread)
+// Checks the arguments for count targets against the parameters of the subroutine.
+static bool matches(const rio2d::Script::Subroutine* global, const rio2d::Script::Argument* args, size_t numArgs, size_t count)
+{
+  // The target is the first parameter.
+  if (numArgs != global->m_numParams - 1)
+  {
+    CCLOG("Wrong number of arguments to subroutine %08x", global->m_hash);
+    return false;
+  }
+
+  for (size_t i = 0; i < count; i++)
+  {
+    for (size_t j = 0; j < numArgs; j++)
     {
-      rio2d::Script::Index index = m_bytecode[thread->m_pc].m_index;
-      rio2d::Script::Index field = m_bytecode[thread->m_pc + 1].m_index;
-      rio2d::Script::Index ease = m_bytecode[thread->m_pc + 2].m_index;
+      if (args->m_type != global->m_locals[j + 1].m_type)
+      {
+        CCLOG("Wrong type of argument %u to subroutine %08x", (unsigned)j + 1, global->m_hash);
+        return false;
+      }
 
-      rio2d::Script::LocalVar* local = m_locals + index;
-      cocos2d::Node* node = (cocos2d::Node*)local->m_pointer;
+      args++;
+    }
+  }
 
-      switch (field)
-      {
-      case Fields::kOpacityIndex:
-      case Fields::kRotationIndex:
-      case Fields::kScaleIndex:
-      {
-        VaryArgs1* args = (VaryArgs1*)((char*)(thread->m_stack + thread->m_sp) - sizeof(VaryArgs1));
-        args->m_sourceT += thread->m_dt;
+  return true;
+}
 
-        if (args->m_sourceT < args->m_destT)
-        {
-          rio2d::Script::Number time = Easing::evaluate(ease, args->m_sourceT / args->m_destT);
-          setField(node, field, args->m_sourceA + time * (args->m_destA - args->m_sourceA));
-          return false;
-        }
-        else
-        {
-          setField(node, field, args->m_destA);
-          thread->m_dt = args->m_sourceT - args->m_destT;
-          thread->m_sp -= 4;
-          thread->m_pc += 3;
-          return true;
-        }
+bool rio2d::ScriptBase::runActionArgs(cocos2d::Ref* listener, NotifyFunc port, Subroutine* global, cocos2d::Node* target, const Argument* args, size_t count)
+{
+  if (!matches(global, args, count, 1))
+  {
+    return false;
+  }
 
-        break;
-      }
+  return RunnerImpl::spawn(this, global, m_bytecode, listener, port, &target, 1, args);
+}
 
-      case Fields::kPositionIndex:
-      case Fields::kSkewIndex:
-      {
-        VaryArgs2* args = (VaryArgs2*)((char*)(thread->m_stack + thread->m_sp) - sizeof(VaryArgs2));
-        args->m_sourceT += thread->m_dt;
+bool rio2d::ScriptBase::runActionBatch(Hash hash, cocos2d::Node* const* targets, size_t count, const Argument* args, size_t numArgs)
+{
+  Subroutine* global = find(hash);
 
-        if (args->m_sourceT < args->m_destT)
-        {
-          rio2d::Script::Number time = Easing::evaluate(ease, args->m_sourceT / args->m_destT);
-          float a = args->m_sourceA + time * (args->m_destA - args->m_sourceA);
-          float b = args->m_sourceB + time * (args->m_destB - args->m_sourceB);
-          setField(node, field, a, b);
-          return false;
-        }
-        else
-        {
-          setField(node, field, args->m_destA, args->m_destB);
-          thread->m_dt = args->m_sourceT - args->m_destT;
-          thread->m_sp -= 6;
-          thread->m_pc += 3;
-          return true;
-        }
+  if (global == nullptr)
+  {
+    return false;
+  }
+
+  // The types of the parameters are only known after compiling the subroutine.
+  if (!global->m_compiled)
+  {
+    compile(global);
+  }
+
+  if (!matches(global, args, numArgs, count))
+  {
+    return false;
+  }
 
-        break;
-      }
+  return RunnerImpl::spawn(this, global, m_bytecode, nullptr, nullptr, targets, count, args);
+}
 
-      case Fields::kTintIndex:
-      {
-        VaryArgs3* args = (VaryArgs3*)((char*)(thread->m_stack + thread->m_sp) - sizeof(VaryArgs3));
-        args->m_sourceT += thread->m_dt;
+bool rio2d::ScriptBase::runActionBatch(Name name, cocos2d::Node* const* targets, size_t count, const Argument* args, size_t numArgs)
+{
+  return runActionBatch(name.m_hash, targets, count, args, numArgs);
+}
 
-        if (args->m_sourceT < args->m_destT)
-        {
-          rio2d::Script::Number time = Easing::evaluate(ease, args->m_sourceT / args->m_destT);
-          float a = args->m_sourceA + time * (args->m_destA - args->m_sourceA);
-          float b = args->m_sourceB + time * (args->m_destB - args->m_sourceB);
-          float c = args->m_sourceC + time * (args->m_destC - args->m_sourceC);
-          setField(node, field, a, b, c);
-          return false;
-        }
-        else
-        {
-          setField(node, field, args->m_destA, args->m_destB, args->m_destC);
-          thread->m_dt = args->m_sourceT - args->m_destT;
-          thread->m_sp -= 8;
-          thread->m_pc += 3;
-          return true;
-        }
+bool rio2d::ScriptBase::runActionBatch(const char* name, cocos2d::Node* const* targets, size_t count, const Argument* args, size_t numArgs)
+{
+  return runActionBatch(hashLower(name), targets, count, args, numArgs);
+}
 
-        break;
-      }
-      }
+bool rio2d::ScriptBase::prewarm(Hash hash, size_t count)
+{
+  Subroutine* global = find(hash);
 
-      return true;
-    }
+  if (global == nullptr)
+  {
+    return false;
+  }
 
-    bool varyRel(Thread* thread)
-    {
-      rio2d::Script::Index index = m_bytecode[thread->m_pc].m_index;
-      rio2d::Script::Index field = m_bytecode[thread->m_pc + 1].m_index;
-      rio2d::Script::Index ease = m_bytecode[thread->m_pc + 2].m_index;
+  if (!global->m_compiled)
+  {
+    compile(global);
+  }
 
-      rio2d::Script::LocalVar* local = m_locals + index;
-      cocos2d::Node* node = (cocos2d::Node*)local->m_pointer;
+  return RunnerImpl::reserve(m_allocator, RunnerImpl::size(m_config, global->m_numLocals), count) != nullptr;
+}
 
-      switch (field)
-      {
-      case Fields::kPositionIndex:
-      {
-        VaryArgs2* args = (VaryArgs2*)((char*)(thread->m_stack + thread->m_sp) - sizeof(VaryArgs2));
-        args->m_sourceT += thread->m_dt;
+bool rio2d::ScriptBase::prewarm(Name name, size_t count)
+{
+  return prewarm(name.m_hash, count);
+}
 
-        if (args->m_sourceT < args->m_destT)
-        {
-          rio2d::Script::Number time = Easing::evaluate(ease, args->m_sourceT / args->m_destT);
-          node->setPositionX(args->m_sourceA + time * args->m_destA);
-          node->setPositionY(args->m_sourceB + time * args->m_destB);
-          return false;
-        }
-        else
-        {
-          node->setPositionX(args->m_sourceA + args->m_destA);
-          node->setPositionY(args->m_sourceB + args->m_destB);
-          thread->m_dt = args->m_sourceT - args->m_destT;
-          thread->m_sp -= 6;
-          thread->m_pc += 3;
-          return true;
-        }
+bool rio2d::ScriptBase::prewarm(const char* name, size_t count)
+{
+  return prewarm(hashLower(name), count);
+}
 
-        break;
-      }
+void rio2d::ScriptBase::purgeRunners()
+{
+  RunnerImpl::purge();
+}
 
-      case Fields::kRotationIndex:
-      case Fields::kScaleIndex:
-      {
-        VaryArgs1* args = (VaryArgs1*)((char*)(thread->m_stack + thread->m_sp) - sizeof(VaryArgs1));
-        args->m_sourceT += thread->m_dt;
+rio2d::ScriptBase::Callable::Callable()
+  : m_script(nullptr)
+  , m_global(nullptr)
+{
+}
 
-        if (args->m_sourceT < args->m_destT)
-        {
-          rio2d::Script::Number time = Easing::evaluate(ease, args->m_sourceT / args->m_destT);
-          setField(node, field, args->m_sourceA + time * args->m_destA);
-          return false;
-        }
-        else
-        {
-          setField(node, field, args->m_sourceA + args->m_destA);
-          thread->m_dt = args->m_sourceT - args->m_destT;
-          thread->m_sp -= 4;
-          thread->m_pc += 3;
-          return true;
-        }
+rio2d::ScriptBase::Callable::Callable(const Callable& other)
+  : m_script(other.m_script)
+  , m_global(other.m_global)
+{
+  CC_SAFE_RETAIN(m_script);
+}
 
-        break;
-      }
-      }
+rio2d::ScriptBase::Callable::~Callable()
+{
+  CC_SAFE_RELEASE(m_script);
+}
 
-      return true;
-    }
+rio2d::ScriptBase::Callable& rio2d::ScriptBase::Callable::operator=(const Callable& other)
+{
+  // Retain first in case both are the same.
+  CC_SAFE_RETAIN(other.m_script);
+  CC_SAFE_RELEASE(m_script);
 
-    bool consume(Thread* thread)
-    {
-      // Execute a thread until an insn that consumes time.
-      // If the thread executes the same address twice while in here, stop it (infinite loop).
+  m_script = other.m_script;
+  m_global = other.m_global;
+  return *this;
+}
 
-      rio2d::Script::Address saved_pc = thread->m_pc;
+bool rio2d::ScriptBase::Callable::isValid() const
+{
+  return m_script != nullptr && !m_script->isStale();
+}
 
-      do
-      {
-        bool cont;
+rio2d::ScriptBase::Callable rio2d::ScriptBase::prepare(Hash hash)
+{
+  Callable callable;
+  Subroutine* global = find(hash);
 
-        switch (m_bytecode[thread->m_pc++].m_insn)
-        {
-        // Insns that take 0 time.
-        case Insns::kAdd:             cont = add(thread); break;
-        case Insns::kCallMethod:      cont = callMethod(thread); break;
-        case Insns::kCeil:            cont = ceil(thread); break;
-        case Insns::kCmpEqual:        cont = cmpEqual(thread); break;
-        case Insns::kCmpGreater:      cont = cmpGreater(thread); break;
-        case Insns::kCmpGreaterEqual: cont = cmpGreaterEqual(thread); break;
-        case Insns::kCmpLess:         cont = cmpLess(thread); break;
-        case Insns::kCmpLessEqual:    cont = cmpLessEqual(thread); break;
-        case Insns::kCmpNotEqual:     cont = cmpNotEqual(thread); break;
-        case Insns::kDiv:             cont = div(thread); break;
-        case Insns::kFloor:           cont = floor(thread); break;
-        case Insns::kGetLocal:        cont = getLocal(thread); break;
-        case Insns::kGetProp:         cont = getProp(thread); break;
-        case Insns::kLogicalAnd:      cont = logicalAnd(thread); break;
-        case Insns::kLogicalNot:      cont = logicalNot(thread); break;
-        case Insns::kLogicalOr:       cont = logicalOr(thread); break;
-        case Insns::kModulus:         cont = modulus(thread); break;
-        case Insns::kMul:             cont = mul(thread); break;
-        case Insns::kNeg:             cont = neg(thread); break;
-        case Insns::kPush:            cont = push(thread); break;
-        case Insns::kRand:            cont = rand(thread); break;
-        case Insns::kRandRange:       cont = randRange(thread); break;
-        case Insns::kSetLocal:        cont = setLocal(thread); break;
-        case Insns::kSetFrame:        cont = setFrame(thread); break;
-        case Insns::kSetProp:         cont = setProp(thread); break;
-        case Insns::kSignal:          cont = signal(thread); break;
-        case Insns::kSpawn:           cont = spawn(thread); break;
-        case Insns::kSub:             cont = sub(thread); break;
-        case Insns::kTrunc:           cont = trunc(thread); break;
+  if (global != nullptr)
+  {
+    // Generate the code now so runs don't have to check.
+    if (!global->m_compiled)
+    {
+      compile(global);
+    }
 
-        // Insns that consume time.
-        case Insns::kPause:           cont = pause(thread); break;
-        case Insns::kVaryAbs:         cont = varyAbs(thread); break;
-        case Insns::kVaryRel:         cont = varyRel(thread); break;
+    retain();
+    callable.m_script = this;
+    callable.m_global = global;
+  }
 
-        // Insns that jump in into the code.
-        case Insns::kJump:            cont = jump(thread); break;
-        case Insns::kJz:              cont = jz(thread); break;
-        case Insns::kNext:            cont = next(thread); break;
+  return callable;
+}
 
-        default:                      CCASSERT(0, "Unknown instruction");
-        case Insns::kStop:            return true;
-        }
+rio2d::ScriptBase::Callable rio2d::ScriptBase::prepare(Name name)
+{
+  return prepare(name.m_hash);
+}
 
-        if (!cont)
-        {
-          thread->m_pc--;
-          thread->m_dt = 0.0f;
-          return false;
-        }
+rio2d::ScriptBase::Callable rio2d::ScriptBase::prepare(const char* name)
+{
+  return prepare(hashLower(name));
+}
 
-        if (thread->m_pc == saved_pc)
-        {
-          // Avoid infinite loops.
-          thread->m_dt = 0.0f;
-          return false;
-        }
-      } while (thread->m_dt > 0.0f);
+void rio2d::ScriptBase::invalidate()
+{
+  m_stale = true;
+}
 
-      return false;
-    }
-  };
+bool rio2d::ScriptBase::isStale() const
+{
+  return m_stale;
 }
 
-rio2d::Script* rio2d::Script::initWithSource(const char* source, char* error, size_t size)
+void rio2d::ScriptBase::getMemoryStats(MemoryStats* stats) const
 {
-  Script *self = new (std::nothrow) Script();
+  size_t numLocals = 0;
 
-  if (self && self->init(source, error, size))
+  for (size_t i = 0; i < m_numGlobals; i++)
   {
-    self->autorelease();
-    return self;
+    numLocals += m_globals[i].m_numLocals;
   }
 
-  CC_SAFE_DELETE(self);
-  return nullptr;
+  stats->m_scriptBytes = m_arenaSize + (m_ownsImage ? m_imageSize : 0);
+  stats->m_bytecodeBytes = m_bcSize * sizeof(Bytecode);
+  stats->m_globalsBytes = m_numGlobals * (sizeof(Subroutine) + sizeof(Usage)) + numLocals * sizeof(LocalVar) + ((size_t)1 << m_indexBits) * sizeof(uint16_t);
+  stats->m_numRunners = m_numRunners;
+  stats->m_runnerBytes = m_runnerBytes;
+  stats->m_peakRunners = m_peakRunners;
+  stats->m_peakRunnerBytes = m_peakRunnerBytes;
 }
 
-bool rio2d::Script::runAction(Hash hash, cocos2d::Node* target, ...)
+size_t rio2d::ScriptBase::getSubroutineStats(SubroutineStats* stats, size_t count) const
 {
-  va_list args;
-  va_start(args, target);
+  for (size_t i = 0; i < std::min(count, m_numGlobals); i++)
+  {
+    const Subroutine* global = m_globals + i;
+    const Usage* usage = m_usage + i;
 
-  bool res = runActionV(nullptr, nullptr, hash, target, args);
+    stats[i].m_hash = global->m_hash;
+    stats[i].m_numRunners = usage->m_numRunners;
+    stats[i].m_runnerBytes = usage->m_numRunners * RunnerImpl::slotSize(m_config, global->m_numLocals);
+    stats[i].m_peakRunners = usage->m_peakRunners;
+  }
 
-  va_end(args);
-  return res;
+  return m_numGlobals;
 }
 
-bool rio2d::Script::runAction(const char* name, cocos2d::Node* target, ...)
+void rio2d::ScriptBase::resetPeaks()
 {
-  va_list args;
-  va_start(args, target);
+  for (size_t i = 0; i < m_numGlobals; i++)
+  {
+    m_usage[i].m_peakRunners = m_usage[i].m_numRunners;
+  }
+
+  m_peakRunners = m_numRunners;
+  m_peakRunnerBytes = m_runnerBytes;
+}
 
-  bool res = runActionV(nullptr, nullptr, rio2d::Hash(name), target, args);
+size_t rio2d::ScriptBase::getPooledBytes()
+{
+  return RunnerImpl::pooled();
+}
 
-  va_end(args);
-  return res;
+size_t rio2d::ScriptBase::snapshotRunners(void* buffer, size_t size, const NodeToId& toId) const
+{
+  return RunnerImpl::snapshot(this, nullptr, buffer, size, toId);
 }
 
-bool rio2d::Script::runActionWithListener(cocos2d::Ref* listener, NotifyFunc port, Hash hash, cocos2d::Node* target, ...)
+bool rio2d::ScriptBase::restoreRunners(const void* buffer, size_t size, const IdToNode& toNode, cocos2d::Ref* listener, NotifyFunc port)
 {
-  va_list args;
-  va_start(args, target);
+  const char* start = (const char*)buffer;
+  const char* end = start + size;
+  uint32_t count;
+
+  if (!RunnerImpl::readHeader(start, end, &count))
+  {
+    return false;
+  }
+
+  // Validate the whole snapshot before starting the runners.
+  for (int pass = 0; pass < 2; pass++)
+  {
+    const char* in = start;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+      Hash hash;
+
+      if (!RunnerImpl::get(in, end, &hash, sizeof(hash)))
+      {
+        return false;
+      }
+
+      Subroutine* global = find(hash);
+
+      if (global == nullptr)
+      {
+        return false;
+      }
+
+      if (!global->m_compiled)
+      {
+        compile(global);
+      }
 
-  bool res = runActionV(listener, port, hash, target, args);
+      // Subroutines are laid out in order, each one ending where the next one starts.
+      Address limit = global + 1 < m_globals + m_numGlobals ? global[1].m_pc : (Address)m_bcSize;
+
+      if (pass == 0)
+      {
+        if (!RunnerImpl::read(nullptr, global, m_bytecode, limit, m_config, in, end, toNode))
+        {
+          return false;
+        }
+      }
+      else if (!RunnerImpl::restore(this, global, m_bytecode, limit, in, end, toNode, listener, port))
+      {
+        return false;
+      }
+    }
+  }
 
-  va_end(args);
-  return res;
+  return true;
 }
 
-bool rio2d::Script::runActionWithListener(cocos2d::Ref* listener, NotifyFunc port, const char* name, cocos2d::Node* target, ...)
+void rio2d::ScriptBase::buildIndex()
 {
-  va_list args;
-  va_start(args, target);
+  unsigned bits = Arena::indexBits(m_numGlobals);
+  size_t size = (size_t)1 << bits;
+
+  memset(m_index, 0, size * sizeof(uint16_t));
+  m_indexBits = bits;
+
+  for (size_t i = 0; i < m_numGlobals; i++)
+  {
+    size_t j = rio2d::detail::slot(m_globals[i].m_hash, bits);
 
-  bool res = runActionV(listener, port, hash(name), target, args);
+    while (m_index[j] != 0)
+    {
+      j = (j + 1) & (size - 1);
+    }
 
-  va_end(args);
-  return res;
+    m_index[j] = (uint16_t)(i + 1);
+  }
 }
 
-bool rio2d::Script::runActionV(cocos2d::Ref* listener, NotifyFunc port, Hash hash, cocos2d::Node* target, va_list args)
+rio2d::ScriptBase::Subroutine* rio2d::ScriptBase::find(Hash hash) const
 {
-  Subroutine* global = m_globals;
-  const Subroutine* end = global + m_numGlobals;
+  size_t mask = ((size_t)1 << m_indexBits) - 1;
+  size_t j = rio2d::detail::slot(hash, m_indexBits);
 
-  while (global < end)
+  // The index is never full, so there's always an empty slot to stop the search.
+  while (m_index[j] != 0)
   {
+    Subroutine* global = m_globals + m_index[j] - 1;
+
     if (global->m_hash == hash)
     {
-      Runner* action = Runner::create(this, global->m_locals, global->m_numLocals, m_bytecode, global->m_pc, listener, port, target, args);
-      target->runAction(action);
-      return true;
+      return global;
     }
 
-    global++;
+    j = (j + 1) & mask;
   }
 
-  return false;
+  return nullptr;
+}
+
+void rio2d::ScriptBase::compile(Subroutine* global)
+{
+  Parser parser(m_config);
+  parser.initWithSubroutine(m_source, m_bytecode, global);
 }
 
-bool rio2d::Script::init(const char* source, char* error, size_t size)
+bool rio2d::ScriptBase::init(const char* source, char* error, size_t size, unsigned options)
 {
-  Parser parser;
+  Parser parser(m_config);
+  Arena arena(m_allocator);
+  bool lazy = (options & kCompileLazily) != 0;
 
-  int res = parser.initWithSourceAndPointers(source, &m_bytecode, &m_bcSize, &m_globals, &m_numGlobals);
+  int res;
+
+  if (!lazy && (options & kCompileInParallel) != 0)
+  {
+    res = parser.initWithSourceInParallel(source, &arena, &m_bcSize, &m_numGlobals);
+  }
+  else
+  {
+    res = parser.initWithSourceAndPointers(source, &arena, &m_bcSize, &m_numGlobals, lazy);
+  }
 
   if (res == Errors::kOk)
   {
+    m_globals = arena.m_globals;
+    m_index = arena.m_index;
+    m_usage = arena.m_usage;
+    m_bytecode = arena.m_bytecode;
+    m_source = arena.m_source;
+    m_arenaSize = arena.m_size;
+
+    buildIndex();
     return true;
   }
 
   if (error != nullptr)
   {
-    const char* msg;
-
-    switch (res)
-    {
-    case Errors::kMalformedNumber:         msg = "Malformed number"; break;
-    case Errors::kUnterminatedString:      msg = "Unterminated string"; break;
-    case Errors::kUnexpectedEOF:           msg = "Unexpected end of file"; break;
-    case Errors::kInvalidCharacterInInput: msg = "Invalid character in input"; break;
-    case Errors::kUnexpectedToken:         msg = "Unexpected token"; break;
-    case Errors::kOutOfMemory:             msg = "Out of memory"; break;
-    case Errors::kUnknownType:             msg = "Unknown type"; break;
-    case Errors::kDuplicateIdentifier:     msg = "Duplicated identifier"; break;
-    case Errors::kUnknownIdentifier:       msg = "Unknown identifier"; break;
-    case Errors::kUnknownField:            msg = "Unknown field"; break;
-    case Errors::kTypeMismatch:            msg = "Type mismatch"; break;
-    case Errors::kFirstParamNotANode:      msg = "First parameter must be of type \"node\""; break;
-    case Errors::kUnknownEaseFunc:         msg = "Unknown easing function"; break;
-    default:                               msg = "Unknown error"; break;
-    }
+    const char* msg = Errors::describe((Errors::Enum)res);
 
     size_t length, i;
     const char* lexeme = parser.getLexeme(&length);
@@ -3544,3 +2494,26 @@ bool rio2d::Script::init(const char* source, char* error, size_t size)
 
   return false;
 }
+
+bool rio2d::ScriptBase::initBytecode(const void* image, size_t size)
+{
+  Arena arena(m_allocator);
+  Errors::Enum res = Image::read(image, size, m_config, &arena, &m_bcSize, &m_numGlobals);
+
+  if (res != Errors::kOk)
+  {
+    CCLOG("%s", Errors::describe(res));
+    return false;
+  }
+
+  m_image = image;
+  m_imageSize = size;
+  m_globals = arena.m_globals;
+  m_index = arena.m_index;
+  m_usage = arena.m_usage;
+  m_bytecode = arena.m_bytecode;
+  m_arenaSize = arena.m_size;
+
+  buildIndex();
+  return true;
+}
@@ -23,8 +23,23 @@
 
 #include <map>
 #include <atomic>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "rio2d.h"
+#include "bundle.inl"
+
+#define MD5_STATIC static
+#include "md5.inl"
 
 #ifndef NDEBUG
 #include "civetweb.h"
@@ -36,6 +51,99 @@ static std::map<rio2d::Hash, std::atomic_uintptr_t*> m_scripts;
 static std::map<rio2d::Hash, uintptr_t> m_scripts;
 #endif
 
+// Guards m_scripts, which can be changed by preload and the web server threads, and the bundles below.
+static std::mutex s_mutex;
+
+// A mounted bundle, memory mapped if possible or read into memory otherwise.
+struct Mount
+{
+  const void* m_data;
+  size_t m_size;
+  bool m_mapped;
+};
+
+static std::vector<Mount> s_mounts;
+
+#ifndef NDEBUG
+// The scripts created from the bundles, including the ones replaced by live reloads.
+static std::vector<rio2d::Script*> s_inPlace;
+#endif
+
+static void unmount(const Mount& mount)
+{
+  if (!mount.m_mapped)
+  {
+    free((void*)mount.m_data);
+  }
+  else
+  {
+#ifdef _WIN32
+    UnmapViewOfFile(mount.m_data);
+#else
+    munmap((void*)mount.m_data, mount.m_size);
+#endif
+  }
+}
+
+static bool mapFile(const std::string& path, Mount* mount)
+{
+#ifdef _WIN32
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+  if (file == INVALID_HANDLE_VALUE)
+  {
+    return false;
+  }
+
+  LARGE_INTEGER size;
+  HANDLE mapping = nullptr;
+
+  if (GetFileSizeEx(file, &size) && size.QuadPart != 0)
+  {
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  }
+
+  CloseHandle(file);
+
+  if (mapping == nullptr)
+  {
+    return false;
+  }
+
+  // The view keeps the mapping alive.
+  mount->m_data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  mount->m_size = (size_t)size.QuadPart;
+  CloseHandle(mapping);
+  return mount->m_data != nullptr;
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+
+  if (fd == -1)
+  {
+    return false;
+  }
+
+  struct stat st;
+  void* data = MAP_FAILED;
+
+  if (fstat(fd, &st) == 0 && st.st_size != 0)
+  {
+    data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+
+  close(fd);
+
+  if (data == MAP_FAILED)
+  {
+    return false;
+  }
+
+  mount->m_data = data;
+  mount->m_size = (size_t)st.st_size;
+  return true;
+#endif
+}
+
 bool rio2d::Webserver::init(short port)
 {
 #ifndef NDEBUG
@@ -64,6 +172,8 @@ void rio2d::Webserver::destroy()
   mg_stop(s_ctx);
   s_ctx = nullptr;
 
+  std::lock_guard<std::mutex> lock(s_mutex);
+
   for (auto it = m_scripts.begin(); it != m_scripts.end(); ++it)
   {
     auto script = (Script*)it->second->load();
@@ -71,16 +181,230 @@ void rio2d::Webserver::destroy()
     delete it->second;
   }
 #else
+  std::lock_guard<std::mutex> lock(s_mutex);
+
   for (auto it = m_scripts.begin(); it != m_scripts.end(); ++it)
   {
     auto script = (Script*)it->second;
     script->release();
   }
 #endif
+
+  m_scripts.clear();
+
+#ifndef NDEBUG
+  for (auto it = s_inPlace.begin(); it != s_inPlace.end(); ++it)
+  {
+    CCASSERT((*it)->getReferenceCount() == 1, "A script from a bundle is still in use, it can't outlive destroy");
+    (*it)->release();
+  }
+
+  s_inPlace.clear();
+#endif
+
+  // Scripts loaded from the bundles can't be used anymore.
+  for (auto it = s_mounts.begin(); it != s_mounts.end(); ++it)
+  {
+    unmount(*it);
+  }
+
+  s_mounts.clear();
+}
+
+bool rio2d::Webserver::mount(const char* filename)
+{
+  auto utils = cocos2d::FileUtils::getInstance();
+  Mount mount;
+
+  if (mapFile(utils->fullPathForFilename(filename), &mount))
+  {
+    mount.m_mapped = true;
+  }
+  else
+  {
+    // Files inside packages, i.e. Android's assets, can't be mapped.
+    auto data = utils->getDataFromFile(filename);
+
+    if (data.isNull())
+    {
+      CCLOG("Error reading from %s", filename);
+      return false;
+    }
+
+    ssize_t size;
+    mount.m_data = data.takeBuffer(&size);
+    mount.m_size = (size_t)size;
+    mount.m_mapped = false;
+  }
+
+  if (!Bundle::validate(mount.m_data, mount.m_size))
+  {
+    CCLOG("Invalid bundle %s", filename);
+    unmount(mount);
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(s_mutex);
+  s_mounts.push_back(mount);
+  return true;
+}
+
+// Returns the path of the cached image for the source code, keyed by the MD5 of the bytecode version and the source.
+static std::string getCachePath(const char* source, size_t length)
+{
+  static std::once_flag s_once;
+  static std::string s_cacheDir;
+
+  std::call_once(s_once, []()
+  {
+    auto utils = cocos2d::FileUtils::getInstance();
+    s_cacheDir = utils->getWritablePath() + "rio2d/";
+    utils->createDirectory(s_cacheDir);
+  });
+
+  uint32_t version = rio2d::Script::kBytecodeVersion;
+  md5_byte_t digest[16];
+  md5_state_t state;
+
+  md5_init(&state);
+  md5_append(&state, (const md5_byte_t*)&version, sizeof(version));
+  md5_append(&state, (const md5_byte_t*)source, length);
+  md5_finish(&state, digest);
+
+  char name[40];
+
+  for (int i = 0; i < 16; i++)
+  {
+    sprintf(name + i * 2, "%02x", digest[i]);
+  }
+
+  strcpy(name + 32, ".rio");
+  return s_cacheDir + name;
+}
+
+static void* readCache(const std::string& path, size_t* size)
+{
+  FILE* file = fopen(path.c_str(), "rb");
+
+  if (file == nullptr)
+  {
+    return nullptr;
+  }
+
+  void* image = nullptr;
+  long length;
+
+  if (fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0)
+  {
+    image = rio2d::getAllocator()->allocate((size_t)length);
+
+    if (image != nullptr && fread(image, 1, (size_t)length, file) != (size_t)length)
+    {
+      rio2d::getAllocator()->deallocate(image);
+      image = nullptr;
+    }
+
+    *size = (size_t)length;
+  }
+
+  fclose(file);
+  return image;
+}
+
+static void writeCache(const std::string& path, const rio2d::Script* script)
+{
+  size_t size = script->writeBytecode(nullptr, 0);
+  void* image = malloc(size);
+
+  if (image == nullptr)
+  {
+    return;
+  }
+
+  script->writeBytecode(image, size);
+
+  // Write to a temporary file first so other threads never read a partial image.
+  static std::atomic<unsigned> s_counter(0);
+  char suffix[16];
+  snprintf(suffix, sizeof(suffix), ".%u", s_counter++);
+  std::string temp = path + suffix;
+
+  FILE* file = fopen(temp.c_str(), "wb");
+
+  if (file != nullptr)
+  {
+    bool ok = fwrite(image, 1, size, file) == size;
+
+    if (fclose(file) == 0 && ok)
+    {
+      remove(path.c_str());
+      ok = rename(temp.c_str(), path.c_str()) == 0;
+    }
+
+    if (!ok)
+    {
+      remove(temp.c_str());
+    }
+  }
+
+  free(image);
 }
 
-static rio2d::Script* initWithFilename(const char* filename, char* error, size_t size)
+// Loads the script from the compile cache, or compiles it and adds it to the cache. The source must be null-terminated.
+static rio2d::Script* newWithCachedSource(const char* source, size_t length, char* error, size_t size)
 {
+  std::string path = getCachePath(source, length);
+  size_t imageSize;
+  void* image = readCache(path, &imageSize);
+
+  if (image != nullptr)
+  {
+    rio2d::Script* script = rio2d::Script::newWithOwnedBytecode(image, imageSize);
+
+    if (script != nullptr)
+    {
+      return script;
+    }
+  }
+
+  rio2d::Script* script = rio2d::Script::newWithSource(source, error, size, 0);
+
+  if (script != nullptr)
+  {
+    writeCache(path, script);
+  }
+
+  return script;
+}
+
+// Returns a script that is not autoreleased, so it can be called from any thread. mounts is s_mounts, or a copy of it made
+// with s_mutex locked, and inPlace tells if the script uses one of them.
+static rio2d::Script* newWithFilename(const char* filename, const std::vector<Mount>& mounts, bool* inPlace, char* error, size_t size)
+{
+  // Scripts in the mounted bundles are used in place.
+  rio2d::Hash hash = rio2d::hash(filename);
+  *inPlace = false;
+
+  for (auto it = mounts.begin(); it != mounts.end(); ++it)
+  {
+    size_t imageSize;
+    const void* image = Bundle::find(it->m_data, it->m_size, hash, &imageSize);
+
+    if (image != nullptr)
+    {
+      rio2d::Script* script = rio2d::Script::newWithBytecode(image, imageSize);
+
+      if (script != nullptr)
+      {
+        *inPlace = true;
+        return script;
+      }
+
+      CCLOG("Invalid bytecode for %s, compiling the source code", filename);
+      break;
+    }
+  }
+
   auto data = cocos2d::FileUtils::getInstance()->getDataFromFile(filename);
 
   if (data.isNull())
@@ -100,7 +424,7 @@ static rio2d::Script* initWithFilename(const char* filename, char* error, size_t
   memcpy(source, data.getBytes(), data.getSize());
   source[data.getSize()] = 0;
 
-  rio2d::Script* script = rio2d::Script::initWithSource(source, error, size);
+  rio2d::Script* script = newWithCachedSource(source, data.getSize(), error, size);
 
   if (script == nullptr)
   {
@@ -139,11 +463,18 @@ static int handleScriptUpload(struct mg_connection* conn, void* cbdata)
   // Check if we're watching the script.
   // Disregard the leading slash, note that the URI length must be at least 1 in a valid HTTP request.
   rio2d::Hash hash = rio2d::hash(req->request_uri + 1);
-  auto it = m_scripts.find(hash);
+  std::atomic_uintptr_t* atomic;
 
-  if (it == m_scripts.end())
   {
-    return serverError(conn, "Unknown resource");
+    std::lock_guard<std::mutex> lock(s_mutex);
+    auto it = m_scripts.find(hash);
+
+    if (it == m_scripts.end())
+    {
+      return serverError(conn, "Unknown resource");
+    }
+
+    atomic = it->second;
   }
 
   // Read POST data.
@@ -165,7 +496,7 @@ static int handleScriptUpload(struct mg_connection* conn, void* cbdata)
 
   // Compile the new script.
   char error[256];
-  auto script = rio2d::Script::initWithSource(source, error, sizeof(error));
+  auto script = newWithCachedSource(source, numread, error, sizeof(error));
 
   if (script == nullptr)
   {
@@ -174,8 +505,8 @@ static int handleScriptUpload(struct mg_connection* conn, void* cbdata)
   }
 
   // Replace the old script for the new.
-  auto old = (rio2d::Script*)it->second->exchange((uintptr_t)script);
-  script->retain();
+  auto old = (rio2d::Script*)atomic->exchange((uintptr_t)script);
+  old->invalidate();
   old->release();
 
   // Ok!
@@ -185,30 +516,35 @@ static int handleScriptUpload(struct mg_connection* conn, void* cbdata)
 }
 #endif
 
-rio2d::Script* rio2d::Webserver::getScript(const char* filename)
+// Keeps a reference to a script that uses a bundle in place, so destroy can check that nobody else holds it before
+// unmapping the bundles. Must be called with s_mutex locked.
+static void trackInPlace(rio2d::Script* script)
+{
+#ifndef NDEBUG
+  script->retain();
+  s_inPlace.push_back(script);
+#else
+  (void)script;
+#endif
+}
+
+// Adds a script to the resource map, must be called with s_mutex locked. Takes ownership of the script.
+static rio2d::Script* addScript(rio2d::Hash hash, const char* filename, rio2d::Script* script)
 {
-  // Try to find an existing script.
-  Hash hash = rio2d::hash(filename);
   auto it = m_scripts.find(hash);
 
   if (it != m_scripts.end())
   {
+    // Someone else added the script first, keep theirs.
+    script->release();
+
 #ifndef NDEBUG
-    return (Script*)it->second->load();
+    return (rio2d::Script*)it->second->load();
 #else
-    return (Script*)it->second;
+    return (rio2d::Script*)it->second;
 #endif
   }
 
-  // Not found, try to load it from the file system.
-  char error[256];
-  Script* script = initWithFilename(filename, error, sizeof(error));
-
-  if (script == nullptr)
-  {
-    return nullptr;
-  }
-
 #ifndef NDEBUG
   // Ok, add it to the resource map.
   auto atomic = new (std::nothrow) std::atomic_uintptr_t((uintptr_t)script);
@@ -220,7 +556,7 @@ rio2d::Script* rio2d::Webserver::getScript(const char* filename)
 
   if (path == nullptr)
   {
-    CCLOG("Error allocating memory, script %s not being watched");
+    CCLOG("Error allocating memory, script %s not being watched", filename);
   }
   else
   {
@@ -237,11 +573,130 @@ rio2d::Script* rio2d::Webserver::getScript(const char* filename)
     mg_set_request_handler(s_ctx, path, handleScriptUpload, nullptr);
   }
 #else
+  (void)filename;
   auto pair = std::pair<rio2d::Hash, uintptr_t>(hash, (uintptr_t)script);
   m_scripts.insert(pair);
 #endif
 
-  // Ok!
-  script->retain();
   return script;
 }
+
+rio2d::Script* rio2d::Webserver::getScript(const char* filename)
+{
+  std::lock_guard<std::mutex> lock(s_mutex);
+
+  // Try to find an existing script.
+  Hash hash = rio2d::hash(filename);
+  auto it = m_scripts.find(hash);
+
+  if (it != m_scripts.end())
+  {
+#ifndef NDEBUG
+    return (Script*)it->second->load();
+#else
+    return (Script*)it->second;
+#endif
+  }
+
+  // Not found, try to load it from the file system.
+  char error[256];
+  bool inPlace;
+  Script* script = newWithFilename(filename, s_mounts, &inPlace, error, sizeof(error));
+
+  if (script == nullptr)
+  {
+    return nullptr;
+  }
+
+  if (inPlace)
+  {
+    trackInPlace(script);
+  }
+
+  // Ok!
+  return addScript(hash, filename, script);
+}
+
+std::future<bool> rio2d::Webserver::preload(const std::vector<std::string>& filenames)
+{
+  return std::async(std::launch::async, [filenames]() -> bool
+  {
+    size_t count = filenames.size();
+    std::vector<Script*> scripts(count, nullptr);
+    std::vector<bool> loaded(count, false);
+    std::vector<char> inPlace(count, 0); // Not bool, the workers set different elements at the same time.
+    std::vector<Mount> mounts;
+
+    {
+      // Don't compile scripts that are already loaded.
+      std::lock_guard<std::mutex> lock(s_mutex);
+
+      for (size_t i = 0; i < count; i++)
+      {
+        loaded[i] = m_scripts.find(rio2d::hash(filenames[i].c_str())) != m_scripts.end();
+      }
+
+      // The workers search the bundles without the lock.
+      mounts = s_mounts;
+    }
+
+    std::atomic<size_t> next(0);
+
+    auto worker = [&filenames, &mounts, &scripts, &loaded, &inPlace, &next, count]()
+    {
+      for (;;)
+      {
+        size_t i = next++;
+
+        if (i >= count)
+        {
+          break;
+        }
+
+        if (!loaded[i])
+        {
+          char error[256];
+          bool found;
+          scripts[i] = newWithFilename(filenames[i].c_str(), mounts, &found, error, sizeof(error));
+          inPlace[i] = found;
+        }
+      }
+    };
+
+    size_t numWorkers = std::min<size_t>(std::max<unsigned>(std::thread::hardware_concurrency(), 1), count);
+    std::vector<std::thread> workers;
+
+    for (size_t i = 0; i < numWorkers; i++)
+    {
+      workers.push_back(std::thread(worker));
+    }
+
+    for (size_t i = 0; i < numWorkers; i++)
+    {
+      workers[i].join();
+    }
+
+    // Publish all the scripts at once.
+    std::lock_guard<std::mutex> lock(s_mutex);
+    bool ok = true;
+
+    for (size_t i = 0; i < count; i++)
+    {
+      if (scripts[i] != nullptr)
+      {
+        if (inPlace[i])
+        {
+          trackInPlace(scripts[i]);
+        }
+
+        addScript(rio2d::hash(filenames[i].c_str()), filenames[i].c_str(), scripts[i]);
+      }
+      else if (!loaded[i])
+      {
+        ok = false;
+      }
+    }
+
+    return ok;
+  });
+}
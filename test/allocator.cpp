@@ -0,0 +1,98 @@
+/******************************************************************************
+* Copyright (c) 2016 Andre Leiradella
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+// Resets and destroys bump allocators that hold recycled runners, after which the runner pools must not touch their
+// memory. Compile with g++ -g -std=c++11 -fsanitize=address -I../src -o allocator allocator.cpp ../src/script.cpp and
+// link it with cocos2d-x; it returns a non-zero exit code if a check fails.
+
+#include <stdio.h>
+
+#include "rio2d.h"
+
+namespace
+{
+  int s_failed = 0;
+
+  #define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); s_failed++; } } while (0)
+
+  const char* s_source = "sub spin(n as node)\n  forever\n    n.rotation = n.rotation + 1\n    pause 0.1 secs\n  end\nend\n";
+
+  // Creates a script with the allocator and leaves a few recycled runners in its pool.
+  void prewarm(rio2d::Allocator* allocator)
+  {
+    rio2d::setAllocator(allocator);
+    rio2d::Script* script = rio2d::Script::newWithSource(s_source, nullptr, 0, 0);
+    CHECK(script != nullptr);
+
+    if (script != nullptr)
+    {
+      CHECK(script->prewarm("spin", 8));
+      script->release();
+    }
+
+    rio2d::setAllocator(nullptr);
+    CHECK(rio2d::Script::getPooledBytes() != 0);
+  }
+
+  void testReset()
+  {
+    rio2d::BumpAllocator bump(1 << 16);
+
+    prewarm(&bump);
+    bump.reset();
+    CHECK(rio2d::Script::getPooledBytes() == 0);
+
+    // The buffer is reused by a new pool.
+    prewarm(&bump);
+    bump.reset();
+    CHECK(rio2d::Script::getPooledBytes() == 0);
+  }
+
+  void testDestroy()
+  {
+    for (int i = 0; i < 4; i++)
+    {
+      rio2d::BumpAllocator* bump = new rio2d::BumpAllocator(1 << 16);
+      prewarm(bump);
+      delete bump;
+
+      CHECK(rio2d::Script::getPooledBytes() == 0);
+      rio2d::Script::purgeRunners();
+    }
+  }
+}
+
+int main()
+{
+  testReset();
+  testDestroy();
+
+  if (s_failed != 0)
+  {
+    fprintf(stderr, "%d check(s) failed\n", s_failed);
+    return 1;
+  }
+
+  printf("All checks passed\n");
+  return 0;
+}
@@ -0,0 +1,260 @@
+/******************************************************************************
+* Copyright (c) 2016 Andre Leiradella
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+// Feeds truncated and forged precompiled images to Image::read, which must reject them without reading past the image.
+// Compile with g++ -g -std=c++11 -fsanitize=address -o image image.cpp -lpthread or a similar command, and run it from
+// this directory; it returns a non-zero exit code if a check fails.
+
+#define RIO2D_HEADLESS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include <string>
+#include <vector>
+
+#define CCASSERT(cond, msg) assert(cond)
+#define CCLOG(...) do {} while (0)
+
+#include "../src/rio2d.h"
+#include "../src/compiler.inl"
+
+namespace
+{
+  int s_failed = 0;
+
+  #define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); s_failed++; } } while (0)
+
+  // Reads an image from a buffer of exactly size bytes, so out of bounds reads are caught by the address sanitizer.
+  Errors::Enum read(const std::vector<uint32_t>& words, size_t size, const rio2d::ScriptBase::Config& config)
+  {
+    uint32_t* image = (uint32_t*)malloc(size != 0 ? size : 1);
+    memcpy(image, words.data(), std::min(size, words.size() * sizeof(uint32_t)));
+
+    Arena arena;
+    size_t bcSize, numGlobals;
+    Errors::Enum res = Image::read(image, size, config, &arena, &bcSize, &numGlobals);
+
+    if (res == Errors::kOk)
+    {
+      arena.release();
+    }
+
+    free(image);
+    return res;
+  }
+
+  Errors::Enum read(const std::vector<uint32_t>& words)
+  {
+    return read(words, words.size() * sizeof(uint32_t), rio2d::ScriptBase::Config::get<rio2d::DefaultLimits>());
+  }
+
+  Errors::Enum compile(const char* source, std::vector<uint32_t>* image, const rio2d::ScriptBase::Config& config)
+  {
+    Parser parser(config);
+    Arena arena;
+    size_t bcSize, numGlobals;
+    Errors::Enum res = parser.initWithSourceAndPointers(source, &arena, &bcSize, &numGlobals, false);
+
+    if (res != Errors::kOk)
+    {
+      return res;
+    }
+
+    image->resize(Image::size(arena.m_globals, numGlobals, bcSize) / sizeof(uint32_t));
+    Image::write(image->data(), arena.m_bytecode, bcSize, arena.m_globals, numGlobals);
+    arena.release();
+    return Errors::kOk;
+  }
+
+  bool compile(const char* source, std::vector<uint32_t>* image)
+  {
+    return compile(source, image, rio2d::ScriptBase::Config::get<rio2d::DefaultLimits>()) == Errors::kOk;
+  }
+
+  void testHeaders()
+  {
+    enum { kHeaderWords = sizeof(Image::Header) / sizeof(uint32_t) };
+
+    // A header that claims one subroutine, with the code at offsets that overlap the header.
+    for (uint32_t offset = 0; offset < sizeof(Image::Header); offset += Image::kAlignment)
+    {
+      std::vector<uint32_t> forged(kHeaderWords, 0);
+      Image::Header* header = (Image::Header*)forged.data();
+      header->m_magic = Image::kMagic;
+      header->m_version = Image::kVersion;
+      header->m_numGlobals = 1;
+      header->m_bcOffset = offset;
+      CHECK(read(forged) == Errors::kInvalidBytecode);
+    }
+
+    std::vector<uint32_t> valid;
+    CHECK(compile("sub a(n as node)\n  n.x = 1\nend\n", &valid));
+    CHECK(read(valid) == Errors::kOk);
+
+    std::vector<uint32_t> forged = valid;
+    ((Image::Header*)forged.data())->m_magic ^= 1;
+    CHECK(read(forged) == Errors::kInvalidBytecode);
+
+    forged = valid;
+    ((Image::Header*)forged.data())->m_version++;
+    CHECK(read(forged) == Errors::kInvalidBytecode);
+
+    forged = valid;
+    ((Image::Header*)forged.data())->m_numGlobals = 0xffffffff;
+    CHECK(read(forged) == Errors::kInvalidBytecode);
+
+    forged = valid;
+    ((Image::Header*)forged.data())->m_maxStack = 0xffffffff;
+    CHECK(read(forged) == Errors::kInvalidBytecode);
+
+    forged = valid;
+    ((Image::Header*)forged.data())->m_bcSize = 0xffffffff;
+    CHECK(read(forged) == Errors::kInvalidBytecode);
+
+    forged = valid;
+    ((Image::Header*)forged.data())->m_bcOffset = 0xfffffff0;
+    CHECK(read(forged) == Errors::kInvalidBytecode);
+  }
+
+  void testTruncated()
+  {
+    std::vector<uint32_t> image;
+    CHECK(compile("sub a(n as node, k as number)\n  parallel\n    sequence\n      n.x = k\n    end\n    forever\n      pause 1 secs\n    end\n  end\nend\nsub b(n as node)\n  n.y = 2\nend\n", &image));
+
+    size_t size = image.size() * sizeof(uint32_t);
+    CHECK(read(image) == Errors::kOk);
+
+    for (size_t i = 0; i < size; i++)
+    {
+      CHECK(read(image, i, rio2d::ScriptBase::Config::get<rio2d::DefaultLimits>()) == Errors::kInvalidBytecode);
+    }
+
+    // Images that need more than the limits of the script are rejected too.
+    CHECK(read(image, size, rio2d::ScriptBase::Config::get<rio2d::Limits<1, 32, 32, 16>>()) == Errors::kInvalidBytecode);
+    CHECK(read(image, size, rio2d::ScriptBase::Config::get<rio2d::Limits<128, 1, 32, 16>>()) == Errors::kInvalidBytecode);
+  }
+
+  // The tint takes eight values, and t * 2 one more.
+  void testStack()
+  {
+    static const char* source = "sub a(n as node, t as number)\n  n.tintto 255, 255, 255 in t * 2 secs\nend\n";
+    std::vector<uint32_t> image;
+
+    CHECK(compile(source, &image, rio2d::ScriptBase::Config::get<rio2d::Limits<16, 8, 2, 8>>()) == Errors::kOutOfMemory);
+    CHECK(compile(source, &image, rio2d::ScriptBase::Config::get<rio2d::Limits<16, 8, 2, 9>>()) == Errors::kOk);
+    CHECK(((Image::Header*)image.data())->m_maxStack == 9);
+
+    size_t size = image.size() * sizeof(uint32_t);
+    CHECK(read(image, size, rio2d::ScriptBase::Config::get<rio2d::Limits<16, 8, 2, 9>>()) == Errors::kOk);
+    CHECK(read(image, size, rio2d::ScriptBase::Config::get<rio2d::Limits<16, 8, 2, 8>>()) == Errors::kInvalidBytecode);
+
+    // The depth in the header must be the one of the code, whatever it claims.
+    std::vector<uint32_t> forged = image;
+    ((Image::Header*)forged.data())->m_maxStack = 0;
+    CHECK(read(forged) == Errors::kInvalidBytecode);
+
+    forged = image;
+    ((Image::Header*)forged.data())->m_maxStack = 10;
+    CHECK(read(forged) == Errors::kInvalidBytecode);
+
+    // Code that pops more than it pushed, here the pause that follows the push.
+    CHECK(compile("sub a(n as node)\n  pause 1 secs\nend\n", &image));
+    forged = image;
+    Image::Header* header = (Image::Header*)forged.data();
+    rio2d::Script::Bytecode* bc = (rio2d::Script::Bytecode*)((char*)forged.data() + header->m_bcOffset);
+    CHECK(bc[0].m_insn == Insns::kPush && bc[2].m_insn == Insns::kPause);
+    bc[0].m_insn = Insns::kPause;
+    bc[1].m_insn = Insns::kPause;
+    header->m_maxStack = 0;
+    CHECK(read(forged) == Errors::kInvalidBytecode);
+
+    // Each enclosing loop keeps its limit and step on the stack.
+    source = "sub a(n as node)\n  for i = 1 to 2\n    for j = 1 to 2\n      n.x = i + j\n    next\n  next\nend\n";
+    CHECK(compile(source, &image, rio2d::ScriptBase::Config::get<rio2d::Limits<16, 8, 2, 5>>()) == Errors::kOutOfMemory);
+    CHECK(compile(source, &image, rio2d::ScriptBase::Config::get<rio2d::Limits<16, 8, 2, 6>>()) == Errors::kOk);
+    CHECK(read(image, image.size() * sizeof(uint32_t), rio2d::ScriptBase::Config::get<rio2d::Limits<16, 8, 2, 6>>()) == Errors::kOk);
+  }
+
+  // Jumps must land on an instruction that expects the stack they leave.
+  void testJumps()
+  {
+    std::vector<uint32_t> image;
+    CHECK(compile("sub a(n as node)\n  while n.x < 1\n    n.x = 1\n  end\n  n.y = 2\nend\n", &image));
+    CHECK(read(image) == Errors::kOk);
+
+    Image::Header* header = (Image::Header*)image.data();
+    rio2d::Script::Bytecode* bc = (rio2d::Script::Bytecode*)((char*)image.data() + header->m_bcOffset);
+    CHECK(header->m_bcSize == 21 && bc[10].m_insn == Insns::kSetProp && bc[13].m_insn == Insns::kJump && bc[15].m_insn == Insns::kPush);
+
+    // A loop that leaves a value on the stack in each iteration, balanced by dropping the push after the loop.
+    std::vector<uint32_t> forged = image;
+    header = (Image::Header*)forged.data();
+    bc = (rio2d::Script::Bytecode*)((char*)forged.data() + header->m_bcOffset);
+    bc[10].m_insn = bc[11].m_insn = bc[12].m_insn = Insns::kCeil;
+    bc[15].m_insn = bc[16].m_insn = Insns::kCeil;
+    CHECK(read(forged) == Errors::kInvalidBytecode);
+
+    // A jump into the operand of a push.
+    forged = image;
+    header = (Image::Header*)forged.data();
+    bc = (rio2d::Script::Bytecode*)((char*)forged.data() + header->m_bcOffset);
+    bc[14].m_address = 4;
+    CHECK(read(forged) == Errors::kInvalidBytecode);
+  }
+
+  // Flipping bits anywhere in the image must never read outside of it.
+  void testCorrupted()
+  {
+    std::vector<uint32_t> image;
+    CHECK(compile("sub a(n as node, k as number)\n  for i = 1 to k\n    n.x = n.x + i\n  next\n  signal \"done\"\nend\n", &image));
+
+    for (size_t i = 0; i < image.size() * 32; i++)
+    {
+      std::vector<uint32_t> corrupted = image;
+      corrupted[i / 32] ^= 1U << (i % 32);
+      read(corrupted);
+    }
+  }
+}
+
+int main()
+{
+  testHeaders();
+  testTruncated();
+  testStack();
+  testJumps();
+  testCorrupted();
+
+  if (s_failed != 0)
+  {
+    fprintf(stderr, "%d check(s) failed\n", s_failed);
+    return 1;
+  }
+
+  printf("All checks passed\n");
+  return 0;
+}
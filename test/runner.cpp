@@ -0,0 +1,110 @@
+/******************************************************************************
+* Copyright (c) 2016 Andre Leiradella
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+// Finds the runners of subroutines whose hashes are the invalid action tag and the tag it is moved to. Compile with
+// g++ -g -std=c++11 -fsanitize=address -I../src -o runner runner.cpp ../src/script.cpp and link it with cocos2d-x; it
+// returns a non-zero exit code if a check fails.
+
+#include <stdio.h>
+
+#include "rio2d.h"
+
+namespace
+{
+  int s_failed = 0;
+
+  #define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); s_failed++; } } while (0)
+
+  // The hashes of tagcjlggc4 and tagcjlggc3 are 0xffffffff and 0xfffffffe.
+  const char* s_source = "sub tagcjlggc4(n as node)\n  pause 10 secs\nend\nsub tagcjlggc3(n as node)\n  pause 10 secs\nend\n";
+
+  void testTags()
+  {
+    static_assert(rio2d::hashLower("tagcjlggc4") == 0xffffffffU, "tagcjlggc4 must hash to the invalid tag");
+    static_assert(rio2d::hashLower("tagcjlggc3") == 0xfffffffeU, "tagcjlggc3 must hash to the tag before it");
+
+    rio2d::Hash invalid = rio2d::hashLower("tagcjlggc4");
+    rio2d::Hash before = rio2d::hashLower("tagcjlggc3");
+
+    CHECK(rio2d::Runner::tagOf(invalid) != cocos2d::Action::INVALID_TAG);
+    CHECK(rio2d::Runner::tagOf(invalid) == rio2d::Runner::tagOf(before));
+    CHECK(rio2d::Runner::tagOf(1234) == 1234);
+
+    rio2d::Script* script = rio2d::Script::newWithSource(s_source, nullptr, 0, 0);
+    CHECK(script != nullptr);
+
+    if (script == nullptr)
+    {
+      return;
+    }
+
+    cocos2d::Node* node = cocos2d::Node::create();
+    cocos2d::Node* twin = cocos2d::Node::create();
+    cocos2d::Node* other = cocos2d::Node::create();
+    node->retain();
+    twin->retain();
+    other->retain();
+
+    CHECK(script->runAction(invalid, node));
+    rio2d::Runner* runner = rio2d::Runner::find(node, invalid);
+    CHECK(runner != nullptr && runner->getHash() == invalid && runner->getTag() == rio2d::Runner::tagOf(invalid));
+    CHECK(node->getActionByTag(rio2d::Runner::tagOf(invalid)) == runner);
+
+    // Clones keep the tag.
+    if (runner != nullptr)
+    {
+      CHECK(runner->cloneOnto(twin));
+      CHECK(rio2d::Runner::find(twin, invalid) != nullptr);
+    }
+
+    // The runner of the other subroutine with the same tag isn't returned.
+    CHECK(rio2d::Runner::find(node, before) == nullptr);
+
+    CHECK(script->runAction(before, other));
+    CHECK(rio2d::Runner::find(other, before) != nullptr);
+    CHECK(rio2d::Runner::find(other, invalid) == nullptr);
+
+    node->stopAllActions();
+    twin->stopAllActions();
+    other->stopAllActions();
+    node->release();
+    twin->release();
+    other->release();
+    script->release();
+  }
+}
+
+int main()
+{
+  testTags();
+  rio2d::Script::purgeRunners();
+
+  if (s_failed != 0)
+  {
+    fprintf(stderr, "%d check(s) failed\n", s_failed);
+    return 1;
+  }
+
+  printf("All checks passed\n");
+  return 0;
+}
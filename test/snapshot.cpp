@@ -0,0 +1,156 @@
+/******************************************************************************
+* Copyright (c) 2016 Andre Leiradella
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+// Restores snapshots whose threads were moved to where they can't be, which restoreRunners must reject. Compile with
+// g++ -g -std=c++11 -fsanitize=address -I../src -o snapshot snapshot.cpp ../src/script.cpp and link it with
+// cocos2d-x; it returns a non-zero exit code if a check fails.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include "rio2d.h"
+
+namespace
+{
+  int s_failed = 0;
+
+  #define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); s_failed++; } } while (0)
+
+  // a is push, set_property, push, pause and stop, and b starts right after it at address 9.
+  const char* s_source = "sub a(n as node)\n  n.x = 1\n  pause 10 secs\nend\nsub b(n as node)\n  n.y = 2\n  pause 10 secs\nend\n";
+
+  // Where the thread of the only runner is in the snapshot.
+  enum
+  {
+    kPcOffset = 32,
+    kSpOffset = 40,
+    kWakeOffset = 44,
+    kSnapshotSize = 56,
+  };
+
+  struct Thread
+  {
+    uint32_t m_pc;
+    uint32_t m_sp;
+    double m_wake;
+  };
+
+  bool restore(rio2d::Script* script, const std::vector<char>& snapshot, const Thread& thread, cocos2d::Node* node)
+  {
+    std::vector<char> forged = snapshot;
+    memcpy(forged.data() + kPcOffset, &thread.m_pc, sizeof(thread.m_pc));
+    memcpy(forged.data() + kSpOffset, &thread.m_sp, sizeof(thread.m_sp));
+    memcpy(forged.data() + kWakeOffset, &thread.m_wake, sizeof(thread.m_wake));
+
+    return script->restoreRunners(forged.data(), forged.size(), [node](uint32_t) { return node; });
+  }
+
+  void testThreads(unsigned options)
+  {
+    rio2d::Script* script = rio2d::Script::newWithSource(s_source, nullptr, 0, options);
+    CHECK(script != nullptr);
+
+    if (script == nullptr)
+    {
+      return;
+    }
+
+    cocos2d::Node* node = cocos2d::Node::create();
+    node->retain();
+    CHECK(script->runAction("a", node));
+
+    // Run the runner until it parks in the pause.
+    rio2d::Runner* runner = rio2d::Runner::find(node, rio2d::hashLower("a"));
+    CHECK(runner != nullptr);
+
+    if (runner == nullptr)
+    {
+      node->release();
+      script->release();
+      return;
+    }
+
+    runner->step(1.0f / 60.0f);
+
+    auto toId = [](cocos2d::Node*) { return 1U; };
+    std::vector<char> snapshot(script->snapshotRunners(nullptr, 0, toId));
+    CHECK(snapshot.size() == kSnapshotSize);
+    script->snapshotRunners(snapshot.data(), snapshot.size(), toId);
+
+    Thread parked;
+    memcpy(&parked.m_pc, snapshot.data() + kPcOffset, sizeof(parked.m_pc));
+    memcpy(&parked.m_sp, snapshot.data() + kSpOffset, sizeof(parked.m_sp));
+    memcpy(&parked.m_wake, snapshot.data() + kWakeOffset, sizeof(parked.m_wake));
+    CHECK(parked.m_pc == 7 && parked.m_sp == 1 && parked.m_wake >= 0.0);
+
+    cocos2d::Node* other = cocos2d::Node::create();
+    other->retain();
+    CHECK(restore(script, snapshot, parked, other));
+
+    // The same pause in b.
+    Thread forged = parked;
+    forged.m_pc = 16;
+    CHECK(!restore(script, snapshot, forged, other));
+
+    // Inside the operand of the push.
+    forged.m_pc = 6;
+    CHECK(!restore(script, snapshot, forged, other));
+
+    // On the push, but with its operand already on the stack.
+    forged.m_pc = 5;
+    CHECK(!restore(script, snapshot, forged, other));
+
+    // Parked somewhere that isn't a pause.
+    forged.m_pc = 0;
+    forged.m_sp = 0;
+    CHECK(!restore(script, snapshot, forged, other));
+
+    // Threads that aren't parked can be anywhere the code can stop.
+    forged.m_wake = -1.0;
+    CHECK(restore(script, snapshot, forged, other));
+
+    other->stopAllActions();
+    other->release();
+    node->stopAllActions();
+    node->release();
+    script->release();
+  }
+}
+
+int main()
+{
+  testThreads(0);
+  testThreads(rio2d::Script::kCompileLazily);
+  rio2d::Script::purgeRunners();
+
+  if (s_failed != 0)
+  {
+    fprintf(stderr, "%d check(s) failed\n", s_failed);
+    return 1;
+  }
+
+  printf("All checks passed\n");
+  return 0;
+}